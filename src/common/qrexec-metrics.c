@@ -0,0 +1,335 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <strsafe.h>
+
+#include <log.h>
+
+#include "qrexec-metrics.h"
+
+static HANDLE g_MetricsSection = NULL;
+static PQREXEC_METRICS g_Metrics = NULL;
+static LONG64 g_TimerFrequency = 0;
+
+static DWORD MapSection(IN BOOL readOnly)
+{
+    g_Metrics = MapViewOfFile(g_MetricsSection, readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, sizeof(QREXEC_METRICS));
+    if (!g_Metrics)
+    {
+        DWORD status = win_perror("MapViewOfFile(metrics)");
+        CloseHandle(g_MetricsSection);
+        g_MetricsSection = NULL;
+        return status;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD QmCreate(void)
+{
+    DWORD status;
+
+    // default DACL: SYSTEM and administrators only
+    g_MetricsSection = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        0, sizeof(QREXEC_METRICS), QREXEC_METRICS_SECTION_NAME);
+
+    if (!g_MetricsSection)
+        return win_perror("CreateFileMapping(metrics)");
+
+    status = MapSection(FALSE);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    // the section may outlive an agent restart if a reader keeps it open
+    if (g_Metrics->Magic != QREXEC_METRICS_MAGIC || g_Metrics->Version != QREXEC_METRICS_VERSION)
+    {
+        ZeroMemory(g_Metrics, sizeof(QREXEC_METRICS));
+        g_Metrics->MaxServices = QREXEC_METRICS_MAX_SERVICES;
+        g_Metrics->Version = QREXEC_METRICS_VERSION;
+        MemoryBarrier();
+        g_Metrics->Magic = QREXEC_METRICS_MAGIC;
+    }
+
+    LogDebug("metrics section mapped at %p", g_Metrics);
+    return ERROR_SUCCESS;
+}
+
+DWORD QmOpen(IN BOOL readOnly)
+{
+    DWORD status;
+
+    g_MetricsSection = OpenFileMapping(readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, FALSE, QREXEC_METRICS_SECTION_NAME);
+    if (!g_MetricsSection)
+    {
+        status = GetLastError();
+        LogDebug("metrics section not available (0x%x)", status);
+        return status;
+    }
+
+    status = MapSection(readOnly);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (g_Metrics->Magic != QREXEC_METRICS_MAGIC || g_Metrics->Version != QREXEC_METRICS_VERSION)
+    {
+        LogWarning("metrics section version mismatch (magic 0x%x, version %u)", g_Metrics->Magic, g_Metrics->Version);
+        QmClose();
+        return ERROR_REVISION_MISMATCH;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void QmClose(void)
+{
+    if (g_Metrics)
+    {
+        UnmapViewOfFile(g_Metrics);
+        g_Metrics = NULL;
+    }
+
+    if (g_MetricsSection)
+    {
+        CloseHandle(g_MetricsSection);
+        g_MetricsSection = NULL;
+    }
+}
+
+void QmReset(void)
+{
+    if (!g_Metrics)
+        return;
+
+    for (LONG i = 0; i < QREXEC_METRICS_MAX_SERVICES; i++)
+    {
+        PQREXEC_SERVICE_METRICS entry = &g_Metrics->Services[i];
+
+        InterlockedExchange64(&entry->Calls, 0);
+        InterlockedExchange64(&entry->Failures, 0);
+        InterlockedExchange64(&entry->Refused, 0);
+        InterlockedExchange64(&entry->BytesIn, 0);
+        InterlockedExchange64(&entry->BytesOut, 0);
+        InterlockedExchange(&entry->LastExitCode, 0);
+        for (int j = 0; j < QREXEC_LATENCY_COUNT; j++)
+        {
+            PQREXEC_HISTOGRAM histogram = &entry->Latency[j];
+
+            InterlockedExchange64(&histogram->Count, 0);
+            InterlockedExchange64(&histogram->SumUs, 0);
+            InterlockedExchange64(&histogram->MaxUs, 0);
+            for (int k = 0; k < QREXEC_METRICS_BUCKETS; k++)
+                InterlockedExchange64(&histogram->Buckets[k], 0);
+        }
+    }
+}
+
+const QREXEC_METRICS* QmGetMetrics(void)
+{
+    return g_Metrics;
+}
+
+LONG QmGetServiceSlot(IN const WCHAR* serviceName)
+{
+    WCHAR name[QREXEC_METRICS_NAME_SIZE];
+    size_t nameLength;
+
+    if (!g_Metrics || !serviceName)
+        return QREXEC_METRICS_NO_SLOT;
+
+    // strip the RPC argument
+    nameLength = wcscspn(serviceName, L"+");
+    if (FAILED(StringCchCopyN(name, RTL_NUMBER_OF(name), serviceName, nameLength)))
+        return QREXEC_METRICS_NO_SLOT;
+
+    for (LONG i = 0; i < QREXEC_METRICS_MAX_SERVICES; i++)
+    {
+        PQREXEC_SERVICE_METRICS entry = &g_Metrics->Services[i];
+
+        if (entry->InUse)
+        {
+            if (wcscmp(entry->Name, name) == 0)
+                return i;
+            continue;
+        }
+
+        // slots are only allocated by the agent's control thread, readers only look at InUse entries
+        StringCchCopy(entry->Name, RTL_NUMBER_OF(entry->Name), name);
+        MemoryBarrier();
+        entry->InUse = TRUE;
+        LogDebug("service '%s': metrics slot %d", name, i);
+        return i;
+    }
+
+    LogWarning("no free metrics slot for service '%s'", name);
+    return QREXEC_METRICS_NO_SLOT;
+}
+
+LONG64 QmTimestamp(void)
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+LONG64 QmElapsedUs(IN LONG64 start)
+{
+    if (g_TimerFrequency == 0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        g_TimerFrequency = frequency.QuadPart;
+    }
+
+    LONG64 elapsed = QmTimestamp() - start;
+    if (elapsed < 0)
+        return 0;
+
+    return elapsed * 1000000 / g_TimerFrequency;
+}
+
+static PQREXEC_SERVICE_METRICS GetEntry(IN LONG slot)
+{
+    if (!g_Metrics || slot < 0 || slot >= QREXEC_METRICS_MAX_SERVICES)
+        return NULL;
+
+    return &g_Metrics->Services[slot];
+}
+
+void QmRecordCall(IN LONG slot)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+
+    if (entry)
+        InterlockedIncrement64(&entry->Calls);
+}
+
+void QmRecordFailure(IN LONG slot)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+
+    if (entry)
+        InterlockedIncrement64(&entry->Failures);
+}
+
+void QmRecordRefused(IN LONG slot)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+
+    // no wrapper is started to report an exit code
+    if (entry)
+    {
+        InterlockedIncrement64(&entry->Refused);
+        InterlockedIncrement64(&entry->Failures);
+    }
+}
+
+void QmRecordLatency(IN LONG slot, IN QREXEC_LATENCY which, IN LONG64 us)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+    PQREXEC_HISTOGRAM histogram;
+    ULONG bucket = 0;
+    LONG64 max;
+
+    if (!entry || which >= QREXEC_LATENCY_COUNT)
+        return;
+
+    histogram = &entry->Latency[which];
+
+    // bucket index is the number of significant bits
+    while (bucket < QREXEC_METRICS_BUCKETS - 1 && (us >> bucket) != 0)
+        bucket++;
+
+    InterlockedIncrement64(&histogram->Buckets[bucket]);
+    InterlockedAdd64(&histogram->SumUs, us);
+
+    max = histogram->MaxUs;
+    while (us > max)
+    {
+        LONG64 previous = InterlockedCompareExchange64(&histogram->MaxUs, us, max);
+        if (previous == max)
+            break;
+        max = previous;
+    }
+
+    // count last so readers never see more samples than bucket entries
+    InterlockedIncrement64(&histogram->Count);
+}
+
+void QmRecordBytes(IN LONG slot, IN LONG64 bytesIn, IN LONG64 bytesOut)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+
+    if (!entry)
+        return;
+
+    if (bytesIn)
+        InterlockedAdd64(&entry->BytesIn, bytesIn);
+    if (bytesOut)
+        InterlockedAdd64(&entry->BytesOut, bytesOut);
+}
+
+void QmRecordExitCode(IN LONG slot, IN int exitCode)
+{
+    PQREXEC_SERVICE_METRICS entry = GetEntry(slot);
+
+    if (!entry)
+        return;
+
+    InterlockedExchange(&entry->LastExitCode, exitCode);
+    if (exitCode != 0)
+        InterlockedIncrement64(&entry->Failures);
+}
+
+LONG64 QmPercentileUs(IN const QREXEC_HISTOGRAM* histogram, IN ULONG percentile)
+{
+    LONG64 total = 0;
+    LONG64 threshold;
+    LONG64 seen = 0;
+
+    for (ULONG i = 0; i < QREXEC_METRICS_BUCKETS; i++)
+        total += histogram->Buckets[i];
+
+    if (total == 0)
+        return 0;
+
+    if (percentile > 100)
+        percentile = 100;
+
+    // rank of the sample, rounded up
+    threshold = (total * percentile + 99) / 100;
+    if (threshold == 0)
+        threshold = 1;
+
+    for (ULONG i = 0; i < QREXEC_METRICS_BUCKETS; i++)
+    {
+        seen += histogram->Buckets[i];
+        if (seen >= threshold)
+        {
+            if (i == QREXEC_METRICS_BUCKETS - 1)
+                return histogram->MaxUs;
+            return 1LL << i;
+        }
+    }
+
+    return histogram->MaxUs;
+}
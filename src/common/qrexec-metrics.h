@@ -0,0 +1,148 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Per-service qrexec counters and latency histograms.
+// The table lives in a named section created by qrexec-agent. qrexec-wrapper
+// opens it to account for data transferred and child exit codes,
+// qrexec-metrics.exe reads it.
+
+#pragma once
+#include <windows.h>
+
+#define QREXEC_METRICS_SECTION_NAME L"Global\\QrexecAgentMetrics"
+
+// Passed from the agent to qrexec-wrapper: "<slot> <exec timestamp>"
+#define QREXEC_METRICS_ENV          L"QREXEC_METRICS_CONTEXT"
+
+#define QREXEC_METRICS_MAGIC        0x4d584551 // 'QEXM'
+#define QREXEC_METRICS_VERSION      2
+
+#define QREXEC_METRICS_MAX_SERVICES 64
+#define QREXEC_METRICS_NAME_SIZE    64 // WCHARs, same as service_name in trigger_service_params
+
+// Bucket 0 counts latencies below 1us, bucket i counts [2^(i-1), 2^i) us.
+// The last bucket also holds everything above its lower bound.
+#define QREXEC_METRICS_BUCKETS      32
+
+#define QREXEC_METRICS_NO_SLOT      (-1)
+
+// Name under which plain (non-RPC) commands are accounted
+#define QREXEC_METRICS_COMMAND_NAME L"(command)"
+// Name under which exec requests that don't resolve to a service definition are accounted
+#define QREXEC_METRICS_UNKNOWN_NAME L"(unknown)"
+
+typedef enum _QREXEC_LATENCY
+{
+    QREXEC_LATENCY_TRIGGER_CONNECT = 0, // MSG_TRIGGER_SERVICE sent -> MSG_SERVICE_CONNECT received
+    QREXEC_LATENCY_EXEC_START,          // exec message received -> child process started
+    QREXEC_LATENCY_DURATION,            // exec message received -> qrexec-wrapper exited
+    QREXEC_LATENCY_QUEUE_WAIT,          // exec message received -> dequeued by the agent (queued requests only)
+    QREXEC_LATENCY_COUNT
+} QREXEC_LATENCY;
+
+typedef struct _QREXEC_HISTOGRAM
+{
+    volatile LONG64 Count;
+    volatile LONG64 SumUs;
+    volatile LONG64 MaxUs;
+    volatile LONG64 Buckets[QREXEC_METRICS_BUCKETS];
+} QREXEC_HISTOGRAM, *PQREXEC_HISTOGRAM;
+
+typedef struct _QREXEC_SERVICE_METRICS
+{
+    volatile LONG InUse; // Name is valid
+    WCHAR Name[QREXEC_METRICS_NAME_SIZE];
+    volatile LONG64 Calls;
+    volatile LONG64 Failures; // refused, failed to start or non-zero exit code
+    volatile LONG64 Refused; // rejected by admission control (also counted as failures)
+    volatile LONG64 BytesIn; // received from the remote peer
+    volatile LONG64 BytesOut; // sent to the remote peer
+    volatile LONG LastExitCode;
+    QREXEC_HISTOGRAM Latency[QREXEC_LATENCY_COUNT];
+} QREXEC_SERVICE_METRICS, *PQREXEC_SERVICE_METRICS;
+
+typedef struct _QREXEC_METRICS
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG MaxServices;
+    QREXEC_SERVICE_METRICS Services[QREXEC_METRICS_MAX_SERVICES];
+} QREXEC_METRICS, *PQREXEC_METRICS;
+
+/**
+ * @brief Create and initialize the metrics section (qrexec-agent).
+ * @return Error code. Metrics are disabled on failure, recording functions become no-ops.
+ */
+DWORD QmCreate(void);
+
+/**
+ * @brief Open an existing metrics section.
+ * @param readOnly Map the section read-only (for readers).
+ * @return Error code. Metrics are disabled on failure, recording functions become no-ops.
+ */
+DWORD QmOpen(IN BOOL readOnly);
+
+void QmClose(void);
+
+/**
+ * @brief Zero all counters and histograms. Service slots are kept.
+ *        Samples recorded concurrently may be partially lost.
+ */
+void QmReset(void);
+
+/**
+ * @brief Get the mapped metrics table.
+ * @return Metrics table or NULL if not mapped.
+ */
+const QREXEC_METRICS* QmGetMetrics(void);
+
+/**
+ * @brief Find or allocate the table slot for a service.
+ *        RPC argument (anything after '+') is not a part of the key.
+ * @param serviceName Service name.
+ * @return Slot index or QREXEC_METRICS_NO_SLOT if metrics are disabled or the table is full.
+ */
+LONG QmGetServiceSlot(IN const WCHAR* serviceName);
+
+/**
+ * @brief Get a timestamp for latency measurements. Comparable across processes.
+ */
+LONG64 QmTimestamp(void);
+
+/**
+ * @brief Microseconds elapsed since @a start (obtained from QmTimestamp).
+ */
+LONG64 QmElapsedUs(IN LONG64 start);
+
+void QmRecordCall(IN LONG slot);
+void QmRecordFailure(IN LONG slot);
+void QmRecordRefused(IN LONG slot);
+void QmRecordLatency(IN LONG slot, IN QREXEC_LATENCY which, IN LONG64 us);
+void QmRecordBytes(IN LONG slot, IN LONG64 bytesIn, IN LONG64 bytesOut);
+void QmRecordExitCode(IN LONG slot, IN int exitCode);
+
+/**
+ * @brief Approximate a latency percentile from the histogram.
+ * @param histogram Histogram to query.
+ * @param percentile Requested percentile (0-100).
+ * @return Upper bound of the bucket containing the percentile, in microseconds (0 if empty).
+ */
+LONG64 QmPercentileUs(IN const QREXEC_HISTOGRAM* histogram, IN ULONG percentile);
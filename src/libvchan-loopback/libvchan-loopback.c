@@ -0,0 +1,409 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Stand-in for libvchan that connects processes on the same machine through shared memory.
+// Built as libvchan.dll next to the qrexec-loopback harness so that the agent code and
+// qrexec-wrapper.exe can run without Xen. Vchans are identified by port, the domain is ignored.
+// libvchan.h isn't included because it declares the functions as imported, exports are
+// listed in libvchan-loopback.def instead.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+typedef struct libvchan libvchan_t;
+typedef void libvchan_logger_t(int level, const char* function, const WCHAR* format, va_list args);
+
+#define LOOPBACK_NAME_PREFIX   L"Local\\QrexecLoopback"
+#define LOOPBACK_MAGIC         0x4b424c51 // 'QLBK'
+#define LOOPBACK_MIN_RING_SIZE 4096
+#define LOOPBACK_MAX_RING_SIZE (16 * 1024 * 1024)
+
+#define SIDE_SERVER 0
+#define SIDE_CLIENT 1
+
+// same values as libvchan_is_open()
+#define STATE_CLOSED    0
+#define STATE_CONNECTED 1
+#define STATE_WAITING   2
+
+typedef struct _LOOPBACK_RING
+{
+    volatile LONG64 Produced; // total bytes written
+    volatile LONG64 Consumed; // total bytes read
+    ULONG Size; // power of 2
+    ULONG Offset; // of the ring data from the start of the section
+} LOOPBACK_RING, *PLOOPBACK_RING;
+
+// Start of the shared section, ring data follows.
+typedef struct _LOOPBACK_SHARED
+{
+    volatile LONG Magic; // set last by the server
+    volatile LONG State[2]; // of each side
+    LOOPBACK_RING Ring[2]; // written by the server, written by the client
+} LOOPBACK_SHARED, *PLOOPBACK_SHARED;
+
+struct libvchan
+{
+    int Port;
+    int Side;
+    HANDLE Section;
+    PLOOPBACK_SHARED Shared;
+    PLOOPBACK_RING WriteRing;
+    PLOOPBACK_RING ReadRing;
+    BYTE* WriteData;
+    BYTE* ReadData;
+    // Event[i]: data written, data consumed or state changed by the other side (for select)
+    // Space[i]: data consumed or state changed by the other side (for blocked writers)
+    HANDLE Event[2];
+    HANDLE Space[2];
+};
+
+static const WCHAR* g_SideName[2] = { L"server", L"client" };
+
+static void MakeName(OUT WCHAR* name, IN size_t cchName, IN int port, IN const WCHAR* object, IN int side)
+{
+    StringCchPrintfW(name, cchName, LOOPBACK_NAME_PREFIX L"-%d-%s-%s", port, object, g_SideName[side]);
+}
+
+static ULONG RingSize(IN size_t requested)
+{
+    ULONG size = LOOPBACK_MIN_RING_SIZE;
+
+    while (size < requested && size < LOOPBACK_MAX_RING_SIZE)
+        size *= 2;
+    return size;
+}
+
+static void FreeVchan(IN libvchan_t* ctrl)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (ctrl->Event[i])
+            CloseHandle(ctrl->Event[i]);
+        if (ctrl->Space[i])
+            CloseHandle(ctrl->Space[i]);
+    }
+
+    if (ctrl->Shared)
+        UnmapViewOfFile(ctrl->Shared);
+    if (ctrl->Section)
+        CloseHandle(ctrl->Section);
+    free(ctrl);
+}
+
+static void SetupRings(IN OUT libvchan_t* ctrl)
+{
+    ctrl->WriteRing = &ctrl->Shared->Ring[ctrl->Side];
+    ctrl->ReadRing = &ctrl->Shared->Ring[!ctrl->Side];
+    ctrl->WriteData = (BYTE*)ctrl->Shared + ctrl->WriteRing->Offset;
+    ctrl->ReadData = (BYTE*)ctrl->Shared + ctrl->ReadRing->Offset;
+}
+
+static void NotifyPeer(IN const libvchan_t* ctrl, IN BOOL space)
+{
+    SetEvent(ctrl->Event[!ctrl->Side]);
+    if (space)
+        SetEvent(ctrl->Space[!ctrl->Side]);
+}
+
+static LONG PeerState(IN const libvchan_t* ctrl)
+{
+    return ctrl->Shared->State[!ctrl->Side];
+}
+
+static ULONG RingUsed(IN const LOOPBACK_RING* ring)
+{
+    return (ULONG)(ring->Produced - ring->Consumed);
+}
+
+static void RingWrite(IN const libvchan_t* ctrl, IN const BYTE* data, IN ULONG size)
+{
+    PLOOPBACK_RING ring = ctrl->WriteRing;
+    ULONG offset = (ULONG)ring->Produced & (ring->Size - 1);
+    ULONG first = min(size, ring->Size - offset);
+
+    memcpy(ctrl->WriteData + offset, data, first);
+    memcpy(ctrl->WriteData, data + first, size - first);
+    MemoryBarrier(); // data before the counter
+    ring->Produced += size; // only this side writes the counter
+    NotifyPeer(ctrl, FALSE);
+}
+
+static void RingRead(IN const libvchan_t* ctrl, OUT BYTE* data, IN ULONG size)
+{
+    PLOOPBACK_RING ring = ctrl->ReadRing;
+    ULONG offset = (ULONG)ring->Consumed & (ring->Size - 1);
+    ULONG first = min(size, ring->Size - offset);
+
+    MemoryBarrier(); // counter before the data
+    memcpy(data, ctrl->ReadData + offset, first);
+    memcpy(data + first, ctrl->ReadData, size - first);
+    MemoryBarrier();
+    ring->Consumed += size;
+    NotifyPeer(ctrl, TRUE);
+}
+
+libvchan_t* libvchan_server_init(int domain, int port, size_t read_min, size_t write_min)
+{
+    WCHAR name[128];
+    libvchan_t* ctrl;
+    ULONG readSize = RingSize(read_min);
+    ULONG writeSize = RingSize(write_min);
+    ULONG sectionSize = sizeof(LOOPBACK_SHARED) + readSize + writeSize;
+
+    UNREFERENCED_PARAMETER(domain);
+
+    ctrl = calloc(1, sizeof(*ctrl));
+    if (!ctrl)
+        return NULL;
+
+    ctrl->Port = port;
+    ctrl->Side = SIDE_SERVER;
+
+    // events first, the client checks the section magic before opening them
+    for (int i = 0; i < 2; i++)
+    {
+        MakeName(name, RTL_NUMBER_OF(name), port, L"event", i);
+        ctrl->Event[i] = CreateEventW(NULL, FALSE, FALSE, name);
+        if (!ctrl->Event[i] || GetLastError() == ERROR_ALREADY_EXISTS)
+            goto fail;
+
+        MakeName(name, RTL_NUMBER_OF(name), port, L"space", i);
+        ctrl->Space[i] = CreateEventW(NULL, FALSE, FALSE, name);
+        if (!ctrl->Space[i] || GetLastError() == ERROR_ALREADY_EXISTS)
+            goto fail;
+    }
+
+    MakeName(name, RTL_NUMBER_OF(name), port, L"section", SIDE_SERVER);
+    ctrl->Section = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sectionSize, name);
+    if (!ctrl->Section || GetLastError() == ERROR_ALREADY_EXISTS)
+        goto fail;
+
+    ctrl->Shared = MapViewOfFile(ctrl->Section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!ctrl->Shared)
+        goto fail;
+
+    // the section is zeroed
+    ctrl->Shared->Ring[SIDE_SERVER].Size = writeSize;
+    ctrl->Shared->Ring[SIDE_SERVER].Offset = sizeof(LOOPBACK_SHARED);
+    ctrl->Shared->Ring[SIDE_CLIENT].Size = readSize;
+    ctrl->Shared->Ring[SIDE_CLIENT].Offset = sizeof(LOOPBACK_SHARED) + writeSize;
+    ctrl->Shared->State[SIDE_SERVER] = STATE_CONNECTED;
+    ctrl->Shared->State[SIDE_CLIENT] = STATE_WAITING;
+    SetupRings(ctrl);
+    InterlockedExchange(&ctrl->Shared->Magic, LOOPBACK_MAGIC);
+    return ctrl;
+
+fail:
+    FreeVchan(ctrl);
+    return NULL;
+}
+
+libvchan_t* libvchan_client_init(int domain, int port)
+{
+    WCHAR name[128];
+    libvchan_t* ctrl;
+
+    UNREFERENCED_PARAMETER(domain);
+
+    ctrl = calloc(1, sizeof(*ctrl));
+    if (!ctrl)
+        return NULL;
+
+    ctrl->Port = port;
+    ctrl->Side = SIDE_CLIENT;
+
+    MakeName(name, RTL_NUMBER_OF(name), port, L"section", SIDE_SERVER);
+    ctrl->Section = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!ctrl->Section) // no server
+        goto fail;
+
+    ctrl->Shared = MapViewOfFile(ctrl->Section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!ctrl->Shared || ctrl->Shared->Magic != LOOPBACK_MAGIC)
+        goto fail;
+
+    for (int i = 0; i < 2; i++)
+    {
+        MakeName(name, RTL_NUMBER_OF(name), port, L"event", i);
+        ctrl->Event[i] = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+        if (!ctrl->Event[i])
+            goto fail;
+
+        MakeName(name, RTL_NUMBER_OF(name), port, L"space", i);
+        ctrl->Space[i] = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+        if (!ctrl->Space[i])
+            goto fail;
+    }
+
+    // only one client, and not after the server is gone
+    if (ctrl->Shared->State[SIDE_SERVER] != STATE_CONNECTED ||
+        InterlockedCompareExchange(&ctrl->Shared->State[SIDE_CLIENT], STATE_CONNECTED, STATE_WAITING) != STATE_WAITING)
+        goto fail;
+
+    SetupRings(ctrl);
+    NotifyPeer(ctrl, TRUE);
+    return ctrl;
+
+fail:
+    FreeVchan(ctrl);
+    return NULL;
+}
+
+int libvchan_send(libvchan_t* ctrl, const void* data, size_t size)
+{
+    if (size > ctrl->WriteRing->Size)
+        return -1;
+
+    while (TRUE)
+    {
+        if (PeerState(ctrl) == STATE_CLOSED)
+            return -1;
+
+        if (ctrl->WriteRing->Size - RingUsed(ctrl->WriteRing) >= size)
+        {
+            RingWrite(ctrl, data, (ULONG)size);
+            return (int)size;
+        }
+
+        WaitForSingleObject(ctrl->Space[ctrl->Side], INFINITE);
+    }
+}
+
+int libvchan_write(libvchan_t* ctrl, const void* data, size_t size)
+{
+    const BYTE* buffer = data;
+    size_t written = 0;
+
+    while (written < size)
+    {
+        if (PeerState(ctrl) == STATE_CLOSED)
+            return -1;
+
+        ULONG chunk = (ULONG)min(size - written, ctrl->WriteRing->Size - RingUsed(ctrl->WriteRing));
+        if (chunk == 0)
+        {
+            WaitForSingleObject(ctrl->Space[ctrl->Side], INFINITE);
+            continue;
+        }
+
+        RingWrite(ctrl, buffer + written, chunk);
+        written += chunk;
+    }
+
+    return (int)size;
+}
+
+int libvchan_recv(libvchan_t* ctrl, void* data, size_t size)
+{
+    if (size > ctrl->ReadRing->Size)
+        return -1;
+
+    while (TRUE)
+    {
+        if (RingUsed(ctrl->ReadRing) >= size)
+        {
+            RingRead(ctrl, data, (ULONG)size);
+            return (int)size;
+        }
+
+        // data written before close can still be read
+        if (PeerState(ctrl) == STATE_CLOSED)
+            return -1;
+
+        WaitForSingleObject(ctrl->Event[ctrl->Side], INFINITE);
+    }
+}
+
+int libvchan_read(libvchan_t* ctrl, void* data, size_t size)
+{
+    while (TRUE)
+    {
+        ULONG chunk = (ULONG)min(size, RingUsed(ctrl->ReadRing));
+        if (chunk > 0)
+        {
+            RingRead(ctrl, data, chunk);
+            return (int)chunk;
+        }
+
+        if (PeerState(ctrl) == STATE_CLOSED)
+            return -1;
+
+        WaitForSingleObject(ctrl->Event[ctrl->Side], INFINITE);
+    }
+}
+
+int libvchan_wait(libvchan_t* ctrl)
+{
+    if (WaitForSingleObject(ctrl->Event[ctrl->Side], INFINITE) != WAIT_OBJECT_0)
+        return -1;
+
+    if (PeerState(ctrl) == STATE_CLOSED && RingUsed(ctrl->ReadRing) == 0)
+        return -1;
+
+    return 0;
+}
+
+void libvchan_close(libvchan_t* ctrl)
+{
+    if (!ctrl)
+        return;
+
+    InterlockedExchange(&ctrl->Shared->State[ctrl->Side], STATE_CLOSED);
+    NotifyPeer(ctrl, TRUE);
+    FreeVchan(ctrl);
+}
+
+HANDLE libvchan_fd_for_select(libvchan_t* ctrl)
+{
+    return ctrl->Event[ctrl->Side];
+}
+
+int libvchan_is_open(libvchan_t* ctrl)
+{
+    if (ctrl->Shared->State[ctrl->Side] == STATE_CLOSED)
+        return STATE_CLOSED;
+
+    return PeerState(ctrl);
+}
+
+int libvchan_data_ready(libvchan_t* ctrl)
+{
+    return (int)RingUsed(ctrl->ReadRing);
+}
+
+int libvchan_buffer_space(libvchan_t* ctrl)
+{
+    return (int)(ctrl->WriteRing->Size - RingUsed(ctrl->WriteRing));
+}
+
+void libvchan_cleanup(libvchan_t* ctrl)
+{
+    // nothing is published anywhere
+    UNREFERENCED_PARAMETER(ctrl);
+}
+
+void libvchan_register_logger(libvchan_logger_t* logger, int level)
+{
+    // errors are reported through return values only
+    UNREFERENCED_PARAMETER(logger);
+    UNREFERENCED_PARAMETER(level);
+}
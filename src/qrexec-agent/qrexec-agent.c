@@ -21,6 +21,7 @@
 
 #include <windows.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <lmcons.h>
 #include <shlwapi.h>
 #include <assert.h>
@@ -29,6 +30,7 @@
 #include <strsafe.h>
 
 #include "qrexec-agent.h"
+#include "qrexec-metrics.h"
 
 #include <qrexec.h>
 #include <libvchan.h>
@@ -54,6 +56,18 @@ SRWLOCK g_ConnectionsHandlesLock;
 LIST_ENTRY g_RequestList; // pending service requests (local)
 ULONG g_RequestId = 0;
 
+// Admission control state, only accessed by the control vchan thread.
+LIST_ENTRY g_AdmissionList; // SERVICE_ADMISSION
+LIST_ENTRY g_PendingExecLists[RPC_PRIORITY_COUNT]; // PENDING_EXEC, in arrival order for each priority
+ULONG g_RunningServices = 0; // running wrappers: admitted exec requests and service connects
+ULONG g_QueuedServices = 0;
+DWORD g_MaxConcurrent = DEFAULT_MAX_CONCURRENT;
+DWORD g_MaxQueued = DEFAULT_MAX_QUEUED;
+
+#ifdef QREXEC_LOOPBACK
+static const WCHAR* g_LoopbackRpcRoot; // replaces the private volume in RPC service lookups
+#endif
+
 #ifdef _DEBUG
 void DumpRequestList(void)
 {
@@ -79,6 +93,9 @@ struct _connection_info
     HANDLE handle;
     int connect_domain;
     int connect_port;
+    LONG metrics_slot;
+    LONG64 exec_time; // when the exec/connect message was received
+    PSERVICE_ADMISSION service; // NULL if not subject to admission control
 };
 
 // args for pipe client threads
@@ -88,9 +105,10 @@ struct CLIENT_CONTEXT
     LONGLONG id;
 };
 
-#define MAX_FDS 128
+#define MAX_FDS MAX_CHILDREN
 static struct _connection_info connection_info[MAX_FDS];
 
+#ifndef QREXEC_LOOPBACK
 /**
  * @brief Wait for qubesdb service to start.
  * @return TRUE if a connection could be opened, FALSE if timed out (60 seconds).
@@ -120,6 +138,77 @@ BOOL WaitForQdb(void)
     LogDebug("qdb is running");
     return TRUE;
 }
+#endif
+
+/**
+ * @brief Send all messages accumulated in a batch to the vchan peer in one write and empty the batch.
+ *        Messages from other threads can't be interleaved with the batch.
+ * @param vchan Control vchan.
+ * @param batch Messages to send.
+ * @return TRUE on success.
+ */
+static BOOL VchanFlushBatch(
+    _Inout_ libvchan_t* vchan,
+    _Inout_ PCONTROL_BATCH batch
+)
+{
+    BOOL status = TRUE;
+
+    assert(vchan);
+
+    if (batch->Size == 0)
+        return TRUE;
+
+    LogVerbose("%lu messages, %lu bytes", batch->Count, batch->Size);
+
+    EnterCriticalSection(&g_DaemonCriticalSection);
+    if (!VchanSendBuffer(vchan, batch->Buffer, batch->Size, L"message batch"))
+    {
+        LogError("VchanSendBuffer(%lu batched messages) failed", batch->Count);
+        status = FALSE;
+    }
+    LeaveCriticalSection(&g_DaemonCriticalSection);
+
+    batch->Size = 0;
+    batch->Count = 0;
+    return status;
+}
+
+/**
+ * @brief Append a message to a batch, flush the batch first if the message doesn't fit.
+ * @param vchan Control vchan.
+ * @param batch Batch to append to.
+ * @param messageType Control message
+ * @param data Buffer to send.
+ * @param cbData Size of the @a data buffer, in bytes. Header and data must fit in CONTROL_BATCH_SIZE.
+ * @return TRUE on success.
+ */
+static BOOL VchanQueueMessage(
+    _Inout_ libvchan_t* vchan,
+    _Inout_ PCONTROL_BATCH batch,
+    _In_ ULONG messageType,
+    _In_reads_bytes_opt_(cbData) const void* data,
+    _In_ ULONG cbData
+)
+{
+    struct msg_header header;
+    ULONG cbMessage = sizeof(header) + cbData;
+
+    assert(cbMessage <= CONTROL_BATCH_SIZE);
+
+    if (batch->Size + cbMessage > CONTROL_BATCH_SIZE && !VchanFlushBatch(vchan, batch))
+        return FALSE;
+
+    header.type = messageType;
+    header.len = cbData;
+    memcpy(batch->Buffer + batch->Size, &header, sizeof(header));
+    if (cbData > 0)
+        memcpy(batch->Buffer + batch->Size + sizeof(header), data, cbData);
+
+    batch->Size += cbMessage;
+    batch->Count++;
+    return TRUE;
+}
 
 /**
  * @brief Send message to the vchan peer.
@@ -145,6 +234,19 @@ BOOL VchanSendMessage(
 
     LogDebug("msg 0x%x, data %p, size %u (%s)", messageType, data, cbData, what);
 
+    // small messages: header and data in one write
+    if (sizeof(header) + cbData <= CONTROL_BATCH_SIZE)
+    {
+        CONTROL_BATCH batch;
+
+        CONTROL_BATCH_INIT(&batch);
+        VchanQueueMessage(vchan, &batch, messageType, data, cbData);
+        status = VchanFlushBatch(vchan, &batch);
+        if (!status)
+            LogError("failed to send %s", what);
+        return status;
+    }
+
     header.type = messageType;
     header.len = cbData;
     EnterCriticalSection(&g_DaemonCriticalSection);
@@ -174,7 +276,8 @@ cleanup:
     return status;
 }
 
-static void register_vchan_connection(HANDLE handle, int domain, int port)
+static BOOL register_vchan_connection(HANDLE handle, int domain, int port, LONG metricsSlot, LONG64 execTime,
+    PSERVICE_ADMISSION service)
 {
     AcquireSRWLockExclusive(&g_ConnectionsHandlesLock);
     for (int i = 0; i < MAX_FDS; i++)
@@ -185,27 +288,38 @@ static void register_vchan_connection(HANDLE handle, int domain, int port)
             connection_info[i].handle = handle;
             connection_info[i].connect_domain = domain;
             connection_info[i].connect_port = port;
+            connection_info[i].metrics_slot = metricsSlot;
+            connection_info[i].exec_time = execTime;
+            connection_info[i].service = service;
             ReleaseSRWLockExclusive(&g_ConnectionsHandlesLock);
-            return;
+            return TRUE;
         }
     }
     ReleaseSRWLockExclusive(&g_ConnectionsHandlesLock);
     LogError("No free slot for child %p (connection to %d:%d)", handle, domain, port);
-    // FIXME: error
+    return FALSE;
 }
 
-static void release_connection(int id)
+/**
+ * @brief Release a child's connection slot.
+ * @param id Connection slot.
+ * @param batch MSG_CONNECTION_TERMINATED for the child is appended here, the caller sends it.
+ */
+static void release_connection(int id, PCONTROL_BATCH batch)
 {
     struct exec_params params;
+    PSERVICE_ADMISSION service = connection_info[id].service;
 
     HANDLE handle = connection_info[id].handle;
     params.connect_domain = connection_info[id].connect_domain;
     params.connect_port = connection_info[id].connect_port;
     LogVerbose("child %p, %d:%d", handle, params.connect_domain, params.connect_port);
 
+    QmRecordLatency(connection_info[id].metrics_slot, QREXEC_LATENCY_DURATION,
+        QmElapsedUs(connection_info[id].exec_time));
+
     // data size is just sizeof(struct exec_params) so no command line
-    if (!VchanSendMessage(g_DaemonVchan, MSG_CONNECTION_TERMINATED, &params, sizeof(struct exec_params),
-        L"terminate connection"))
+    if (!VchanQueueMessage(g_DaemonVchan, batch, MSG_CONNECTION_TERMINATED, &params, sizeof(struct exec_params)))
     {
         LogError("Failed to send MSG_CONNECTION_TERMINATED for %d:%d", params.connect_domain, params.connect_port);
         // FIXME: error
@@ -213,6 +327,136 @@ static void release_connection(int id)
 
     CloseHandle(handle);
     connection_info[id].handle = NULL;
+    connection_info[id].service = NULL;
+
+    if (service)
+        service->Running--;
+    g_RunningServices--;
+}
+
+/**
+ * @brief Tell the daemon that a data connection is done, for connections without a registered wrapper.
+ * @param domain Data vchan domain.
+ * @param port Data vchan port.
+ * @return TRUE on success.
+ */
+static BOOL SendConnectionTerminated(int domain, int port)
+{
+    struct exec_params params;
+
+    params.connect_domain = domain;
+    params.connect_port = port;
+    return VchanSendMessage(g_DaemonVchan, MSG_CONNECTION_TERMINATED, &params, sizeof(params), L"connection terminated");
+}
+
+// exec request finished without starting qrexec-wrapper
+typedef struct _COMPLETE_EXEC
+{
+    int Domain;
+    int Port;
+    int ExitCode;
+} COMPLETE_EXEC, *PCOMPLETE_EXEC;
+
+static volatile LONG g_CompletingExecs = 0; // queued CompleteExecWorker calls
+
+/**
+ * @brief Tell the daemon that a data connection is done, unless the daemon vchan was closed already.
+ * @return TRUE on success.
+ */
+static BOOL SendConnectionTerminatedIfConnected(int domain, int port)
+{
+    BOOL status = TRUE;
+
+    EnterCriticalSection(&g_DaemonCriticalSection);
+    if (g_DaemonVchan)
+        status = SendConnectionTerminated(domain, port);
+    LeaveCriticalSection(&g_DaemonCriticalSection);
+    return status;
+}
+
+/**
+ * @brief Thread pool callback of CompleteExec. Connecting to the data vchan and writing to it
+ *        may block, so this doesn't run on the control vchan thread.
+ * @param param PCOMPLETE_EXEC, freed here.
+ * @return Error code.
+ */
+static DWORD WINAPI CompleteExecWorker(PVOID param)
+{
+    PCOMPLETE_EXEC request = param;
+    CONTROL_BATCH batch;
+    struct peer_info info;
+    libvchan_t* vchan;
+    DWORD status = ERROR_SUCCESS;
+
+    LogDebug("domain %d, port %d, exit code %d", request->Domain, request->Port, request->ExitCode);
+
+    vchan = libvchan_client_init(request->Domain, request->Port);
+    if (vchan)
+    {
+        CONTROL_BATCH_INIT(&batch);
+        info.version = QREXEC_PROTOCOL_VERSION;
+        // peer closes the vchan after the exit code, so EOF goes first
+        VchanQueueMessage(vchan, &batch, MSG_HELLO, &info, sizeof(info));
+        VchanQueueMessage(vchan, &batch, MSG_DATA_STDERR, NULL, 0);
+        VchanQueueMessage(vchan, &batch, MSG_DATA_STDOUT, NULL, 0);
+        VchanQueueMessage(vchan, &batch, MSG_DATA_EXIT_CODE, &request->ExitCode, sizeof(request->ExitCode));
+        if (!VchanFlushBatch(vchan, &batch))
+            status = ERROR_INVALID_FUNCTION;
+
+        libvchan_close(vchan);
+    }
+    else
+    {
+        LogError("libvchan_client_init(%d, %d) failed", request->Domain, request->Port);
+        status = ERROR_INVALID_FUNCTION;
+    }
+
+    if (!SendConnectionTerminatedIfConnected(request->Domain, request->Port))
+        status = ERROR_INVALID_FUNCTION;
+
+    free(request);
+    InterlockedDecrement(&g_CompletingExecs);
+    return status;
+}
+
+/**
+ * @brief Finish an exec request without starting qrexec-wrapper. The exit code is sent through
+ *        the data vchan the same way the wrapper does it, then the connection is released.
+ *        This is done on a thread pool thread, the control vchan loop doesn't wait for the peer.
+ * @param domain Data vchan domain.
+ * @param port Data vchan port.
+ * @param exitCode Exit code reported to the peer.
+ * @return Error code.
+ */
+static DWORD CompleteExec(int domain, int port, int exitCode)
+{
+    PCOMPLETE_EXEC request;
+    DWORD status;
+
+    if (InterlockedIncrement(&g_CompletingExecs) > MAX_COMPLETING_EXECS)
+    {
+        InterlockedDecrement(&g_CompletingExecs);
+        LogWarning("too many requests being completed, not sending exit code %d to %d:%d", exitCode, domain, port);
+        return SendConnectionTerminated(domain, port) ? ERROR_SUCCESS : ERROR_INVALID_FUNCTION;
+    }
+
+    status = ERROR_OUTOFMEMORY;
+    request = malloc(sizeof(COMPLETE_EXEC));
+    if (request)
+    {
+        request->Domain = domain;
+        request->Port = port;
+        request->ExitCode = exitCode;
+        if (QueueUserWorkItem(CompleteExecWorker, request, WT_EXECUTEDEFAULT))
+            return ERROR_SUCCESS;
+
+        status = win_perror("QueueUserWorkItem");
+        free(request);
+    }
+
+    InterlockedDecrement(&g_CompletingExecs);
+    SendConnectionTerminated(domain, port);
+    return status;
 }
 
 // based on https://stackoverflow.com/a/780024
@@ -398,8 +642,15 @@ static BOOL SubdirExists(OUT WCHAR* directory, IN const WCHAR* parent, IN const
  */
 static DWORD GetRpcFile(OUT WCHAR* path, IN const WCHAR* rpcSubdir, IN const WCHAR* serviceFile)
 {
+#ifdef QREXEC_LOOPBACK
+    // the harness supplies its own services, installed ones are not used
+    const WCHAR* privateRoot = g_LoopbackRpcRoot;
+#else
+    const WCHAR* privateRoot = PRIVATE_VOLUME_ROOT;
+#endif
+
     // try private volume first
-    if (SubdirExists(path, PRIVATE_VOLUME_ROOT, rpcSubdir))
+    if (SubdirExists(path, privateRoot, rpcSubdir))
     {
         DWORD status = PathCchAppendEx(path, MAX_PATH_LONG, serviceFile, PATHCCH_ALLOW_LONG_PATHS);
         if (FAILED(status))
@@ -412,6 +663,9 @@ static DWORD GetRpcFile(OUT WCHAR* path, IN const WCHAR* rpcSubdir, IN const WCH
             return ERROR_SUCCESS;
     }
 
+#ifdef QREXEC_LOOPBACK
+    return ERROR_FILE_NOT_FOUND;
+#else
     // try install dir
     const WCHAR* tools_dir = CfgGetToolsDir();
     if (!tools_dir)
@@ -434,6 +688,7 @@ static DWORD GetRpcFile(OUT WCHAR* path, IN const WCHAR* rpcSubdir, IN const WCH
     }
 
     return ERROR_FILE_NOT_FOUND;
+#endif
 }
 
 /**
@@ -453,6 +708,72 @@ static const WCHAR* ExtractRpcArgument(IN OUT WCHAR* serviceName)
     return NULL;
 }
 
+static RPC_PRIORITY ParsePriority(IN char* value, IN const WCHAR* serviceName)
+{
+    char* end;
+
+    while (isspace((unsigned char)*value))
+        value++;
+
+    end = value + strlen(value);
+    while (end > value && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    if (strcmp(value, "interactive") == 0)
+        return RPC_PRIORITY_INTERACTIVE;
+    if (strcmp(value, "bulk") == 0)
+        return RPC_PRIORITY_BULK;
+    if (strcmp(value, "normal") != 0)
+        LogWarning("service '%s': unknown priority '%S'", serviceName, value);
+
+    return RPC_PRIORITY_NORMAL;
+}
+
+/**
+ * @brief Parse optional "key=value" lines of a service definition.
+ * @param options Contents of the definition following the handler command line. Modified in place.
+ * @param serviceInfo Service properties to update.
+ */
+static void ParseServiceOptions(IN OUT char* options, IN OUT PRPC_SERVICE_INFO serviceInfo)
+{
+    char* context = NULL;
+
+    for (char* line = strtok_s(options, "\r\n", &context); line; line = strtok_s(NULL, "\r\n", &context))
+    {
+        while (isspace((unsigned char)*line))
+            line++;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        char* value = strchr(line, '=');
+        if (!value)
+        {
+            LogWarning("service '%s': invalid option line '%S'", serviceInfo->Name, line);
+            continue;
+        }
+
+        *value++ = '\0';
+        size_t keyLength = strlen(line);
+        while (keyLength > 0 && isspace((unsigned char)line[keyLength - 1]))
+            line[--keyLength] = '\0';
+
+        ULONG number = strtoul(value, NULL, 10);
+
+        if (strcmp(line, RPC_OPTION_MAX_CONCURRENT) == 0)
+            serviceInfo->MaxConcurrent = number;
+        else if (strcmp(line, RPC_OPTION_MAX_QUEUED) == 0)
+            serviceInfo->MaxQueued = number;
+        else if (strcmp(line, RPC_OPTION_PRIORITY) == 0)
+            serviceInfo->Priority = ParsePriority(value, serviceInfo->Name);
+        else
+            LogWarning("service '%s': unknown option '%S'", serviceInfo->Name, line);
+    }
+
+    LogDebug("service '%s': max concurrent %lu, max queued %lu, priority %d",
+        serviceInfo->Name, serviceInfo->MaxConcurrent, serviceInfo->MaxQueued, serviceInfo->Priority);
+}
+
 /**
  * @brief Recognize magic RPC request command ("QUBESRPC") and replace it with real
  *        command to be executed, after reading RPC service configuration.
@@ -460,9 +781,11 @@ static const WCHAR* ExtractRpcArgument(IN OUT WCHAR* serviceName)
  * @param commandLine Command line received from vchan, may be modified.
  * @param serviceCommandLine Parsed service handler command if successful. Must be freed by the caller.
  * @param sourceDomainName Source domain (if available) to be set in environment. Must be freed by caller.
+ * @param serviceInfo Properties of the requested service (or of plain commands if no RPC request is present).
  * @return Error code.
  */
-static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceCommandLine, OUT WCHAR** sourceDomainName)
+static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceCommandLine, OUT WCHAR** sourceDomainName,
+    OUT PRPC_SERVICE_INFO serviceInfo)
 {
     DWORD status = ERROR_INVALID_PARAMETER;
     HANDLE serviceConfigFile = INVALID_HANDLE_VALUE;
@@ -471,14 +794,20 @@ static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceC
 
     LogVerbose("cmd '%s'", commandLine);
 
-    if (!commandLine || !serviceCommandLine || !sourceDomainName)
+    if (!commandLine || !serviceCommandLine || !sourceDomainName || !serviceInfo)
         goto end;
 
     *serviceCommandLine = *sourceDomainName = NULL;
+    ZeroMemory(serviceInfo, sizeof(*serviceInfo));
+    serviceInfo->MaxQueued = DEFAULT_MAX_QUEUED;
+    serviceInfo->Priority = RPC_PRIORITY_NORMAL;
 
     status = ERROR_SUCCESS;
     if (wcsncmp(commandLine, RPC_REQUEST_COMMAND, wcslen(RPC_REQUEST_COMMAND)) != 0)
+    {
+        StringCchCopy(serviceInfo->Name, RTL_NUMBER_OF(serviceInfo->Name), QREXEC_METRICS_COMMAND_NAME);
         goto end;
+    }
 
     status = ERROR_OUTOFMEMORY;
     serviceFilePath = calloc(sizeof(WCHAR), MAX_PATH_LONG);
@@ -517,6 +846,7 @@ static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceC
     }
 
     const WCHAR* rpcArgument = ExtractRpcArgument(serviceName);
+    StringCchCopy(serviceInfo->Name, RTL_NUMBER_OF(serviceInfo->Name), serviceName);
     if (rpcArgument)
     {
         LogDebug("RPC argument: %s", rpcArgument);
@@ -559,6 +889,14 @@ static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceC
         goto end;
     }
 
+    // first line is the handler command, optional settings follow
+    char* options = strchr(serviceConfigContents, '\n');
+    if (options)
+    {
+        *options++ = '\0';
+        ParseServiceOptions(options, serviceInfo);
+    }
+
     WCHAR* rawServiceFilePath = NULL;
     size_t cfg_size;
     status = ConvertUTF8ToUTF16Static(serviceConfigContents, &rawServiceFilePath, &cfg_size);
@@ -570,7 +908,7 @@ static DWORD InterceptRPCRequest(IN OUT WCHAR* commandLine, OUT WCHAR** serviceC
 
     // strip white chars (especially end-of-line) from string
     DWORD pathLength = (ULONG)wcslen(rawServiceFilePath);
-    while (iswspace(rawServiceFilePath[pathLength - 1]))
+    while (pathLength > 0 && iswspace(rawServiceFilePath[pathLength - 1]))
     {
         pathLength--;
         rawServiceFilePath[pathLength] = L'\0';
@@ -676,6 +1014,93 @@ BOOL VchanSendHello(
     return VchanSendMessage(vchan, MSG_HELLO, &info, sizeof(info), L"hello");
 }
 
+/**
+ * @brief Build the environment block for a qrexec-wrapper: a copy of ours with the metrics context added.
+ *        Variables stay sorted by name, as CreateProcess expects.
+ * @param metricsContext Value of QREXEC_METRICS_ENV.
+ * @return Environment block (free with free()), NULL on error.
+ */
+static PWSTR BuildWrapperEnvironment(IN const WCHAR* metricsContext)
+{
+    PWCH environment = GetEnvironmentStringsW();
+    size_t nameLength = wcslen(QREXEC_METRICS_ENV);
+    size_t variableLength = nameLength + 1 + wcslen(metricsContext) + 1;
+    const WCHAR* entry;
+    size_t length;
+    PWSTR block = NULL;
+    PWSTR out;
+    BOOL added = FALSE;
+
+    if (!environment)
+    {
+        win_perror("GetEnvironmentStrings");
+        return NULL;
+    }
+
+    for (entry = environment; *entry; entry += wcslen(entry) + 1)
+        ;
+
+    block = malloc(((entry - environment) + variableLength + 1) * sizeof(WCHAR));
+    if (!block)
+        goto cleanup;
+
+    out = block;
+    for (entry = environment; *entry; entry += length + 1)
+    {
+        length = wcslen(entry);
+
+        // inherited value, replaced by ours
+        if (_wcsnicmp(entry, QREXEC_METRICS_ENV, nameLength) == 0 && entry[nameLength] == L'=')
+            continue;
+
+        if (!added && entry[0] != L'=' && _wcsnicmp(entry, QREXEC_METRICS_ENV, nameLength) > 0)
+        {
+            swprintf_s(out, variableLength, L"%s=%s", QREXEC_METRICS_ENV, metricsContext);
+            out += variableLength;
+            added = TRUE;
+        }
+
+        wmemcpy(out, entry, length + 1);
+        out += length + 1;
+    }
+
+    if (!added)
+    {
+        swprintf_s(out, variableLength, L"%s=%s", QREXEC_METRICS_ENV, metricsContext);
+        out += variableLength;
+    }
+
+    *out = L'\0';
+
+cleanup:
+    FreeEnvironmentStringsW(environment);
+    return block;
+}
+
+/**
+ * @brief Start a qrexec-wrapper process with its own environment block.
+ * @param commandLine Wrapper command line, can be modified by CreateProcess.
+ * @param environment Environment block for the wrapper.
+ * @param process Receives the process handle.
+ * @return Error code.
+ */
+static DWORD CreateWrapperProcess(IN OUT PWSTR commandLine, IN PWSTR environment, OUT HANDLE* process)
+{
+    STARTUPINFO si = { 0 };
+    PROCESS_INFORMATION pi;
+
+    si.cb = sizeof(si);
+    if (!CreateProcess(NULL, commandLine, NULL, NULL, FALSE, CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT,
+        environment, NULL, &si, &pi))
+    {
+        return win_perror("CreateProcess(qrexec-wrapper)");
+    }
+
+    CloseHandle(pi.hThread);
+    *process = pi.hProcess;
+    return ERROR_SUCCESS;
+}
+
 /**
  * @brief Start qrexec-wrapper process that will handle data vchan and child process I/O.
  * @param domain Data vchan domain.
@@ -685,11 +1110,17 @@ BOOL VchanSendHello(
  * @param isServer Determines whether qrexec-wrapper should act as a vchan server.
  * @param piped Determines whether the local executable's I/O should be connected to the data vchan.
  * @param interactive Determines whether the local executable should be run in the interactive session.
+ * @param metricsSlot Metrics slot of the service being handled.
+ * @param execTime Time when the request was received (QmTimestamp).
+ * @param service Admission state the child counts against, NULL if not subject to admission control.
  * @return Error code.
  */
-static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine, BOOL isServer, BOOL piped, BOOL interactive)
+static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine, BOOL isServer, BOOL piped, BOOL interactive,
+    LONG metricsSlot, LONG64 execTime, PSERVICE_ADMISSION service)
 {
     PWSTR command = malloc(MAX_PATH_LONG * sizeof(WCHAR));
+    WCHAR metricsContext[64];
+    PWSTR environment;
     int flags = 0;
     HANDLE wrapper;
     DWORD status;
@@ -702,14 +1133,29 @@ static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine,
     *                      0x01 act as vchan server (default is client)
     *                      0x02 pipe child process' io to vchan (default is not)
     *                      0x04 run the child process in the interactive session (requires that a user is logged on)
+    *                      0x08 raise CPU priority of the wrapper and the child (interactive services)
+    *                      0x10 lower CPU and IO priority of the wrapper and the child (bulk services)
     *             command_line: local program to execute
     */
     if (!command)
         return ERROR_OUTOFMEMORY;
 
+    // exec requests are limited by admission control, this only stops service connects
+    if (g_RunningServices >= MAX_CHILDREN)
+    {
+        LogError("no free connection slot for %d:%d (%lu children running)", domain, port, g_RunningServices);
+        QmRecordCall(metricsSlot);
+        QmRecordFailure(metricsSlot);
+        SendConnectionTerminated(domain, port);
+        free(command);
+        return ERROR_BUSY;
+    }
+
     if (isServer)    flags |= 0x01;
     if (piped)       flags |= 0x02;
     if (interactive) flags |= 0x04;
+    if (service && service->Priority == RPC_PRIORITY_INTERACTIVE) flags |= 0x08;
+    if (service && service->Priority == RPC_PRIORITY_BULK)        flags |= 0x10;
 
     StringCchPrintf(command, MAX_PATH_LONG, L"qrexec-wrapper.exe %d%c%d%c%s%c%d%c%s",
         domain, QUBES_ARGUMENT_SEPARATOR,
@@ -720,12 +1166,46 @@ static DWORD StartChild(int domain, int port, PWSTR userName, PWSTR commandLine,
 
     LogDebug("domain %d, port %d, user '%s', isServer %d, piped %d, interactive %d, cmd '%s', final command '%s'",
         domain, port, userName, isServer, piped, interactive, commandLine, command);
-    // wrapper will run as current user (SYSTEM, we're a service)
-    status = CreateNormalProcessAsCurrentUser(command, &wrapper);
+
+    QmRecordCall(metricsSlot);
+
+    // passed in the wrapper's own environment block, ours isn't changed
+    StringCchPrintf(metricsContext, RTL_NUMBER_OF(metricsContext), L"%ld %lld", metricsSlot, execTime);
+    environment = BuildWrapperEnvironment(metricsContext);
+    if (environment)
+    {
+        // wrapper will run as current user (SYSTEM, we're a service)
+        status = CreateWrapperProcess(command, environment, &wrapper);
+    }
+    else
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+
     if (status == ERROR_SUCCESS)
     {
-        register_vchan_connection(wrapper, domain, port);
+        if (register_vchan_connection(wrapper, domain, port, metricsSlot, execTime, service))
+        {
+            if (service)
+                service->Running++;
+            g_RunningServices++;
+        }
+        else
+        {
+            // nothing would wait for the wrapper or release its connection
+            TerminateProcess(wrapper, ERROR_BUSY);
+            CloseHandle(wrapper);
+            SendConnectionTerminated(domain, port);
+            QmRecordFailure(metricsSlot);
+            status = ERROR_BUSY;
+        }
+    }
+    else
+    {
+        QmRecordFailure(metricsSlot);
     }
+
+    free(environment);
     free(command);
     return status;
 }
@@ -770,6 +1250,22 @@ static PSERVICE_REQUEST FindServiceRequest(
     return returnContext;
 }
 
+/**
+ * @brief Get the metrics slot for a service triggered by a local client.
+ * @param context Service request.
+ * @return Metrics slot.
+ */
+static LONG GetTriggeredServiceSlot(IN const SERVICE_REQUEST* context)
+{
+    WCHAR* serviceName = NULL;
+
+    // service names are ASCII, but use the same conversion as for exec messages
+    if (ConvertUTF8ToUTF16Static(context->ServiceParams.service_name, &serviceName, NULL) != ERROR_SUCCESS)
+        return QREXEC_METRICS_NO_SLOT;
+
+    return QmGetServiceSlot(serviceName);
+}
+
 /**
  * @brief Handle qrexec service connect (allowed).
  * @param header Qrexec header with data connection parameters.
@@ -780,6 +1276,8 @@ DWORD HandleServiceConnect(IN const struct msg_header* header)
     DWORD status;
     struct exec_params* params = NULL;
     PSERVICE_REQUEST context = NULL;
+    LONG64 connectTime = QmTimestamp();
+    LONG metricsSlot;
 
     LogVerbose("msg 0x%x, len %d", header->type, header->len);
 
@@ -801,7 +1299,12 @@ DWORD HandleServiceConnect(IN const struct msg_header* header)
         goto cleanup;
     }
 
-    status = StartChild(params->connect_domain, params->connect_port, context->UserName, context->CommandLine, TRUE, TRUE, TRUE);
+    metricsSlot = GetTriggeredServiceSlot(context);
+    QmRecordLatency(metricsSlot, QREXEC_LATENCY_TRIGGER_CONNECT, QmElapsedUs(context->TriggerTime));
+
+    // locally triggered, not subject to admission control
+    status = StartChild(params->connect_domain, params->connect_port, context->UserName, context->CommandLine, TRUE, TRUE, TRUE,
+        metricsSlot, connectTime, NULL);
     if (ERROR_SUCCESS != status)
         win_perror("StartChild");
 
@@ -848,6 +1351,7 @@ DWORD HandleServiceRefused(IN const struct msg_header* header)
         context->ServiceParams.target_domain, context->ServiceParams.service_name, context->UserName, context->CommandLine);
 
     // TODO: notify user?
+    QmRecordFailure(GetTriggeredServiceSlot(context));
 
     EnterCriticalSection(&g_RequestCriticalSection);
     RemoveEntryList(&context->ListEntry);
@@ -866,9 +1370,11 @@ DWORD HandleServiceRefused(IN const struct msg_header* header)
  * @param userName Requested user name. Must be freed by the caller.
  * @param commandLine Actual command line to execute locally. Set to NULL if command line parsing fails. Must be freed by the caller.
  * @param runInteractively Determines whether the local command should be run in the interactive session.
+ * @param serviceInfo Properties of the requested service. Name is empty if parsing the command line fails.
  * @return Exec params on success (even if parsing command line fails). Must be freed by the caller.
  */
-struct exec_params* HandleExecCommon(IN int bufferSize, OUT WCHAR** userName, OUT WCHAR** commandLine, OUT BOOL* runInteractively)
+struct exec_params* HandleExecCommon(IN int bufferSize, OUT WCHAR** userName, OUT WCHAR** commandLine, OUT BOOL* runInteractively,
+    OUT PRPC_SERVICE_INFO serviceInfo)
 {
     struct exec_params* exec = NULL;
     DWORD status;
@@ -883,6 +1389,8 @@ struct exec_params* HandleExecCommon(IN int bufferSize, OUT WCHAR** userName, OU
     }
 
     *runInteractively = TRUE;
+    ZeroMemory(serviceInfo, sizeof(*serviceInfo));
+    serviceInfo->Priority = RPC_PRIORITY_NORMAL;
 
     status = ParseUtf8Command(exec->cmdline, userName, commandLine, runInteractively);
     if (ERROR_SUCCESS != status)
@@ -894,7 +1402,7 @@ struct exec_params* HandleExecCommon(IN int bufferSize, OUT WCHAR** userName, OU
     LogDebug("user: '%s', interactive: %d, parsed: '%s'", *userName, *runInteractively, *commandLine);
 
     // serviceCommandLine and remoteDomainName are allocated in the call
-    status = InterceptRPCRequest(*commandLine, &serviceCommandLine, &remoteDomainName);
+    status = InterceptRPCRequest(*commandLine, &serviceCommandLine, &remoteDomainName, serviceInfo);
     if (ERROR_SUCCESS != status)
     {
         LogWarning("InterceptRPCRequest failed");
@@ -927,6 +1435,152 @@ struct exec_params* HandleExecCommon(IN int bufferSize, OUT WCHAR** userName, OU
     return exec;
 }
 
+/**
+ * @brief Get admission state of a service, create it if needed.
+ * @param serviceInfo Service properties. Limits of an existing entry are updated (definition may have changed).
+ * @return Admission state or NULL if out of memory.
+ */
+static PSERVICE_ADMISSION GetServiceAdmission(IN const RPC_SERVICE_INFO* serviceInfo)
+{
+    PLIST_ENTRY entry;
+    PSERVICE_ADMISSION service = NULL;
+
+    for (entry = g_AdmissionList.Flink; entry != &g_AdmissionList; entry = entry->Flink)
+    {
+        PSERVICE_ADMISSION current = CONTAINING_RECORD(entry, SERVICE_ADMISSION, ListEntry);
+        if (wcscmp(current->Name, serviceInfo->Name) == 0)
+        {
+            service = current;
+            break;
+        }
+    }
+
+    if (!service)
+    {
+        service = calloc(1, sizeof(SERVICE_ADMISSION));
+        if (!service)
+            return NULL;
+
+        StringCchCopy(service->Name, RTL_NUMBER_OF(service->Name), serviceInfo->Name);
+        InsertTailList(&g_AdmissionList, &service->ListEntry);
+    }
+
+    service->MaxConcurrent = serviceInfo->MaxConcurrent;
+    service->MaxQueued = serviceInfo->MaxQueued;
+    service->Priority = serviceInfo->Priority;
+    return service;
+}
+
+static BOOL ServiceHasFreeSlot(IN const SERVICE_ADMISSION* service)
+{
+    if (g_RunningServices >= g_MaxConcurrent)
+        return FALSE;
+
+    return service->MaxConcurrent == 0 || service->Running < service->MaxConcurrent;
+}
+
+static void FreePendingExec(IN PPENDING_EXEC pending)
+{
+    free(pending->UserName);
+    free(pending->CommandLine);
+    free(pending);
+}
+
+/**
+ * @brief Start an exec request that was admitted.
+ * @param pending Request parameters.
+ * @return Error code.
+ */
+static DWORD StartAdmittedExec(IN const PENDING_EXEC* pending)
+{
+    DWORD status;
+
+    status = StartChild(pending->Domain, pending->Port, pending->UserName, pending->CommandLine, FALSE,
+        pending->Piped, pending->Interactive, pending->MetricsSlot, pending->ExecTime, pending->Service);
+    if (ERROR_SUCCESS != status)
+        LogError("StartChild(%s) failed", pending->CommandLine);
+
+    return status;
+}
+
+/**
+ * @brief Start an exec request now, queue it or refuse it, depending on service and global limits.
+ *        Refused requests get ERROR_BUSY as the exit code through the data vchan.
+ * @param request Request parameters. Strings are copied if the request is queued.
+ * @return Error code.
+ */
+static DWORD AdmitExec(IN PPENDING_EXEC request)
+{
+    PSERVICE_ADMISSION service = request->Service;
+    PPENDING_EXEC pending;
+
+    // don't let new requests overtake queued ones of the same service
+    if (service->Queued == 0 && ServiceHasFreeSlot(service))
+        return StartAdmittedExec(request);
+
+    if (service->Queued >= service->MaxQueued || g_QueuedServices >= g_MaxQueued)
+    {
+        LogWarning("service '%s' busy (%lu running, %lu queued, %lu total running), refusing request",
+            service->Name, service->Running, service->Queued, g_RunningServices);
+        QmRecordCall(request->MetricsSlot);
+        QmRecordRefused(request->MetricsSlot);
+        return CompleteExec(request->Domain, request->Port, ERROR_BUSY);
+    }
+
+    pending = malloc(sizeof(PENDING_EXEC));
+    if (!pending)
+        return ERROR_OUTOFMEMORY;
+
+    *pending = *request;
+    pending->UserName = request->UserName ? _wcsdup(request->UserName) : NULL;
+    pending->CommandLine = _wcsdup(request->CommandLine);
+    if (!pending->CommandLine || (request->UserName && !pending->UserName))
+    {
+        FreePendingExec(pending);
+        return ERROR_OUTOFMEMORY;
+    }
+
+    InsertTailList(&g_PendingExecLists[service->Priority], &pending->ListEntry);
+    service->Queued++;
+    g_QueuedServices++;
+
+    LogDebug("service '%s': request queued (%lu running, %lu queued)", service->Name, service->Running, service->Queued);
+    return ERROR_SUCCESS;
+}
+
+/**
+ * @brief Start queued exec requests that fit in the service and global limits.
+ *        Higher priority requests go first, arrival order is kept within a priority.
+ */
+static void DispatchPendingExecs(void)
+{
+    for (int priority = 0; priority < RPC_PRIORITY_COUNT; priority++)
+    {
+        PLIST_ENTRY list = &g_PendingExecLists[priority];
+        PLIST_ENTRY entry = list->Flink;
+
+        while (entry != list)
+        {
+            PPENDING_EXEC pending = CONTAINING_RECORD(entry, PENDING_EXEC, ListEntry);
+            entry = entry->Flink;
+
+            if (g_RunningServices >= g_MaxConcurrent)
+                return;
+
+            if (!ServiceHasFreeSlot(pending->Service))
+                continue;
+
+            RemoveEntryList(&pending->ListEntry);
+            pending->Service->Queued--;
+            g_QueuedServices--;
+
+            QmRecordLatency(pending->MetricsSlot, QREXEC_LATENCY_QUEUE_WAIT, QmElapsedUs(pending->ExecTime));
+            StartAdmittedExec(pending);
+            FreePendingExec(pending);
+        }
+    }
+}
+
 /**
  * @brief Handle EXEC command from control vchan.
  * @param header Qrexec header.
@@ -940,28 +1594,57 @@ static DWORD HandleExec(IN const struct msg_header* header, BOOL piped)
     WCHAR* commandLine = NULL;
     BOOL interactive;
     struct exec_params* exec;
+    LONG64 execTime = QmTimestamp();
+    LONG metricsSlot = QREXEC_METRICS_NO_SLOT;
+    RPC_SERVICE_INFO serviceInfo;
 
     LogVerbose("msg 0x%x, len %d", header->type, header->len);
 
-    exec = HandleExecCommon(header->len, &userName, &commandLine, &interactive);
+    exec = HandleExecCommon(header->len, &userName, &commandLine, &interactive, &serviceInfo);
     if (!exec)
         return ERROR_INVALID_FUNCTION;
 
+    // Only resolved services get their own metrics slot, otherwise requests for made up
+    // names could use up the whole table.
+    if (commandLine)
+        metricsSlot = QmGetServiceSlot(serviceInfo.Name);
+    else
+        metricsSlot = QmGetServiceSlot(QREXEC_METRICS_UNKNOWN_NAME);
+
     if (commandLine)
     {
-        // Start the wrapper that will take care of data vchan, launch the child and redirect child's IO to data vchan if piped==TRUE.
-        status = StartChild(exec->connect_domain, exec->connect_port, userName, commandLine, FALSE, piped, interactive);
-        if (ERROR_SUCCESS != status)
-            LogError("StartChild(%s) failed", commandLine);
+        PENDING_EXEC request = { 0 };
+
+        request.Service = GetServiceAdmission(&serviceInfo);
+        if (!request.Service)
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto cleanup;
+        }
+
+        request.Domain = exec->connect_domain;
+        request.Port = exec->connect_port;
+        request.UserName = userName;
+        request.CommandLine = commandLine;
+        request.Piped = piped;
+        request.Interactive = interactive;
+        request.MetricsSlot = metricsSlot;
+        request.ExecTime = execTime;
+
+        // The wrapper will take care of data vchan, launch the child and redirect child's IO to data vchan if piped==TRUE.
+        status = AdmitExec(&request);
     }
     else
     {
         LogDebug("Parsing the command line failed");
-        // parsing failed, most likely unknown service - start the wrapper with dummy command line to send non-zero exit code through data vchan
-        StartChild(exec->connect_domain, exec->connect_port, userName, L"dummy", FALSE, piped, interactive);
+        // most likely unknown service, send non-zero exit code through data vchan
+        QmRecordCall(metricsSlot);
+        QmRecordFailure(metricsSlot);
+        CompleteExec(exec->connect_domain, exec->connect_port, ERROR_FILE_NOT_FOUND);
         status = ERROR_SUCCESS;
     }
 
+cleanup:
     free(commandLine);
     free(userName);
     free(exec);
@@ -1049,16 +1732,20 @@ static DWORD WatchForEvents(HANDLE stopEvent)
     BOOL run = TRUE;
     BOOL daemonConnected = FALSE;
     HANDLE waitObjects[2 + MAX_FDS];
+#ifndef QREXEC_LOOPBACK
     HANDLE advertiseToolsProcess;
     WCHAR advertiseCommand[] = L"advertise-tools.exe 1"; // must be non-const
+#endif
 
     LogVerbose("start");
 
+#ifndef QREXEC_LOOPBACK
     // Don't do anything before qdb is available, otherwise advertise-tools may fail.
     if (!WaitForQdb())
     {
         return win_perror("WaitForQdb");
     }
+#endif
 
     // We give a 5 minute timeout here because xeniface can take some time
     // to load the first time after reboot after pvdrivers installation.
@@ -1124,6 +1811,7 @@ static DWORD WatchForEvents(HANDLE stopEvent)
                 daemonConnected = TRUE;
                 LeaveCriticalSection(&g_DaemonCriticalSection);
 
+#ifndef QREXEC_LOOPBACK
                 // advertise tools presence to dom0 by writing appropriate entries to qubesdb
                 // it waits for user logon
                 status = CreateNormalProcessAsCurrentUser(advertiseCommand, &advertiseToolsProcess);
@@ -1136,6 +1824,7 @@ static DWORD WatchForEvents(HANDLE stopEvent)
                     win_perror("Failed to create advertise-tools process");
                     // this is non-fatal?
                 }
+#endif
                 continue;
             }
 
@@ -1164,14 +1853,31 @@ static DWORD WatchForEvents(HANDLE stopEvent)
 
         if (signaledEvent < waitObjectsIndex) // wrapped processes
         {
-            for (int i = 0; i < MAX_FDS; i++)
+            CONTROL_BATCH batch;
+
+            CONTROL_BATCH_INIT(&batch);
+            // Children often exit together (e.g. a burst of short VMExec calls).
+            // Release every one that has exited, not just the first signaled handle,
+            // and report them all to the daemon in one vchan write.
+            for (DWORD j = signaledEvent; j < waitObjectsIndex; j++)
             {
-                if (connection_info[i].handle == waitObjects[signaledEvent])
+                if (j != signaledEvent && WaitForSingleObject(waitObjects[j], 0) != WAIT_OBJECT_0)
+                    continue;
+
+                for (int i = 0; i < MAX_FDS; i++)
                 {
-                    release_connection(i);
-                    break;
+                    if (connection_info[i].handle == waitObjects[j])
+                    {
+                        release_connection(i, &batch);
+                        break;
+                    }
                 }
             }
+
+            if (!VchanFlushBatch(g_DaemonVchan, &batch))
+                LogError("Failed to send MSG_CONNECTION_TERMINATED messages");
+
+            DispatchPendingExecs();
         }
     }
 
@@ -1279,6 +1985,7 @@ DWORD WINAPI PipeClientThread(PVOID param)
     QpsDisconnectClient(ctx->server, ctx->id);
 
     StringCbPrintfA(context->ServiceParams.request_id.ident, sizeof(context->ServiceParams.request_id.ident), "%lu", g_RequestId++);
+    context->TriggerTime = QmTimestamp();
     if (!VchanSendMessage(g_DaemonVchan, MSG_TRIGGER_SERVICE, &context->ServiceParams, sizeof(context->ServiceParams), L"trigger_service_params"))
     {
         LogError("sending trigger params to daemon failed");
@@ -1397,6 +2104,34 @@ cleanup:
     return status;
 }
 
+/**
+ * @brief Read global admission control limits from the registry config.
+ */
+static void ReadAdmissionConfig(void)
+{
+    WCHAR moduleName[CFG_MODULE_MAX];
+    DWORD value;
+    DWORD status = CfgGetModuleName(moduleName, RTL_NUMBER_OF(moduleName));
+    if (status != ERROR_SUCCESS)
+    {
+        win_perror2(status, "Failed to get self module name");
+        return;
+    }
+
+    if (CfgReadDword(moduleName, REG_CONFIG_MAX_CONCURRENT_VALUE, &value, NULL) == ERROR_SUCCESS)
+    {
+        if (value == 0 || value > DEFAULT_MAX_CONCURRENT)
+            LogWarning(REG_CONFIG_MAX_CONCURRENT_VALUE L" must be between 1 and %d, ignoring %lu", DEFAULT_MAX_CONCURRENT, value);
+        else
+            g_MaxConcurrent = value;
+    }
+
+    if (CfgReadDword(moduleName, REG_CONFIG_MAX_QUEUED_VALUE, &value, NULL) == ERROR_SUCCESS)
+        g_MaxQueued = value;
+
+    LogDebug("max concurrent services %lu, max queued %lu", g_MaxConcurrent, g_MaxQueued);
+}
+
 /**
  * @brief Service worker thread.
  * @param param Worker context.
@@ -1415,7 +2150,12 @@ DWORD WINAPI ServiceExecutionThread(void* param)
 
     libvchan_register_logger(XifLogger, LogGetLevel());
 
+    status = QmCreate();
+    if (status != ERROR_SUCCESS)
+        win_perror2(status, "creating metrics section (non-fatal)");
+
     ProcessAutostarts();
+    ReadAdmissionConfig();
 
     status = CreatePublicPipeSecurityDescriptor(&sd, &acl);
     if (status != ERROR_SUCCESS)
@@ -1466,6 +2206,7 @@ DWORD WINAPI ServiceExecutionThread(void* param)
 
     LocalFree(acl);
     LocalFree(sd);
+    QmClose();
 
     LogInfo("Shutting down");
 
@@ -1474,14 +2215,68 @@ DWORD WINAPI ServiceExecutionThread(void* param)
 
 static DWORD WINAPI ServiceCleanup(void)
 {
+    // CompleteExecWorker may still be running
+    EnterCriticalSection(&g_DaemonCriticalSection);
     if (g_DaemonVchan)
     {
         libvchan_close(g_DaemonVchan);
         g_DaemonVchan = NULL;
     }
+    LeaveCriticalSection(&g_DaemonCriticalSection);
+
+    // daemon is gone, queued requests can't be served
+    for (int priority = 0; priority < RPC_PRIORITY_COUNT; priority++)
+    {
+        while (!IsListEmpty(&g_PendingExecLists[priority]))
+        {
+            PPENDING_EXEC pending = CONTAINING_RECORD(RemoveHeadList(&g_PendingExecLists[priority]), PENDING_EXEC, ListEntry);
+            pending->Service->Queued--;
+            g_QueuedServices--;
+            FreePendingExec(pending);
+        }
+    }
+
     return ERROR_SUCCESS;
 }
 
+/**
+ * @brief Initialize locks and lists shared by the control vchan loop and the pipe server.
+ */
+static void InitAgentState(void)
+{
+    InitializeCriticalSection(&g_DaemonCriticalSection);
+    InitializeCriticalSection(&g_RequestCriticalSection);
+    InitializeSRWLock(&g_ConnectionsHandlesLock);
+    InitializeListHead(&g_RequestList);
+    InitializeListHead(&g_AdmissionList);
+    for (int priority = 0; priority < RPC_PRIORITY_COUNT; priority++)
+        InitializeListHead(&g_PendingExecLists[priority]);
+}
+
+#ifdef QREXEC_LOOPBACK
+DWORD LoopbackAgentMain(IN HANDLE stopEvent, IN const WCHAR* rpcRoot)
+{
+    DWORD status;
+
+    LogVerbose("start");
+
+    g_LoopbackRpcRoot = rpcRoot;
+    InitAgentState();
+    libvchan_register_logger(XifLogger, LogGetLevel());
+
+    status = QmCreate();
+    if (status != ERROR_SUCCESS)
+        win_perror2(status, "creating metrics section (non-fatal)");
+
+    ReadAdmissionConfig();
+
+    status = WatchForEvents(stopEvent);
+    QmClose();
+
+    LogVerbose("exiting");
+    return status;
+}
+#else
 int wmain(int argc, WCHAR* argv[])
 {
     UNREFERENCED_PARAMETER(argc);
@@ -1494,10 +2289,7 @@ int wmain(int argc, WCHAR* argv[])
 #endif
     LogVerbose("start");
 
-    InitializeCriticalSection(&g_DaemonCriticalSection);
-    InitializeCriticalSection(&g_RequestCriticalSection);
-    InitializeSRWLock(&g_ConnectionsHandlesLock);
-    InitializeListHead(&g_RequestList);
+    InitAgentState();
 
     status = SvcMainLoop(
         SERVICE_NAME,
@@ -1510,3 +2302,4 @@ int wmain(int argc, WCHAR* argv[])
     LogVerbose("exiting");
     return status;
 }
+#endif
@@ -28,6 +28,8 @@
 #define DEFAULT_USER_PASSWORD_UNICODE   L"userpass"
 
 #define REG_CONFIG_AUTOSTART_VALUE      L"Autostart"
+#define REG_CONFIG_MAX_CONCURRENT_VALUE L"MaxConcurrentServices"
+#define REG_CONFIG_MAX_QUEUED_VALUE     L"MaxQueuedServices"
 
 #define	TRIGGER_PIPE_NAME               L"\\\\.\\pipe\\qrexec_trigger"
 
@@ -42,6 +44,83 @@
 #define QREXEC_RPC_DEFINITION_DIR  L"qubes-rpc"
 #define QREXEC_RPC_HANDLER_DIR     L"qubes-rpc-services"
 
+// Optional "key=value" lines following the handler command in a service definition
+#define RPC_OPTION_MAX_CONCURRENT  "max-concurrent" // local handlers allowed to run at once (0: no per-service limit)
+#define RPC_OPTION_MAX_QUEUED      "max-queued"     // requests held while the service is at its limit
+#define RPC_OPTION_PRIORITY        "priority"       // "interactive", "normal" or "bulk"
+
+#define RPC_SERVICE_NAME_SIZE      64 // same as service_name in trigger_service_params
+
+// Child handles are waited on together with the stop event and the control vchan.
+#define MAX_CHILDREN               (MAXIMUM_WAIT_OBJECTS - 2)
+// Connection slots exec requests can't use, kept for locally triggered service connects.
+// Refused requests don't need a slot, the agent reports them without starting qrexec-wrapper.
+#define SERVICE_CONNECT_RESERVE    4
+#define DEFAULT_MAX_CONCURRENT     (MAX_CHILDREN - SERVICE_CONNECT_RESERVE)
+#define DEFAULT_MAX_QUEUED         64
+// Refused and failed exec requests being reported on worker threads. Above this, only
+// MSG_CONNECTION_TERMINATED is sent for them and the peer gets no exit code.
+#define MAX_COMPLETING_EXECS       64
+
+// Dispatch order of queued requests, also selects CPU/IO priority of the wrapper and its child.
+typedef enum _RPC_PRIORITY
+{
+    RPC_PRIORITY_INTERACTIVE = 0, // latency sensitive, dispatched first
+    RPC_PRIORITY_NORMAL,
+    RPC_PRIORITY_BULK,            // long transfers, background IO priority
+    RPC_PRIORITY_COUNT
+} RPC_PRIORITY;
+
+// RPC service properties read from its definition
+typedef struct _RPC_SERVICE_INFO
+{
+    WCHAR Name[RPC_SERVICE_NAME_SIZE]; // without the argument
+    ULONG MaxConcurrent;
+    ULONG MaxQueued;
+    RPC_PRIORITY Priority;
+} RPC_SERVICE_INFO, *PRPC_SERVICE_INFO;
+
+// admission state of a service
+typedef struct _SERVICE_ADMISSION
+{
+    LIST_ENTRY ListEntry;
+    WCHAR Name[RPC_SERVICE_NAME_SIZE];
+    ULONG MaxConcurrent;
+    ULONG MaxQueued;
+    RPC_PRIORITY Priority;
+    ULONG Running;
+    ULONG Queued;
+} SERVICE_ADMISSION, *PSERVICE_ADMISSION;
+
+// exec request held until its service and the agent have a free slot
+typedef struct _PENDING_EXEC
+{
+    LIST_ENTRY ListEntry;
+    PSERVICE_ADMISSION Service;
+    int Domain;
+    int Port;
+    PWSTR UserName;
+    PWSTR CommandLine;
+    BOOL Piped;
+    BOOL Interactive;
+    LONG MetricsSlot;
+    LONG64 ExecTime;
+} PENDING_EXEC, *PPENDING_EXEC;
+
+// Control messages accumulated to be sent to the daemon in a single vchan write.
+// Big enough for MSG_CONNECTION_TERMINATED of all children at once.
+#define CONTROL_BATCH_SIZE 4096
+
+typedef struct _CONTROL_BATCH
+{
+    ULONG Size; // bytes used in Buffer
+    ULONG Count; // messages in Buffer
+    BYTE Buffer[CONTROL_BATCH_SIZE];
+} CONTROL_BATCH, *PCONTROL_BATCH;
+
+// Buffer is only read up to Size, so batches on the stack don't need to be zeroed.
+#define CONTROL_BATCH_INIT(batch) ((batch)->Size = (batch)->Count = 0)
+
 // received from qrexec-client-vm
 typedef struct _SERVICE_REQUEST
 {
@@ -49,4 +128,17 @@ typedef struct _SERVICE_REQUEST
     struct trigger_service_params ServiceParams;
     PWSTR UserName; // user name for the service handler
     PWSTR CommandLine; // executable that will be the local service endpoint
+    LONG64 TriggerTime; // when MSG_TRIGGER_SERVICE was sent (QmTimestamp)
 } SERVICE_REQUEST, *PSERVICE_REQUEST;
+
+#ifdef QREXEC_LOOPBACK
+/**
+ * @brief Run the control vchan loop in the calling thread, without the service and the trigger pipe.
+ *        Used by the qrexec-loopback harness, qubesdb and advertise-tools are skipped.
+ * @param stopEvent When this event is signaled, the function returns.
+ * @param rpcRoot Directory with qubes-rpc and qubes-rpc-services subdirectories. RPC services are
+ *                looked up only there, instead of the private volume and the install dir.
+ * @return Error code.
+ */
+DWORD LoopbackAgentMain(IN HANDLE stopEvent, IN const WCHAR* rpcRoot);
+#endif
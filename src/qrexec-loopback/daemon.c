@@ -0,0 +1,402 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Fake qrexec daemon: the dom0 side of the control vchan and the qrexec-client side
+// of data vchans, enough to run commands through the agent and measure them.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qrexec.h>
+#include <libvchan.h>
+
+#include <log.h>
+#include <list.h>
+
+#include "qrexec-agent.h"
+#include "qrexec-loopback.h"
+#include "qrexec-metrics.h"
+
+// call waiting for MSG_CONNECTION_TERMINATED
+typedef struct _PENDING_CALL
+{
+    LIST_ENTRY ListEntry;
+    int Port;
+    HANDLE Terminated;
+} PENDING_CALL, *PPENDING_CALL;
+
+static libvchan_t* g_ControlVchan;
+static CRITICAL_SECTION g_ControlCs; // serializes control vchan writes
+static CRITICAL_SECTION g_CallsCs;
+static LIST_ENTRY g_PendingCalls;
+static volatile LONG g_NextPort = LOOPBACK_FIRST_PORT - 1;
+static HANDLE g_ReaderThread;
+static HANDLE g_StopEvent;
+
+static BOOL DaemonSendMessage(IN libvchan_t* vchan, IN UINT type, IN const void* data, IN UINT size)
+{
+    struct msg_header header;
+
+    header.type = type;
+    header.len = size;
+    if (libvchan_send(vchan, &header, sizeof(header)) != sizeof(header))
+        return FALSE;
+
+    return size == 0 || libvchan_send(vchan, data, size) == (int)size;
+}
+
+static void CompleteCall(IN int port)
+{
+    PLIST_ENTRY entry;
+
+    EnterCriticalSection(&g_CallsCs);
+    for (entry = g_PendingCalls.Flink; entry != &g_PendingCalls; entry = entry->Flink)
+    {
+        PPENDING_CALL call = CONTAINING_RECORD(entry, PENDING_CALL, ListEntry);
+        if (call->Port == port)
+        {
+            SetEvent(call->Terminated);
+            break;
+        }
+    }
+    LeaveCriticalSection(&g_CallsCs);
+
+    if (entry == &g_PendingCalls)
+        LogWarning("MSG_CONNECTION_TERMINATED for unknown port %d", port);
+}
+
+static DWORD WINAPI ControlReaderThread(PVOID param)
+{
+    HANDLE waitObjects[2];
+    struct msg_header header;
+    BYTE buffer[4096];
+
+    UNREFERENCED_PARAMETER(param);
+
+    waitObjects[0] = g_StopEvent;
+    waitObjects[1] = libvchan_fd_for_select(g_ControlVchan);
+
+    while (WaitForMultipleObjects(2, waitObjects, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    {
+        while (libvchan_data_ready(g_ControlVchan) > 0)
+        {
+            if (libvchan_recv(g_ControlVchan, &header, sizeof(header)) != sizeof(header))
+                return win_perror2(ERROR_INVALID_FUNCTION, "receive control header");
+
+            if (header.len > sizeof(buffer))
+            {
+                LogError("control message 0x%x too big: %u", header.type, header.len);
+                return ERROR_INVALID_DATA;
+            }
+
+            if (header.len > 0 && libvchan_recv(g_ControlVchan, buffer, header.len) != (int)header.len)
+                return win_perror2(ERROR_INVALID_FUNCTION, "receive control data");
+
+            if (header.type == MSG_CONNECTION_TERMINATED && header.len >= sizeof(struct exec_params))
+                CompleteCall(((struct exec_params*)buffer)->connect_port);
+            else
+                LogWarning("unexpected control message 0x%x, len %u", header.type, header.len);
+        }
+
+        if (!libvchan_is_open(g_ControlVchan))
+        {
+            LogError("agent disconnected");
+            return ERROR_BROKEN_PIPE;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD DaemonConnect(IN DWORD timeoutMs)
+{
+    ULONGLONG start = GetTickCount64();
+    struct msg_header header;
+    struct peer_info info;
+
+    InitializeCriticalSection(&g_ControlCs);
+    InitializeCriticalSection(&g_CallsCs);
+    InitializeListHead(&g_PendingCalls);
+
+    // the agent creates the control vchan server when its loop starts
+    while (!(g_ControlVchan = libvchan_client_init(0, VCHAN_BASE_PORT)))
+    {
+        if (GetTickCount64() - start > timeoutMs)
+            return win_perror2(ERROR_TIMEOUT, "connect to the agent");
+        Sleep(10);
+    }
+
+    // agent speaks first
+    if (libvchan_recv(g_ControlVchan, &header, sizeof(header)) != sizeof(header) ||
+        header.type != MSG_HELLO || header.len != sizeof(info) ||
+        libvchan_recv(g_ControlVchan, &info, sizeof(info)) != sizeof(info))
+    {
+        LogError("no MSG_HELLO from the agent");
+        return ERROR_INVALID_DATA;
+    }
+
+    LogDebug("agent protocol version %d", info.version);
+
+    info.version = QREXEC_PROTOCOL_VERSION;
+    if (!DaemonSendMessage(g_ControlVchan, MSG_HELLO, &info, sizeof(info)))
+        return win_perror2(ERROR_INVALID_FUNCTION, "send MSG_HELLO");
+
+    g_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!g_StopEvent)
+        return win_perror("CreateEvent");
+
+    g_ReaderThread = CreateThread(NULL, 0, ControlReaderThread, NULL, 0, NULL);
+    if (!g_ReaderThread)
+        return win_perror("create control reader thread");
+
+    return ERROR_SUCCESS;
+}
+
+void DaemonDisconnect(void)
+{
+    if (g_ReaderThread)
+    {
+        SetEvent(g_StopEvent);
+        WaitForSingleObject(g_ReaderThread, INFINITE);
+        CloseHandle(g_ReaderThread);
+        g_ReaderThread = NULL;
+    }
+
+    if (g_StopEvent)
+    {
+        CloseHandle(g_StopEvent);
+        g_StopEvent = NULL;
+    }
+
+    if (g_ControlVchan)
+    {
+        libvchan_close(g_ControlVchan);
+        g_ControlVchan = NULL;
+    }
+}
+
+/**
+ * @brief Handle messages the wrapper sent so far.
+ * @return Error code.
+ */
+static DWORD ReceiveOutput(IN libvchan_t* vchan, IN OUT BYTE* buffer, IN OUT PCALL_RESULT result, OUT BOOL* exited)
+{
+    struct msg_header header;
+
+    while (libvchan_data_ready(vchan) > 0)
+    {
+        if (libvchan_recv(vchan, &header, sizeof(header)) != sizeof(header))
+            return win_perror2(ERROR_INVALID_FUNCTION, "receive data header");
+
+        if (header.len > MAX_DATA_CHUNK)
+        {
+            LogError("msg 0x%x, size too big: %u", header.type, header.len);
+            return ERROR_INVALID_DATA;
+        }
+
+        if (header.len > 0 && libvchan_recv(vchan, buffer, header.len) != (int)header.len)
+            return win_perror2(ERROR_INVALID_FUNCTION, "receive data");
+
+        switch (header.type)
+        {
+        case MSG_HELLO:
+            break;
+
+        case MSG_DATA_STDOUT:
+            result->BytesIn += header.len;
+            break;
+
+        case MSG_DATA_STDERR:
+            break;
+
+        case MSG_DATA_EXIT_CODE:
+            if (header.len != sizeof(int))
+                return ERROR_INVALID_DATA;
+            result->ExitCode = *(int*)buffer;
+            *exited = TRUE;
+            return ERROR_SUCCESS;
+
+        default:
+            LogError("unexpected data message 0x%x", header.type);
+            return ERROR_INVALID_DATA;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+/**
+ * @brief Exchange data with the wrapper until it sends the exit code.
+ * @return Error code.
+ */
+static DWORD RunDataVchan(IN libvchan_t* vchan, IN HANDLE terminated, IN LONG64 stdinSize, IN LONG64 start,
+    OUT PCALL_RESULT result)
+{
+    HANDLE waitObjects[2];
+    struct peer_info info;
+    BOOL eofSent = FALSE;
+    BOOL exited = FALSE;
+    BYTE* buffer;
+    DWORD status = ERROR_SUCCESS;
+
+    buffer = malloc(MAX_DATA_CHUNK);
+    if (!buffer)
+        return ERROR_OUTOFMEMORY;
+
+    // stdin payload, contents don't matter
+    memset(buffer, 'q', MAX_DATA_CHUNK);
+
+    waitObjects[0] = libvchan_fd_for_select(vchan);
+    waitObjects[1] = terminated;
+
+    // wait for qrexec-wrapper to connect, the agent reports the wrapper's exit if it never does
+    while (libvchan_is_open(vchan) == 2) // no client yet
+    {
+        if (WaitForMultipleObjects(2, waitObjects, FALSE, LOOPBACK_CALL_TIMEOUT) != WAIT_OBJECT_0)
+        {
+            LogError("qrexec-wrapper didn't connect");
+            status = ERROR_CONNECTION_ABORTED;
+            goto cleanup;
+        }
+    }
+
+    info.version = QREXEC_PROTOCOL_VERSION;
+    if (!DaemonSendMessage(vchan, MSG_HELLO, &info, sizeof(info)))
+    {
+        status = win_perror2(ERROR_INVALID_FUNCTION, "send MSG_HELLO");
+        goto cleanup;
+    }
+
+    while (!exited)
+    {
+        status = ReceiveOutput(vchan, buffer, result, &exited);
+        if (status != ERROR_SUCCESS || exited)
+            break;
+
+        // send stdin only as long as it doesn't block, output must keep flowing
+        UINT chunk = (UINT)min(stdinSize - result->BytesOut, MAX_DATA_CHUNK);
+        if (!eofSent && libvchan_buffer_space(vchan) >= (int)(sizeof(struct msg_header) + chunk))
+        {
+            if (!DaemonSendMessage(vchan, MSG_DATA_STDIN, buffer, chunk))
+            {
+                status = win_perror2(ERROR_INVALID_FUNCTION, "send stdin");
+                break;
+            }
+
+            result->BytesOut += chunk;
+            eofSent = (chunk == 0);
+            continue;
+        }
+
+        if (!libvchan_is_open(vchan) && libvchan_data_ready(vchan) == 0)
+        {
+            LogError("qrexec-wrapper disconnected without an exit code");
+            status = ERROR_BROKEN_PIPE;
+            break;
+        }
+
+        if (WaitForSingleObject(waitObjects[0], LOOPBACK_CALL_TIMEOUT) != WAIT_OBJECT_0)
+        {
+            LogError("timed out waiting for qrexec-wrapper");
+            status = ERROR_TIMEOUT;
+            break;
+        }
+    }
+
+    if (exited)
+        result->LatencyUs = QmElapsedUs(start);
+
+cleanup:
+    free(buffer);
+    return status;
+}
+
+DWORD DaemonCall(IN const char* commandLine, IN LONG64 stdinSize, OUT PCALL_RESULT result)
+{
+    PENDING_CALL call = { 0 };
+    struct exec_params* exec = NULL;
+    libvchan_t* vchan = NULL;
+    UINT cbExec = (UINT)(sizeof(struct exec_params) + strlen(commandLine) + 1);
+    LONG64 start;
+    BOOL sent;
+    DWORD status;
+
+    ZeroMemory(result, sizeof(*result));
+    result->ExitCode = -1;
+
+    call.Port = InterlockedIncrement(&g_NextPort);
+    call.Terminated = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!call.Terminated)
+        return win_perror("CreateEvent");
+
+    exec = malloc(cbExec);
+    if (!exec)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto cleanup;
+    }
+
+    exec->connect_domain = 0;
+    exec->connect_port = call.Port;
+    memcpy(exec->cmdline, commandLine, strlen(commandLine) + 1);
+
+    // qrexec-client is the data vchan server
+    vchan = libvchan_server_init(0, call.Port, VCHAN_BUFFER_SIZE, VCHAN_BUFFER_SIZE);
+    if (!vchan)
+    {
+        LogError("libvchan_server_init(%d) failed", call.Port);
+        status = ERROR_INVALID_FUNCTION;
+        goto cleanup;
+    }
+
+    EnterCriticalSection(&g_CallsCs);
+    InsertTailList(&g_PendingCalls, &call.ListEntry);
+    LeaveCriticalSection(&g_CallsCs);
+
+    start = QmTimestamp();
+    EnterCriticalSection(&g_ControlCs);
+    sent = DaemonSendMessage(g_ControlVchan, MSG_EXEC_CMDLINE, exec, cbExec);
+    LeaveCriticalSection(&g_ControlCs);
+
+    if (sent)
+        status = RunDataVchan(vchan, call.Terminated, stdinSize, start, result);
+    else
+        status = win_perror2(ERROR_INVALID_FUNCTION, "send MSG_EXEC_CMDLINE");
+
+    // the connection is done when the agent says so, not when the exit code arrives
+    if (sent && WaitForSingleObject(call.Terminated, LOOPBACK_CALL_TIMEOUT) != WAIT_OBJECT_0)
+    {
+        LogError("no MSG_CONNECTION_TERMINATED for port %d", call.Port);
+        status = ERROR_TIMEOUT;
+    }
+
+    EnterCriticalSection(&g_CallsCs);
+    RemoveEntryList(&call.ListEntry);
+    LeaveCriticalSection(&g_CallsCs);
+
+cleanup:
+    if (vchan)
+        libvchan_close(vchan);
+    free(exec);
+    CloseHandle(call.Terminated);
+    return status;
+}
@@ -0,0 +1,999 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Loopback benchmark of the qrexec agent. The agent's control vchan loop runs in this process,
+// the fake daemon sends it exec requests and each request goes through a real qrexec-wrapper.exe
+// to a child process (this executable in --sink or --source mode). Vchans are provided by the
+// libvchan-loopback stand-in, no VM or Xen is involved.
+// Measures call round trip latency, call throughput with concurrent callers, bulk stream
+// throughput, commands during a flood of requests for unknown services, reporting of children
+// exiting at once and the latency of normal and interactive services under bulk load. Exits with a nonzero code if any call fails.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+#include <log.h>
+
+#include "qrexec-agent.h"
+#include "qrexec-loopback.h"
+#include "qrexec-metrics.h"
+
+#define DEFAULT_LATENCY_CALLS    200
+#define DEFAULT_CALLS_PER_THREAD 20
+#define DEFAULT_BULK_MB          256
+#define MAX_THREADS              32
+#define CHILD_IO_SIZE            65536
+
+// Background load for the priority benchmark: more bulk callers than the agent runs at once
+// (DEFAULT_MAX_CONCURRENT), so requests queue and the dispatch order matters.
+// Children released at once by the termination benchmark, at most DEFAULT_MAX_CONCURRENT
+#define MAX_TERMINATIONS         56
+
+#define BACKGROUND_THREADS       64
+#define BACKGROUND_CALL_SIZE     (1024 * 1024)
+
+// RPC services defined by the harness in g_RpcRoot
+#define SERVICE_NORMAL           "loopback.Normal"
+#define SERVICE_INTERACTIVE      "loopback.Interactive"
+#define SERVICE_BULK             "loopback.Bulk"
+
+typedef struct _WORKER
+{
+    HANDLE Start;
+    ULONG Index;
+    const char* Command;
+    ULONG Calls;
+    LONG64* Samples; // Calls entries
+    ULONG Count; // successful calls
+    LONG64 Finished; // QmTimestamp after the last call
+} WORKER, *PWORKER;
+
+static WCHAR g_SelfPath[MAX_PATH];
+static WCHAR g_RpcRoot[MAX_PATH];
+static volatile LONG g_Failures = 0;
+static volatile LONG g_StopBackground = FALSE;
+
+static const WCHAR* g_LatencyNames[QREXEC_LATENCY_COUNT] =
+{
+    L"trigger->connect",
+    L"exec->start",
+    L"duration",
+    L"queue wait",
+};
+
+/**
+ * @brief Child mode: read stdin until EOF.
+ * @return 0 if exactly @a expected bytes were read.
+ */
+static int RunSink(IN LONG64 expected)
+{
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    BYTE* buffer = malloc(CHILD_IO_SIZE);
+    LONG64 total = 0;
+    DWORD cbRead;
+
+    if (!buffer)
+        return 2;
+
+    while (ReadFile(input, buffer, CHILD_IO_SIZE, &cbRead, NULL) && cbRead > 0)
+        total += cbRead;
+
+    free(buffer);
+    return total == expected ? 0 : 1;
+}
+
+/**
+ * @brief Child mode: write @a size bytes to stdout.
+ */
+static int RunSource(IN LONG64 size)
+{
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    BYTE* buffer = malloc(CHILD_IO_SIZE);
+    DWORD cbWritten;
+
+    if (!buffer)
+        return 2;
+
+    memset(buffer, 'q', CHILD_IO_SIZE);
+    while (size > 0)
+    {
+        if (!WriteFile(output, buffer, (DWORD)min(size, CHILD_IO_SIZE), &cbWritten, NULL))
+            break;
+        size -= cbWritten;
+    }
+
+    free(buffer);
+    return size == 0 ? 0 : 1;
+}
+
+// Named objects shared with --wait children, suffixed with the harness' process id
+#define WAIT_STARTED_NAME        L"qrexec-loopback-started-%lu"
+#define WAIT_EXIT_NAME           L"qrexec-loopback-exit-%lu"
+
+/**
+ * @brief Child mode: tell the harness this child is running, then exit when it says so.
+ * @param harnessPid Process id of the harness.
+ * @return 0 if the harness released the child in time.
+ */
+static int RunWait(IN DWORD harnessPid)
+{
+    WCHAR name[64];
+    HANDLE started = NULL;
+    HANDLE release = NULL;
+    int status = 1;
+
+    if (FAILED(StringCchPrintfW(name, RTL_NUMBER_OF(name), WAIT_STARTED_NAME, harnessPid)) ||
+        !(started = OpenSemaphoreW(SEMAPHORE_MODIFY_STATE, FALSE, name)))
+        goto cleanup;
+
+    if (FAILED(StringCchPrintfW(name, RTL_NUMBER_OF(name), WAIT_EXIT_NAME, harnessPid)) ||
+        !(release = OpenEventW(SYNCHRONIZE, FALSE, name)))
+        goto cleanup;
+
+    if (ReleaseSemaphore(started, 1, NULL) && WaitForSingleObject(release, LOOPBACK_CALL_TIMEOUT) == WAIT_OBJECT_0)
+        status = 0;
+
+cleanup:
+    if (started)
+        CloseHandle(started);
+    if (release)
+        CloseHandle(release);
+    return status;
+}
+
+/**
+ * @brief Build the exec command line running this executable in a child mode.
+ * @return UTF-8 command line, caller must free it. NULL on failure.
+ */
+static char* BuildCommand(IN const WCHAR* mode, IN LONG64 size)
+{
+    WCHAR command[MAX_PATH + 64];
+    char* commandUtf8;
+    int cbCommand;
+
+    if (FAILED(StringCchPrintfW(command, RTL_NUMBER_OF(command), L"SYSTEM:nogui:\"%s\" %s %lld", g_SelfPath, mode, size)))
+        return NULL;
+
+    cbCommand = WideCharToMultiByte(CP_UTF8, 0, command, -1, NULL, 0, NULL, NULL);
+    if (cbCommand == 0)
+        return NULL;
+
+    commandUtf8 = malloc(cbCommand);
+    if (commandUtf8 && WideCharToMultiByte(CP_UTF8, 0, command, -1, commandUtf8, cbCommand, NULL, NULL) == 0)
+    {
+        free(commandUtf8);
+        commandUtf8 = NULL;
+    }
+
+    return commandUtf8;
+}
+
+/**
+ * @brief Run one call and check its result.
+ * @return TRUE if the call exited with @a expectedExitCode and sent @a expectedOutput bytes.
+ */
+static BOOL CallWithExitCode(IN const char* command, IN LONG64 input, IN LONG64 expectedOutput, IN int expectedExitCode,
+    OUT LONG64* latencyUs)
+{
+    CALL_RESULT result;
+    DWORD status = DaemonCall(command, input, &result);
+
+    if (status != ERROR_SUCCESS || result.ExitCode != expectedExitCode || result.BytesIn != expectedOutput)
+    {
+        InterlockedIncrement(&g_Failures);
+        fwprintf(stderr, L"call failed: status %lu, exit code %d, %lld bytes received\n",
+            status, result.ExitCode, result.BytesIn);
+        return FALSE;
+    }
+
+    *latencyUs = result.LatencyUs;
+    return TRUE;
+}
+
+/**
+ * @brief Run one call and check its result.
+ * @return TRUE if the child succeeded and sent @a expectedOutput bytes.
+ */
+static BOOL Call(IN const char* command, IN LONG64 input, IN LONG64 expectedOutput, OUT LONG64* latencyUs)
+{
+    return CallWithExitCode(command, input, expectedOutput, 0, latencyUs);
+}
+
+static int CompareLatency(const void* a, const void* b)
+{
+    LONG64 x = *(const LONG64*)a;
+    LONG64 y = *(const LONG64*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void PrintLatencies(IN LONG64* samples, IN ULONG count)
+{
+    LONG64 sum = 0;
+
+    if (count == 0)
+        return;
+
+    qsort(samples, count, sizeof(LONG64), CompareLatency);
+    for (ULONG i = 0; i < count; i++)
+        sum += samples[i];
+
+    wprintf(L"    round trip  n=%-6lu min=%-8lld avg=%-8lld p50=%-8lld p90=%-8lld p99=%-8lld max=%lld (us)\n",
+        count, samples[0], sum / count, samples[(count - 1) * 50 / 100], samples[(count - 1) * 90 / 100],
+        samples[(count - 1) * 99 / 100], samples[count - 1]);
+}
+
+/**
+ * @brief Print what the agent and the wrappers recorded for the calls since the last QmReset.
+ */
+static void PrintAgentMetrics(void)
+{
+    const QREXEC_METRICS* metrics = QmGetMetrics();
+    LONG slot = QmGetServiceSlot(QREXEC_METRICS_COMMAND_NAME);
+
+    if (!metrics || slot == QREXEC_METRICS_NO_SLOT)
+        return;
+
+    const QREXEC_SERVICE_METRICS* entry = &metrics->Services[slot];
+    wprintf(L"    agent: calls %lld, failures %lld, bytes in %lld, bytes out %lld\n",
+        entry->Calls, entry->Failures, entry->BytesIn, entry->BytesOut);
+
+    for (int i = 0; i < QREXEC_LATENCY_COUNT; i++)
+    {
+        const QREXEC_HISTOGRAM* histogram = &entry->Latency[i];
+
+        if (histogram->Count == 0)
+            continue;
+
+        wprintf(L"    %-18s n=%-6lld avg=%-8lld p50<=%-8lld p99<=%-8lld max=%lld (us)\n",
+            g_LatencyNames[i], histogram->Count, histogram->SumUs / histogram->Count,
+            QmPercentileUs(histogram, 50), QmPercentileUs(histogram, 99), histogram->MaxUs);
+    }
+}
+
+static void CheckCounter(IN const WCHAR* name, IN LONG64 actual, IN LONG64 expected)
+{
+    if (actual == expected)
+        return;
+
+    fwprintf(stderr, L"metrics: %s is %lld, expected %lld\n", name, actual, expected);
+    InterlockedIncrement(&g_Failures);
+}
+
+/**
+ * @brief Run a known sequence of calls and check what the agent and the wrappers counted.
+ *        Skipped if metrics are not available.
+ */
+static void MetricsTest(IN const char* emptyCommand)
+{
+    const QREXEC_METRICS* metrics = QmGetMetrics();
+    char* sourceCommand = BuildCommand(L"--source", 1000);
+    char* sinkCommand = BuildCommand(L"--sink", 2000);
+    char* failCommand = BuildCommand(L"--sink", 1); // gets no stdin, exits with 1
+    const QREXEC_SERVICE_METRICS* entry;
+    LONG64 latencyUs;
+    LONG slot;
+
+    if (!metrics)
+        goto cleanup;
+
+    if (!sourceCommand || !sinkCommand || !failCommand)
+    {
+        InterlockedIncrement(&g_Failures);
+        goto cleanup;
+    }
+
+    wprintf(L"metrics: checking counters\n");
+    QmReset();
+
+    for (int i = 0; i < 4; i++)
+        Call(emptyCommand, 0, 0, &latencyUs);
+    Call(sourceCommand, 0, 1000, &latencyUs);
+    Call(sinkCommand, 2000, 0, &latencyUs);
+    for (int i = 0; i < 2; i++)
+        CallWithExitCode(failCommand, 0, 0, 1, &latencyUs);
+    for (int i = 0; i < 3; i++)
+        CallWithExitCode("SYSTEM:QUBESRPC loopback.Missing dom0", 0, 0, ERROR_FILE_NOT_FOUND, &latencyUs);
+
+    slot = QmGetServiceSlot(QREXEC_METRICS_COMMAND_NAME);
+    if (slot == QREXEC_METRICS_NO_SLOT)
+    {
+        InterlockedIncrement(&g_Failures);
+        goto cleanup;
+    }
+
+    entry = &metrics->Services[slot];
+    CheckCounter(L"command calls", entry->Calls, 8);
+    CheckCounter(L"command failures", entry->Failures, 2);
+    CheckCounter(L"command refused", entry->Refused, 0);
+    CheckCounter(L"command bytes in", entry->BytesIn, 2000);
+    CheckCounter(L"command bytes out", entry->BytesOut, 1000);
+    CheckCounter(L"command last exit code", entry->LastExitCode, 1);
+    CheckCounter(L"command exec->start samples", entry->Latency[QREXEC_LATENCY_EXEC_START].Count, 8);
+    CheckCounter(L"command duration samples", entry->Latency[QREXEC_LATENCY_DURATION].Count, 8);
+    CheckCounter(L"command queue wait samples", entry->Latency[QREXEC_LATENCY_QUEUE_WAIT].Count, 0);
+
+    slot = QmGetServiceSlot(QREXEC_METRICS_UNKNOWN_NAME);
+    if (slot == QREXEC_METRICS_NO_SLOT)
+    {
+        InterlockedIncrement(&g_Failures);
+        goto cleanup;
+    }
+
+    entry = &metrics->Services[slot];
+    CheckCounter(L"unknown calls", entry->Calls, 3);
+    CheckCounter(L"unknown failures", entry->Failures, 3);
+    CheckCounter(L"unknown duration samples", entry->Latency[QREXEC_LATENCY_DURATION].Count, 0);
+
+cleanup:
+    free(sourceCommand);
+    free(sinkCommand);
+    free(failCommand);
+}
+
+static void LatencyBenchmark(IN const char* command, IN ULONG calls)
+{
+    LONG64* samples = malloc(calls * sizeof(LONG64));
+    ULONG count = 0;
+
+    if (!samples)
+        return;
+
+    wprintf(L"latency: %lu sequential calls\n", calls);
+    QmReset();
+
+    for (ULONG i = 0; i < calls; i++)
+    {
+        if (Call(command, 0, 0, &samples[count]))
+            count++;
+    }
+
+    PrintLatencies(samples, count);
+    PrintAgentMetrics();
+    free(samples);
+}
+
+static DWORD WINAPI ScalingWorker(PVOID param)
+{
+    PWORKER worker = param;
+
+    WaitForSingleObject(worker->Start, INFINITE);
+    for (ULONG i = 0; i < worker->Calls; i++)
+    {
+        if (Call(worker->Command, 0, 0, &worker->Samples[worker->Count]))
+            worker->Count++;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static void ScalingBenchmark(IN const char* command, IN ULONG callsPerThread)
+{
+    WORKER workers[MAX_THREADS];
+    HANDLE threads[MAX_THREADS];
+    HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    LONG64* samples = malloc(MAX_THREADS * callsPerThread * sizeof(LONG64));
+
+    if (!start || !samples)
+        goto cleanup;
+
+    wprintf(L"scaling: %lu calls per thread\n", callsPerThread);
+
+    for (ULONG threadCount = 1; threadCount <= MAX_THREADS; threadCount *= 2)
+    {
+        ULONG started = 0;
+        ULONG count = 0;
+        LONG64 begin;
+        LONG64 elapsedUs;
+
+        ResetEvent(start);
+        for (; started < threadCount; started++)
+        {
+            workers[started].Start = start;
+            workers[started].Index = started;
+            workers[started].Command = command;
+            workers[started].Calls = callsPerThread;
+            workers[started].Samples = samples + started * callsPerThread;
+            workers[started].Count = 0;
+            threads[started] = CreateThread(NULL, 0, ScalingWorker, &workers[started], 0, NULL);
+            if (!threads[started])
+            {
+                win_perror("create worker thread");
+                InterlockedIncrement(&g_Failures);
+                break;
+            }
+        }
+
+        QmReset();
+        begin = QmTimestamp();
+        SetEvent(start);
+        if (started > 0)
+            WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+        elapsedUs = QmElapsedUs(begin);
+
+        for (ULONG i = 0; i < started; i++)
+        {
+            CloseHandle(threads[i]);
+            // compact the samples of successful calls
+            memmove(samples + count, workers[i].Samples, workers[i].Count * sizeof(LONG64));
+            count += workers[i].Count;
+        }
+
+        wprintf(L"  %2lu threads: %lu calls in %lld ms, %.1f calls/s\n", started, count, elapsedUs / 1000,
+            elapsedUs > 0 ? count * 1000000.0 / elapsedUs : 0.0);
+        PrintLatencies(samples, count);
+        PrintAgentMetrics();
+    }
+
+cleanup:
+    free(samples);
+    if (start)
+        CloseHandle(start);
+}
+
+/**
+ * @brief Calls for services without a definition, each with a different name. The agent refuses
+ *        them without starting qrexec-wrapper.
+ */
+static DWORD WINAPI FloodWorker(PVOID param)
+{
+    PWORKER worker = param;
+    char command[64];
+
+    WaitForSingleObject(worker->Start, INFINITE);
+    for (ULONG i = 0; i < worker->Calls; i++)
+    {
+        if (FAILED(StringCchPrintfA(command, RTL_NUMBER_OF(command), "SYSTEM:QUBESRPC loopback.Flood%lu.%lu dom0",
+            worker->Index, i)))
+            break;
+
+        if (CallWithExitCode(command, 0, 0, ERROR_FILE_NOT_FOUND, &worker->Samples[worker->Count]))
+            worker->Count++;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static ULONG CountMetricsSlots(void)
+{
+    const QREXEC_METRICS* metrics = QmGetMetrics();
+    ULONG count = 0;
+
+    for (ULONG i = 0; metrics && i < QREXEC_METRICS_MAX_SERVICES; i++)
+    {
+        if (metrics->Services[i].InUse)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Requests for unknown services from all threads at once while one caller runs real commands.
+ *        Refusals must not hold up the real calls or use up agent resources.
+ */
+static void FloodBenchmark(IN const char* command, IN ULONG callsPerThread)
+{
+    WORKER workers[MAX_THREADS];
+    HANDLE threads[MAX_THREADS];
+    HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    LONG64* samples = malloc(MAX_THREADS * callsPerThread * sizeof(LONG64));
+    LONG64* callSamples = malloc(callsPerThread * sizeof(LONG64));
+    ULONG started = 0;
+    ULONG count = 0;
+    ULONG callCount = 0;
+    ULONG slotsBefore;
+    LONG64 begin;
+    LONG64 elapsedUs;
+
+    if (!start || !samples || !callSamples)
+        goto cleanup;
+
+    wprintf(L"flood: %lu threads, %lu unknown service calls per thread\n", MAX_THREADS, callsPerThread);
+
+    for (; started < MAX_THREADS; started++)
+    {
+        workers[started].Start = start;
+        workers[started].Index = started;
+        workers[started].Command = NULL;
+        workers[started].Calls = callsPerThread;
+        workers[started].Samples = samples + started * callsPerThread;
+        workers[started].Count = 0;
+        threads[started] = CreateThread(NULL, 0, FloodWorker, &workers[started], 0, NULL);
+        if (!threads[started])
+        {
+            win_perror("create flood thread");
+            InterlockedIncrement(&g_Failures);
+            break;
+        }
+    }
+
+    QmReset();
+    slotsBefore = CountMetricsSlots();
+    begin = QmTimestamp();
+    SetEvent(start);
+
+    for (ULONG i = 0; i < callsPerThread; i++)
+    {
+        if (Call(command, 0, 0, &callSamples[callCount]))
+            callCount++;
+    }
+
+    if (started > 0)
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    elapsedUs = QmElapsedUs(begin);
+
+    for (ULONG i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+        memmove(samples + count, workers[i].Samples, workers[i].Count * sizeof(LONG64));
+        count += workers[i].Count;
+    }
+
+    wprintf(L"  refused: %lu calls in %lld ms, %.1f calls/s\n", count, elapsedUs / 1000,
+        elapsedUs > 0 ? count * 1000000.0 / elapsedUs : 0.0);
+    PrintLatencies(samples, count);
+    wprintf(L"  commands during the flood:\n");
+    PrintLatencies(callSamples, callCount);
+    PrintAgentMetrics();
+
+    // all unknown services share one slot
+    if (QmGetMetrics() && CountMetricsSlots() > slotsBefore + 1)
+    {
+        fwprintf(stderr, L"unknown services took %lu metrics slots\n", CountMetricsSlots() - slotsBefore);
+        InterlockedIncrement(&g_Failures);
+    }
+
+cleanup:
+    free(samples);
+    free(callSamples);
+    if (start)
+        CloseHandle(start);
+}
+
+/**
+ * @brief Path of a file in the harness' RPC definition directory.
+ */
+static BOOL RpcDefinitionPath(OUT WCHAR* path, IN const WCHAR* serviceName)
+{
+    if (serviceName)
+        return SUCCEEDED(StringCchPrintfW(path, MAX_PATH, L"%s\\" QREXEC_RPC_DEFINITION_DIR L"\\%s", g_RpcRoot, serviceName));
+    return SUCCEEDED(StringCchPrintfW(path, MAX_PATH, L"%s\\" QREXEC_RPC_DEFINITION_DIR, g_RpcRoot));
+}
+
+/**
+ * @brief Define a service running this executable in a child mode.
+ */
+static BOOL WriteServiceDefinition(IN const WCHAR* serviceName, IN const WCHAR* mode, IN LONG64 size, IN const WCHAR* priority)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR definition[MAX_PATH + 64];
+    char definitionUtf8[3 * RTL_NUMBER_OF(definition)];
+    int cbDefinition;
+    HANDLE file;
+    DWORD cbWritten;
+    BOOL success;
+
+    if (!RpcDefinitionPath(path, serviceName) ||
+        FAILED(StringCchPrintfW(definition, RTL_NUMBER_OF(definition), L"\"%s\" %s %lld\npriority=%s\n",
+            g_SelfPath, mode, size, priority)))
+        return FALSE;
+
+    // first line is the handler command, the agent reads it as UTF-8
+    cbDefinition = WideCharToMultiByte(CP_UTF8, 0, definition, -1, definitionUtf8, sizeof(definitionUtf8), NULL, NULL);
+    if (cbDefinition == 0)
+        return FALSE;
+
+    file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    success = WriteFile(file, definitionUtf8, cbDefinition - 1, &cbWritten, NULL);
+    CloseHandle(file);
+    return success;
+}
+
+static const WCHAR* g_ServiceNames[] = { L"" SERVICE_NORMAL, L"" SERVICE_INTERACTIVE, L"" SERVICE_BULK };
+
+/**
+ * @brief Create the RPC services used by the benchmarks in a temporary directory.
+ * @return Error code.
+ */
+static DWORD CreateServices(void)
+{
+    WCHAR path[MAX_PATH];
+    DWORD status;
+
+    if (!GetTempPathW(RTL_NUMBER_OF(path), path) ||
+        FAILED(StringCchPrintfW(g_RpcRoot, RTL_NUMBER_OF(g_RpcRoot), L"%sqrexec-loopback-%lu", path, GetCurrentProcessId())))
+        return win_perror2(ERROR_INSUFFICIENT_BUFFER, "format service directory");
+
+    if (!CreateDirectoryW(g_RpcRoot, NULL) || !RpcDefinitionPath(path, NULL) || !CreateDirectoryW(path, NULL))
+        return win_perror("create service directory");
+
+    status = ERROR_SUCCESS;
+    if (!WriteServiceDefinition(g_ServiceNames[0], L"--sink", 0, L"normal") ||
+        !WriteServiceDefinition(g_ServiceNames[1], L"--sink", 0, L"interactive") ||
+        !WriteServiceDefinition(g_ServiceNames[2], L"--source", BACKGROUND_CALL_SIZE, L"bulk"))
+        status = win_perror("write service definition");
+
+    return status;
+}
+
+static void DeleteServices(void)
+{
+    WCHAR path[MAX_PATH];
+
+    if (g_RpcRoot[0] == L'\0')
+        return;
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(g_ServiceNames); i++)
+    {
+        if (RpcDefinitionPath(path, g_ServiceNames[i]))
+            DeleteFileW(path);
+    }
+
+    if (RpcDefinitionPath(path, NULL))
+        RemoveDirectoryW(path);
+    RemoveDirectoryW(g_RpcRoot);
+}
+
+static DWORD WINAPI BackgroundWorker(PVOID param)
+{
+    PWORKER worker = param;
+    LONG64 latencyUs;
+
+    WaitForSingleObject(worker->Start, INFINITE);
+    while (!g_StopBackground)
+    {
+        if (!Call(worker->Command, 0, BACKGROUND_CALL_SIZE, &latencyUs))
+            break;
+        worker->Count++;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+/**
+ * @brief Latency of sequential calls while BACKGROUND_THREADS callers keep the agent busy with bulk calls.
+ */
+static void MeasureUnderLoad(IN const char* command, IN ULONG calls)
+{
+    WORKER workers[BACKGROUND_THREADS];
+    HANDLE threads[BACKGROUND_THREADS];
+    HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    LONG64* samples = malloc(calls * sizeof(LONG64));
+    ULONG started = 0;
+    ULONG count = 0;
+    ULONG background = 0;
+
+    if (!start || !samples)
+        goto cleanup;
+
+    g_StopBackground = FALSE;
+    for (; started < BACKGROUND_THREADS; started++)
+    {
+        workers[started].Start = start;
+        workers[started].Index = started;
+        workers[started].Command = "SYSTEM:QUBESRPC " SERVICE_BULK " dom0";
+        workers[started].Calls = 0;
+        workers[started].Samples = NULL;
+        workers[started].Count = 0;
+        threads[started] = CreateThread(NULL, 0, BackgroundWorker, &workers[started], 0, NULL);
+        if (!threads[started])
+        {
+            win_perror("create background thread");
+            InterlockedIncrement(&g_Failures);
+            break;
+        }
+    }
+
+    SetEvent(start);
+    // let the queue fill up
+    Sleep(500);
+    QmReset();
+
+    for (ULONG i = 0; i < calls; i++)
+    {
+        if (Call(command, 0, 0, &samples[count]))
+            count++;
+    }
+
+    g_StopBackground = TRUE;
+    if (started > 0)
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+
+    for (ULONG i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+        background += workers[i].Count;
+    }
+
+    PrintLatencies(samples, count);
+    wprintf(L"    %lu background calls\n", background);
+
+cleanup:
+    free(samples);
+    if (start)
+        CloseHandle(start);
+}
+
+/**
+ * @brief Compare a normal and an interactive service under background load. Interactive requests
+ *        are dispatched before queued ones, their p99 should stay close to the idle latency.
+ */
+static void PriorityBenchmark(IN ULONG calls)
+{
+    wprintf(L"priority: %lu calls under load from %lu bulk callers\n", calls, BACKGROUND_THREADS);
+
+    wprintf(L"  normal:\n");
+    MeasureUnderLoad("SYSTEM:QUBESRPC " SERVICE_NORMAL " dom0", calls);
+    wprintf(L"  interactive:\n");
+    MeasureUnderLoad("SYSTEM:QUBESRPC " SERVICE_INTERACTIVE " dom0", calls);
+}
+
+static DWORD WINAPI TerminationWorker(PVOID param)
+{
+    PWORKER worker = param;
+
+    if (Call(worker->Command, 0, 0, &worker->Samples[0]))
+        worker->Count++;
+    worker->Finished = QmTimestamp();
+    return ERROR_SUCCESS;
+}
+
+/**
+ * @brief Start children that all wait for one event, release them at once and measure how long
+ *        it takes until the agent reported every connection terminated.
+ */
+static void TerminationBenchmark(void)
+{
+    static const ULONG childCounts[] = { 1, 8, 16, 32, MAX_TERMINATIONS };
+    WORKER workers[MAX_TERMINATIONS];
+    HANDLE threads[MAX_TERMINATIONS];
+    LONG64 samples[MAX_TERMINATIONS];
+    WCHAR name[64];
+    HANDLE started = NULL;
+    HANDLE release = NULL;
+    char* command = BuildCommand(L"--wait", GetCurrentProcessId());
+
+    if (!command ||
+        FAILED(StringCchPrintfW(name, RTL_NUMBER_OF(name), WAIT_STARTED_NAME, GetCurrentProcessId())) ||
+        !(started = CreateSemaphoreW(NULL, 0, MAX_TERMINATIONS, name)) ||
+        FAILED(StringCchPrintfW(name, RTL_NUMBER_OF(name), WAIT_EXIT_NAME, GetCurrentProcessId())) ||
+        !(release = CreateEventW(NULL, TRUE, FALSE, name)))
+    {
+        win_perror("create termination benchmark objects");
+        InterlockedIncrement(&g_Failures);
+        goto cleanup;
+    }
+
+    wprintf(L"termination: children released at once\n");
+
+    for (ULONG n = 0; n < RTL_NUMBER_OF(childCounts); n++)
+    {
+        ULONG running = 0;
+        ULONG count = 0;
+        LONG64 released;
+        LONG64 lastFinished;
+        LONG64 elapsedUs;
+
+        ResetEvent(release);
+        for (; running < childCounts[n]; running++)
+        {
+            workers[running].Command = command;
+            workers[running].Samples = &samples[running];
+            workers[running].Count = 0;
+            threads[running] = CreateThread(NULL, 0, TerminationWorker, &workers[running], 0, NULL);
+            if (!threads[running])
+            {
+                win_perror("create termination thread");
+                InterlockedIncrement(&g_Failures);
+                break;
+            }
+        }
+
+        // every child must be running before they are released
+        for (ULONG i = 0; i < running; i++)
+        {
+            if (WaitForSingleObject(started, LOOPBACK_CALL_TIMEOUT) != WAIT_OBJECT_0)
+            {
+                LogError("only %lu of %lu children started", i, running);
+                InterlockedIncrement(&g_Failures);
+                break;
+            }
+        }
+
+        QmReset();
+        released = QmTimestamp();
+        SetEvent(release);
+        if (running > 0)
+            WaitForMultipleObjects(running, threads, TRUE, INFINITE);
+
+        lastFinished = released;
+        for (ULONG i = 0; i < running; i++)
+        {
+            CloseHandle(threads[i]);
+            count += workers[i].Count;
+            lastFinished = max(lastFinished, workers[i].Finished);
+        }
+
+        // both measured now, the difference is release -> last MSG_CONNECTION_TERMINATED
+        elapsedUs = QmElapsedUs(released) - QmElapsedUs(lastFinished);
+        wprintf(L"  %2lu children: %lu calls, all terminated %lld us after release\n", running, count, elapsedUs);
+        PrintAgentMetrics();
+    }
+
+cleanup:
+    free(command);
+    if (started)
+        CloseHandle(started);
+    if (release)
+        CloseHandle(release);
+}
+
+static void PrintThroughput(IN const WCHAR* name, IN LONG64 size, IN LONG64 elapsedUs)
+{
+    wprintf(L"  %s: %lld MiB in %lld ms, %.1f MiB/s\n", name, size / (1024 * 1024), elapsedUs / 1000,
+        elapsedUs > 0 ? (size / (1024.0 * 1024.0)) / (elapsedUs / 1000000.0) : 0.0);
+}
+
+static void BulkBenchmark(IN LONG64 size)
+{
+    char* sinkCommand = BuildCommand(L"--sink", size);
+    char* sourceCommand = BuildCommand(L"--source", size);
+    LONG64 elapsedUs;
+
+    if (!sinkCommand || !sourceCommand)
+    {
+        InterlockedIncrement(&g_Failures);
+        goto cleanup;
+    }
+
+    wprintf(L"bulk: %lld MiB each way\n", size / (1024 * 1024));
+    QmReset();
+
+    if (Call(sinkCommand, size, 0, &elapsedUs))
+        PrintThroughput(L"stdin ", size, elapsedUs);
+
+    if (Call(sourceCommand, 0, size, &elapsedUs))
+        PrintThroughput(L"stdout", size, elapsedUs);
+
+    PrintAgentMetrics();
+
+cleanup:
+    free(sinkCommand);
+    free(sourceCommand);
+}
+
+static DWORD WINAPI AgentThread(PVOID param)
+{
+    return LoopbackAgentMain((HANDLE)param, g_RpcRoot);
+}
+
+static void Usage(IN const WCHAR* name)
+{
+    wprintf(L"Usage: %s [-n latency calls] [-c calls per thread] [-b bulk MiB]\n", name);
+}
+
+int wmain(int argc, WCHAR* argv[])
+{
+    ULONG latencyCalls = DEFAULT_LATENCY_CALLS;
+    ULONG callsPerThread = DEFAULT_CALLS_PER_THREAD;
+    ULONG bulkMb = DEFAULT_BULK_MB;
+    char* emptyCommand = NULL;
+    HANDLE stopEvent = NULL;
+    HANDLE agentThread = NULL;
+    DWORD status;
+
+    // child modes, started by qrexec-wrapper
+    if (argc == 3 && wcscmp(argv[1], L"--sink") == 0)
+        return RunSink(_wtoi64(argv[2]));
+    if (argc == 3 && wcscmp(argv[1], L"--source") == 0)
+        return RunSource(_wtoi64(argv[2]));
+    if (argc == 3 && wcscmp(argv[1], L"--wait") == 0)
+        return RunWait(wcstoul(argv[2], NULL, 10));
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        ULONG value = i + 1 < argc ? wcstoul(argv[i + 1], NULL, 10) : 0;
+
+        if (value == 0)
+        {
+            Usage(argv[0]);
+            return ERROR_INVALID_PARAMETER;
+        }
+
+        if (wcscmp(argv[i], L"-n") == 0)
+            latencyCalls = value;
+        else if (wcscmp(argv[i], L"-c") == 0)
+            callsPerThread = value;
+        else if (wcscmp(argv[i], L"-b") == 0)
+            bulkMb = value;
+        else
+        {
+            Usage(argv[0]);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    if (GetModuleFileNameW(NULL, g_SelfPath, RTL_NUMBER_OF(g_SelfPath)) == RTL_NUMBER_OF(g_SelfPath))
+        return win_perror2(ERROR_INSUFFICIENT_BUFFER, "get executable path");
+
+    status = CreateServices();
+    if (status != ERROR_SUCCESS)
+        goto cleanup;
+
+    emptyCommand = BuildCommand(L"--sink", 0);
+    stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!emptyCommand || !stopEvent)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto cleanup;
+    }
+
+    agentThread = CreateThread(NULL, 0, AgentThread, stopEvent, 0, NULL);
+    if (!agentThread)
+    {
+        status = win_perror("create agent thread");
+        goto cleanup;
+    }
+
+    status = DaemonConnect(10000);
+    if (status != ERROR_SUCCESS)
+        goto cleanup;
+
+    if (!QmGetMetrics())
+        wprintf(L"agent metrics are not available (run as administrator to see them)\n");
+
+    MetricsTest(emptyCommand);
+    LatencyBenchmark(emptyCommand, latencyCalls);
+    ScalingBenchmark(emptyCommand, callsPerThread);
+    BulkBenchmark((LONG64)bulkMb * 1024 * 1024);
+    FloodBenchmark(emptyCommand, callsPerThread);
+    TerminationBenchmark();
+    PriorityBenchmark(latencyCalls);
+
+    if (g_Failures > 0)
+    {
+        fwprintf(stderr, L"%ld calls failed\n", g_Failures);
+        status = ERROR_GEN_FAILURE;
+    }
+
+cleanup:
+    DaemonDisconnect();
+
+    if (agentThread)
+    {
+        SetEvent(stopEvent);
+        WaitForSingleObject(agentThread, INFINITE);
+        CloseHandle(agentThread);
+    }
+
+    if (stopEvent)
+        CloseHandle(stopEvent);
+    free(emptyCommand);
+    DeleteServices();
+
+    return status == ERROR_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Loopback harness: runs the agent's control vchan code and qrexec-wrapper.exe against
+// a fake qrexec daemon, with vchans provided by the libvchan-loopback stand-in.
+
+#pragma once
+#include <windows.h>
+
+#include <qrexec.h>
+
+// how long a single call may take before it's considered hung
+#define LOOPBACK_CALL_TIMEOUT 30000
+
+// data vchan ports used by the fake daemon start here
+#define LOOPBACK_FIRST_PORT   (VCHAN_BASE_PORT + 1)
+
+typedef struct _CALL_RESULT
+{
+    int ExitCode; // received in MSG_DATA_EXIT_CODE
+    LONG64 BytesIn; // stdout received from the child
+    LONG64 BytesOut; // stdin sent to the child
+    LONG64 LatencyUs; // exec request sent -> exit code received
+} CALL_RESULT, *PCALL_RESULT;
+
+/**
+ * @brief Connect to the agent's control vchan and exchange MSG_HELLO.
+ * @param timeoutMs How long to wait for the agent to create the vchan.
+ * @return Error code.
+ */
+DWORD DaemonConnect(IN DWORD timeoutMs);
+
+/**
+ * @brief Stop the control reader thread and close the control vchan.
+ */
+void DaemonDisconnect(void);
+
+/**
+ * @brief Run a command through the agent like qrexec-client does (MSG_EXEC_CMDLINE)
+ *        and wait until the agent reports the connection terminated. Thread safe.
+ * @param commandLine "user:[nogui:]command" in UTF-8.
+ * @param stdinSize Bytes to send to the child's stdin before EOF.
+ * @param result Call statistics.
+ * @return Error code. Non-zero exit code of the child is not an error.
+ */
+DWORD DaemonCall(IN const char* commandLine, IN LONG64 stdinSize, OUT PCALL_RESULT result);
@@ -0,0 +1,163 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// This program prints per-service qrexec metrics collected by qrexec-agent
+// and optionally publishes their summaries to qubesdb.
+// Counters can be reset between runs so that a benchmark (e.g. a loop of
+// qvm-run/qrexec-client calls from dom0) only sees its own samples.
+// Needs to run elevated (the metrics section is only accessible to SYSTEM and administrators).
+
+#include <windows.h>
+#include <stdio.h>
+#include <strsafe.h>
+
+#include <qubesdb-client.h>
+#include <log.h>
+#include <utf8-conv.h>
+
+#include "qrexec-metrics.h"
+
+#define QDB_PATH_PREFIX "/qubes-rpc-metrics/"
+
+static const WCHAR* g_LatencyNames[QREXEC_LATENCY_COUNT] =
+{
+    L"trigger->connect",
+    L"exec->start",
+    L"duration",
+    L"queue wait",
+};
+
+static void PrintHistogram(IN const WCHAR* name, IN const QREXEC_HISTOGRAM* histogram)
+{
+    LONG64 count = histogram->Count;
+
+    if (count == 0)
+        return;
+
+    wprintf(L"    %-18s n=%-8lld avg=%-10lld p50<=%-10lld p99<=%-10lld max=%lld (us)\n",
+        name, count, histogram->SumUs / count,
+        QmPercentileUs(histogram, 50), QmPercentileUs(histogram, 99), histogram->MaxUs);
+}
+
+static void PrintMetrics(IN const QREXEC_METRICS* metrics)
+{
+    for (ULONG i = 0; i < metrics->MaxServices && i < QREXEC_METRICS_MAX_SERVICES; i++)
+    {
+        const QREXEC_SERVICE_METRICS* entry = &metrics->Services[i];
+
+        if (!entry->InUse)
+            continue;
+
+        wprintf(L"%s: calls %lld, failures %lld, refused %lld, bytes in %lld, bytes out %lld, last exit code %ld\n",
+            entry->Name, entry->Calls, entry->Failures, entry->Refused, entry->BytesIn, entry->BytesOut, entry->LastExitCode);
+
+        for (int j = 0; j < QREXEC_LATENCY_COUNT; j++)
+            PrintHistogram(g_LatencyNames[j], &entry->Latency[j]);
+    }
+}
+
+static DWORD PublishMetrics(IN const QREXEC_METRICS* metrics)
+{
+    qdb_handle_t qdb;
+    DWORD status = ERROR_SUCCESS;
+    char path[256];
+    char value[256];
+
+    qdb = qdb_open(NULL);
+    if (!qdb)
+        return win_perror("qdb_open");
+
+    for (ULONG i = 0; i < metrics->MaxServices && i < QREXEC_METRICS_MAX_SERVICES; i++)
+    {
+        const QREXEC_SERVICE_METRICS* entry = &metrics->Services[i];
+        const QREXEC_HISTOGRAM* duration = &entry->Latency[QREXEC_LATENCY_DURATION];
+        char* nameUtf8 = NULL;
+
+        if (!entry->InUse)
+            continue;
+
+        status = ConvertUTF16ToUTF8Static(entry->Name, &nameUtf8, NULL);
+        if (status != ERROR_SUCCESS)
+        {
+            win_perror2(status, "ConvertUTF16ToUTF8Static(service name)");
+            break;
+        }
+
+        StringCbPrintfA(path, sizeof(path), QDB_PATH_PREFIX "%s", nameUtf8);
+        StringCbPrintfA(value, sizeof(value), "calls=%lld failures=%lld refused=%lld in=%lld out=%lld p50us=%lld p99us=%lld",
+            entry->Calls, entry->Failures, entry->Refused, entry->BytesIn, entry->BytesOut,
+            QmPercentileUs(duration, 50), QmPercentileUs(duration, 99));
+
+        LogDebug("%S = %S", path, value);
+        if (!qdb_write(qdb, path, value, (int)strlen(value)))
+        {
+            status = win_perror("qdb_write");
+            break;
+        }
+    }
+
+    qdb_close(qdb);
+    return status;
+}
+
+static void Usage(IN const WCHAR* name)
+{
+    wprintf(L"Usage: %s [-q] [-r]\n", name);
+    wprintf(L"-q: also publish service summaries to qubesdb (" TEXT(QDB_PATH_PREFIX) L"<service>)\n");
+    wprintf(L"-r: reset all counters after printing them\n");
+}
+
+int wmain(int argc, WCHAR* argv[])
+{
+    const QREXEC_METRICS* metrics;
+    BOOL publish = FALSE;
+    BOOL reset = FALSE;
+    DWORD status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (wcscmp(argv[i], L"-q") == 0)
+            publish = TRUE;
+        else if (wcscmp(argv[i], L"-r") == 0)
+            reset = TRUE;
+        else
+        {
+            Usage(argv[0]);
+            return ERROR_BAD_ARGUMENTS;
+        }
+    }
+
+    status = QmOpen(!reset);
+    if (status != ERROR_SUCCESS)
+        return win_perror2(status, "opening metrics section (is qrexec-agent running?)");
+
+    metrics = QmGetMetrics();
+    PrintMetrics(metrics);
+
+    if (publish)
+        status = PublishMetrics(metrics);
+
+    if (reset)
+        QmReset();
+
+    QmClose();
+    return status;
+}
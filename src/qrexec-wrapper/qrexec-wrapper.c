@@ -24,6 +24,7 @@
 // It's role is communication with the data vchan peer and handling child program's I/O.
 
 #include "qrexec-wrapper.h"
+#include "qrexec-metrics.h"
 #include <stdlib.h>
 #include <shlwapi.h>
 #include <assert.h>
@@ -39,6 +40,55 @@
 
 static CRITICAL_SECTION g_VchanCs;
 static BOOL g_exitCodeReceived = FALSE;
+static LONG g_MetricsSlot = QREXEC_METRICS_NO_SLOT;
+static LONG64 g_ExecTime = 0;
+// Outcome of the call, recorded in metrics once when the wrapper exits.
+static int g_ExitCode = 0;
+static BOOL g_ExitCodeKnown = FALSE;
+
+/**
+ * @brief Remember the exit code to account for the call. Only the first one counts.
+ * @param exitCode Exit code of the local child or the remote peer.
+ */
+static void SetExitCode(IN int exitCode)
+{
+    if (g_ExitCodeKnown)
+        return;
+
+    g_ExitCode = exitCode;
+    g_ExitCodeKnown = TRUE;
+}
+
+/**
+ * @brief Read metrics context passed by qrexec-agent and map the metrics section.
+ *        Metrics are optional, failures are not fatal.
+ */
+static void InitMetrics(void)
+{
+    WCHAR context[64];
+    DWORD size = GetEnvironmentVariable(QREXEC_METRICS_ENV, context, RTL_NUMBER_OF(context));
+
+    if (size == 0 || size >= RTL_NUMBER_OF(context))
+        return;
+
+    // don't pass it to the child
+    SetEnvironmentVariable(QREXEC_METRICS_ENV, NULL);
+
+    if (swscanf_s(context, L"%ld %lld", &g_MetricsSlot, &g_ExecTime) != 2)
+    {
+        LogWarning("invalid metrics context: '%s'", context);
+        g_MetricsSlot = QREXEC_METRICS_NO_SLOT;
+        return;
+    }
+
+    if (g_MetricsSlot == QREXEC_METRICS_NO_SLOT)
+        return;
+
+    if (QmOpen(FALSE) != ERROR_SUCCESS)
+        g_MetricsSlot = QREXEC_METRICS_NO_SLOT;
+
+    LogVerbose("metrics slot %d", g_MetricsSlot);
+}
 
 /**
  * @brief Create an anonymous pipe that will be used as one of the std handles for a child process.
@@ -349,7 +399,11 @@ BOOL VchanSendData(
         return FALSE;
     }
 
-    return VchanSendMessage(child->Vchan, messageType, data, cbData, L"output data");
+    if (!VchanSendMessage(child->Vchan, messageType, data, cbData, L"output data"))
+        return FALSE;
+
+    QmRecordBytes(g_MetricsSlot, 0, cbData);
+    return TRUE;
 }
 
 /**
@@ -434,6 +488,8 @@ DWORD HandleRemoteData(
     if (!VchanReceiveBuffer(child->Vchan, buffer, header->len, header->type == MSG_DATA_STDERR ? L"stderr data" : L"inbound data"))
         goto cleanup;
 
+    QmRecordBytes(g_MetricsSlot, header->len, 0);
+
     if (header->type != MSG_DATA_STDERR)
     {
         assert(child->Stdin.WriteEndpoint);
@@ -474,6 +530,7 @@ DWORD HandleExitCode(
         return ERROR_INVALID_FUNCTION;
 
     LogDebug("remote exit code: %d", code);
+    SetExitCode(code);
 
     g_exitCodeReceived = TRUE;
     return ERROR_SUCCESS;
@@ -789,6 +846,9 @@ DWORD EventLoop(
             }
 
             LogDebug("child process exited with code %d", exitCode);
+            // if we're the vchan server, the remote exit code is what matters
+            if (!child->IsVchanServer)
+                SetExitCode(exitCode);
 
             // wait for the threads to finish before sending exit code
             waitObjects[0] = child->StdoutThread;
@@ -818,6 +878,34 @@ DWORD EventLoop(
     return status;
 }
 
+/**
+ * @brief Apply the service priority requested by qrexec-agent to this process.
+ * @param flags Wrapper flags.
+ * @return Priority class for the child process or 0 to leave it at default.
+ */
+static DWORD SetServicePriority(
+    _In_ int flags
+    )
+{
+    if (flags & 0x08)
+    {
+        // interactive service: don't let bulk transfers delay our vchan IO
+        if (!SetPriorityClass(GetCurrentProcess(), ABOVE_NORMAL_PRIORITY_CLASS))
+            win_perror("SetPriorityClass(ABOVE_NORMAL)");
+        return ABOVE_NORMAL_PRIORITY_CLASS;
+    }
+
+    if (flags & 0x10)
+    {
+        // bulk service: background mode also lowers IO and memory priority, only possible for the current process
+        if (!SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN))
+            win_perror("SetPriorityClass(PROCESS_MODE_BACKGROUND_BEGIN)");
+        return BELOW_NORMAL_PRIORITY_CLASS;
+    }
+
+    return 0;
+}
+
 /**
  * @brief Print usage info.
  * @param name Executable name.
@@ -835,6 +923,8 @@ void Usage(
     wprintf(L"         0x01 act as vchan server (default is client)\n");
     wprintf(L"         0x02 pipe child process' io to vchan (default is not)\n");
     wprintf(L"         0x04 run the child process in the interactive session (requires that a user is logged on)\n");
+    wprintf(L"         0x08 raise CPU priority of this process and the child (interactive services)\n");
+    wprintf(L"         0x10 lower CPU and IO priority of this process and the child (bulk services)\n");
     wprintf(L"command_line: local program to execute and connect to data vchan or (null) if local program is not needed\n");
 }
 
@@ -849,6 +939,8 @@ void Usage(
  *                      0x01 act as vchan server (default is client)
  *                      0x02 pipe child process' io to vchan (default is not)
  *                      0x04 run the child process in the interactive session (requires that a user is logged on)
+ *                      0x08 raise CPU priority of this process and the child (interactive services)
+ *                      0x10 lower CPU and IO priority of this process and the child (bulk services)
  *             command_line: local program to execute and connect to data vchan
  * @return Error code.
  */
@@ -862,6 +954,7 @@ int wmain(int argc, WCHAR *argv[])
     PWSTR domainName, portStr, flagsStr, userName, commandLine;
     DWORD status = ERROR_NOT_ENOUGH_MEMORY;
     BOOL startLocalProcess = TRUE;
+    DWORD childPriority;
 
     LogVerbose("start");
 
@@ -885,6 +978,7 @@ int wmain(int argc, WCHAR *argv[])
 
     InitializeCriticalSection(&g_VchanCs);
     libvchan_register_logger(XifLogger, LogGetLevel());
+    InitMetrics();
 
     domain = _wtoi(domainName);
     port = _wtoi(portStr);
@@ -893,6 +987,7 @@ int wmain(int argc, WCHAR *argv[])
     child->IsVchanServer = !!(flags & 0x01);
     piped = !!(flags & 0x02);
     interactive = !!(flags & 0x04);
+    childPriority = SetServicePriority(flags);
 
     LogDebug("domain %d, port %d, user %s, flags 0x%x, cmd '%s'", domain, port, userName, flags, commandLine);
 
@@ -962,6 +1057,11 @@ int wmain(int argc, WCHAR *argv[])
     if (ERROR_SUCCESS != status)
         goto cleanup;
 
+    if (childPriority != 0 && !SetPriorityClass(child->Process, childPriority))
+        win_perror("SetPriorityClass(child)");
+
+    QmRecordLatency(g_MetricsSlot, QREXEC_LATENCY_EXEC_START, QmElapsedUs(g_ExecTime));
+
     if (piped)
     {
         child->StdoutThread = CreateThread(NULL, 0, StdoutThread, child, 0, NULL);
@@ -999,5 +1099,8 @@ cleanup:
         free(child);
     }
 
+    // creation status if there was no exit code from the child or the peer
+    QmRecordExitCode(g_MetricsSlot, g_ExitCodeKnown ? g_ExitCode : (int)status);
+    QmClose();
     return status;
 }
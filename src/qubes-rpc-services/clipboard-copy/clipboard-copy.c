@@ -25,96 +25,236 @@
 #include <stdlib.h>
 
 #include <qubes-io.h>
-#include <utf8-conv.h>
 #include <log.h>
 
-#define CLIPBOARD_FORMAT CF_UNICODETEXT
+#include "clipboard.h"
 
-static BOOL PrepareClipText(IN WCHAR *clipText, OUT WCHAR **clipTextPrepared)
-{
-    if (!clipText || !clipTextPrepared)
-        return FALSE;
-    // replace \r\n -> \r
-    *clipTextPrepared = (WCHAR*)calloc((wcslen(clipText) + 1) * sizeof(WCHAR), 1);
-    if (!*clipTextPrepared)
-        return FALSE;
-    WCHAR* src = clipText;
-    WCHAR* dst = *clipTextPrepared;
-    size_t strLen = wcslen(clipText);
-    for (size_t i = 0; i < strLen; i++)
-    {
-        if ((*src) != L'\r')
-        {
-            *dst++ = *src;
-        }
-        src++;
-    }
-    *dst = 0;
-    return TRUE;
-}
-
-static BOOL WriteClipboardText(IN HWND window, OUT HANDLE outputFile)
+// Copy clipboard data to a private buffer so the clipboard can be closed before sending.
+// Only the requested format is rendered by its owner. The copy is followed by two zero bytes
+// since the data isn't guaranteed to be terminated.
+static BYTE* GetClipboardBytes(IN HWND window, IN UINT windowsFormat, OUT size_t *size)
 {
     HANDLE clipData;
-    WCHAR *clipText;
-    WCHAR *clipTextPrepared;
-    CHAR *clipTextUtf8;
-    size_t cbTextUtf8;
+    BYTE *clipBytes;
+    BYTE *bytesCopy = NULL;
 
-    if (!IsClipboardFormatAvailable(CLIPBOARD_FORMAT))
-        return FALSE;
+    if (!IsClipboardFormatAvailable(windowsFormat))
+    {
+        LogWarning("clipboard format %u not available", windowsFormat);
+        return NULL;
+    }
 
     if (!OpenClipboard(window))
     {
         win_perror("OpenClipboard");
-        return FALSE;
+        return NULL;
     }
 
-    clipData = GetClipboardData(CLIPBOARD_FORMAT);
+    clipData = GetClipboardData(windowsFormat);
     if (!clipData)
     {
         win_perror("GetClipboardData");
         CloseClipboard();
-        return FALSE;
+        return NULL;
     }
 
-    clipText = GlobalLock(clipData);
-    if (!clipText)
+    clipBytes = GlobalLock(clipData);
+    if (!clipBytes)
     {
         win_perror("GlobalLock");
         CloseClipboard();
-        return FALSE;
+        return NULL;
     }
 
-    if (!PrepareClipText(clipText, &clipTextPrepared))
+    *size = GlobalSize(clipData);
+    bytesCopy = malloc(*size + sizeof(WCHAR));
+    if (bytesCopy)
     {
-        win_perror("PrepareClipText");
-        CloseClipboard();
-        GlobalUnlock(clipData);
-        return FALSE;
+        memcpy(bytesCopy, clipBytes, *size);
+        ZeroMemory(bytesCopy + *size, sizeof(WCHAR));
+    }
+    else
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
     }
 
-    CloseClipboard();
     GlobalUnlock(clipData);
+    CloseClipboard();
+    return bytesCopy;
+}
+
+static BOOL WriteClipboardText(IN HWND window, OUT HANDLE outputFile)
+{
+    UTF16_ENCODER encoder = { 0 };
+    ULONG maxSize = ClipboardGetMaxSize();
+    size_t totalSize = 0;
+    size_t offset = 0;
+    size_t length;
+    WCHAR *clipText;
+    CHAR *clipTextUtf8;
+    BOOL final;
+    BOOL success = FALSE;
+
+    clipText = (WCHAR*)GetClipboardBytes(window, CF_UNICODETEXT, &length);
+    if (!clipText)
+        return FALSE;
+
+    length = wcsnlen(clipText, length / sizeof(WCHAR));
+
+    clipTextUtf8 = malloc(UTF16_ENCODE_BUFFER_SIZE(CLIPBOARD_CHUNK_SIZE));
+    if (!clipTextUtf8)
+        goto cleanup;
+
+    do
+    {
+        size_t chunkLength = min(length - offset, CLIPBOARD_CHUNK_SIZE);
+        size_t cbTextUtf8;
+        DWORD status;
+
+        final = (offset + chunkLength == length);
+        status = Utf16EncodeChunk(&encoder, clipText + offset, chunkLength, clipTextUtf8, &cbTextUtf8, final);
+        if (status != ERROR_SUCCESS)
+            goto cleanup;
+
+        if (totalSize + cbTextUtf8 > maxSize)
+        {
+            LogWarning("clipboard data exceeds %lu bytes, truncating", maxSize);
+            cbTextUtf8 = maxSize - totalSize;
+            // don't cut a UTF-8 sequence in half
+            while (cbTextUtf8 > 0 && ((BYTE)clipTextUtf8[cbTextUtf8] & 0xc0) == 0x80)
+                cbTextUtf8--;
+            final = TRUE;
+        }
+
+        if (cbTextUtf8 > 0 && !QioWriteBuffer(outputFile, clipTextUtf8, (DWORD)cbTextUtf8))
+        {
+            win_perror("QioWriteBuffer");
+            goto cleanup;
+        }
+
+        totalSize += cbTextUtf8;
+        offset += chunkLength;
+    } while (!final);
+
+    LogDebug("sent %Iu characters, %Iu bytes", length, totalSize);
+    success = TRUE;
 
-    if (FAILED(ConvertUTF16ToUTF8Static(clipTextPrepared, &clipTextUtf8, &cbTextUtf8)))
+cleanup:
+    free(clipTextUtf8);
+    free(clipText);
+    return success;
+}
+
+static BOOL WriteChunks(OUT HANDLE outputFile, IN const BYTE *data, IN size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += CLIPBOARD_CHUNK_SIZE)
     {
-        win_perror("ConvertUTF16ToUTF8Static");
-        free(clipTextPrepared);
+        if (!QioWriteBuffer(outputFile, (void*)(data + offset), (DWORD)min(size - offset, CLIPBOARD_CHUNK_SIZE)))
+        {
+            win_perror("QioWriteBuffer");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// HTML, RTF and images are sent as is, there is no sensible way to truncate them.
+static BOOL WriteClipboardBinary(IN HWND window, OUT HANDLE outputFile, IN CLIPBOARD_FORMAT format)
+{
+    ULONG maxSize = ClipboardGetMaxSize();
+    UINT windowsFormat;
+    BITMAPFILEHEADER fileHeader = { 0 };
+    BYTE *data;
+    size_t size;
+    size_t start = 0;
+    size_t end;
+    size_t totalSize;
+    BOOL success = FALSE;
+
+    windowsFormat = ClipboardGetWindowsFormat(format);
+    if (windowsFormat == 0)
         return FALSE;
+
+    data = GetClipboardBytes(window, windowsFormat, &size);
+    if (!data)
+        return FALSE;
+
+    end = size;
+    switch (format)
+    {
+    case ClipboardFormatHtml:
+        if (!ClipboardGetHtmlRange(data, size, &start, &end))
+            goto cleanup;
+        break;
+
+    case ClipboardFormatRtf:
+        end = strnlen((const char*)data, size);
+        break;
+
+    case ClipboardFormatImage:
+        if (!ClipboardGetBitmapFileHeader(data, size, &fileHeader))
+            goto cleanup;
+        break;
+
+    default:
+        break;
+    }
+
+    totalSize = end - start;
+    if (format == ClipboardFormatImage)
+        totalSize += sizeof(fileHeader);
+
+    if (totalSize > maxSize)
+    {
+        LogError("clipboard data (%Iu bytes) exceeds %lu bytes", totalSize, maxSize);
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        goto cleanup;
     }
 
-    if (!QioWriteBuffer(outputFile, clipTextUtf8, (DWORD)cbTextUtf8))
+    if (format == ClipboardFormatImage && !QioWriteBuffer(outputFile, &fileHeader, sizeof(fileHeader)))
     {
         win_perror("QioWriteBuffer");
-        free(clipTextPrepared);
-        return FALSE;
+        goto cleanup;
+    }
+
+    if (!WriteChunks(outputFile, data + start, end - start))
+        goto cleanup;
+
+    LogDebug("sent %S, %Iu bytes", ClipboardFormatMimeType(format), totalSize);
+    success = TRUE;
+
+cleanup:
+    free(data);
+    return success;
+}
+
+// Format negotiation: list what can be requested without rendering anything.
+static BOOL WriteFormatList(OUT HANDLE outputFile)
+{
+    char line[CLIPBOARD_FORMAT_LINE_SIZE];
+
+    for (int i = 0; i < ClipboardFormatCount; i++)
+    {
+        CLIPBOARD_FORMAT format = (CLIPBOARD_FORMAT)i;
+        UINT windowsFormat = ClipboardGetWindowsFormat(format);
+        size_t length;
+
+        if (windowsFormat == 0 || !IsClipboardFormatAvailable(windowsFormat))
+            continue;
+
+        length = ClipboardFormatListLine(format, line);
+        if (!QioWriteBuffer(outputFile, line, (DWORD)length))
+        {
+            win_perror("QioWriteBuffer");
+            return FALSE;
+        }
     }
 
-    free(clipTextPrepared);
     return TRUE;
 }
 
+// Usage: clipboard-copy.exe [formats|<format name>]
 int APIENTRY wWinMain(    _In_ HINSTANCE instance,
                       _In_opt_ HINSTANCE previousInstance,
                           _In_ WCHAR *commandLine,
@@ -126,6 +266,9 @@ int APIENTRY wWinMain(    _In_ HINSTANCE instance,
     UNREFERENCED_PARAMETER(showFlags);
 
     HANDLE stdOut;
+    const WCHAR *argument = __argc > 1 ? __wargv[1] : NULL;
+    CLIPBOARD_FORMAT format;
+    BOOL success;
 
     stdOut = GetStdHandle(STD_OUTPUT_HANDLE);
     if (stdOut == INVALID_HANDLE_VALUE)
@@ -133,7 +276,26 @@ int APIENTRY wWinMain(    _In_ HINSTANCE instance,
         win_perror("GetStdHandle");
         return 1;
     }
-    if (!WriteClipboardText(NULL, stdOut))
+
+    if (argument && _wcsicmp(argument, CLIPBOARD_FORMAT_LIST) == 0)
+    {
+        success = WriteFormatList(stdOut);
+    }
+    else if (!ClipboardParseFormat(argument, &format))
+    {
+        LogError("unknown clipboard format '%s'", argument);
+        return 1;
+    }
+    else if (format == ClipboardFormatText)
+    {
+        success = WriteClipboardText(NULL, stdOut);
+    }
+    else
+    {
+        success = WriteClipboardBinary(NULL, stdOut, format);
+    }
+
+    if (!success)
     {
         return 1;
     }
@@ -24,90 +24,299 @@
 #include <strsafe.h>
 #include <stdlib.h>
 
-#include <qubes-io.h>
-#include <utf8-conv.h>
 #include <log.h>
 
-#define CLIPBOARD_FORMAT CF_UNICODETEXT
+#include "clipboard.h"
 
-#define MAX_CLIPBOARD_SIZE 65000
+// Received data accumulated directly in the memory object handed to the clipboard
+typedef struct _CLIPBOARD_DATA
+{
+    CLIPBOARD_FORMAT Format;
+    HGLOBAL Data;
+    size_t Size; // in bytes, without the terminator
+    size_t Capacity; // in bytes
+    UTF8_DECODER Decoder; // text only
+} CLIPBOARD_DATA;
 
-BOOL ReadClipboardText(IN HWND window, IN HANDLE inputFile)
+// Make room for 'size' more bytes and the terminator.
+static BOOL ReserveData(IN OUT CLIPBOARD_DATA* data, IN size_t size)
 {
-    HANDLE clipData;
-    WCHAR *text, *textLocked;
-    char *inputText;
-    size_t cchText;
-    DWORD cbRead;
-
-    inputText = malloc(MAX_CLIPBOARD_SIZE + 1);
-    if (!inputText)
-        goto fail;
+    size_t needed = data->Size + size + sizeof(WCHAR);
+    size_t capacity;
+    HGLOBAL memory;
+
+    if (needed <= data->Capacity)
+        return TRUE;
 
-    ZeroMemory(inputText, MAX_CLIPBOARD_SIZE + 1);
+    capacity = max(data->Capacity * 2, needed);
+    if (data->Data)
+        memory = GlobalReAlloc(data->Data, capacity, GMEM_MOVEABLE);
+    else
+        memory = GlobalAlloc(GMEM_MOVEABLE, capacity);
 
-    cbRead = QioReadUntilEof(inputFile, inputText, MAX_CLIPBOARD_SIZE);
-    if (cbRead == 0)
+    if (!memory)
     {
-        LogError("QioReadUntilEof returned 0");
-        goto fail;
+        win_perror("GlobalAlloc");
+        return FALSE;
     }
 
-    inputText[cbRead] = '\0';
+    data->Data = memory;
+    data->Capacity = capacity;
+    return TRUE;
+}
+
+// Append a chunk of input, text is converted to UTF-16.
+static BOOL AppendData(IN OUT CLIPBOARD_DATA* data, IN const char* input, IN size_t inputSize, IN BOOL final)
+{
+    BYTE* dataLocked;
+    size_t written = inputSize;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!ReserveData(data, data->Format == ClipboardFormatText ? UTF8_DECODE_BUFFER_LENGTH(inputSize) * sizeof(WCHAR) : inputSize))
+        return FALSE;
 
-    if (ERROR_SUCCESS != ConvertUTF8ToUTF16Static(inputText, &text, &cchText))
+    dataLocked = GlobalLock(data->Data);
+    if (!dataLocked)
     {
-        win_perror("ConvertUTF8ToUTF16Static");
-        goto fail;
+        win_perror("GlobalLock");
+        return FALSE;
     }
 
-    clipData = GlobalAlloc(GMEM_MOVEABLE, (cchText + 1) * sizeof(WCHAR));
-    if (!clipData)
+    if (data->Format == ClipboardFormatText)
     {
-        win_perror("GlobalAlloc");
-        goto fail;
+        status = Utf8DecodeChunk(&data->Decoder, input, inputSize, (WCHAR*)(dataLocked + data->Size), &written, final);
+        written *= sizeof(WCHAR);
+    }
+    else if (inputSize > 0)
+    {
+        CopyMemory(dataLocked + data->Size, input, inputSize);
     }
 
-    textLocked = GlobalLock(clipData);
-    if (!textLocked)
+    if (status == ERROR_SUCCESS)
+    {
+        data->Size += written;
+        ZeroMemory(dataLocked + data->Size, sizeof(WCHAR));
+    }
+
+    GlobalUnlock(data->Data);
+
+    if (status != ERROR_SUCCESS)
+    {
+        SetLastError(status);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Store the CF_HTML header in the space reserved at the start.
+static BOOL FinishHtml(IN OUT CLIPBOARD_DATA* data)
+{
+    char header[CF_HTML_HEADER_SIZE + 1];
+    BYTE* dataLocked;
+
+    ClipboardFormatHtmlHeader(header, data->Size - CF_HTML_HEADER_SIZE);
+
+    dataLocked = GlobalLock(data->Data);
+    if (!dataLocked)
     {
         win_perror("GlobalLock");
-        GlobalFree(clipData);
-        goto fail;
+        return FALSE;
+    }
+
+    CopyMemory(dataLocked, header, CF_HTML_HEADER_SIZE);
+    GlobalUnlock(data->Data);
+    return TRUE;
+}
+
+// Strip the BMP file header, CF_DIB starts with the BITMAPINFOHEADER.
+static BOOL FinishImage(IN OUT CLIPBOARD_DATA* data)
+{
+    BYTE* dataLocked;
+    BOOL valid;
+
+    if (data->Size < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER))
+    {
+        LogError("image too small (%Iu bytes)", data->Size);
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
     }
 
-    memcpy(textLocked, text, (cchText + 1) * sizeof(WCHAR));
+    dataLocked = GlobalLock(data->Data);
+    if (!dataLocked)
+    {
+        win_perror("GlobalLock");
+        return FALSE;
+    }
 
-    GlobalUnlock(clipData);
+    valid = ((BITMAPFILEHEADER*)dataLocked)->bfType == 0x4d42; // 'BM'
+    if (valid)
+    {
+        data->Size -= sizeof(BITMAPFILEHEADER);
+        MoveMemory(dataLocked, dataLocked + sizeof(BITMAPFILEHEADER), data->Size + sizeof(WCHAR));
+    }
+
+    GlobalUnlock(data->Data);
+
+    if (!valid)
+    {
+        LogError("image is not in BMP format");
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Read the whole input in chunks, converting as it arrives.
+static BOOL ReceiveData(IN HANDLE inputFile, IN OUT CLIPBOARD_DATA* data)
+{
+    ULONG maxSize = ClipboardGetMaxSize();
+    ULONG64 totalSize = 0;
+    BOOL truncated = FALSE;
+    BOOL success = FALSE;
+    char* chunk;
+
+    chunk = malloc(CLIPBOARD_CHUNK_SIZE);
+    if (!chunk)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    // space for the header, filled in when the size is known
+    if (data->Format == ClipboardFormatHtml)
+    {
+        FillMemory(chunk, CF_HTML_HEADER_SIZE, ' ');
+        if (!AppendData(data, chunk, CF_HTML_HEADER_SIZE, FALSE))
+            goto cleanup;
+    }
+
+    while (TRUE)
+    {
+        DWORD cbRead;
+
+        if (!ReadFile(inputFile, chunk, CLIPBOARD_CHUNK_SIZE, &cbRead, NULL))
+        {
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                break;
+
+            win_perror("ReadFile");
+            goto cleanup;
+        }
+
+        if (cbRead == 0)
+            break;
+
+        // keep reading to EOF so that the sender doesn't block
+        if (truncated)
+            continue;
+
+        if (totalSize + cbRead > maxSize)
+        {
+            // only text can be cut short
+            if (data->Format != ClipboardFormatText)
+            {
+                LogError("clipboard data exceeds %lu bytes", maxSize);
+                SetLastError(ERROR_FILE_TOO_LARGE);
+                goto cleanup;
+            }
+
+            LogWarning("clipboard data exceeds %lu bytes, truncating", maxSize);
+            cbRead = (DWORD)(maxSize - totalSize);
+            // don't cut a UTF-8 sequence in half, the first dropped byte must not be a continuation
+            // (a valid sequence has at most 3 of them)
+            for (int i = 0; i < 3 && cbRead > 0 && ((BYTE)chunk[cbRead] & 0xc0) == 0x80; i++)
+                cbRead--;
+            // the sequence started in the previous chunk, drop its part kept by the decoder
+            if (cbRead == 0 && ((BYTE)chunk[0] & 0xc0) == 0x80)
+                data->Decoder.PendingSize = 0;
+            truncated = TRUE;
+        }
+
+        totalSize += cbRead;
+
+        if (!AppendData(data, chunk, cbRead, FALSE))
+            goto cleanup;
+    }
+
+    if (totalSize == 0)
+    {
+        LogError("no clipboard data received");
+        SetLastError(ERROR_NO_DATA);
+        goto cleanup;
+    }
+
+    switch (data->Format)
+    {
+    case ClipboardFormatText:
+        // flush an incomplete trailing sequence
+        if (!AppendData(data, NULL, 0, TRUE))
+            goto cleanup;
+        break;
+
+    case ClipboardFormatHtml:
+        if (!FinishHtml(data))
+            goto cleanup;
+        break;
+
+    case ClipboardFormatImage:
+        if (!FinishImage(data))
+            goto cleanup;
+        break;
+
+    default:
+        break;
+    }
+
+    LogDebug("received %S, %I64u bytes", ClipboardFormatMimeType(data->Format), totalSize);
+    success = TRUE;
+
+cleanup:
+    free(chunk);
+    return success;
+}
+
+BOOL ReadClipboardData(IN HWND window, IN HANDLE inputFile, IN CLIPBOARD_FORMAT format)
+{
+    CLIPBOARD_DATA data = { 0 };
+    UINT windowsFormat;
+
+    windowsFormat = ClipboardGetWindowsFormat(format);
+    if (windowsFormat == 0)
+        return FALSE;
+
+    data.Format = format;
+    if (!ReceiveData(inputFile, &data))
+        goto fail;
 
     if (!OpenClipboard(window))
     {
         win_perror("OpenClipboard");
-        GlobalFree(clipData);
         goto fail;
     }
 
     if (!EmptyClipboard())
     {
         win_perror("EmptyClipboard");
-        GlobalFree(clipData);
         CloseClipboard();
         goto fail;
     }
 
-    if (!SetClipboardData(CLIPBOARD_FORMAT, clipData))
+    if (!SetClipboardData(windowsFormat, data.Data))
     {
         win_perror("SetClipboardData");
-        GlobalFree(clipData);
         CloseClipboard();
         goto fail;
     }
 
+    // the system owns the memory now
     CloseClipboard();
     return TRUE;
 
 fail:
-    free(inputText);
+    if (data.Data)
+        GlobalFree(data.Data);
     return FALSE;
 }
 
@@ -148,6 +357,7 @@ HWND CreateMainWindow(IN HINSTANCE instance)
         NULL);
 }
 
+// Usage: clipboard-paste.exe [<format name>]
 int APIENTRY wWinMain(    _In_ HINSTANCE instance,
                       _In_opt_ HINSTANCE previousInstance,
                           _In_ WCHAR* commandLine,
@@ -159,6 +369,14 @@ int APIENTRY wWinMain(    _In_ HINSTANCE instance,
 
     HANDLE stdIn;
     HWND window;
+    const WCHAR* argument = __argc > 1 ? __wargv[1] : NULL;
+    CLIPBOARD_FORMAT format;
+
+    if (!ClipboardParseFormat(argument, &format))
+    {
+        LogError("unknown clipboard format '%s'", argument);
+        return ERROR_INVALID_PARAMETER;
+    }
 
     stdIn = GetStdHandle(STD_INPUT_HANDLE);
     if (stdIn == INVALID_HANDLE_VALUE)
@@ -172,7 +390,7 @@ int APIENTRY wWinMain(    _In_ HINSTANCE instance,
         return win_perror("createMainWindow");
     }
 
-    if (!ReadClipboardText(window, stdIn))
+    if (!ReadClipboardData(window, stdIn, format))
     {
         return GetLastError();
     }
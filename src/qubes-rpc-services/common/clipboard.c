@@ -0,0 +1,478 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <strsafe.h>
+#include <stdlib.h>
+#include <emmintrin.h>
+
+#include "clipboard.h"
+
+#include <config.h>
+#include <log.h>
+
+ULONG ClipboardGetMaxSize(void)
+{
+    DWORD value;
+
+    if (CfgReadDword(NULL, REG_CONFIG_MAX_CLIPBOARD_SIZE, &value, NULL) == ERROR_SUCCESS && value != 0)
+        return value;
+
+    return CLIPBOARD_DEFAULT_MAX_SIZE;
+}
+
+static const struct
+{
+    const WCHAR* Name;
+    const char* MimeType;
+    UINT PredefinedFormat;
+    const WCHAR* RegisteredFormat; // name of a registered format if not predefined
+} g_Formats[ClipboardFormatCount] =
+{
+    { L"text", "text/plain;charset=utf-8", CF_UNICODETEXT, NULL },
+    { L"html", "text/html", 0, L"HTML Format" },
+    { L"rtf", "text/rtf", 0, L"Rich Text Format" },
+    { L"image", "image/bmp", CF_DIB, NULL },
+};
+
+BOOL ClipboardParseFormat(IN const WCHAR* name, OUT CLIPBOARD_FORMAT* format)
+{
+    if (!name || !*name)
+    {
+        *format = ClipboardFormatText;
+        return TRUE;
+    }
+
+    for (int i = 0; i < ClipboardFormatCount; i++)
+    {
+        if (_wcsicmp(name, g_Formats[i].Name) == 0)
+        {
+            *format = (CLIPBOARD_FORMAT)i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+const WCHAR* ClipboardFormatName(IN CLIPBOARD_FORMAT format)
+{
+    return g_Formats[format].Name;
+}
+
+const char* ClipboardFormatMimeType(IN CLIPBOARD_FORMAT format)
+{
+    return g_Formats[format].MimeType;
+}
+
+UINT ClipboardGetWindowsFormat(IN CLIPBOARD_FORMAT format)
+{
+    UINT id;
+
+    if (!g_Formats[format].RegisteredFormat)
+        return g_Formats[format].PredefinedFormat;
+
+    // returns the existing ID if already registered
+    id = RegisterClipboardFormat(g_Formats[format].RegisteredFormat);
+    if (id == 0)
+        win_perror("RegisterClipboardFormat");
+
+    return id;
+}
+
+size_t ClipboardFormatListLine(IN CLIPBOARD_FORMAT format, OUT char* line)
+{
+    StringCbPrintfA(line, CLIPBOARD_FORMAT_LINE_SIZE, "%S %s\n", g_Formats[format].Name, g_Formats[format].MimeType);
+    return strlen(line);
+}
+
+void ClipboardFormatHtmlHeader(OUT char* header, IN size_t documentSize)
+{
+    StringCbPrintfA(header, CF_HTML_HEADER_SIZE + 1, CF_HTML_HEADER_FORMAT,
+                    CF_HTML_HEADER_SIZE, CF_HTML_HEADER_SIZE + documentSize, CF_HTML_HEADER_SIZE, CF_HTML_HEADER_SIZE + documentSize);
+}
+
+// Parse a decimal offset from the CF_HTML description header.
+static BOOL GetHtmlOffset(IN const char* header, IN const char* key, OUT size_t* offset)
+{
+    const char* value = strstr(header, key);
+    long number;
+
+    if (!value)
+        return FALSE;
+
+    number = strtol(value + strlen(key), NULL, 10);
+    if (number < 0) // -1 means not present
+        return FALSE;
+
+    *offset = (size_t)number;
+    return TRUE;
+}
+
+BOOL ClipboardGetHtmlRange(IN const BYTE* data, IN size_t size, OUT size_t* start, OUT size_t* end)
+{
+    char header[512];
+
+    // the description header is short ASCII text at the start
+    StringCbCopyNA(header, sizeof(header), (const char*)data, min(size, sizeof(header) - 1));
+
+    if (!(GetHtmlOffset(header, "StartHTML:", start) && GetHtmlOffset(header, "EndHTML:", end)) &&
+        !(GetHtmlOffset(header, "StartFragment:", start) && GetHtmlOffset(header, "EndFragment:", end)))
+    {
+        LogError("invalid CF_HTML header");
+        return FALSE;
+    }
+
+    if (*start > *end || *end > size)
+    {
+        LogError("invalid CF_HTML offsets %Iu-%Iu, size %Iu", *start, *end, size);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL ClipboardGetBitmapFileHeader(IN const BYTE* data, IN size_t size, OUT BITMAPFILEHEADER* fileHeader)
+{
+    const BITMAPINFOHEADER* info = (const BITMAPINFOHEADER*)data;
+    size_t colors;
+
+    if (size < sizeof(BITMAPINFOHEADER) || info->biSize < sizeof(BITMAPINFOHEADER) || info->biSize > size)
+    {
+        LogError("invalid CF_DIB data, size %Iu", size);
+        return FALSE;
+    }
+
+    colors = info->biClrUsed;
+    if (colors == 0 && info->biBitCount > 0 && info->biBitCount <= 8)
+        colors = (size_t)1 << info->biBitCount;
+
+    ZeroMemory(fileHeader, sizeof(*fileHeader));
+    fileHeader->bfType = 0x4d42; // 'BM'
+    fileHeader->bfSize = (DWORD)(sizeof(*fileHeader) + size);
+    fileHeader->bfOffBits = (DWORD)(sizeof(*fileHeader) + info->biSize + colors * sizeof(RGBQUAD));
+    // color masks follow a plain BITMAPINFOHEADER
+    if (info->biSize == sizeof(BITMAPINFOHEADER) && info->biCompression == BI_BITFIELDS)
+        fileHeader->bfOffBits += (DWORD)(3 * sizeof(DWORD));
+
+    return TRUE;
+}
+
+#define REPLACEMENT_CHARACTER 0xfffd
+
+// Decode one UTF-8 sequence as specified by Unicode table 3-7 (no overlongs, surrogates
+// or values above U+10FFFF). Returns the number of bytes consumed, 0 if the input ends
+// inside a valid prefix. An invalid sequence consumes its maximal valid prefix (at least
+// one byte) and yields U+FFFD, same as MultiByteToWideChar.
+static size_t DecodeSequence(IN const BYTE* input, IN size_t inputSize, OUT UINT32* codePoint)
+{
+    BYTE lead = input[0];
+    BYTE low = 0x80;
+    BYTE high = 0xbf;
+    size_t length;
+    UINT32 value;
+
+    if (lead >= 0xc2 && lead <= 0xdf)
+    {
+        length = 2;
+        value = lead & 0x1f;
+    }
+    else if (lead >= 0xe0 && lead <= 0xef)
+    {
+        length = 3;
+        value = lead & 0x0f;
+        if (lead == 0xe0)
+            low = 0xa0;
+        else if (lead == 0xed)
+            high = 0x9f;
+    }
+    else if (lead >= 0xf0 && lead <= 0xf4)
+    {
+        length = 4;
+        value = lead & 0x07;
+        if (lead == 0xf0)
+            low = 0x90;
+        else if (lead == 0xf4)
+            high = 0x8f;
+    }
+    else
+    {
+        *codePoint = REPLACEMENT_CHARACTER;
+        return 1;
+    }
+
+    for (size_t i = 1; i < length; i++)
+    {
+        if (i >= inputSize)
+            return 0;
+
+        if (input[i] < low || input[i] > high)
+        {
+            *codePoint = REPLACEMENT_CHARACTER;
+            return i;
+        }
+
+        value = (value << 6) | (input[i] & 0x3f);
+        // only the second byte has a narrowed range
+        low = 0x80;
+        high = 0xbf;
+    }
+
+    *codePoint = value;
+    return length;
+}
+
+static size_t PutUtf16(IN UINT32 codePoint, OUT WCHAR* output)
+{
+    if (codePoint < 0x10000)
+    {
+        output[0] = (WCHAR)codePoint;
+        return 1;
+    }
+
+    codePoint -= 0x10000;
+    output[0] = (WCHAR)(0xd800 | (codePoint >> 10));
+    output[1] = (WCHAR)(0xdc00 | (codePoint & 0x3ff));
+    return 2;
+}
+
+DWORD Utf8DecodeChunk(
+    IN OUT PUTF8_DECODER decoder,
+    IN const char* input,
+    IN size_t inputSize,
+    OUT WCHAR* output,
+    OUT size_t* outputLength,
+    IN BOOL final)
+{
+    const BYTE* in = (const BYTE*)input;
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    size_t o = 0;
+    size_t consumed;
+    UINT32 codePoint;
+
+    *outputLength = 0;
+
+    // finish the sequence started in the previous chunk, a byte at a time
+    if (decoder->PendingSize > 0)
+    {
+        consumed = 0;
+        while (decoder->PendingSize < sizeof(decoder->Pending) && i < inputSize)
+        {
+            decoder->Pending[decoder->PendingSize++] = in[i++];
+            consumed = DecodeSequence((const BYTE*)decoder->Pending, decoder->PendingSize, &codePoint);
+            if (consumed != 0)
+                break;
+        }
+
+        if (consumed == 0)
+        {
+            if (!final)
+                return ERROR_SUCCESS; // still incomplete, only possible for tiny chunks
+
+            // truncated at the end of input
+            codePoint = REPLACEMENT_CHARACTER;
+            consumed = decoder->PendingSize;
+        }
+
+        o += PutUtf16(codePoint, output + o);
+        // an invalid byte ending the sequence is decoded again on its own
+        i -= decoder->PendingSize - consumed;
+        decoder->PendingSize = 0;
+        decoder->PreviousCr = FALSE;
+    }
+
+    while (i < inputSize)
+    {
+        // 16 ASCII bytes without LF: just widen
+        if (inputSize - i >= 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i*)(in + i));
+
+            if (_mm_movemask_epi8(block) == 0 && _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf)) == 0)
+            {
+                _mm_storeu_si128((__m128i*)(output + o), _mm_unpacklo_epi8(block, zero));
+                _mm_storeu_si128((__m128i*)(output + o + 8), _mm_unpackhi_epi8(block, zero));
+                decoder->PreviousCr = (in[i + 15] == '\r');
+                i += 16;
+                o += 16;
+                continue;
+            }
+        }
+
+        if (in[i] < 0x80)
+        {
+            // LF -> CRLF, existing CRLF is kept
+            if (in[i] == '\n' && !decoder->PreviousCr)
+                output[o++] = L'\r';
+
+            decoder->PreviousCr = (in[i] == '\r');
+            output[o++] = in[i++];
+            continue;
+        }
+
+        consumed = DecodeSequence(in + i, inputSize - i, &codePoint);
+        if (consumed == 0)
+        {
+            if (!final)
+            {
+                // keep the incomplete sequence (at most 3 bytes) for the next chunk
+                decoder->PendingSize = (ULONG)(inputSize - i);
+                CopyMemory(decoder->Pending, in + i, decoder->PendingSize);
+                break;
+            }
+
+            codePoint = REPLACEMENT_CHARACTER;
+            consumed = inputSize - i;
+        }
+
+        o += PutUtf16(codePoint, output + o);
+        decoder->PreviousCr = FALSE;
+        i += consumed;
+    }
+
+    *outputLength = o;
+    return ERROR_SUCCESS;
+}
+
+static size_t PutUtf8(IN UINT32 codePoint, OUT char* output)
+{
+    BYTE* out = (BYTE*)output;
+
+    if (codePoint < 0x800)
+    {
+        out[0] = (BYTE)(0xc0 | (codePoint >> 6));
+        out[1] = (BYTE)(0x80 | (codePoint & 0x3f));
+        return 2;
+    }
+
+    if (codePoint < 0x10000)
+    {
+        out[0] = (BYTE)(0xe0 | (codePoint >> 12));
+        out[1] = (BYTE)(0x80 | ((codePoint >> 6) & 0x3f));
+        out[2] = (BYTE)(0x80 | (codePoint & 0x3f));
+        return 3;
+    }
+
+    out[0] = (BYTE)(0xf0 | (codePoint >> 18));
+    out[1] = (BYTE)(0x80 | ((codePoint >> 12) & 0x3f));
+    out[2] = (BYTE)(0x80 | ((codePoint >> 6) & 0x3f));
+    out[3] = (BYTE)(0x80 | (codePoint & 0x3f));
+    return 4;
+}
+
+static UINT32 CombineSurrogates(IN WCHAR high, IN WCHAR low)
+{
+    return 0x10000 + (((UINT32)high - 0xd800) << 10) + ((UINT32)low - 0xdc00);
+}
+
+DWORD Utf16EncodeChunk(
+    IN OUT PUTF16_ENCODER encoder,
+    IN const WCHAR* input,
+    IN size_t inputLength,
+    OUT char* output,
+    OUT size_t* outputSize,
+    IN BOOL final)
+{
+    const __m128i nonAscii = _mm_set1_epi16((short)0xff80);
+    const __m128i cr = _mm_set1_epi16(L'\r');
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    size_t o = 0;
+
+    *outputSize = 0;
+
+    // finish the surrogate pair started in the previous chunk
+    if (encoder->PendingSurrogate)
+    {
+        if (inputLength > 0 && IS_LOW_SURROGATE(input[0]))
+        {
+            o += PutUtf8(CombineSurrogates(encoder->PendingSurrogate, input[0]), output);
+            i++;
+        }
+        else if (inputLength == 0 && !final)
+        {
+            return ERROR_SUCCESS;
+        }
+        else
+        {
+            o += PutUtf8(REPLACEMENT_CHARACTER, output);
+        }
+
+        encoder->PendingSurrogate = 0;
+    }
+
+    while (i < inputLength)
+    {
+        WCHAR c;
+
+        // 8 ASCII characters without CR: just narrow
+        if (inputLength - i >= 8)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i*)(input + i));
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(block, nonAscii), zero)) == 0xffff &&
+                _mm_movemask_epi8(_mm_cmpeq_epi16(block, cr)) == 0)
+            {
+                _mm_storel_epi64((__m128i*)(output + o), _mm_packus_epi16(block, block));
+                i += 8;
+                o += 8;
+                continue;
+            }
+        }
+
+        c = input[i++];
+        if (c < 0x80)
+        {
+            // CRLF -> LF
+            if (c != L'\r')
+                output[o++] = (char)c;
+        }
+        else if (IS_HIGH_SURROGATE(c))
+        {
+            if (i < inputLength && IS_LOW_SURROGATE(input[i]))
+            {
+                o += PutUtf8(CombineSurrogates(c, input[i]), output + o);
+                i++;
+            }
+            else if (i == inputLength && !final)
+            {
+                encoder->PendingSurrogate = c;
+            }
+            else
+            {
+                o += PutUtf8(REPLACEMENT_CHARACTER, output + o);
+            }
+        }
+        else if (IS_LOW_SURROGATE(c))
+        {
+            o += PutUtf8(REPLACEMENT_CHARACTER, output + o);
+        }
+        else
+        {
+            o += PutUtf8(c, output + o);
+        }
+    }
+
+    *outputSize = o;
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,172 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Shared by clipboard-copy and clipboard-paste: chunked UTF-8 <-> UTF-16 conversion
+// and the transfer size limit.
+// Line endings are normalized in the same pass: text sent to other VMs uses LF,
+// text put on the Windows clipboard uses CRLF.
+
+#pragma once
+#include <windows.h>
+
+// Global config value (DWORD, bytes of UTF-8 text) overriding CLIPBOARD_DEFAULT_MAX_SIZE.
+#define REG_CONFIG_MAX_CLIPBOARD_SIZE L"MaxClipboardSize"
+#define CLIPBOARD_DEFAULT_MAX_SIZE    (64 * 1024 * 1024)
+
+// UTF-8 bytes processed at once
+#define CLIPBOARD_CHUNK_SIZE 65536
+
+// Formats that can be transferred between VMs. The format name is the qrexec service argument
+// (qubes.ClipboardCopy+html, qubes.ClipboardPaste+html), no argument means text.
+// qubes.ClipboardCopy+formats lists the formats available in the source VM, one
+// "<name> <MIME type>\n" line each, without rendering any data. Only the format requested
+// afterwards is converted and transferred.
+typedef enum _CLIPBOARD_FORMAT
+{
+    ClipboardFormatText, // UTF-8 text with LF line endings (CF_UNICODETEXT)
+    ClipboardFormatHtml, // UTF-8 HTML document (CF_HTML without its description header)
+    ClipboardFormatRtf, // RTF document
+    ClipboardFormatImage, // BMP file (CF_DIB with a file header)
+    ClipboardFormatCount
+} CLIPBOARD_FORMAT;
+
+#define CLIPBOARD_FORMAT_LIST L"formats"
+#define CLIPBOARD_FORMAT_LINE_SIZE 64 // longest "<name> <MIME type>\n" line with the terminator
+
+// CF_HTML description header with fixed width offsets, so that its size is known up front.
+// The whole document is marked as the fragment.
+#define CF_HTML_HEADER_FORMAT "Version:0.9\r\nStartHTML:%010Iu\r\nEndHTML:%010Iu\r\nStartFragment:%010Iu\r\nEndFragment:%010Iu\r\n"
+#define CF_HTML_HEADER_SIZE (sizeof("Version:0.9\r\nStartHTML:\r\nEndHTML:\r\nStartFragment:\r\nEndFragment:\r\n") - 1 + 4 * 10)
+
+// Output buffer sizes needed for a chunk of a given input size.
+// Decoding: up to two WCHARs per input byte (LF -> CRLF, 4 byte sequences) plus the carried over sequence.
+#define UTF8_DECODE_BUFFER_LENGTH(inputSize)  (2 * (inputSize) + 2)
+// Encoding: up to 3 bytes per WCHAR (4 per surrogate pair) plus the carried over surrogate.
+#define UTF16_ENCODE_BUFFER_SIZE(inputLength) (3 * ((inputLength) + 1))
+
+// UTF-8 -> UTF-16 conversion state, sequences may be split between chunks.
+typedef struct _UTF8_DECODER
+{
+    char Pending[4]; // start of an incomplete sequence
+    ULONG PendingSize;
+    BOOL PreviousCr; // last character written was CR
+} UTF8_DECODER, *PUTF8_DECODER;
+
+// UTF-16 -> UTF-8 conversion state, surrogate pairs may be split between chunks.
+typedef struct _UTF16_ENCODER
+{
+    WCHAR PendingSurrogate; // high surrogate at the end of the previous chunk, 0 if none
+} UTF16_ENCODER, *PUTF16_ENCODER;
+
+/**
+ * @brief Get the maximum clipboard transfer size (bytes of payload).
+ */
+ULONG ClipboardGetMaxSize(void);
+
+/**
+ * @brief Look up a transfer format by its name (case insensitive).
+ * @param name Format name, NULL or empty for text.
+ * @param format Receives the format.
+ * @return FALSE if the name is unknown.
+ */
+BOOL ClipboardParseFormat(IN const WCHAR* name, OUT CLIPBOARD_FORMAT* format);
+
+/**
+ * @brief Get the name of a transfer format.
+ */
+const WCHAR* ClipboardFormatName(IN CLIPBOARD_FORMAT format);
+
+/**
+ * @brief Get the MIME type of a transfer format's payload.
+ */
+const char* ClipboardFormatMimeType(IN CLIPBOARD_FORMAT format);
+
+/**
+ * @brief Get the Windows clipboard format backing a transfer format.
+ * @return Clipboard format ID, 0 on error.
+ */
+UINT ClipboardGetWindowsFormat(IN CLIPBOARD_FORMAT format);
+
+/**
+ * @brief Format the qubes.ClipboardCopy+formats line announcing a transfer format.
+ * @param line Receives "<name> <MIME type>\n", terminated. Must have room for CLIPBOARD_FORMAT_LINE_SIZE bytes.
+ * @return Length of the line without the terminator.
+ */
+size_t ClipboardFormatListLine(IN CLIPBOARD_FORMAT format, OUT char* line);
+
+/**
+ * @brief Format the CF_HTML description header for an HTML document that follows it.
+ * @param header Receives CF_HTML_HEADER_SIZE bytes and a terminator.
+ * @param documentSize Size of the document in bytes.
+ */
+void ClipboardFormatHtmlHeader(OUT char* header, IN size_t documentSize);
+
+/**
+ * @brief Locate the HTML document within CF_HTML data.
+ * @param start Receives the offset of the document (the fragment if the document offsets are missing).
+ * @param end Receives the offset after the document, not larger than size.
+ * @return FALSE if the description header is invalid.
+ */
+BOOL ClipboardGetHtmlRange(IN const BYTE* data, IN size_t size, OUT size_t* start, OUT size_t* end);
+
+/**
+ * @brief Build the BMP file header that makes CF_DIB data a BMP file.
+ * @return FALSE if the data doesn't start with a valid BITMAPINFOHEADER.
+ */
+BOOL ClipboardGetBitmapFileHeader(IN const BYTE* data, IN size_t size, OUT BITMAPFILEHEADER* fileHeader);
+
+/**
+ * @brief Convert a chunk of UTF-8 text to UTF-16. Invalid sequences are replaced by U+FFFD.
+ *        LF is converted to CRLF, existing CRLF is kept.
+ * @param decoder Conversion state, zero initialized before the first chunk.
+ * @param input UTF-8 text.
+ * @param inputSize Size of the input in bytes, at most CLIPBOARD_CHUNK_SIZE.
+ * @param output Receives UTF-16 text, not terminated. Must have room for UTF8_DECODE_BUFFER_LENGTH(inputSize) WCHARs.
+ * @param outputLength Number of WCHARs written.
+ * @param final TRUE for the last chunk, any incomplete sequence is then converted as well.
+ * @return Error code.
+ */
+DWORD Utf8DecodeChunk(
+    IN OUT PUTF8_DECODER decoder,
+    IN const char* input,
+    IN size_t inputSize,
+    OUT WCHAR* output,
+    OUT size_t* outputLength,
+    IN BOOL final);
+
+/**
+ * @brief Convert a chunk of UTF-16 text to UTF-8. Unpaired surrogates are replaced by U+FFFD.
+ *        CR characters are dropped (CRLF -> LF).
+ * @param encoder Conversion state, zero initialized before the first chunk.
+ * @param input UTF-16 text.
+ * @param inputLength Length of the input in WCHARs, at most CLIPBOARD_CHUNK_SIZE.
+ * @param output Receives UTF-8 text, not terminated. Must have room for UTF16_ENCODE_BUFFER_SIZE(inputLength) bytes.
+ * @param outputSize Number of bytes written.
+ * @param final TRUE for the last chunk.
+ * @return Error code.
+ */
+DWORD Utf16EncodeChunk(
+    IN OUT PUTF16_ENCODER encoder,
+    IN const WCHAR* input,
+    IN size_t inputLength,
+    OUT char* output,
+    OUT size_t* outputSize,
+    IN BOOL final);
@@ -22,6 +22,7 @@
 #include <windows.h>
 
 #include "filecopy.h"
+#include "linux.h"
 #include "crc32.h"
 
 #include <qubes-io.h>
@@ -66,6 +67,30 @@ FC_COPY_STATUS FcCopyFile(IN HANDLE output, IN HANDLE input, IN UINT64 size, OUT
     return COPY_FILE_OK;
 }
 
+void FcWindowsTimeToUnix(IN const FILETIME *windowsTime, OUT UINT32 *unixTime, OUT UINT32 *unixTimeNsec)
+{
+    ULARGE_INTEGER tmp;
+
+    tmp.LowPart = windowsTime->dwLowDateTime;
+    tmp.HighPart = windowsTime->dwHighDateTime;
+
+    *unixTimeNsec = (UINT32) ((tmp.QuadPart % 10000000LL) * 100LL);
+    *unixTime = (UINT32) ((tmp.QuadPart / 10000000LL) - UNIX_EPOCH_OFFSET);
+}
+
+void FcUnixTimeToWindows(IN UINT32 unixTime, IN UINT32 unixTimeNsec, OUT FILETIME *windowsTime)
+{
+    ULARGE_INTEGER value;
+
+    value.QuadPart = ((UINT64)unixTime + UNIX_EPOCH_OFFSET) * 10000000ULL;
+    // the sender can put anything here
+    if (unixTimeNsec < 1000000000)
+        value.QuadPart += unixTimeNsec / 100;
+
+    windowsTime->dwLowDateTime = value.LowPart;
+    windowsTime->dwHighDateTime = value.HighPart;
+}
+
 char *FcStatusToString(IN FC_COPY_STATUS status)
 {
     switch (status)
@@ -83,3 +83,7 @@ typedef void(*fNotifyProgressCallback)(DWORD size, FC_PROGRESS_TYPE progressType
 
 FC_COPY_STATUS FcCopyFile(IN HANDLE output, IN HANDLE input, IN UINT64 size, OUT UINT32 *crc32 OPTIONAL, IN fNotifyProgressCallback progressCallback OPTIONAL);
 char *FcStatusToString(IN FC_COPY_STATUS status);
+
+// Times in file_header: seconds since 1970 and nanoseconds. The receiver ignores invalid nanoseconds.
+void FcWindowsTimeToUnix(IN const FILETIME *windowsTime, OUT UINT32 *unixTime, OUT UINT32 *unixTimeNsec);
+void FcUnixTimeToWindows(IN UINT32 unixTime, IN UINT32 unixTimeNsec, OUT FILETIME *windowsTime);
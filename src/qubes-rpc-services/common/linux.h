@@ -21,7 +21,7 @@
 
 #pragma once
 
-#define UNIX_EPOCH_OFFSET 11644478640LL
+#define UNIX_EPOCH_OFFSET 11644473600LL // seconds from 1601-01-01 to 1970-01-01
 
 #pragma warning(suppress:4005) // macro redefinition: ENAMETOOLONG is defined as 38 in msvcrt's errno.h even though MSDN claims it should be Unix compatible
 #undef ENAMETOOLONG
@@ -0,0 +1,286 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <winternl.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <qubes-io.h>
+#include <log.h>
+
+#include "dir-cache.h"
+
+// access needed on a directory handle to create children relative to it
+#define DIR_CACHE_ACCESS (FILE_TRAVERSE | SYNCHRONIZE)
+#define DIR_CACHE_SHARE (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE)
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(status) (((NTSTATUS)(status)) >= 0)
+#endif
+
+typedef struct _DIR_CACHE_ENTRY
+{
+    WCHAR* Path; // NULL if the slot is free
+    size_t Length;
+    HANDLE Handle;
+    ULONG64 LastUse;
+    BOOL Writable; // FILE_WRITE_ATTRIBUTES access
+} DIR_CACHE_ENTRY;
+
+static DIR_CACHE_ENTRY g_DirCache[DIR_CACHE_SIZE];
+static ULONG64 g_DirCacheClock;
+static size_t g_RootLength;
+static ULONG64 g_DirCacheHits;
+static ULONG64 g_DirCacheMisses;
+
+static void Remove(IN DIR_CACHE_ENTRY* entry)
+{
+    CloseHandle(entry->Handle);
+    free(entry->Path);
+    entry->Path = NULL;
+}
+
+void DirCacheInit(IN const WCHAR* incomingDir)
+{
+    g_RootLength = wcslen(incomingDir);
+    while (g_RootLength > 0 && incomingDir[g_RootLength - 1] == L'\\')
+        g_RootLength--;
+}
+
+void DirCacheClose(void)
+{
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (g_DirCache[i].Path)
+            Remove(&g_DirCache[i]);
+    }
+
+    LogDebug("directory cache: %I64u hits, %I64u misses", g_DirCacheHits, g_DirCacheMisses);
+}
+
+static DIR_CACHE_ENTRY* Lookup(IN const WCHAR* path, IN size_t length)
+{
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        DIR_CACHE_ENTRY* entry = &g_DirCache[i];
+
+        if (entry->Path && entry->Length == length && wmemcmp(entry->Path, path, length) == 0)
+        {
+            entry->LastUse = ++g_DirCacheClock;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Takes ownership of the handle, it's closed if there is no memory for the entry.
+static BOOL Insert(IN const WCHAR* path, IN size_t length, IN HANDLE handle, IN BOOL writable)
+{
+    DIR_CACHE_ENTRY* entry = &g_DirCache[0];
+
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (!g_DirCache[i].Path)
+        {
+            entry = &g_DirCache[i];
+            break;
+        }
+
+        if (g_DirCache[i].LastUse < entry->LastUse)
+            entry = &g_DirCache[i];
+    }
+
+    WCHAR* pathCopy = malloc((length + 1) * sizeof(WCHAR));
+    if (!pathCopy)
+    {
+        CloseHandle(handle);
+        return FALSE;
+    }
+
+    wmemcpy(pathCopy, path, length);
+    pathCopy[length] = L'\0';
+
+    if (entry->Path)
+        Remove(entry);
+
+    entry->Path = pathCopy;
+    entry->Length = length;
+    entry->Handle = handle;
+    entry->LastUse = ++g_DirCacheClock;
+    entry->Writable = writable;
+    return TRUE;
+}
+
+// Win32 maps these to devices even with an extension or a stream name (RtlIsDosDeviceName_U).
+// Relative NtCreateFile doesn't, so this is the only thing that keeps them out of the fast path.
+static BOOL IsDosDeviceName(IN const WCHAR* name)
+{
+    static const WCHAR* devices[] = { L"CON", L"PRN", L"AUX", L"NUL", L"CONIN$", L"CONOUT$" };
+    // COM and LPT followed by one of these, including superscript 1-3
+    static const WCHAR portNumbers[] = L"0123456789\x00b9\x00b2\x00b3";
+    size_t baseLength = wcscspn(name, L".:");
+
+    while (baseLength > 0 && name[baseLength - 1] == L' ')
+        baseLength--;
+
+    for (size_t i = 0; i < ARRAYSIZE(devices); i++)
+    {
+        if (baseLength == wcslen(devices[i]) && _wcsnicmp(name, devices[i], baseLength) == 0)
+            return TRUE;
+    }
+
+    if (baseLength == 4 && (_wcsnicmp(name, L"COM", 3) == 0 || _wcsnicmp(name, L"LPT", 3) == 0) &&
+        wcschr(portNumbers, name[3]))
+        return TRUE;
+
+    return FALSE;
+}
+
+// Get the parent directory handle and the name relative to it.
+// Returns NULL if the entry should be created by its full path.
+static HANDLE GetParent(IN const WCHAR* path, OUT const WCHAR** name)
+{
+    // reused for every entry
+    static WCHAR parentPath[MAX_PATH_LONG];
+    const WCHAR* separator = wcsrchr(path, L'\\');
+    size_t parentLength;
+    size_t nameLength;
+    DIR_CACHE_ENTRY* entry;
+    HANDLE handle;
+
+    // the root itself or outside of it
+    if (!separator || (size_t)(separator - path) < g_RootLength)
+        return NULL;
+
+    *name = separator + 1;
+    nameLength = wcslen(*name);
+    if (nameLength == 0 || (*name)[nameLength - 1] == L'.' || (*name)[nameLength - 1] == L' ' || IsDosDeviceName(*name))
+        return NULL;
+
+    parentLength = (size_t)(separator - path);
+    entry = Lookup(path, parentLength);
+    if (entry)
+    {
+        g_DirCacheHits++;
+        return entry->Handle;
+    }
+
+    g_DirCacheMisses++;
+    if (parentLength >= MAX_PATH_LONG)
+        return NULL;
+
+    wmemcpy(parentPath, path, parentLength);
+    parentPath[parentLength] = L'\0';
+
+    handle = CreateFile(parentPath, DIR_CACHE_ACCESS, DIR_CACHE_SHARE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        LogDebug("opening '%s' failed: 0x%x", parentPath, GetLastError());
+        return NULL;
+    }
+
+    return Insert(parentPath, parentLength, handle, FALSE) ? handle : NULL;
+}
+
+static NTSTATUS CreateRelative(IN HANDLE parent, IN const WCHAR* name, IN ACCESS_MASK access, IN ULONG shareAccess,
+    IN ULONG options, OUT HANDLE* handle)
+{
+    UNICODE_STRING nameU;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+
+    RtlInitUnicodeString(&nameU, name);
+    InitializeObjectAttributes(&oa, &nameU, OBJ_CASE_INSENSITIVE, parent, NULL);
+
+    return NtCreateFile(handle, access, &oa, &iosb, NULL, FILE_ATTRIBUTE_NORMAL, shareAccess, FILE_CREATE,
+        options | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+}
+
+HANDLE DirCacheCreateFile(IN const WCHAR* path)
+{
+    const WCHAR* name;
+    HANDLE parent = GetParent(path, &name);
+    HANDLE file;
+    NTSTATUS status;
+
+    if (!parent)
+        return CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+
+    status = CreateRelative(parent, name, FILE_GENERIC_WRITE, FILE_SHARE_READ, FILE_NON_DIRECTORY_FILE, &file);
+    if (!NT_SUCCESS(status))
+    {
+        DWORD error = RtlNtStatusToDosError(status);
+
+        // CreateFile reports a name collision differently
+        SetLastError(error == ERROR_ALREADY_EXISTS ? ERROR_FILE_EXISTS : error);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return file;
+}
+
+BOOL DirCacheCreateDirectory(IN const WCHAR* path)
+{
+    const WCHAR* name;
+    HANDLE parent = GetParent(path, &name);
+    HANDLE directory;
+    NTSTATUS status;
+
+    if (!parent)
+        return CreateDirectory(path, NULL);
+
+    status = CreateRelative(parent, name, DIR_CACHE_ACCESS | FILE_WRITE_ATTRIBUTES, DIR_CACHE_SHARE, FILE_DIRECTORY_FILE,
+        &directory);
+    if (!NT_SUCCESS(status))
+    {
+        SetLastError(RtlNtStatusToDosError(status));
+        return FALSE;
+    }
+
+    // its contents follow
+    Insert(path, wcslen(path), directory, TRUE);
+    return TRUE;
+}
+
+BOOL DirCacheSetTimes(IN const WCHAR* path, IN const FILETIME* accessTime OPTIONAL, IN const FILETIME* modificationTime OPTIONAL)
+{
+    DIR_CACHE_ENTRY* entry = Lookup(path, wcslen(path));
+    HANDLE directory;
+    BOOL success;
+
+    if (entry && entry->Writable)
+    {
+        success = SetFileTime(entry->Handle, NULL, accessTime, modificationTime);
+        // nothing more is created in it
+        Remove(entry);
+        return success;
+    }
+
+    directory = CreateFile(path, FILE_WRITE_ATTRIBUTES, DIR_CACHE_SHARE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (directory == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    success = SetFileTime(directory, NULL, accessTime, modificationTime);
+    CloseHandle(directory);
+    return success;
+}
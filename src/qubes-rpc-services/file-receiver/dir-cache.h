@@ -0,0 +1,68 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Cache of open handles to directories of the received tree.
+// Files and directories are created relative to a cached handle of their parent,
+// so the system doesn't resolve the whole incoming path again for every entry.
+// Entries that Win32 would treat specially (names with trailing dots or spaces,
+// DOS device names) and entries not below the incoming dir are created by full path.
+// Directories created here keep FILE_WRITE_ATTRIBUTES so their times can be set through
+// the same handle once all of their contents were received.
+
+#pragma once
+#include <windows.h>
+
+#define DIR_CACHE_SIZE 16 // least recently used handles are closed
+
+/**
+ * @brief Initialize the cache.
+ * @param incomingDir Root of the received tree, paths passed to the cache start with it.
+ */
+void DirCacheInit(IN const WCHAR* incomingDir);
+
+/**
+ * @brief Close all cached handles.
+ */
+void DirCacheClose(void);
+
+/**
+ * @brief Create a new file for writing, same as CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL).
+ * @param path Sanitized full path of the file.
+ * @return File handle, INVALID_HANDLE_VALUE on error (call GetLastError).
+ */
+HANDLE DirCacheCreateFile(IN const WCHAR* path);
+
+/**
+ * @brief Create a directory, same as CreateDirectory(path, NULL). The new directory is cached.
+ * @param path Sanitized full path of the directory.
+ * @return FALSE on error (call GetLastError), ERROR_ALREADY_EXISTS if it exists.
+ */
+BOOL DirCacheCreateDirectory(IN const WCHAR* path);
+
+/**
+ * @brief Set times of a directory whose contents are complete. Its cached handle is used and closed
+ *        if there is one, otherwise the directory is opened by path.
+ * @param path Sanitized full path of the directory.
+ * @param accessTime Last access time, NULL to leave unchanged.
+ * @param modificationTime Last write time, NULL to leave unchanged.
+ * @return FALSE on error (call GetLastError).
+ */
+BOOL DirCacheSetTimes(IN const WCHAR* path, IN const FILETIME* accessTime OPTIONAL, IN const FILETIME* modificationTime OPTIONAL);
@@ -0,0 +1,37 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Internals of sanitize.c, exposed for services-test.
+
+#pragma once
+#include <windows.h>
+
+/**
+ * @brief Convert an untrusted UTF-8 name to UTF-16. ':' becomes '_' and '/' becomes '\'.
+ *        Invalid bytes 0xa0-0xff are kept as the code point of the same value, other invalid bytes
+ *        become two hex digits.
+ * @param wcs Receives the result, always terminated unless the parameters are invalid.
+ * @param utfs Input.
+ * @param wcslen Size of wcs in WCHARs, including the terminator.
+ * @param utflen Size of the input in bytes, negative if it's terminated.
+ * @return Length of the result, -1 with errno EINVAL for invalid parameters or ERANGE if wcs is too small.
+ */
+int xutftowcsn(wchar_t *wcs, const char *utfs, size_t wcslen, int utflen);
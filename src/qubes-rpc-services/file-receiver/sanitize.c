@@ -0,0 +1,283 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <shlwapi.h>
+#include <wchar.h>
+#include <emmintrin.h>
+
+#include <utf8-conv.h>
+#include <log.h>
+
+#include "sanitize.h"
+#include "sanitize-internal.h"
+
+// FIXME: see how this differs from ConvertUTF8ToUTF16 and possibly update the latter
+int xutftowcsn(wchar_t *wcs, const char *utfs, size_t wcslen, int utflen)
+{
+    int upos = 0, wpos = 0;
+    const unsigned char *utf = (const unsigned char*) utfs;
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i colonToUnderscore = _mm_set1_epi8('_' - ':');
+    const __m128i slashToBackslash = _mm_set1_epi8('\\' - '/');
+    const __m128i zero = _mm_setzero_si128();
+    if (!utf || !wcs || wcslen < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* reserve space for \0 */
+    wcslen--;
+    /* the fast path must not read past the terminator */
+    if (utflen < 0)
+        utflen = (int)strnlen(utfs, INT_MAX);
+
+    while (upos < utflen) {
+        /* ASCII fast path: 16 bytes at once if they all fit, same mapping as below */
+        if (utflen - upos >= 16 && wpos + 16 <= (int)wcslen) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(utf + upos));
+            if (_mm_movemask_epi8(block) == 0) {
+                block = _mm_add_epi8(block, _mm_and_si128(_mm_cmpeq_epi8(block, colon), colonToUnderscore));
+                block = _mm_add_epi8(block, _mm_and_si128(_mm_cmpeq_epi8(block, slash), slashToBackslash));
+                _mm_storeu_si128((__m128i*)(wcs + wpos), _mm_unpacklo_epi8(block, zero));
+                _mm_storeu_si128((__m128i*)(wcs + wpos + 8), _mm_unpackhi_epi8(block, zero));
+                upos += 16;
+                wpos += 16;
+                continue;
+            }
+        }
+
+        int c = utf[upos++] & 0xff;
+
+        if (wpos >= (int)wcslen) {
+            wcs[wpos] = 0;
+            errno = ERANGE;
+            return -1;
+        }
+
+        if (c < 0x80) {
+            /* ASCII */
+            if (c == ':') {
+                c = '_';
+            } else if (c == '/') {
+                // CanonicalizePath... APIs don't change slashes to backslashes
+                // this is needed to properly compare normalized path prefixes
+                c = '\\';
+            }
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xc2 && c < 0xe0 && upos < utflen &&
+                   (utf[upos] & 0xc0) == 0x80) {
+            /* 2-byte utf-8 */
+            c = ((c & 0x1f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xe0 && c < 0xf0 && upos + 1 < utflen &&
+                   !(c == 0xe0 && utf[upos] < 0xa0) && /* over-long encoding */
+                   (utf[upos] & 0xc0) == 0x80 &&
+                   (utf[upos + 1] & 0xc0) == 0x80) {
+            /* 3-byte utf-8 */
+            c = ((c & 0x0f) << 12);
+            c |= ((utf[upos++] & 0x3f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xf0 && c < 0xf5 && upos + 2 < utflen &&
+                   wpos + 1 < wcslen &&
+                   !(c == 0xf0 && utf[upos] < 0x90) && /* over-long encoding */
+                   !(c == 0xf4 && utf[upos] >= 0x90) && /* > \u10ffff */
+                   (utf[upos] & 0xc0) == 0x80 &&
+                   (utf[upos + 1] & 0xc0) == 0x80 &&
+                   (utf[upos + 2] & 0xc0) == 0x80) {
+            /* 4-byte utf-8: convert to \ud8xx \udcxx surrogate pair */
+            c = ((c & 0x07) << 18);
+            c |= ((utf[upos++] & 0x3f) << 12);
+            c |= ((utf[upos++] & 0x3f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            c -= 0x10000;
+            assert((0xd800 | (c >> 10)) <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)(0xd800 | (c >> 10));
+            assert((0xdc00 | (c & 0x3ff)) <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)(0xdc00 | (c & 0x3ff));
+        } else if (c >= 0xa0) {
+            /* invalid utf-8 byte, printable unicode char: convert 1:1 */
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else {
+            /* invalid utf-8 byte, non-printable unicode: convert to hex */
+            static const char *hex = "0123456789abcdef";
+            wcs[wpos++] = hex[c >> 4];
+            if (wpos < wcslen)
+                wcs[wpos++] = hex[c & 0x0f];
+        }
+    }
+    wcs[wpos] = 0;
+    return wpos;
+}
+
+static inline int xutftowcs_path_ex(wchar_t *wcs, const char *utf,
+                                    size_t wcslen, int utflen)
+{
+    int result = xutftowcsn(wcs, utf, wcslen, utflen);
+    if (result < 0 && errno == ERANGE)
+        errno = ENAMETOOLONG;
+    return result;
+}
+
+// wcs must have space for MAX_PATH_LONG WCHARs
+static inline int xutftowcs_path(wchar_t *wcs, const char *utf)
+{
+    return xutftowcs_path_ex(wcs, utf, MAX_PATH_LONG, -1);
+}
+
+// Append the components of a relative path (backslash separated) to a trusted path,
+// resolving "." and "..". The trusted path never gets shorter than rootLength.
+// Returns FALSE if the result would be outside of the root or too long.
+static BOOL AppendRelativePath(IN OUT WCHAR* path, IN OUT size_t* length, IN size_t rootLength, IN const WCHAR* relativePath)
+{
+    const WCHAR* component = relativePath;
+
+    while (TRUE)
+    {
+        const WCHAR* end = wcschr(component, L'\\');
+        size_t componentLength = end ? (size_t)(end - component) : wcslen(component);
+
+        if (componentLength == 0 || (componentLength == 1 && component[0] == L'.'))
+        {
+            // nothing to do
+        }
+        else if (componentLength == 2 && component[0] == L'.' && component[1] == L'.')
+        {
+            if (*length == rootLength)
+            {
+                LogError("path escapes the incoming dir: '%s'", relativePath);
+                return FALSE;
+            }
+
+            // separators we add are never within the root
+            while (path[*length - 1] != L'\\')
+                (*length)--;
+            (*length)--;
+            path[*length] = L'\0';
+        }
+        else
+        {
+            if (*length + 1 + componentLength >= MAX_PATH_LONG)
+            {
+                LogError("path too long: '%s'", relativePath);
+                return FALSE;
+            }
+
+            path[(*length)++] = L'\\';
+            wmemcpy(path + *length, component, componentLength);
+            *length += componentLength;
+            path[*length] = L'\0';
+        }
+
+        if (!end)
+            break;
+        component = end + 1;
+    }
+
+    return TRUE;
+}
+
+// only the untrusted part is resolved, incomingDir is already canonical
+int ResolveUntrustedPath(IN const WCHAR* incomingDir, IN const char* untrustedPathUtf8, IN const WCHAR* linkPath OPTIONAL,
+    OUT WCHAR* trustedPath)
+{
+    // reused for every entry
+    static WCHAR untrustedPath[MAX_PATH_LONG];
+
+    LogVerbose("start");
+    int result = xutftowcs_path(untrustedPath, untrustedPathUtf8);
+    if (result <= 0)
+    {
+        LogError("Failed to convert untrusted path to UTF16");
+        return EINVAL;
+    }
+
+    LogDebug("untrusted path: '%s'", untrustedPath);
+
+    if (!PathIsRelative(untrustedPath))
+    {
+        if (linkPath)
+        {
+            LogError("link target is not relative, link path: %s", linkPath);
+            return EPERM;
+        }
+
+        LogError("path is not relative: '%s'", untrustedPath);
+        return EINVAL;
+    }
+
+    // components are appended after the incoming dir without a trailing separator
+    size_t rootLength = wcslen(incomingDir);
+    while (rootLength > 0 && incomingDir[rootLength - 1] == L'\\')
+        rootLength--;
+
+    size_t length;
+    if (linkPath) // link targets are relative to the link itself
+    {
+        length = wcslen(linkPath);
+        if (length <= rootLength || length >= MAX_PATH_LONG)
+        {
+            LogError("invalid link path: '%s'", linkPath);
+            return EINVAL;
+        }
+
+        wmemcpy(trustedPath, linkPath, length + 1);
+        // remove the link name
+        if (!AppendRelativePath(trustedPath, &length, rootLength, L".."))
+            return EINVAL;
+
+        LogDebug("link base: %s", trustedPath);
+    }
+    else
+    {
+        wmemcpy(trustedPath, incomingDir, rootLength);
+        trustedPath[rootLength] = L'\0';
+        length = rootLength;
+    }
+
+    // slashes must be converted to backslashes already
+    if (!AppendRelativePath(trustedPath, &length, rootLength, untrustedPath))
+        return EINVAL;
+
+    if (length == rootLength)
+        wmemcpy(trustedPath, incomingDir, wcslen(incomingDir) + 1);
+
+    // resolved above, but keep the final check independent of it
+    if (!PathIsPrefix(incomingDir, trustedPath))
+    {
+        LogError("canonical path '%s' is not within incoming dir '%s'", trustedPath, incomingDir);
+        return EINVAL;
+    }
+
+    LogDebug("trusted path: '%s'", trustedPath);
+    LogVerbose("end");
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Conversion of untrusted entry names and link targets to paths within the incoming dir.
+// Doesn't touch the filesystem.
+
+#pragma once
+#include <windows.h>
+
+/**
+ * @brief Resolve an untrusted relative path within the incoming dir.
+ *        Slashes are separators and ':' becomes '_'. "." and ".." are resolved
+ *        without ever leaving the incoming dir.
+ * @param incomingDir Canonical path of the incoming dir.
+ * @param untrustedPathUtf8 Received path.
+ * @param linkPath Sanitized path of the link if untrustedPathUtf8 is a link target
+ *                 (the target is relative to the link), NULL otherwise.
+ * @param trustedPath Receives the result, needs space for MAX_PATH_LONG WCHARs.
+ * @return 0 on success, otherwise the errno value to report to the peer.
+ */
+int ResolveUntrustedPath(IN const WCHAR* incomingDir, IN const char* untrustedPathUtf8, IN const WCHAR* linkPath OPTIONAL,
+    OUT WCHAR* trustedPath);
@@ -36,10 +36,16 @@
 
 #include "linux.h"
 #include "filecopy.h"
+#include "dir-cache.h"
+#include "writer.h"
+#include "sanitize.h"
 
 static_assert(FC_MAX_PATH < MAX_PATH_LONG, "FC_MAX_PATH must be lesser than MAX_PATH_LONG");
 
 char g_untrustedName[FC_MAX_PATH];
+char g_untrustedLinkTarget[FC_MAX_PATH];
+WCHAR g_trustedPath[MAX_PATH_LONG];
+WCHAR g_trustedLinkTargetPath[MAX_PATH_LONG];
 INT64 g_bytesLimit = 0;
 INT64 g_filesLimit = 0;
 INT64 g_totalBytesReceived = 0;
@@ -49,107 +55,6 @@ UINT32 g_crc32 = 0;
 extern HANDLE g_stdin;
 extern HANDLE g_stdout;
 
-// FIXME: see how this differs from ConvertUTF8ToUTF16 and possibly update the latter
-static int xutftowcsn(wchar_t *wcs, const char *utfs, size_t wcslen, int utflen)
-{
-    int upos = 0, wpos = 0;
-    const unsigned char *utf = (const unsigned char*) utfs;
-    if (!utf || !wcs || wcslen < 1) {
-        errno = EINVAL;
-        return -1;
-    }
-    /* reserve space for \0 */
-    wcslen--;
-    if (utflen < 0)
-        utflen = INT_MAX;
-
-    while (upos < utflen) {
-        int c = utf[upos++] & 0xff;
-        if (utflen == INT_MAX && c == 0)
-            break;
-
-        if (wpos >= (int)wcslen) {
-            wcs[wpos] = 0;
-            errno = ERANGE;
-            return -1;
-        }
-
-        if (c < 0x80) {
-            /* ASCII */
-            if (c == ':') {
-                c = '_';
-            } else if (c == '/') {
-                // CanonicalizePath... APIs don't change slashes to backslashes
-                // this is needed to properly compare normalized path prefixes
-                c = '\\';
-            }
-            assert(c <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)c;
-        } else if (c >= 0xc2 && c < 0xe0 && upos < utflen &&
-                   (utf[upos] & 0xc0) == 0x80) {
-            /* 2-byte utf-8 */
-            c = ((c & 0x1f) << 6);
-            c |= (utf[upos++] & 0x3f);
-            assert(c <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)c;
-        } else if (c >= 0xe0 && c < 0xf0 && upos + 1 < utflen &&
-                   !(c == 0xe0 && utf[upos] < 0xa0) && /* over-long encoding */
-                   (utf[upos] & 0xc0) == 0x80 &&
-                   (utf[upos + 1] & 0xc0) == 0x80) {
-            /* 3-byte utf-8 */
-            c = ((c & 0x0f) << 12);
-            c |= ((utf[upos++] & 0x3f) << 6);
-            c |= (utf[upos++] & 0x3f);
-            assert(c <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)c;
-        } else if (c >= 0xf0 && c < 0xf5 && upos + 2 < utflen &&
-                   wpos + 1 < wcslen &&
-                   !(c == 0xf0 && utf[upos] < 0x90) && /* over-long encoding */
-                   !(c == 0xf4 && utf[upos] >= 0x90) && /* > \u10ffff */
-                   (utf[upos] & 0xc0) == 0x80 &&
-                   (utf[upos + 1] & 0xc0) == 0x80 &&
-                   (utf[upos + 2] & 0xc0) == 0x80) {
-            /* 4-byte utf-8: convert to \ud8xx \udcxx surrogate pair */
-            c = ((c & 0x07) << 18);
-            c |= ((utf[upos++] & 0x3f) << 12);
-            c |= ((utf[upos++] & 0x3f) << 6);
-            c |= (utf[upos++] & 0x3f);
-            c -= 0x10000;
-            assert((0xd800 | (c >> 10)) <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)(0xd800 | (c >> 10));
-            assert((0xdc00 | (c & 0x3ff)) <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)(0xdc00 | (c & 0x3ff));
-        } else if (c >= 0xa0) {
-            /* invalid utf-8 byte, printable unicode char: convert 1:1 */
-            assert(c <= WCHAR_MAX);
-            wcs[wpos++] = (wchar_t)c;
-        } else {
-            /* invalid utf-8 byte, non-printable unicode: convert to hex */
-            static const char *hex = "0123456789abcdef";
-            wcs[wpos++] = hex[c >> 4];
-            if (wpos < wcslen)
-                wcs[wpos++] = hex[c & 0x0f];
-        }
-    }
-    wcs[wpos] = 0;
-    return wpos;
-}
-
-static inline int xutftowcs_path_ex(wchar_t *wcs, const char *utf,
-                                    size_t wcslen, int utflen)
-{
-    int result = xutftowcsn(wcs, utf, wcslen, utflen);
-    if (result < 0 && errno == ERANGE)
-        errno = ENAMETOOLONG;
-    return result;
-}
-
-// wcs must have space for MAX_PATH_LONG WCHARs
-static inline int xutftowcs_path(wchar_t *wcs, const char *utf)
-{
-    return xutftowcs_path_ex(wcs, utf, MAX_PATH_LONG, -1);
-}
-
 void SetSizeLimit(IN INT64 bytesLimit, IN INT64 filesLimit)
 {
     g_bytesLimit = bytesLimit;
@@ -202,101 +107,25 @@ void SendStatusAndExit(IN UINT32 statusCode, IN const char *lastFileName)
 }
 
 // if untrustedPathUtf8 is a link target, linkPath needs to be a sanitized path of the link file
-// returns buffer that needs to be freed by the caller
+// trustedPath receives the result and needs space for MAX_PATH_LONG WCHARs
 // sends status and exits on any failure
-WCHAR* SanitizePath(IN const WCHAR* incomingDir, IN const char* untrustedPathUtf8, IN const WCHAR* linkPath OPTIONAL)
+void SanitizePath(IN const WCHAR* incomingDir, IN const char* untrustedPathUtf8, IN const WCHAR* linkPath OPTIONAL,
+    OUT WCHAR* trustedPath)
 {
-    LogVerbose("start");
-    WCHAR* untrustedPath = (WCHAR*)malloc(MAX_PATH_LONG_WSIZE);
-    if (!untrustedPath)
-        SendStatusAndExit(ENOMEM, untrustedPathUtf8);
-
-    int result = xutftowcs_path(untrustedPath, untrustedPathUtf8);
-    if (result <= 0)
-    {
-        LogError("Failed to convert untrusted path to UTF16");
-        SendStatusAndExit(EINVAL, untrustedPathUtf8);
-    }
-
-    LogDebug("untrusted path: '%s'", untrustedPath);
-
-    if (linkPath && !PathIsRelative(untrustedPath))
-    {
-        LogError("link target is not relative, link path: %s", linkPath);
-        SendStatusAndExit(EPERM, untrustedPathUtf8);
-    }
-
-    WCHAR* localPath = (WCHAR*)malloc(MAX_PATH_LONG_WSIZE);
-    if (!localPath)
-        SendStatusAndExit(ENOMEM, untrustedPathUtf8);
-
-    HRESULT hresult;
-
-    if (linkPath) // link targets are relative to the link itself
-    {
-        WCHAR* linkBase = _wcsdup(linkPath);
-        hresult = PathCchRemoveFileSpec(linkBase, MAX_PATH_LONG);
-        if (FAILED(hresult))
-        {
-            win_perror2(hresult, "removing file name from link path");
-            SendStatusAndExit(EINVAL, untrustedPathUtf8);
-        }
-
-        LogDebug("link base: %s", linkBase);
-        hresult = PathCchCombineEx(localPath, MAX_PATH_LONG, linkBase, untrustedPath, PATHCCH_ALLOW_LONG_PATHS);
-        if (FAILED(hresult))
-        {
-            win_perror2(hresult, "combining link target path");
-            SendStatusAndExit(EINVAL, untrustedPathUtf8);
-        }
-        free(linkBase);
-    }
-    else
-    {
-        hresult = PathCchCombineEx(localPath, MAX_PATH_LONG, incomingDir, untrustedPath, PATHCCH_ALLOW_LONG_PATHS);
-        if (FAILED(hresult))
-        {
-            win_perror2(hresult, "combining full path");
-            SendStatusAndExit(EINVAL, untrustedPathUtf8);
-        }
-    }
+    int status = ResolveUntrustedPath(incomingDir, untrustedPathUtf8, linkPath, trustedPath);
 
-    free(untrustedPath);
-
-    LogDebug("combined path: '%s'", localPath);
-
-    WCHAR* trustedPath = (WCHAR*)malloc(MAX_PATH_LONG_WSIZE);
-    if (!trustedPath)
-        SendStatusAndExit(ENOMEM, untrustedPathUtf8);
-
-    // slashes must be converted to backslashes already
-    hresult = PathCchCanonicalizeEx(trustedPath, MAX_PATH_LONG, localPath, PATHCCH_ALLOW_LONG_PATHS);
-    if (FAILED(hresult))
-    {
-        win_perror2(hresult, "canonicalizing trusted path");
-        SendStatusAndExit(EINVAL, untrustedPathUtf8);
-    }
-
-    free(localPath);
-    // we know canonicalFilePath is absolute, check if it really starts with incomingDir
-    if (!PathIsPrefix(incomingDir, trustedPath))
-    {
-        LogError("canonical path '%s' is not within incoming dir '%s'", trustedPath, incomingDir);
-        SendStatusAndExit(EINVAL, untrustedPathUtf8);
-    }
-
-    LogDebug("trusted path: '%s'", trustedPath);
-    LogVerbose("end");
-    return trustedPath;
+    if (status != 0)
+        SendStatusAndExit(status, untrustedPathUtf8);
 }
 
 void ProcessRegularFile(IN const WCHAR* incomingDir, IN const struct file_header *untrustedHeader,
     IN const char *untrustedNameUtf8)
 {
     LogVerbose("start");
-    WCHAR* trustedPath = SanitizePath(incomingDir, untrustedNameUtf8, NULL);
+    WCHAR* trustedPath = g_trustedPath;
+    SanitizePath(incomingDir, untrustedNameUtf8, NULL, trustedPath);
 
-    HANDLE outputFile = CreateFile(trustedPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+    HANDLE outputFile = DirCacheCreateFile(trustedPath);
     if (INVALID_HANDLE_VALUE == outputFile)
     {
         // maybe some more complete error code translation needed here, but
@@ -316,31 +145,57 @@ void ProcessRegularFile(IN const WCHAR* incomingDir, IN const struct file_header
     // receive file data from stdin
     LogInfo("receiving file: '%s'", trustedPath);
 
-    FC_COPY_STATUS copyStatus = FcCopyFile(outputFile, g_stdin, untrustedHeader->filelen, &g_crc32, NULL);
-    if (copyStatus != COPY_FILE_OK)
-        SendStatusAndExit(EIO, untrustedNameUtf8);
+    // data is written and the file closed by the writer threads
+    WRITER_FILE* file = WriterOpen(outputFile, untrustedNameUtf8);
+    if (!file)
+        SendStatusAndExit(ENOMEM, untrustedNameUtf8);
 
-    free(trustedPath);
-    CloseHandle(outputFile);
+    for (UINT64 offset = 0; offset < untrustedHeader->filelen; )
+    {
+        BYTE* buffer = WriterGetBuffer();
+        DWORD size = (DWORD)min(untrustedHeader->filelen - offset, WRITER_BUFFER_SIZE);
+
+        if (!ReadWithCrc(g_stdin, buffer, size))
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+
+        WriterWrite(file, buffer, size, offset);
+        offset += size;
+    }
+
+    FILETIME accessTime, modificationTime;
+    FcUnixTimeToWindows(untrustedHeader->atime, untrustedHeader->atime_nsec, &accessTime);
+    FcUnixTimeToWindows(untrustedHeader->mtime, untrustedHeader->mtime_nsec, &modificationTime);
+    // set by the writer thread after the last write
+    WriterClose(file, &accessTime, &modificationTime);
     LogVerbose("end");
 }
 
 void ProcessDirectory(IN const WCHAR* incomingDir, IN const struct file_header *untrustedHeader,
     IN const char *untrustedNameUtf8)
 {
-    UNREFERENCED_PARAMETER(untrustedHeader);
     LogVerbose("start");
-    WCHAR* trustedPath = SanitizePath(incomingDir, untrustedNameUtf8, NULL);
+    WCHAR* trustedPath = g_trustedPath;
+    SanitizePath(incomingDir, untrustedNameUtf8, NULL, trustedPath);
 
     LogInfo("creating directory: '%s'", trustedPath);
-    if (!CreateDirectory(trustedPath, NULL))
+    if (!DirCacheCreateDirectory(trustedPath))
     {
         DWORD errorCode = GetLastError();
         if (ERROR_ALREADY_EXISTS != errorCode)
             SendStatusAndExit(ENOTDIR, untrustedNameUtf8);
+
+        // the sender repeats the header after the directory contents, set times now
+        // that creating them won't change them anymore
+        FILETIME accessTime, modificationTime;
+        FcUnixTimeToWindows(untrustedHeader->atime, untrustedHeader->atime_nsec, &accessTime);
+        FcUnixTimeToWindows(untrustedHeader->mtime, untrustedHeader->mtime_nsec, &modificationTime);
+        if (!DirCacheSetTimes(trustedPath, &accessTime, &modificationTime))
+        {
+            win_perror("DirCacheSetTimes");
+            SendStatusAndExit(EIO, untrustedNameUtf8);
+        }
     }
 
-    free(trustedPath);
     LogVerbose("end");
 }
 
@@ -348,25 +203,23 @@ void ProcessLink(IN const WCHAR* incomingDir, IN const struct file_header *untru
     IN const char *untrustedNameUtf8)
 {
     LogVerbose("start");
-    WCHAR* trustedLinkPath = SanitizePath(incomingDir, untrustedNameUtf8, NULL);
+    WCHAR* trustedLinkPath = g_trustedPath;
+    SanitizePath(incomingDir, untrustedNameUtf8, NULL, trustedLinkPath);
 
     if (untrustedHeader->filelen > FC_MAX_PATH - 1)
         SendStatusAndExit(ENAMETOOLONG, untrustedNameUtf8);
 
     DWORD linkTargetSize = (DWORD) untrustedHeader->filelen; // sanitized above
 
-    char* untrustedLinkTargetPathUtf8 = (char*)malloc(FC_MAX_PATH);
-    if (!untrustedLinkTargetPathUtf8)
-        SendStatusAndExit(ENOMEM, untrustedNameUtf8);
-
+    char* untrustedLinkTargetPathUtf8 = g_untrustedLinkTarget;
     if (!ReadWithCrc(g_stdin, untrustedLinkTargetPathUtf8, linkTargetSize))
         SendStatusAndExit(EIO, untrustedNameUtf8);
 
     untrustedLinkTargetPathUtf8[linkTargetSize] = 0;
 
-    WCHAR* trustedLinkTargetPath = SanitizePath(incomingDir, untrustedLinkTargetPathUtf8, trustedLinkPath);
+    WCHAR* trustedLinkTargetPath = g_trustedLinkTargetPath;
+    SanitizePath(incomingDir, untrustedLinkTargetPathUtf8, trustedLinkPath, trustedLinkTargetPath);
 
-    free(untrustedLinkTargetPathUtf8);
     LogInfo("target: '%s'", trustedLinkTargetPath);
 
     DWORD linkFlags = SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE;
@@ -389,8 +242,6 @@ void ProcessLink(IN const WCHAR* incomingDir, IN const struct file_header *untru
             SendStatusAndExit(EIO, untrustedNameUtf8);
     }
 
-    free(trustedLinkPath);
-    free(trustedLinkTargetPath);
     LogVerbose("end");
 }
 
@@ -423,8 +274,15 @@ void ProcessEntry(IN const WCHAR* incomingDir, IN const struct file_header *untr
 int ReceiveFiles(IN const WCHAR* incomingDir)
 {
     struct file_header untrustedHeader;
+    const char* failedName;
     LogDebug("incoming dir: %s", incomingDir);
 
+    DWORD status = WriterInit();
+    if (status != ERROR_SUCCESS)
+        SendStatusAndExit(status == ERROR_OUTOFMEMORY ? ENOMEM : EIO, NULL);
+
+    DirCacheInit(incomingDir);
+
     /* initialize checksum */
     g_crc32 = 0;
     while (ReadWithCrc(g_stdin, &untrustedHeader, sizeof untrustedHeader))
@@ -439,9 +297,18 @@ int ReceiveFiles(IN const WCHAR* incomingDir)
         ProcessEntry(incomingDir, &untrustedHeader);
         g_totalFilesReceived++;
 
+        // report write failures of earlier files as soon as possible
+        if (WriterFailed(&failedName))
+            SendStatusAndExit(EIO, failedName);
+
         if (g_filesLimit && g_totalFilesReceived > g_filesLimit)
             SendStatusAndExit(EDQUOT, g_untrustedName);
     }
+
+    if (!WriterFlush(&failedName))
+        SendStatusAndExit(EIO, failedName);
+
+    DirCacheClose();
     SendStatusAndCrc(errno, NULL);
     return errno;
 }
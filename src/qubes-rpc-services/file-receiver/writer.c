@@ -0,0 +1,285 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+
+#include "writer.h"
+
+typedef struct _WRITE_REQUEST
+{
+    struct _WRITE_REQUEST* Next;
+    WRITER_FILE* File;
+    BYTE* Data; // NULL for close requests
+    DWORD Size;
+    UINT64 Offset;
+} WRITE_REQUEST;
+
+struct _WRITER_FILE
+{
+    HANDLE Handle;
+    LONG References; // the reader and every pending write
+    char* Name;
+    WRITE_REQUEST CloseRequest;
+    BOOL SetTimes;
+    FILETIME AccessTime;
+    FILETIME ModificationTime;
+};
+
+typedef struct _WRITER_BUFFER
+{
+    WRITE_REQUEST Request;
+    BYTE Data[WRITER_BUFFER_SIZE];
+} WRITER_BUFFER;
+
+static SRWLOCK g_WriterLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE g_QueueNotEmpty = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE g_BufferFree = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE g_AllClosed = CONDITION_VARIABLE_INIT;
+
+// FIFO of pending requests
+static WRITE_REQUEST* g_QueueHead;
+static WRITE_REQUEST* g_QueueTail;
+
+static WRITER_BUFFER* g_Buffers;
+static WRITER_BUFFER* g_FreeBuffers[WRITER_BUFFERS];
+static ULONG g_FreeBufferCount;
+
+static ULONG g_OpenFiles;
+static char* g_FailedName; // first failure, set once
+
+// caller holds the lock
+static void Enqueue(IN WRITE_REQUEST* request)
+{
+    request->Next = NULL;
+    if (g_QueueTail)
+        g_QueueTail->Next = request;
+    else
+        g_QueueHead = request;
+    g_QueueTail = request;
+    WakeConditionVariable(&g_QueueNotEmpty);
+}
+
+static void SetFailed(IN const WRITER_FILE* file)
+{
+    AcquireSRWLockExclusive(&g_WriterLock);
+    if (!g_FailedName)
+        g_FailedName = file->Name;
+    ReleaseSRWLockExclusive(&g_WriterLock);
+}
+
+static void ReleaseFile(IN WRITER_FILE* file)
+{
+    if (InterlockedDecrement(&file->References) == 0)
+    {
+        AcquireSRWLockExclusive(&g_WriterLock);
+        Enqueue(&file->CloseRequest);
+        ReleaseSRWLockExclusive(&g_WriterLock);
+    }
+}
+
+static void WriteData(IN WRITE_REQUEST* request)
+{
+    WRITER_FILE* file = request->File;
+    OVERLAPPED overlapped = { 0 };
+    DWORD written;
+
+    // synchronous handle: the offset just positions the write
+    overlapped.Offset = (DWORD)request->Offset;
+    overlapped.OffsetHigh = (DWORD)(request->Offset >> 32);
+
+    if (!WriteFile(file->Handle, request->Data, request->Size, &written, &overlapped) || written != request->Size)
+    {
+        win_perror("WriteFile");
+        SetFailed(file);
+    }
+
+    AcquireSRWLockExclusive(&g_WriterLock);
+    g_FreeBuffers[g_FreeBufferCount++] = CONTAINING_RECORD(request, WRITER_BUFFER, Request);
+    WakeConditionVariable(&g_BufferFree);
+    ReleaseSRWLockExclusive(&g_WriterLock);
+
+    ReleaseFile(file);
+}
+
+static void CloseFile(IN WRITER_FILE* file)
+{
+    if (file->SetTimes && !SetFileTime(file->Handle, NULL, &file->AccessTime, &file->ModificationTime))
+    {
+        win_perror("SetFileTime");
+        SetFailed(file);
+    }
+
+    if (!CloseHandle(file->Handle))
+    {
+        win_perror("CloseHandle");
+        SetFailed(file);
+    }
+
+    AcquireSRWLockExclusive(&g_WriterLock);
+    // the name is kept if it's reported as failed
+    if (file->Name != g_FailedName)
+        free(file->Name);
+    free(file);
+
+    if (--g_OpenFiles == 0)
+        WakeAllConditionVariable(&g_AllClosed);
+    ReleaseSRWLockExclusive(&g_WriterLock);
+}
+
+static DWORD WINAPI WriterThread(IN void* param)
+{
+    UNREFERENCED_PARAMETER(param);
+
+    while (TRUE)
+    {
+        WRITE_REQUEST* request;
+
+        AcquireSRWLockExclusive(&g_WriterLock);
+        while (!g_QueueHead)
+            SleepConditionVariableSRW(&g_QueueNotEmpty, &g_WriterLock, INFINITE, 0);
+
+        request = g_QueueHead;
+        g_QueueHead = request->Next;
+        if (!g_QueueHead)
+            g_QueueTail = NULL;
+        ReleaseSRWLockExclusive(&g_WriterLock);
+
+        if (request->Data)
+            WriteData(request);
+        else
+            CloseFile(request->File);
+    }
+}
+
+DWORD WriterInit(void)
+{
+    if (g_Buffers)
+        return ERROR_SUCCESS;
+
+    g_Buffers = malloc(WRITER_BUFFERS * sizeof(WRITER_BUFFER));
+    if (!g_Buffers)
+        return ERROR_OUTOFMEMORY;
+
+    for (int i = 0; i < WRITER_BUFFERS; i++)
+        g_FreeBuffers[i] = &g_Buffers[i];
+    g_FreeBufferCount = WRITER_BUFFERS;
+
+    for (int i = 0; i < WRITER_THREADS; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, WriterThread, NULL, 0, NULL);
+        if (!thread)
+            return win_perror("CreateThread");
+        CloseHandle(thread);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+WRITER_FILE* WriterOpen(IN HANDLE handle, IN const char* name)
+{
+    WRITER_FILE* file = malloc(sizeof(WRITER_FILE));
+
+    if (file)
+        file->Name = _strdup(name);
+
+    if (!file || !file->Name)
+    {
+        free(file);
+        CloseHandle(handle);
+        return NULL;
+    }
+
+    file->Handle = handle;
+    file->References = 1;
+    file->SetTimes = FALSE;
+    file->CloseRequest.File = file;
+    file->CloseRequest.Data = NULL;
+
+    AcquireSRWLockExclusive(&g_WriterLock);
+    g_OpenFiles++;
+    ReleaseSRWLockExclusive(&g_WriterLock);
+    return file;
+}
+
+BYTE* WriterGetBuffer(void)
+{
+    WRITER_BUFFER* buffer;
+
+    AcquireSRWLockExclusive(&g_WriterLock);
+    while (g_FreeBufferCount == 0)
+        SleepConditionVariableSRW(&g_BufferFree, &g_WriterLock, INFINITE, 0);
+
+    buffer = g_FreeBuffers[--g_FreeBufferCount];
+    ReleaseSRWLockExclusive(&g_WriterLock);
+    return buffer->Data;
+}
+
+void WriterWrite(IN WRITER_FILE* file, IN BYTE* buffer, IN DWORD size, IN UINT64 offset)
+{
+    WRITE_REQUEST* request = &CONTAINING_RECORD(buffer, WRITER_BUFFER, Data)->Request;
+
+    request->File = file;
+    request->Data = buffer;
+    request->Size = size;
+    request->Offset = offset;
+
+    InterlockedIncrement(&file->References);
+    AcquireSRWLockExclusive(&g_WriterLock);
+    Enqueue(request);
+    ReleaseSRWLockExclusive(&g_WriterLock);
+}
+
+void WriterClose(IN WRITER_FILE* file, IN const FILETIME* accessTime OPTIONAL, IN const FILETIME* modificationTime OPTIONAL)
+{
+    // NULL leaves the time unchanged
+    static const FILETIME unchanged = { 0 };
+
+    if (accessTime || modificationTime)
+    {
+        file->AccessTime = accessTime ? *accessTime : unchanged;
+        file->ModificationTime = modificationTime ? *modificationTime : unchanged;
+        file->SetTimes = TRUE;
+    }
+
+    ReleaseFile(file);
+}
+
+BOOL WriterFailed(OUT const char** failedName)
+{
+    AcquireSRWLockShared(&g_WriterLock);
+    *failedName = g_FailedName;
+    ReleaseSRWLockShared(&g_WriterLock);
+    return *failedName != NULL;
+}
+
+BOOL WriterFlush(OUT const char** failedName)
+{
+    AcquireSRWLockExclusive(&g_WriterLock);
+    while (g_OpenFiles > 0)
+        SleepConditionVariableSRW(&g_AllClosed, &g_WriterLock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&g_WriterLock);
+
+    return !WriterFailed(failedName);
+}
@@ -0,0 +1,87 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Pool of threads writing received file data, so that reading the stream doesn't wait
+// for writes and closes (which can be slow, especially with antivirus filters).
+// The reader creates files and fills buffers from a bounded pool, the buffers are written
+// at their offsets by any of the writer threads. A file is closed by a writer thread after
+// the reader is done with it and all of its writes completed, its times are set just before
+// that so that the writes don't change them.
+// The first failure is remembered together with the name of the file it happened to.
+
+#pragma once
+#include <windows.h>
+
+#define WRITER_THREADS     4
+#define WRITER_BUFFERS     32
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef struct _WRITER_FILE WRITER_FILE;
+
+/**
+ * @brief Allocate the buffer pool and start the writer threads, does nothing if they were started already.
+ * @return Error code.
+ */
+DWORD WriterInit(void);
+
+/**
+ * @brief Start writing a file.
+ * @param handle File handle, owned by the writer from now on.
+ * @param name Name of the file as received, reported on errors.
+ * @return File context, NULL if out of memory (the handle is closed then).
+ */
+WRITER_FILE* WriterOpen(IN HANDLE handle, IN const char* name);
+
+/**
+ * @brief Get a free buffer of WRITER_BUFFER_SIZE bytes, waits if there is none.
+ */
+BYTE* WriterGetBuffer(void);
+
+/**
+ * @brief Queue a buffer to be written, it's returned to the pool afterwards.
+ * @param file File context.
+ * @param buffer Buffer from WriterGetBuffer.
+ * @param size Bytes to write.
+ * @param offset File offset to write at.
+ */
+void WriterWrite(IN WRITER_FILE* file, IN BYTE* buffer, IN DWORD size, IN UINT64 offset);
+
+/**
+ * @brief No more data for the file, close it after pending writes complete.
+ * @param file File context.
+ * @param accessTime Last access time to set before closing, optional.
+ * @param modificationTime Last write time to set before closing, optional.
+ */
+void WriterClose(IN WRITER_FILE* file, IN const FILETIME* accessTime OPTIONAL, IN const FILETIME* modificationTime OPTIONAL);
+
+/**
+ * @brief Check if any write failed so far.
+ * @param failedName Receives the name of the first file that failed.
+ * @return TRUE if there was a failure.
+ */
+BOOL WriterFailed(OUT const char** failedName);
+
+/**
+ * @brief Wait until all files are written and closed.
+ * @param failedName Receives the name of the first file that failed.
+ * @return FALSE if there was a failure.
+ */
+BOOL WriterFlush(OUT const char** failedName);
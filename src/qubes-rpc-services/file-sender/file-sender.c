@@ -132,17 +132,6 @@ static void WaitForResult(void)
     }
 }
 
-static void WindowTimeToUnix(IN FILETIME *windowsTime, OUT unsigned int *unixTime, OUT unsigned int *unixTimeNsec)
-{
-    ULARGE_INTEGER tmp;
-
-    tmp.LowPart = windowsTime->dwLowDateTime;
-    tmp.HighPart = windowsTime->dwHighDateTime;
-
-    *unixTimeNsec = (unsigned int) ((tmp.QuadPart % 10000000LL) * 100LL);
-    *unixTime = (unsigned int) ((tmp.QuadPart / 10000000LL) - UNIX_EPOCH_OFFSET);
-}
-
 static void WriteHeaders(IN struct file_header *hdr, IN const WCHAR *fileName)
 {
     char *fileNameUtf8 = NULL;
@@ -182,8 +171,8 @@ static void ProcessSingleFile(IN const WCHAR *fileName, IN DWORD fileAttributes)
     if (!GetFileTime(input, NULL, &accessTime, &modificationTime))
         FcReportError(GetLastError(), L"Cannot get time of file '%s'", fileName);
 
-    WindowTimeToUnix(&accessTime, &hdr.atime, &hdr.atime_nsec);
-    WindowTimeToUnix(&modificationTime, &hdr.mtime, &hdr.mtime_nsec);
+    FcWindowsTimeToUnix(&accessTime, &hdr.atime, &hdr.atime_nsec);
+    FcWindowsTimeToUnix(&modificationTime, &hdr.mtime, &hdr.mtime_nsec);
     SetProgressText(NULL, fileName);
 
     if ((fileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
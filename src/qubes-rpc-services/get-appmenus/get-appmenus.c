@@ -0,0 +1,762 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// qubes.GetAppMenus: list Start Menu shortcuts as .desktop file entries.
+// Resolved shortcuts are kept in a per-user index keyed by path and last write time,
+// so only new or modified shortcuts are loaded through the shell on subsequent calls.
+
+#define COBJMACROS
+#include <windows.h>
+#include <bcrypt.h>
+#include <shlobj.h>
+#include <strsafe.h>
+
+#include <stdio.h>
+#include <io.h>
+#include <fcntl.h>
+
+#include <qubes-io.h>
+#include <utf8-conv.h>
+#include <log.h>
+
+// FIXME hardcoded reg path, use config library
+#define APP_MAP_KEY L"Software\\Invisible Things Lab\\Qubes Tools\\AppMap"
+
+// index location, relative to the user's LocalAppData
+#define INDEX_DIR     L"Invisible Things Lab\\Qubes Tools"
+#define INDEX_FILE    L"appmenus.idx"
+#define INDEX_MAGIC   0x494d4151 // 'QAMI'
+#define INDEX_VERSION 1
+
+#define LINK_EXTENSION    L".lnk"
+#define DESKTOP_EXTENSION L".desktop"
+
+#define SHA1_SIZE     20
+#define SHA1_HEX_SIZE (2 * SHA1_SIZE + 1)
+
+#define DESCRIPTION_SIZE INFOTIPSIZE
+#define LINE_SIZE        (2 * MAX_PATH_LONG + 64) // escaped Exec= line is the longest
+#define OUTPUT_BUFFER_SIZE 65536
+
+#define INDEX_TABLE_MIN_SIZE 256
+
+typedef struct _INDEX_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG Count;
+} INDEX_HEADER;
+
+// followed by Path and Description (WCHARs, not terminated)
+typedef struct _INDEX_RECORD
+{
+    FILETIME LastWrite;
+    BYTE Hash[SHA1_SIZE];
+    USHORT PathLength; // in WCHARs
+    USHORT DescriptionLength; // in WCHARs
+} INDEX_RECORD;
+
+typedef struct _MENU_ENTRY
+{
+    WCHAR* Path;
+    WCHAR* Description;
+    FILETIME LastWrite;
+    BYTE Hash[SHA1_SIZE]; // SHA1 of UTF-8 path, used as the icon name
+} MENU_ENTRY, *PMENU_ENTRY;
+
+typedef struct _MENU_INDEX
+{
+    PMENU_ENTRY Entries;
+    ULONG Count;
+    ULONG Capacity;
+    ULONG* Table; // open addressing, entry index + 1 (0: free slot)
+    ULONG TableSize; // power of 2
+} MENU_INDEX, *PMENU_INDEX;
+
+typedef struct _APPMENUS_STATS
+{
+    ULONG Links;
+    ULONG Cached;
+    ULONG Resolved;
+    ULONG Skipped;
+    ULONG RegistryUpdates;
+} APPMENUS_STATS;
+
+static MENU_INDEX g_Cached; // loaded from disk
+static MENU_INDEX g_Current; // found in this run
+static APPMENUS_STATS g_Stats;
+
+static HKEY g_AppMapKey = NULL;
+static BCRYPT_ALG_HANDLE g_Sha1 = NULL;
+static IShellLinkW* g_ShellLink = NULL; // created on first cache miss
+static IPersistFile* g_LinkFile = NULL;
+static WCHAR* g_Line = NULL;
+
+// FNV-1a
+static ULONG HashPath(IN const WCHAR* path)
+{
+    ULONG hash = 2166136261;
+
+    for (const BYTE* p = (const BYTE*)path; *path; path++)
+    {
+        hash = (hash ^ *p++) * 16777619;
+        hash = (hash ^ *p++) * 16777619;
+    }
+
+    return hash;
+}
+
+static BOOL IndexAdd(IN OUT PMENU_INDEX index, IN const MENU_ENTRY* entry)
+{
+    if (index->Count == index->Capacity)
+    {
+        ULONG capacity = index->Capacity ? 2 * index->Capacity : INDEX_TABLE_MIN_SIZE;
+        PMENU_ENTRY entries = realloc(index->Entries, capacity * sizeof(MENU_ENTRY));
+
+        if (!entries)
+            return FALSE;
+
+        index->Entries = entries;
+        index->Capacity = capacity;
+    }
+
+    index->Entries[index->Count++] = *entry;
+    return TRUE;
+}
+
+static BOOL IndexBuildTable(IN OUT PMENU_INDEX index)
+{
+    ULONG size = INDEX_TABLE_MIN_SIZE;
+
+    while (size < 2 * index->Count)
+        size *= 2;
+
+    index->Table = calloc(size, sizeof(ULONG));
+    if (!index->Table)
+        return FALSE;
+
+    index->TableSize = size;
+    for (ULONG i = 0; i < index->Count; i++)
+    {
+        ULONG slot = HashPath(index->Entries[i].Path) & (size - 1);
+
+        while (index->Table[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+
+        index->Table[slot] = i + 1;
+    }
+
+    return TRUE;
+}
+
+static PMENU_ENTRY IndexFind(IN const MENU_INDEX* index, IN const WCHAR* path)
+{
+    if (!index->Table)
+        return NULL;
+
+    ULONG slot = HashPath(path) & (index->TableSize - 1);
+
+    while (index->Table[slot] != 0)
+    {
+        PMENU_ENTRY entry = &index->Entries[index->Table[slot] - 1];
+
+        if (wcscmp(entry->Path, path) == 0)
+            return entry;
+
+        slot = (slot + 1) & (index->TableSize - 1);
+    }
+
+    return NULL;
+}
+
+static WCHAR* DuplicateString(IN const WCHAR* source, IN size_t length)
+{
+    WCHAR* copy = malloc((length + 1) * sizeof(WCHAR));
+
+    if (copy)
+    {
+        CopyMemory(copy, source, length * sizeof(WCHAR));
+        copy[length] = 0;
+    }
+
+    return copy;
+}
+
+// A missing or damaged index is not an error, all shortcuts are resolved again in that case.
+static void LoadIndex(IN const WCHAR* indexPath, OUT PMENU_INDEX index)
+{
+    HANDLE file;
+    LARGE_INTEGER fileSize;
+    BYTE* data = NULL;
+    DWORD read;
+    INDEX_HEADER header;
+    size_t offset;
+
+    file = CreateFile(indexPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LogDebug("no index at '%s' (0x%x)", indexPath, GetLastError());
+        return;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(header) || fileSize.QuadPart > MAXLONG)
+        goto invalid;
+
+    data = malloc((size_t)fileSize.QuadPart);
+    if (!data)
+        goto invalid;
+
+    if (!ReadFile(file, data, (DWORD)fileSize.QuadPart, &read, NULL) || read != (DWORD)fileSize.QuadPart)
+        goto invalid;
+
+    CopyMemory(&header, data, sizeof(header));
+    if (header.Magic != INDEX_MAGIC || header.Version != INDEX_VERSION)
+        goto invalid;
+
+    offset = sizeof(header);
+    for (ULONG i = 0; i < header.Count; i++)
+    {
+        INDEX_RECORD record;
+        MENU_ENTRY entry;
+
+        if (offset + sizeof(record) > read)
+            goto invalid;
+
+        // records are only WCHAR aligned
+        CopyMemory(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if (record.PathLength == 0 || offset + ((size_t)record.PathLength + record.DescriptionLength) * sizeof(WCHAR) > read)
+            goto invalid;
+
+        entry.Path = DuplicateString((WCHAR*)(data + offset), record.PathLength);
+        offset += record.PathLength * sizeof(WCHAR);
+        entry.Description = DuplicateString((WCHAR*)(data + offset), record.DescriptionLength);
+        offset += record.DescriptionLength * sizeof(WCHAR);
+        entry.LastWrite = record.LastWrite;
+        CopyMemory(entry.Hash, record.Hash, SHA1_SIZE);
+
+        if (!entry.Path || !entry.Description || !IndexAdd(index, &entry))
+            goto invalid;
+    }
+
+    if (!IndexBuildTable(index))
+        goto invalid;
+
+    LogDebug("loaded %lu index entries", index->Count);
+    free(data);
+    CloseHandle(file);
+    return;
+
+invalid:
+    LogWarning("ignoring invalid index '%s'", indexPath);
+    // Everything will be cleaned up upon process exit.
+    index->Count = 0;
+    free(data);
+    CloseHandle(file);
+}
+
+// Written to a temporary file first so a reader never sees a partial index.
+static DWORD SaveIndex(IN const WCHAR* indexPath, IN const MENU_INDEX* index)
+{
+    static WCHAR tempPath[MAX_PATH_LONG];
+    HANDLE file;
+    DWORD status = ERROR_SUCCESS;
+    DWORD written;
+    INDEX_HEADER header = { INDEX_MAGIC, INDEX_VERSION, index->Count };
+
+    if (FAILED(status = StringCchPrintf(tempPath, ARRAYSIZE(tempPath), L"%s.tmp", indexPath)))
+        return win_perror2(status, "formatting index path");
+
+    file = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return win_perror("CreateFile(index)");
+
+    if (!WriteFile(file, &header, sizeof(header), &written, NULL))
+    {
+        status = win_perror("WriteFile(index header)");
+        goto cleanup;
+    }
+
+    for (ULONG i = 0; i < index->Count; i++)
+    {
+        const MENU_ENTRY* entry = &index->Entries[i];
+        INDEX_RECORD record;
+
+        record.LastWrite = entry->LastWrite;
+        CopyMemory(record.Hash, entry->Hash, SHA1_SIZE);
+        record.PathLength = (USHORT)wcslen(entry->Path);
+        record.DescriptionLength = (USHORT)wcslen(entry->Description);
+
+        if (!WriteFile(file, &record, sizeof(record), &written, NULL) ||
+            !WriteFile(file, entry->Path, record.PathLength * sizeof(WCHAR), &written, NULL) ||
+            !WriteFile(file, entry->Description, record.DescriptionLength * sizeof(WCHAR), &written, NULL))
+        {
+            status = win_perror("WriteFile(index record)");
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    CloseHandle(file);
+    if (status == ERROR_SUCCESS)
+    {
+        if (!MoveFileEx(tempPath, indexPath, MOVEFILE_REPLACE_EXISTING))
+            status = win_perror("MoveFileEx(index)");
+    }
+
+    if (status != ERROR_SUCCESS)
+        DeleteFile(tempPath);
+
+    return status;
+}
+
+static DWORD GetIndexPath(OUT WCHAR* indexPath, IN size_t indexPathLength)
+{
+    WCHAR* appDataPath = NULL;
+    HRESULT hresult;
+    int status;
+
+    hresult = SHGetKnownFolderPath(&FOLDERID_LocalAppData, KF_FLAG_CREATE, NULL, &appDataPath);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "getting LocalAppData path");
+
+    hresult = StringCchPrintf(indexPath, indexPathLength, L"%s\\%s", appDataPath, INDEX_DIR);
+    CoTaskMemFree(appDataPath);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "formatting index path");
+
+    status = SHCreateDirectoryEx(NULL, indexPath, NULL);
+    if (status != ERROR_SUCCESS && status != ERROR_ALREADY_EXISTS)
+        return win_perror2(status, "creating index directory");
+
+    hresult = StringCchCat(indexPath, indexPathLength, L"\\" INDEX_FILE);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "formatting index path");
+
+    return ERROR_SUCCESS;
+}
+
+static DWORD HashPathSha1(IN const WCHAR* path, OUT BYTE* hash)
+{
+    char* pathUtf8 = NULL;
+    size_t pathUtf8Length = 0;
+    DWORD status;
+    NTSTATUS ntStatus;
+
+    if (!g_Sha1)
+    {
+        ntStatus = BCryptOpenAlgorithmProvider(&g_Sha1, BCRYPT_SHA1_ALGORITHM, NULL, 0);
+        if (!BCRYPT_SUCCESS(ntStatus))
+        {
+            g_Sha1 = NULL;
+            return win_perror2(ntStatus, "BCryptOpenAlgorithmProvider(SHA1)");
+        }
+    }
+
+    status = ConvertUTF16ToUTF8Static(path, &pathUtf8, &pathUtf8Length);
+    if (status != ERROR_SUCCESS)
+        return win_perror2(status, "ConvertUTF16ToUTF8Static(path)");
+
+    ntStatus = BCryptHash(g_Sha1, NULL, 0, (BYTE*)pathUtf8, (ULONG)strlen(pathUtf8), hash, SHA1_SIZE);
+    if (!BCRYPT_SUCCESS(ntStatus))
+        return win_perror2(ntStatus, "BCryptHash");
+
+    return ERROR_SUCCESS;
+}
+
+static DWORD ResolveLink(IN const WCHAR* path, OUT WCHAR* description, IN int descriptionLength)
+{
+    HRESULT hresult;
+
+    if (!g_ShellLink)
+    {
+        hresult = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER, &IID_IShellLinkW, (void**)&g_ShellLink);
+        if (FAILED(hresult))
+            return win_perror2(hresult, "CoCreateInstance(ShellLink)");
+
+        hresult = IShellLinkW_QueryInterface(g_ShellLink, &IID_IPersistFile, (void**)&g_LinkFile);
+        if (FAILED(hresult))
+        {
+            IShellLinkW_Release(g_ShellLink);
+            g_ShellLink = NULL;
+            return win_perror2(hresult, "QueryInterface(IPersistFile)");
+        }
+    }
+
+    hresult = IPersistFile_Load(g_LinkFile, path, STGM_READ);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "loading shortcut");
+
+    hresult = IShellLinkW_GetDescription(g_ShellLink, description, descriptionLength);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "IShellLink::GetDescription");
+
+    // output is line based
+    for (WCHAR* c = description; *c; c++)
+    {
+        if (*c < L' ')
+            *c = L' ';
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Only write the value if it's missing or different, every write dirties the hive and notifies watchers.
+static DWORD UpdateAppMap(IN const WCHAR* name, IN const WCHAR* path)
+{
+    static WCHAR value[MAX_PATH_LONG];
+    DWORD valueSize = sizeof(value);
+    DWORD valueType;
+    DWORD pathSize = (DWORD)(wcslen(path) + 1) * sizeof(WCHAR);
+    LSTATUS status;
+
+    status = RegQueryValueEx(g_AppMapKey, name, NULL, &valueType, (BYTE*)value, &valueSize);
+    if (status == ERROR_SUCCESS && valueType == REG_SZ && valueSize == pathSize && memcmp(value, path, pathSize) == 0)
+        return ERROR_SUCCESS;
+
+    status = RegSetValueEx(g_AppMapKey, name, 0, REG_SZ, (const BYTE*)path, pathSize);
+    if (status != ERROR_SUCCESS)
+        return win_perror2(status, "RegSetValueEx(AppMap)");
+
+    g_Stats.RegistryUpdates++;
+    return ERROR_SUCCESS;
+}
+
+static void PrintLine(IN const WCHAR* format, ...)
+{
+    va_list args;
+    char* lineUtf8 = NULL;
+    DWORD status;
+
+    va_start(args, format);
+    status = StringCchVPrintf(g_Line, LINE_SIZE, format, args);
+    va_end(args);
+
+    if (FAILED(status))
+    {
+        win_perror2(status, "formatting output");
+        return;
+    }
+
+    status = ConvertUTF16ToUTF8Static(g_Line, &lineUtf8, NULL);
+    if (status != ERROR_SUCCESS)
+    {
+        win_perror2(status, "ConvertUTF16ToUTF8Static(line)");
+        return;
+    }
+
+    fputs(lineUtf8, stdout);
+}
+
+// relativePath: path of the shortcut relative to the menu root
+static DWORD ProcessLink(IN const WCHAR* fullPath, IN const WCHAR* relativePath, IN const WIN32_FIND_DATA* findData)
+{
+    // single threaded, keep the big buffers off the stack
+    static WCHAR desktopName[MAX_PATH_LONG];
+    static WCHAR location[MAX_PATH_LONG];
+    static WCHAR execPath[2 * MAX_PATH_LONG];
+    WCHAR hashHex[SHA1_HEX_SIZE];
+    WCHAR description[DESCRIPTION_SIZE] = { 0 };
+    const WCHAR* fileName;
+    size_t baseNameLength;
+    size_t length;
+    size_t i;
+    MENU_ENTRY entry = { 0 };
+    PMENU_ENTRY cached;
+    DWORD status;
+
+    g_Stats.Links++;
+
+    cached = IndexFind(&g_Cached, fullPath);
+    if (cached && CompareFileTime(&cached->LastWrite, &findData->ftLastWriteTime) == 0)
+    {
+        entry = *cached;
+        g_Stats.Cached++;
+    }
+    else
+    {
+        status = HashPathSha1(fullPath, entry.Hash);
+        if (status != ERROR_SUCCESS)
+            return status;
+
+        entry.Description = description;
+        if (ResolveLink(fullPath, description, ARRAYSIZE(description)) == ERROR_SUCCESS)
+        {
+            entry.Path = _wcsdup(fullPath);
+            entry.Description = _wcsdup(description);
+            if (!entry.Path || !entry.Description)
+                return ERROR_OUTOFMEMORY;
+
+            entry.LastWrite = findData->ftLastWriteTime;
+            g_Stats.Resolved++;
+        }
+        else
+        {
+            // listed without a description, but not indexed so that it's resolved again next time
+            LogWarning("failed to resolve '%s', no description", fullPath);
+            description[0] = 0;
+        }
+    }
+
+    if (entry.Path && !IndexAdd(&g_Current, &entry))
+        return ERROR_OUTOFMEMORY;
+
+    for (i = 0; i < SHA1_SIZE; i++)
+        StringCchPrintf(hashHex + 2 * i, 3, L"%02x", entry.Hash[i]);
+
+    // desktop file name: relative path with spaces and path separators replaced, without the extension
+    length = wcslen(relativePath) - wcslen(LINK_EXTENSION);
+    for (i = 0; i < length; i++)
+    {
+        if (relativePath[i] == L' ')
+            desktopName[i] = L'_';
+        else if (relativePath[i] == L'\\')
+            desktopName[i] = L'-';
+        else
+            desktopName[i] = relativePath[i];
+    }
+    desktopName[length] = 0;
+
+    // menu location: relative directory with path separators replaced, followed by a space
+    fileName = wcsrchr(relativePath, L'\\');
+    if (fileName)
+    {
+        length = fileName - relativePath;
+        for (i = 0; i < length; i++)
+            location[i] = relativePath[i] == L'\\' ? L'-' : relativePath[i];
+        location[length++] = L' ';
+        location[length] = 0;
+        fileName++;
+    }
+    else
+    {
+        location[0] = 0;
+        fileName = relativePath;
+    }
+    baseNameLength = wcslen(fileName) - wcslen(LINK_EXTENSION);
+
+    // Exec value needs escaped backslashes
+    length = 0;
+    for (i = 0; fullPath[i]; i++)
+    {
+        if (fullPath[i] == L'\\')
+            execPath[length++] = L'\\';
+        execPath[length++] = fullPath[i];
+    }
+    execPath[length] = 0;
+
+    // Icon name is the path hash since the name can't contain some characters that can be in a file path
+    // and the GetImageRGBA Qubes service needs to retrieve bitmap from this name alone.
+    status = UpdateAppMap(hashHex, fullPath);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    // also basename -> path for qubes.StartApp
+    status = UpdateAppMap(desktopName, fullPath);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    LogDebug("%s -> %s", hashHex, fullPath);
+
+    PrintLine(L"%s" DESKTOP_EXTENSION L":Name=%s%.*s\n", desktopName, location, (int)baseNameLength, fileName);
+    PrintLine(L"%s" DESKTOP_EXTENSION L":Exec=cmd.exe /c \"%s\"\n", desktopName, execPath);
+    PrintLine(L"%s" DESKTOP_EXTENSION L":Comment=%s\n", desktopName, entry.Description);
+    PrintLine(L"%s" DESKTOP_EXTENSION L":Icon=%s\n", desktopName, hashHex);
+
+    return ERROR_SUCCESS;
+}
+
+static BOOL IsLink(IN const WCHAR* fileName)
+{
+    size_t length = wcslen(fileName);
+    size_t extensionLength = wcslen(LINK_EXTENSION);
+
+    return length > extensionLength && _wcsicmp(fileName + length - extensionLength, LINK_EXTENSION) == 0;
+}
+
+// path: MAX_PATH_LONG buffer, restored on return
+static DWORD ScanDirectory(IN OUT WCHAR* path, IN size_t rootLength)
+{
+    WIN32_FIND_DATA findData;
+    HANDLE find;
+    size_t pathLength = wcslen(path);
+    DWORD status = ERROR_SUCCESS;
+
+    if (FAILED(StringCchCat(path, MAX_PATH_LONG, L"\\*")))
+    {
+        path[pathLength] = 0;
+        return ERROR_FILENAME_EXCED_RANGE;
+    }
+
+    find = FindFirstFileEx(path, FindExInfoBasic, &findData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    path[pathLength] = 0;
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        status = GetLastError();
+        if (status == ERROR_FILE_NOT_FOUND || status == ERROR_PATH_NOT_FOUND)
+            return ERROR_SUCCESS;
+        return win_perror2(status, "FindFirstFileEx");
+    }
+
+    do
+    {
+        if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+            continue;
+
+        // same items as Get-ChildItem without -Force
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN)
+            continue;
+
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                continue;
+        }
+        else if (!IsLink(findData.cFileName))
+        {
+            continue;
+        }
+
+        if (FAILED(StringCchPrintf(path + pathLength, MAX_PATH_LONG - pathLength, L"\\%s", findData.cFileName)))
+        {
+            LogWarning("path too long: '%s\\%s'", path, findData.cFileName);
+            path[pathLength] = 0;
+            continue;
+        }
+
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            status = ScanDirectory(path, rootLength);
+        }
+        else
+        {
+            status = ProcessLink(path, path + rootLength + 1, &findData);
+            // one bad shortcut shouldn't hide the rest of the menu
+            if (status != ERROR_SUCCESS && status != ERROR_OUTOFMEMORY)
+            {
+                LogWarning("skipping '%s' (0x%x)", path, status);
+                g_Stats.Skipped++;
+                status = ERROR_SUCCESS;
+            }
+        }
+
+        path[pathLength] = 0;
+    } while (status == ERROR_SUCCESS && FindNextFile(find, &findData));
+
+    if (status == ERROR_SUCCESS)
+    {
+        status = GetLastError();
+        if (status == ERROR_NO_MORE_FILES)
+            status = ERROR_SUCCESS;
+        else
+            win_perror2(status, "FindNextFile");
+    }
+
+    FindClose(find);
+    return status;
+}
+
+static DWORD ScanMenu(IN REFKNOWNFOLDERID folderId, IN OUT WCHAR* path)
+{
+    WCHAR* folderPath = NULL;
+    HRESULT hresult;
+
+    hresult = SHGetKnownFolderPath(folderId, 0, NULL, &folderPath);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "SHGetKnownFolderPath");
+
+    hresult = StringCchCopy(path, MAX_PATH_LONG, folderPath);
+    CoTaskMemFree(folderPath);
+    if (FAILED(hresult))
+        return win_perror2(hresult, "formatting menu path");
+
+    LogDebug("scanning '%s'", path);
+    return ScanDirectory(path, wcslen(path));
+}
+
+// Index needs to be rewritten if any shortcut was added, modified or removed.
+static BOOL IndexChanged(void)
+{
+    return g_Stats.Resolved > 0 || g_Current.Count != g_Cached.Count;
+}
+
+int wmain(int argc, WCHAR *argv[])
+{
+    DWORD status = ERROR_OUTOFMEMORY;
+    ULONG64 start = GetTickCount64();
+    WCHAR* indexPath = malloc(MAX_PATH_LONG_WSIZE);
+    WCHAR* path = malloc(MAX_PATH_LONG_WSIZE);
+    BOOL indexAvailable;
+
+    g_Line = malloc(LINE_SIZE * sizeof(WCHAR));
+    if (!indexPath || !path || !g_Line)
+        goto cleanup;
+
+    // Set stdout to binary mode to prevent newline conversions.
+    (void)_setmode(_fileno(stdout), _O_BINARY);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    (void)CoInitialize(NULL);
+
+    status = RegCreateKeyEx(HKEY_CURRENT_USER, APP_MAP_KEY, 0, NULL, 0, KEY_QUERY_VALUE | KEY_SET_VALUE, NULL, &g_AppMapKey, NULL);
+    if (status != ERROR_SUCCESS)
+    {
+        win_perror2(status, "RegCreateKeyEx(AppMap key)");
+        goto cleanup;
+    }
+
+    // An index path on the command line replaces the per-user one, for benchmarks.
+    if (argc > 1)
+        indexAvailable = SUCCEEDED(StringCchCopy(indexPath, MAX_PATH_LONG, argv[1]));
+    else
+        indexAvailable = GetIndexPath(indexPath, MAX_PATH_LONG) == ERROR_SUCCESS;
+    if (indexAvailable)
+        LoadIndex(indexPath, &g_Cached);
+
+    // "All users" menu
+    status = ScanMenu(&FOLDERID_CommonPrograms, path);
+    if (status != ERROR_SUCCESS)
+        goto cleanup;
+
+    // Current user menu
+    status = ScanMenu(&FOLDERID_StartMenu, path);
+    if (status != ERROR_SUCCESS)
+        goto cleanup;
+
+    // apparently stdout is not flushed automatically on process exit if in binary mode...
+    fflush(stdout);
+
+    if (indexAvailable && IndexChanged())
+    {
+        // not fatal, the next call will resolve everything again
+        if (SaveIndex(indexPath, &g_Current) != ERROR_SUCCESS)
+            LogWarning("failed to save index '%s'", indexPath);
+    }
+
+    LogInfo("%lu shortcuts (%lu cached, %lu resolved, %lu skipped), %lu registry values updated, %llu ms",
+        g_Stats.Links, g_Stats.Cached, g_Stats.Resolved, g_Stats.Skipped, g_Stats.RegistryUpdates, GetTickCount64() - start);
+
+cleanup:
+    // Everything will be cleaned up upon process exit.
+    LogDebug("returning %lu", status);
+    return status;
+}
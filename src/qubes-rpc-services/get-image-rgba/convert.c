@@ -0,0 +1,52 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <emmintrin.h>
+
+#include "convert.h"
+#include "icon-cache.h"
+
+void ConvertToRgba(IN OUT BYTE* pixels, IN size_t count)
+{
+    size_t i;
+
+    // Swap B and R, four pixels at a time (SSE2 is always available on x64).
+    const __m128i redBlue = _mm_set1_epi32(0x00ff00ff);
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m128i bgra = _mm_loadu_si128((const __m128i*)(pixels + i * ICON_BYTES_PER_PIXEL));
+        __m128i rb = _mm_and_si128(bgra, redBlue);
+        __m128i ga = _mm_andnot_si128(redBlue, bgra);
+
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i*)(pixels + i * ICON_BYTES_PER_PIXEL), _mm_or_si128(ga, rb));
+    }
+
+    for (; i < count; i++)
+    {
+        BYTE* pixel = pixels + i * ICON_BYTES_PER_PIXEL;
+        BYTE blue = pixel[0];
+
+        pixel[0] = pixel[2];
+        pixel[2] = blue;
+    }
+}
@@ -19,11 +19,27 @@
  *
  */
 
+// qubes.GetImageRGBA: input is an icon name ("xdgicon:<AppMap hash>"), output is
+// "<width> <height>\n" followed by width * height * 4 bytes of RGBA pixel data (straight alpha),
+// rows top to bottom.
+// The name may end with "@<size>" to request an icon of at most size x size pixels.
+// The closest system image list is used and the icon is downscaled if it's still bigger.
+//
+// Batch mode (-b, qubes.GetImageRGBABatch): input is a list of icon names, one per line.
+// For each name, in order, the output is "<name> <width> <height>\n" followed by the pixel
+// data as above. Icons that can't be retrieved are reported as "<name> 0 0\n" without data.
+// Names are processed as they arrive, there is no limit on their number.
+//
+// Extracted icons are cached, see icon-cache.h.
+
 #include <windows.h>
 #include <shlwapi.h>
 #include <shellapi.h>
+#include <shlobj.h>
 #include <strsafe.h>
 #include <commctrl.h>
+#include <initguid.h> // IID_IImageList
+#include <commoncontrols.h>
 
 #include <stdio.h>
 #include <io.h>
@@ -33,117 +49,251 @@
 #include <utf8-conv.h>
 #include <log.h>
 
+#include "convert.h"
+#include "icon-cache.h"
+#include "resample.h"
+
 //#define WRITE_PPM
 
 // FIXME hardcoded reg path, use config library
 #define APP_MAP_KEY L"Software\\Invisible Things Lab\\Qubes Tools\\AppMap"
 #define INPUT_PREFIX "xdgicon:"
 
-// returns appmap hash
-WCHAR* GetShortcutPath(OUT WCHAR *linkPath, IN DWORD linkPathLength)
+#define NAME_SIZE          64
+#define BATCH_LINE_SIZE    4096 // longest accepted name in batch mode
+#define OUTPUT_BUFFER_SIZE 65536
+#define SIZE_SEPARATOR     L'@'
+#define MAX_REQUESTED_SIZE 256 // jumbo system icons
+
+typedef struct _SYSTEM_IMAGE_LIST
 {
-    DWORD status = ERROR_SUCCESS;
-    HKEY key = NULL;
+    int Id; // SHIL_*
+    HIMAGELIST List; // NULL until loaded
+    int Size;
+} SYSTEM_IMAGE_LIST;
+
+// ascending icon size
+static SYSTEM_IMAGE_LIST g_ImageLists[] =
+{
+    { SHIL_SMALL, NULL, 0 },
+    { SHIL_LARGE, NULL, 0 },
+    { SHIL_EXTRALARGE, NULL, 0 },
+    { SHIL_JUMBO, NULL, 0 },
+};
+
+static HKEY g_AppMapKey = NULL;
+static WCHAR* g_LinkPath = NULL;
+static ULONG g_CacheHits = 0;
+
+// Strip whitespaces at the end.
+static void StripLine(IN OUT char* line)
+{
+    size_t length = strlen(line);
+
+    while (length > 0 && isspace((unsigned char)line[length - 1]))
+        line[--length] = 0;
+}
+
+// Input is in the form of: xdgicon:name[@size]
+// Name is a sha1 hash of the file in this case, we'll look it up in the registry.
+// It's set by GetAppMenus Qubes service.
+// size: requested icon size, 0 if not specified
+static DWORD GetShortcutPath(IN const char* input, OUT WCHAR* name, IN size_t nameLength, OUT ULONG* size, OUT WCHAR* linkPath, IN DWORD linkPathLength)
+{
+    DWORD status;
     WCHAR* valueName = NULL;
+    WCHAR* separator;
+    DWORD valueSize;
+    DWORD valueType;
 
-    // Input is in the form of: xdgicon:name
-    // Name is a sha1 hash of the file in this case, we'll look it up in the registry.
-    // It's set by GetAppMenus Qubes service.
-    char param[64] = { 0 };
-    DWORD size = QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), param, sizeof(param) - 1);
-    if (size == 0)
+    LogDebug("input: '%S'", input);
+
+    if (strncmp(input, INPUT_PREFIX, strlen(INPUT_PREFIX)) != 0)
     {
-        status = win_perror("QioReadUntilEof(stdin)");
-        goto cleanup;
+        LogError("invalid icon name '%S'", input);
+        return ERROR_INVALID_PARAMETER;
     }
 
-    LogDebug("input: '%S'", param);
+    status = ConvertUTF8ToUTF16Static(input + strlen(INPUT_PREFIX), &valueName, NULL);
+    if (status != ERROR_SUCCESS)
+        return win_perror2(status, "ConvertUTF8ToUTF16Static");
 
-    // Strip whitespaces at the end.
-    for (size_t i = ARRAYSIZE(param) - 1; i > 0; i--)
+    *size = 0;
+    separator = wcschr(valueName, SIZE_SEPARATOR);
+    if (separator)
     {
-        if (param[i] == 0)
-            continue;
-
-        if (isspace(param[i]))
+        *separator = 0;
+        *size = wcstoul(separator + 1, NULL, 10);
+        if (*size == 0)
         {
-            param[i] = 0;
+            LogError("invalid icon size in '%S'", input);
+            return ERROR_INVALID_PARAMETER;
         }
-        else
+
+        *size = min(*size, MAX_REQUESTED_SIZE);
+    }
+
+    if (FAILED(status = StringCchCopy(name, nameLength, valueName)))
+        return win_perror2(status, "copying icon name");
+
+    if (!g_AppMapKey)
+    {
+        status = RegOpenKeyEx(HKEY_CURRENT_USER, APP_MAP_KEY, 0, KEY_READ, &g_AppMapKey);
+        if (status != ERROR_SUCCESS)
         {
-            break; // stop on first non-space character
+            g_AppMapKey = NULL;
+            return win_perror2(status, "RegOpenKeyEx(AppMap key)");
         }
     }
 
-    status = ConvertUTF8ToUTF16Static(param, &valueName, NULL);
+    valueSize = linkPathLength * sizeof(WCHAR); // buffer size
+    status = RegQueryValueEx(g_AppMapKey, name, NULL, &valueType, (BYTE *) linkPath, &valueSize);
     if (status != ERROR_SUCCESS)
+        return win_perror2(status, "RegQueryValueEx");
+
+    if (valueType != REG_SZ)
     {
-        win_perror2(status, "ConvertUTF8ToUTF16Static");
-        goto cleanup;
+        LogError("AppMap(%s) registry value has incorrect format (0x%x)", name, valueType);
+        return ERROR_DATATYPE_MISMATCH;
     }
 
-    LogDebug("input converted: '%s'", valueName);
+    return ERROR_SUCCESS;
+}
 
-    status = RegOpenKeyEx(HKEY_CURRENT_USER, APP_MAP_KEY, 0, KEY_READ, &key);
-    if (status != ERROR_SUCCESS)
+static BOOL HasAlpha(IN const BYTE* pixels, IN size_t count)
+{
+    for (size_t i = 0; i < count; i++)
     {
-        win_perror2(status, "RegOpenKeyEx(AppMap key)");
-        goto cleanup;
+        if (pixels[i * ICON_BYTES_PER_PIXEL + 3] != 0)
+            return TRUE;
     }
 
-    size = linkPathLength * sizeof(WCHAR); // buffer size
-    DWORD valueType;
-    status = RegQueryValueEx(key, valueName + strlen(INPUT_PREFIX), NULL, &valueType, (BYTE *) linkPath, &size);
-    if (status != ERROR_SUCCESS)
+    return FALSE;
+}
+
+// Icons without an alpha channel (24 bpp and older) get alpha from the AND mask,
+// set mask bits are transparent.
+static DWORD ApplyMask(IN HDC dc, IN HBITMAP mask, IN OUT BYTE* pixels, IN LONG width, IN LONG height)
+{
+    BITMAP bm;
+    BITMAPINFO bmi;
+    BYTE* maskPixels;
+    DWORD status = ERROR_SUCCESS;
+    size_t count = (size_t)width * height;
+
+    if (!mask || !GetObject(mask, sizeof(bm), &bm) || bm.bmWidth != width || bm.bmHeight != height)
+        return ERROR_INVALID_DATA;
+
+    maskPixels = malloc(count * ICON_BYTES_PER_PIXEL);
+    if (!maskPixels)
+        return ERROR_OUTOFMEMORY;
+
+    // expanded to 32 bpp: white for set bits, black otherwise
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = ICON_BYTES_PER_PIXEL * 8;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    if (GetDIBits(dc, mask, 0, height, maskPixels, &bmi, DIB_RGB_COLORS) != height)
     {
-        win_perror2(status, "RegQueryValueEx");
-        goto cleanup;
+        status = win_perror("GetDIBits(mask)");
     }
-
-    if (valueType != REG_SZ)
+    else
     {
-        status = ERROR_DATATYPE_MISMATCH;
-        LogError("AppMap(%s) registry value has incorrect format (0x%x)", valueName + strlen(INPUT_PREFIX), valueType);
-        goto cleanup;
+        for (size_t i = 0; i < count; i++)
+            pixels[i * ICON_BYTES_PER_PIXEL + 3] = maskPixels[i * ICON_BYTES_PER_PIXEL] ? 0 : 0xff;
     }
 
-    status = ERROR_SUCCESS;
+    free(maskPixels);
+    return status;
+}
 
-cleanup:
-    if (key)
-        RegCloseKey(key);
-    SetLastError(status);
-    if (status == ERROR_SUCCESS)
-        valueName += strlen(INPUT_PREFIX);
-    else
-        valueName = NULL;
-    return valueName; // this value is a static buffer in ConvertUTF* library functions
+// Smallest system image list with icons at least as big as requested, or the biggest one.
+static HIMAGELIST GetImageList(IN ULONG size)
+{
+    HIMAGELIST best = NULL;
+
+    for (size_t i = 0; i < ARRAYSIZE(g_ImageLists); i++)
+    {
+        SYSTEM_IMAGE_LIST* imageList = &g_ImageLists[i];
+        int height;
+
+        if (!imageList->List)
+        {
+            HIMAGELIST list = NULL;
+
+            // IImageList can be used as HIMAGELIST
+            if (FAILED(SHGetImageList(imageList->Id, &IID_IImageList, (void**)&list)) ||
+                !ImageList_GetIconSize(list, &imageList->Size, &height))
+            {
+                continue;
+            }
+
+            imageList->List = list;
+            LogDebug("image list %d: %d px", imageList->Id, imageList->Size);
+        }
+
+        best = imageList->List;
+        if ((ULONG)imageList->Size >= size)
+            break;
+    }
+
+    return best;
 }
 
-int wmain(int argc, WCHAR *argv[])
+static DWORD Downscale(IN OUT PICON_IMAGE image, IN ULONG size)
 {
-    UNREFERENCED_PARAMETER(argc);
-    UNREFERENCED_PARAMETER(argv);
+    ULONG width = image->Width;
+    ULONG height = image->Height;
+    BYTE* pixels;
+    DWORD status;
 
-    DWORD status = ERROR_OUTOFMEMORY;
-    WCHAR* linkPath = malloc(MAX_PATH_LONG_WSIZE);
-    if (!linkPath)
-        goto cleanup;
+    // keep the aspect ratio
+    if (width >= height)
+    {
+        height = max(1, height * size / width);
+        width = size;
+    }
+    else
+    {
+        width = max(1, width * size / height);
+        height = size;
+    }
 
-    // Set stdout to binary mode to prevent newline conversions.
-    (void)_setmode(_fileno(stdout), _O_BINARY);
+    pixels = malloc((size_t)width * height * ICON_BYTES_PER_PIXEL);
+    if (!pixels)
+        return ERROR_OUTOFMEMORY;
 
-    // Read input and convert it to the shortcut path.
-    WCHAR* hash = GetShortcutPath(linkPath, MAX_PATH_LONG);
-    if (!hash)
+    status = ResampleRgba(image->Pixels, image->Width, image->Height, pixels, width, height);
+    if (status != ERROR_SUCCESS)
     {
-        win_perror("GetShortcutPath");
-        goto cleanup;
+        free(pixels);
+        return win_perror2(status, "ResampleRgba");
     }
 
-    LogDebug("LinkPath: %s", linkPath);
+    LogDebug("downscaled %lux%lu -> %lux%lu", image->Width, image->Height, width, height);
+    free(image->Pixels);
+    image->Pixels = pixels;
+    image->Width = width;
+    image->Height = height;
+    return ERROR_SUCCESS;
+}
+
+// size: requested icon size, 0 for the default system icon size
+static DWORD RenderIcon(IN const WCHAR* linkPath, IN ULONG size, OUT PICON_IMAGE image)
+{
+    DWORD status = ERROR_SUCCESS;
+    HICON ico = NULL;
+    ICONINFO ii = { 0 };
+    HDC dc = NULL;
+    BITMAP bm;
+    BITMAPINFO bmi;
+    BYTE* buffer = NULL;
+    size_t count;
 
-    (void)CoInitialize(NULL);
     // We use SHGFI_SYSICONINDEX and load the icon manually later, because icons retrieved by
     // SHGFI_ICON always have the shortcut arrow overlay even if the overlay is not visible
     // normally (eg. for start menu shortcuts).
@@ -152,106 +302,305 @@ int wmain(int argc, WCHAR *argv[])
     HIMAGELIST imgList = (HIMAGELIST)SHGetFileInfo(linkPath, 0, &shfi, sizeof(shfi), SHGFI_SYSICONINDEX);
     LogDebug("shfi.iIcon=%d", shfi.iIcon);
     if (!imgList)
+        return win_perror("SHGetFileInfo(SHGFI_SYSICONINDEX)");
+
+    // icon indexes are the same in all system image lists
+    if (size != 0)
     {
-        status = win_perror("SHGetFileInfo(SHGFI_SYSICONINDEX)");
-        goto cleanup;
+        HIMAGELIST sizedList = GetImageList(size);
+        if (sizedList)
+            imgList = sizedList;
     }
 
     // Retrieve the icon directly from the system image list
-    HICON ico = ImageList_GetIcon(imgList, shfi.iIcon, ILD_TRANSPARENT);
+    ico = ImageList_GetIcon(imgList, shfi.iIcon, ILD_TRANSPARENT);
     if (!ico)
-    {
-        status = win_perror("ImageList_GetIcon(ILD_TRANSPARENT)");
-        goto cleanup;
-    }
+        return win_perror("ImageList_GetIcon(ILD_TRANSPARENT)");
 
     // Create bitmap for the icon.
-    ICONINFO ii;
     if (!GetIconInfo(ico, &ii))
     {
         status = win_perror("GetIconInfo");
         goto cleanup;
     }
 
-    HDC dc = CreateCompatibleDC(NULL);
-    SelectObject(dc, ii.hbmColor);
+    dc = CreateCompatibleDC(NULL);
+    if (!dc)
+    {
+        status = win_perror("CreateCompatibleDC");
+        goto cleanup;
+    }
 
     // Retrieve the color bitmap of the icon.
-    BITMAP bm;
-    GetObject(ii.hbmColor, sizeof(bm), &bm);
+    if (!GetObject(ii.hbmColor, sizeof(bm), &bm))
+    {
+        status = win_perror("GetObject(icon bitmap)");
+        goto cleanup;
+    }
+
+    if (bm.bmWidth <= 0 || bm.bmWidth > ICON_MAX_DIMENSION || bm.bmHeight <= 0 || bm.bmHeight > ICON_MAX_DIMENSION)
+    {
+        LogError("unexpected icon size %dx%d", bm.bmWidth, bm.bmHeight);
+        status = ERROR_INVALID_DATA;
+        goto cleanup;
+    }
 
-    size_t size = bm.bmBitsPixel / 8 * bm.bmHeight * bm.bmWidth; // pixel buffer size
-    BYTE* buffer = (BYTE *) malloc(size); // pixel buffer
+    buffer = malloc((size_t)bm.bmWidth * bm.bmHeight * ICON_BYTES_PER_PIXEL); // pixel buffer
     if (!buffer)
-        exit(ERROR_OUTOFMEMORY);
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto cleanup;
+    }
 
-    BITMAPINFO bmi;
     ZeroMemory(&bmi, sizeof(bmi));
     bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
     bmi.bmiHeader.biWidth = bm.bmWidth;
-    bmi.bmiHeader.biHeight = bm.bmHeight;
-    bmi.bmiHeader.biPlanes = bm.bmPlanes;
-    bmi.bmiHeader.biBitCount = bm.bmBitsPixel;
+    bmi.bmiHeader.biHeight = -bm.bmHeight; // top-down, same row order as the output
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = ICON_BYTES_PER_PIXEL * 8;
+    bmi.bmiHeader.biCompression = BI_RGB;
 
     // Copy pixel buffer.
-    GetDIBits(dc, ii.hbmColor, 0, bm.bmHeight, buffer, &bmi, DIB_RGB_COLORS);
+    if (GetDIBits(dc, ii.hbmColor, 0, bm.bmHeight, buffer, &bmi, DIB_RGB_COLORS) != bm.bmHeight)
+    {
+        status = win_perror("GetDIBits");
+        goto cleanup;
+    }
 
     LogDebug("Size: %dx%d, %d bpp", bm.bmWidth, bm.bmHeight, bm.bmBitsPixel);
-    printf("%d %d\n", bm.bmWidth, bm.bmHeight);
+
+    count = (size_t)bm.bmWidth * bm.bmHeight;
+    if (!HasAlpha(buffer, count) && ApplyMask(dc, ii.hbmMask, buffer, bm.bmWidth, bm.bmHeight) != ERROR_SUCCESS)
+    {
+        // better than an invisible icon
+        for (size_t i = 0; i < count; i++)
+            buffer[i * ICON_BYTES_PER_PIXEL + 3] = 0xff;
+    }
+
+    ConvertToRgba(buffer, count);
+
+    image->Width = bm.bmWidth;
+    image->Height = bm.bmHeight;
+    image->Pixels = buffer;
+    buffer = NULL;
+
+cleanup:
+    free(buffer);
+    if (dc)
+        DeleteDC(dc);
+    if (ii.hbmColor)
+        DeleteObject(ii.hbmColor);
+    if (ii.hbmMask)
+        DeleteObject(ii.hbmMask);
+    DestroyIcon(ico);
+    return status;
+}
+
+// input: icon name as received from the caller
+static DWORD GetIcon(IN const char* input, OUT PICON_IMAGE image)
+{
+    WCHAR name[NAME_SIZE];
+    ULONG size;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    DWORD status;
+
+    status = GetShortcutPath(input, name, ARRAYSIZE(name), &size, g_LinkPath, MAX_PATH_LONG);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    LogDebug("LinkPath: %s", g_LinkPath);
+
+    if (!GetFileAttributesEx(g_LinkPath, GetFileExInfoStandard, &attributes))
+        return win_perror("GetFileAttributesEx(shortcut)");
+
+    if (IconCacheLoad(name, size, &attributes.ftLastWriteTime, image))
+    {
+        LogDebug("%s: cached", name);
+        g_CacheHits++;
+        return ERROR_SUCCESS;
+    }
+
+    status = RenderIcon(g_LinkPath, size, image);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (size != 0 && (image->Width > size || image->Height > size))
+    {
+        status = Downscale(image, size);
+        if (status != ERROR_SUCCESS)
+        {
+            free(image->Pixels);
+            image->Pixels = NULL;
+            return status;
+        }
+    }
+
+    // not fatal, the icon will be extracted again next time
+    IconCacheStore(name, size, &attributes.ftLastWriteTime, image);
+    return ERROR_SUCCESS;
+}
+
+static void WriteIcon(IN const ICON_IMAGE* image)
+{
+    fwrite(image->Pixels, ICON_BYTES_PER_PIXEL, (size_t)image->Width * image->Height, stdout);
 
 #ifdef WRITE_PPM
     // Create a PPM bitmap file.
     char path[256];
-    StringCchPrintfA(path, ARRAYSIZE(path), "icon-%S.ppm", hash);
+    StringCchPrintfA(path, ARRAYSIZE(path), "icon-%p.ppm", image->Pixels);
     FILE* ppm = NULL;
     if (fopen_s(&ppm, path, "w") != 0)
     {
         LogWarning("Failed to open PPM file %S", path);
+        return;
     }
 
-    if (ppm)
+    fprintf(ppm, "P3\n");
+    fprintf(ppm, "%lu %lu\n", image->Width, image->Height);
+    fprintf(ppm, "255\n");
+
+    for (ULONG y = 0; y < image->Height; y++)
     {
-        fprintf(ppm, "P3\n");
-        fprintf(ppm, "%d %d\n", bm.bmWidth, bm.bmHeight);
-        fprintf(ppm, "255\n");
+        for (ULONG x = 0; x < image->Width; x++)
+        {
+            BYTE* pixel = image->Pixels + (y * image->Width + x) * ICON_BYTES_PER_PIXEL;
+            fprintf(ppm, "%d %d %d ", pixel[0], pixel[1], pixel[2]);
+        }
+        fprintf(ppm, "\n");
     }
+
+    fclose(ppm);
 #endif
+}
+
+static DWORD ProcessSingle(void)
+{
+    char input[NAME_SIZE] = { 0 };
+    ICON_IMAGE image = { 0 };
+    DWORD status;
+
+    DWORD size = QioReadUntilEof(GetStdHandle(STD_INPUT_HANDLE), input, sizeof(input) - 1);
+    if (size == 0)
+        return win_perror("QioReadUntilEof(stdin)");
+
+    StripLine(input);
 
-    // Output bitmap.
-    for (int y = 0; y < bm.bmHeight; y++)
+    status = GetIcon(input, &image);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    printf("%lu %lu\n", image.Width, image.Height);
+    WriteIcon(&image);
+    free(image.Pixels);
+    return ERROR_SUCCESS;
+}
+
+static void ProcessBatchLine(IN OUT char* line, IN OUT ULONG* count, IN OUT ULONG* failed)
+{
+    ICON_IMAGE image = { 0 };
+
+    StripLine(line);
+    if (line[0] == 0)
+        return;
+
+    (*count)++;
+    if (GetIcon(line, &image) != ERROR_SUCCESS)
+    {
+        (*failed)++;
+        printf("%s 0 0\n", line);
+        return;
+    }
+
+    printf("%s %lu %lu\n", line, image.Width, image.Height);
+    WriteIcon(&image);
+    free(image.Pixels);
+}
+
+static DWORD ProcessBatch(void)
+{
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    char* buffer = malloc(BATCH_LINE_SIZE + 1); // + terminator of the last line
+    DWORD size = 0;
+    DWORD status = ERROR_SUCCESS;
+    ULONG count = 0;
+    ULONG failed = 0;
+
+    if (!buffer)
+        return ERROR_OUTOFMEMORY;
+
+    while (TRUE)
     {
-        for (int x = 0; x < bm.bmWidth; x++)
+        DWORD read = 0;
+        char* line = buffer;
+        char* end;
+
+        if (!ReadFile(input, buffer + size, BATCH_LINE_SIZE - size, &read, NULL) && GetLastError() != ERROR_BROKEN_PIPE)
         {
-            DWORD offset = (bm.bmHeight - y - 1) * 4 * bm.bmWidth + x * 4;
+            status = win_perror("ReadFile(stdin)");
+            break;
+        }
 
-            fwrite(buffer + offset, 4, 1, stdout);
-#ifdef WRITE_PPM
-            BYTE b = *(buffer + offset + 0);
-            BYTE g = *(buffer + offset + 1);
-            BYTE r = *(buffer + offset + 2);
-            //BYTE a = *(buffer + offset + 3);
-            if (ppm)
-                fprintf(ppm, "%d %d %d ", r, g, b);
-#endif
+        size += read;
+        // EOF, the last line may be unterminated
+        if (read == 0 && size > 0)
+            buffer[size++] = '\n';
+
+        while ((end = memchr(line, '\n', (size_t)(buffer + size - line))) != NULL)
+        {
+            *end = 0;
+            ProcessBatchLine(line, &count, &failed);
+            line = end + 1;
+        }
+
+        // keep the incomplete line for the next read
+        size -= (DWORD)(line - buffer);
+        MoveMemory(buffer, line, size);
+
+        if (read == 0)
+            break;
+
+        if (size == BATCH_LINE_SIZE)
+        {
+            LogError("input line longer than %d bytes", BATCH_LINE_SIZE);
+            status = ERROR_INVALID_DATA;
+            break;
         }
-#ifdef WRITE_PPM
-        if (ppm)
-            fprintf(ppm, "\n");
-#endif
     }
 
-#ifdef WRITE_PPM
-    if (ppm)
-        fclose(ppm);
-#endif
+    LogInfo("%lu icons (%lu from cache, %lu failed)", count, g_CacheHits, failed);
+    free(buffer);
+    return status;
+}
+
+int wmain(int argc, WCHAR *argv[])
+{
+    DWORD status = ERROR_OUTOFMEMORY;
+    BOOL batch = argc > 1 && wcscmp(argv[1], L"-b") == 0;
+
+    g_LinkPath = malloc(MAX_PATH_LONG_WSIZE);
+    if (!g_LinkPath)
+        goto cleanup;
+
+    // Set stdout to binary mode to prevent newline conversions.
+    (void)_setmode(_fileno(stdout), _O_BINARY);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    (void)CoInitialize(NULL);
+
+    // not fatal, icons are just extracted every time
+    IconCacheInit(NULL);
+
+    if (batch)
+        status = ProcessBatch();
+    else
+        status = ProcessSingle();
 
     // apparently stdout is not flushed automatically on process exit if in binary mode...
     fflush(stdout);
-    status = ERROR_SUCCESS;
 
 cleanup:
-    if (status == ERROR_SUCCESS && linkPath)
-        LogInfo("LinkPath: %s", linkPath);
+    if (status == ERROR_SUCCESS && !batch)
+        LogInfo("LinkPath: %s", g_LinkPath);
     // Everything will be cleaned up upon process exit.
     LogDebug("returning %lu", status);
     return status;
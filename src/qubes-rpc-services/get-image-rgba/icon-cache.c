@@ -0,0 +1,186 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <shlobj.h>
+#include <strsafe.h>
+
+#include <log.h>
+
+#include "icon-cache.h"
+
+#define ICON_NAME_LENGTH 40 // SHA1 hex
+
+static WCHAR g_CacheDir[MAX_PATH]; // empty if the cache is disabled
+
+DWORD IconCacheInit(IN const WCHAR* directory OPTIONAL)
+{
+    WCHAR* appDataPath = NULL;
+    HRESULT hresult;
+    int status;
+
+    if (directory)
+    {
+        hresult = StringCchCopy(g_CacheDir, ARRAYSIZE(g_CacheDir), directory);
+    }
+    else
+    {
+        hresult = SHGetKnownFolderPath(&FOLDERID_LocalAppData, KF_FLAG_CREATE, NULL, &appDataPath);
+        if (FAILED(hresult))
+            return win_perror2(hresult, "getting LocalAppData path");
+
+        hresult = StringCchPrintf(g_CacheDir, ARRAYSIZE(g_CacheDir), L"%s\\%s", appDataPath, ICON_CACHE_DIR);
+        CoTaskMemFree(appDataPath);
+    }
+
+    if (FAILED(hresult))
+    {
+        g_CacheDir[0] = 0;
+        return win_perror2(hresult, "formatting icon cache path");
+    }
+
+    status = SHCreateDirectoryEx(NULL, g_CacheDir, NULL);
+    if (status != ERROR_SUCCESS && status != ERROR_ALREADY_EXISTS)
+    {
+        g_CacheDir[0] = 0;
+        return win_perror2(status, "creating icon cache directory");
+    }
+
+    LogDebug("icon cache: %s", g_CacheDir);
+    return ERROR_SUCCESS;
+}
+
+// Only AppMap hashes are used as file names, anything else could escape the cache directory.
+static BOOL GetEntryPath(IN const WCHAR* name, IN ULONG size, OUT WCHAR* path, IN size_t pathLength)
+{
+    if (g_CacheDir[0] == 0 || wcslen(name) != ICON_NAME_LENGTH)
+        return FALSE;
+
+    for (const WCHAR* c = name; *c; c++)
+    {
+        if (!((*c >= L'0' && *c <= L'9') || (*c >= L'a' && *c <= L'f')))
+            return FALSE;
+    }
+
+    if (size != 0)
+        return SUCCEEDED(StringCchPrintf(path, pathLength, L"%s\\%s.%lu.rgba", g_CacheDir, name, size));
+
+    return SUCCEEDED(StringCchPrintf(path, pathLength, L"%s\\%s.rgba", g_CacheDir, name));
+}
+
+BOOL IconCacheLoad(IN const WCHAR* name, IN ULONG size, IN const FILETIME* linkLastWrite, OUT PICON_IMAGE image)
+{
+    WCHAR path[MAX_PATH];
+    HANDLE file;
+    ICON_CACHE_HEADER header;
+    LARGE_INTEGER fileSize;
+    DWORD dataSize;
+    DWORD read;
+    BYTE* pixels = NULL;
+
+    if (!GetEntryPath(name, size, path, ARRAYSIZE(path)))
+        return FALSE;
+
+    file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    if (!ReadFile(file, &header, sizeof(header), &read, NULL) || read != sizeof(header))
+        goto miss;
+
+    if (header.Magic != ICON_CACHE_MAGIC || header.Version != ICON_CACHE_VERSION)
+        goto miss;
+
+    if (CompareFileTime(&header.LinkLastWrite, linkLastWrite) != 0)
+    {
+        LogDebug("%s: shortcut modified", name);
+        goto miss;
+    }
+
+    if (header.Width == 0 || header.Width > ICON_MAX_DIMENSION || header.Height == 0 || header.Height > ICON_MAX_DIMENSION)
+        goto miss;
+
+    dataSize = header.Width * header.Height * ICON_BYTES_PER_PIXEL;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart != (LONGLONG)(sizeof(header) + dataSize))
+        goto miss;
+
+    pixels = malloc(dataSize);
+    if (!pixels)
+        goto miss;
+
+    if (!ReadFile(file, pixels, dataSize, &read, NULL) || read != dataSize)
+        goto miss;
+
+    CloseHandle(file);
+    image->Width = header.Width;
+    image->Height = header.Height;
+    image->Pixels = pixels;
+    return TRUE;
+
+miss:
+    free(pixels);
+    CloseHandle(file);
+    return FALSE;
+}
+
+DWORD IconCacheStore(IN const WCHAR* name, IN ULONG size, IN const FILETIME* linkLastWrite, IN const ICON_IMAGE* image)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR tempPath[MAX_PATH];
+    HANDLE file;
+    ICON_CACHE_HEADER header;
+    DWORD dataSize = image->Width * image->Height * ICON_BYTES_PER_PIXEL;
+    DWORD written;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!GetEntryPath(name, size, path, ARRAYSIZE(path)))
+        return ERROR_SUCCESS;
+
+    // several service instances may store the same icon at once
+    if (FAILED(status = StringCchPrintf(tempPath, ARRAYSIZE(tempPath), L"%s.%lu.tmp", path, GetCurrentProcessId())))
+        return win_perror2(status, "formatting icon cache path");
+
+    file = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return win_perror("CreateFile(icon cache entry)");
+
+    header.Magic = ICON_CACHE_MAGIC;
+    header.Version = ICON_CACHE_VERSION;
+    header.LinkLastWrite = *linkLastWrite;
+    header.Width = image->Width;
+    header.Height = image->Height;
+
+    if (!WriteFile(file, &header, sizeof(header), &written, NULL) ||
+        !WriteFile(file, image->Pixels, dataSize, &written, NULL))
+    {
+        status = win_perror("WriteFile(icon cache entry)");
+    }
+
+    CloseHandle(file);
+
+    if (status == ERROR_SUCCESS && !MoveFileEx(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+        status = win_perror("MoveFileEx(icon cache entry)");
+
+    if (status != ERROR_SUCCESS)
+        DeleteFile(tempPath);
+
+    return status;
+}
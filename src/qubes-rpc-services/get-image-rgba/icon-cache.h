@@ -0,0 +1,86 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Per-user cache of icons ready to be sent by qubes.GetImageRGBA.
+//
+// Every icon is stored in its own file: %LOCALAPPDATA%\<ICON_CACHE_DIR>\<name>.rgba
+// where name is the AppMap hash (40 lowercase hex digits, set by qubes.GetAppMenus),
+// or <name>.<size>.rgba for icons of a requested size.
+// File layout (little endian):
+//   ICON_CACHE_HEADER
+//   Width * Height * ICON_BYTES_PER_PIXEL bytes of RGBA pixel data, rows top to bottom,
+//   exactly as written to the service output.
+// An entry is valid only if LinkLastWrite matches the current last write time of the shortcut.
+// Entries are replaced atomically (written to a temporary file and renamed), so concurrent
+// service instances never see a partial file. Stale entries are overwritten on the next miss.
+
+#pragma once
+#include <windows.h>
+
+#define ICON_CACHE_DIR     L"Invisible Things Lab\\Qubes Tools\\icons"
+#define ICON_CACHE_MAGIC   0x4e434951 // 'QICN'
+#define ICON_CACHE_VERSION 1 // bump when the pixel format changes
+
+#define ICON_BYTES_PER_PIXEL 4
+#define ICON_MAX_DIMENSION   1024
+
+typedef struct _ICON_CACHE_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    FILETIME LinkLastWrite; // of the .lnk the icon was extracted from
+    ULONG Width;
+    ULONG Height;
+} ICON_CACHE_HEADER;
+
+typedef struct _ICON_IMAGE
+{
+    ULONG Width;
+    ULONG Height;
+    BYTE* Pixels; // Width * Height * ICON_BYTES_PER_PIXEL, allocated with malloc
+} ICON_IMAGE, *PICON_IMAGE;
+
+/**
+ * @brief Locate and create the cache directory.
+ * @param directory Used instead of the per-user directory if not NULL (tests).
+ * @return Error code. The cache is disabled on failure, lookups miss and stores are no-ops.
+ */
+DWORD IconCacheInit(IN const WCHAR* directory OPTIONAL);
+
+/**
+ * @brief Load an icon from the cache.
+ * @param name AppMap hash of the shortcut.
+ * @param size Requested icon size, 0 for the default size.
+ * @param linkLastWrite Current last write time of the shortcut.
+ * @param image Receives the icon. Caller frees image->Pixels.
+ * @return TRUE on a valid cache hit.
+ */
+BOOL IconCacheLoad(IN const WCHAR* name, IN ULONG size, IN const FILETIME* linkLastWrite, OUT PICON_IMAGE image);
+
+/**
+ * @brief Store an icon in the cache, replacing any previous entry.
+ * @param name AppMap hash of the shortcut. Names that aren't a hash are not cached.
+ * @param size Requested icon size, 0 for the default size.
+ * @param linkLastWrite Last write time of the shortcut the icon was extracted from.
+ * @param image Icon to store.
+ * @return Error code.
+ */
+DWORD IconCacheStore(IN const WCHAR* name, IN ULONG size, IN const FILETIME* linkLastWrite, IN const ICON_IMAGE* image);
@@ -0,0 +1,184 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <math.h>
+#include <emmintrin.h>
+
+#include "resample.h"
+
+// Contribution of source samples to each target sample along one axis.
+typedef struct _BOX_FILTER
+{
+    ULONG Taps; // weights per target sample
+    ULONG* First; // first contributing source sample of each target sample
+    float* Weights; // Taps weights per target sample, zero padded
+} BOX_FILTER;
+
+static void FreeFilter(IN OUT BOX_FILTER* filter)
+{
+    free(filter->First);
+    free(filter->Weights);
+    filter->First = NULL;
+    filter->Weights = NULL;
+}
+
+static DWORD BuildFilter(IN ULONG sourceLength, IN ULONG targetLength, OUT BOX_FILTER* filter)
+{
+    float scale = (float)sourceLength / targetLength;
+
+    filter->Taps = (ULONG)ceilf(scale) + 1;
+    filter->First = malloc(targetLength * sizeof(ULONG));
+    filter->Weights = calloc((size_t)targetLength * filter->Taps, sizeof(float));
+    if (!filter->First || !filter->Weights)
+    {
+        FreeFilter(filter);
+        return ERROR_OUTOFMEMORY;
+    }
+
+    for (ULONG i = 0; i < targetLength; i++)
+    {
+        // target sample i covers [start, end) in source coordinates
+        float start = i * scale;
+        float end = start + scale;
+        ULONG first = (ULONG)start;
+
+        filter->First[i] = first;
+        for (ULONG t = 0; t < filter->Taps; t++)
+        {
+            ULONG s = first + t;
+            float coverage;
+
+            if (s >= sourceLength || s >= end)
+                break;
+
+            coverage = min(end, (float)(s + 1)) - max(start, (float)s);
+            filter->Weights[i * filter->Taps + t] = coverage / scale;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// RGBA bytes -> premultiplied floats
+static __m128 LoadPremultiplied(IN const BYTE* pixel)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i value = _mm_cvtsi32_si128(*(const int*)pixel);
+    __m128 color;
+    float alpha = pixel[3] / 255.0f;
+
+    value = _mm_unpacklo_epi16(_mm_unpacklo_epi8(value, zero), zero);
+    color = _mm_cvtepi32_ps(value);
+    return _mm_mul_ps(color, _mm_setr_ps(alpha, alpha, alpha, 1.0f));
+}
+
+static void StoreStraight(IN __m128 value, OUT BYTE* pixel)
+{
+    float channels[4];
+    float alpha;
+
+    _mm_storeu_ps(channels, value);
+    alpha = channels[3];
+    if (alpha < 0.5f)
+    {
+        *(ULONG*)pixel = 0;
+        return;
+    }
+
+    for (int c = 0; c < 3; c++)
+        pixel[c] = (BYTE)min(channels[c] * 255.0f / alpha + 0.5f, 255.0f);
+    pixel[3] = (BYTE)min(alpha + 0.5f, 255.0f);
+}
+
+DWORD ResampleRgba(
+    IN const BYTE* source,
+    IN ULONG sourceWidth,
+    IN ULONG sourceHeight,
+    OUT BYTE* target,
+    IN ULONG targetWidth,
+    IN ULONG targetHeight)
+{
+    BOX_FILTER horizontal = { 0 };
+    BOX_FILTER vertical = { 0 };
+    __m128* rows = NULL; // horizontally filtered source rows, premultiplied
+    DWORD status;
+
+    if (targetWidth == 0 || targetHeight == 0 || targetWidth > sourceWidth || targetHeight > sourceHeight)
+        return ERROR_INVALID_PARAMETER;
+
+    status = BuildFilter(sourceWidth, targetWidth, &horizontal);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    status = BuildFilter(sourceHeight, targetHeight, &vertical);
+    if (status != ERROR_SUCCESS)
+        goto cleanup;
+
+    rows = _aligned_malloc((size_t)sourceHeight * targetWidth * sizeof(__m128), sizeof(__m128));
+    if (!rows)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto cleanup;
+    }
+
+    // one pixel (4 channels) per SSE register
+    for (ULONG y = 0; y < sourceHeight; y++)
+    {
+        const BYTE* sourceRow = source + (size_t)y * sourceWidth * 4;
+
+        for (ULONG x = 0; x < targetWidth; x++)
+        {
+            const float* weights = horizontal.Weights + (size_t)x * horizontal.Taps;
+            ULONG first = horizontal.First[x];
+            __m128 sum = _mm_setzero_ps();
+
+            for (ULONG t = 0; t < horizontal.Taps && first + t < sourceWidth; t++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(LoadPremultiplied(sourceRow + (first + t) * 4), _mm_set1_ps(weights[t])));
+
+            rows[(size_t)y * targetWidth + x] = sum;
+        }
+    }
+
+    for (ULONG y = 0; y < targetHeight; y++)
+    {
+        const float* weights = vertical.Weights + (size_t)y * vertical.Taps;
+        ULONG first = vertical.First[y];
+
+        for (ULONG x = 0; x < targetWidth; x++)
+        {
+            __m128 sum = _mm_setzero_ps();
+
+            for (ULONG t = 0; t < vertical.Taps && first + t < sourceHeight; t++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(rows[(size_t)(first + t) * targetWidth + x], _mm_set1_ps(weights[t])));
+
+            StoreStraight(sum, target + ((size_t)y * targetWidth + x) * 4);
+        }
+    }
+
+cleanup:
+    _aligned_free(rows);
+    FreeFilter(&horizontal);
+    FreeFilter(&vertical);
+    return status;
+}
@@ -0,0 +1,43 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+
+/**
+ * @brief Downscale an RGBA image (straight alpha, 4 bytes per pixel, no row padding).
+ *        Uses a separable area averaging (box) filter. Colors are weighted by alpha
+ *        so that transparent pixels don't darken the edges.
+ * @param source Source pixels.
+ * @param sourceWidth Source width.
+ * @param sourceHeight Source height.
+ * @param target Receives targetWidth * targetHeight pixels.
+ * @param targetWidth Target width, not larger than sourceWidth.
+ * @param targetHeight Target height, not larger than sourceHeight.
+ * @return Error code.
+ */
+DWORD ResampleRgba(
+    IN const BYTE* source,
+    IN ULONG sourceWidth,
+    IN ULONG sourceHeight,
+    OUT BYTE* target,
+    IN ULONG targetWidth,
+    IN ULONG targetHeight);
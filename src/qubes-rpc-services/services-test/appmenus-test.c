@@ -0,0 +1,74 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Benchmark of get-appmenus: the first call resolves every shortcut through the shell,
+// later calls only load the ones that changed since the index was saved.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define APPMENUS_EXE       L"get-appmenus.exe"
+#define APPMENUS_WARM_RUNS 5
+
+void AppMenusBenchmark(void)
+{
+    WCHAR indexPath[MAX_PATH];
+    WCHAR arguments[MAX_PATH + 2];
+    char* coldOutput = NULL;
+    size_t coldSize;
+    ULONG64 coldMs;
+    ULONG64 warmMs = 0;
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(indexPath), indexPath) != 0) ||
+        !TEST_CHECK(GetTempFileName(indexPath, L"idx", 0, indexPath) != 0))
+        return;
+
+    // no index: everything is resolved and the index is saved
+    DeleteFile(indexPath);
+    swprintf_s(arguments, ARRAYSIZE(arguments), L"\"%s\"", indexPath);
+    if (!TEST_CHECK(TestRunService(APPMENUS_EXE, arguments, NULL, 0, &coldOutput, &coldSize, &coldMs) == 0) ||
+        !TEST_CHECK(GetFileAttributes(indexPath) != INVALID_FILE_ATTRIBUTES))
+        goto cleanup;
+
+    for (int i = 0; i < APPMENUS_WARM_RUNS; i++)
+    {
+        char* output;
+        size_t size;
+        ULONG64 ms;
+
+        // the cached entries must produce the same output as the resolved ones
+        TEST_CHECK(TestRunService(APPMENUS_EXE, arguments, NULL, 0, &output, &size, &ms) == 0);
+        TEST_CHECK(size == coldSize && memcmp(output, coldOutput, size) == 0);
+        free(output);
+        warmMs += ms;
+    }
+
+    printf("get-appmenus: %zu bytes of menu entries, no index %llu ms, with index %llu ms (average of %d)\n",
+        coldSize, coldMs, warmMs / APPMENUS_WARM_RUNS, APPMENUS_WARM_RUNS);
+
+cleanup:
+    free(coldOutput);
+    DeleteFile(indexPath);
+}
@@ -0,0 +1,205 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the qubes.ClipboardCopy/qubes.ClipboardPaste wire format for formats other than text:
+// format names, the +formats list and the headers that convert CF_HTML and CF_DIB data.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clipboard.h"
+#include "test.h"
+
+static void FormatNameTests(void)
+{
+    CLIPBOARD_FORMAT format;
+
+    TEST_CHECK(ClipboardParseFormat(NULL, &format) && format == ClipboardFormatText);
+    TEST_CHECK(ClipboardParseFormat(L"", &format) && format == ClipboardFormatText);
+    TEST_CHECK(ClipboardParseFormat(L"HTML", &format) && format == ClipboardFormatHtml);
+    TEST_CHECK(ClipboardParseFormat(L"Image", &format) && format == ClipboardFormatImage);
+
+    for (int i = 0; i < ClipboardFormatCount; i++)
+        TEST_CHECK(ClipboardParseFormat(ClipboardFormatName((CLIPBOARD_FORMAT)i), &format) && format == (CLIPBOARD_FORMAT)i);
+
+    // the format list request isn't a format
+    TEST_CHECK(!ClipboardParseFormat(CLIPBOARD_FORMAT_LIST, &format));
+    TEST_CHECK(!ClipboardParseFormat(L"png", &format));
+    TEST_CHECK(!ClipboardParseFormat(L"text ", &format));
+    TEST_CHECK(!ClipboardParseFormat(L"htm", &format));
+}
+
+static void FormatListTests(void)
+{
+    static const char* expected[ClipboardFormatCount] =
+    {
+        "text text/plain;charset=utf-8\n",
+        "html text/html\n",
+        "rtf text/rtf\n",
+        "image image/bmp\n",
+    };
+
+    for (int i = 0; i < ClipboardFormatCount; i++)
+    {
+        char line[CLIPBOARD_FORMAT_LINE_SIZE];
+        WCHAR name[CLIPBOARD_FORMAT_LINE_SIZE];
+        CLIPBOARD_FORMAT format;
+        size_t length = ClipboardFormatListLine((CLIPBOARD_FORMAT)i, line);
+        const char* space = strchr(line, ' ');
+        const char* mimeType;
+        size_t nameLength;
+
+        TEST_CHECK(length == strlen(expected[i]) && strcmp(line, expected[i]) == 0);
+
+        // what the receiving side does with a line: one name, one MIME type, nothing else
+        if (!TEST_CHECK(space != NULL))
+            continue;
+        nameLength = space - line;
+        for (size_t c = 0; c < nameLength; c++)
+            name[c] = line[c];
+        name[nameLength] = L'\0';
+        TEST_CHECK(ClipboardParseFormat(name, &format) && format == (CLIPBOARD_FORMAT)i);
+        mimeType = ClipboardFormatMimeType(format);
+        TEST_CHECK(strncmp(space + 1, mimeType, strlen(mimeType)) == 0 && strcmp(space + 1 + strlen(mimeType), "\n") == 0);
+    }
+}
+
+// Header built by clipboard-paste and parsed back by clipboard-copy.
+static void ExpectHtmlRoundTrip(IN size_t documentSize)
+{
+    size_t size = CF_HTML_HEADER_SIZE + documentSize;
+    BYTE* data = malloc(size + 1);
+    size_t start, end;
+
+    if (!TEST_CHECK(data != NULL))
+        return;
+
+    ClipboardFormatHtmlHeader((char*)data, documentSize);
+    TEST_CHECK(strlen((char*)data) == CF_HTML_HEADER_SIZE);
+    memset(data + CF_HTML_HEADER_SIZE, '<', documentSize);
+
+    TEST_CHECK(ClipboardGetHtmlRange(data, size, &start, &end) && start == CF_HTML_HEADER_SIZE && end == size);
+    free(data);
+}
+
+static BOOL HtmlRange(IN const char* data, OUT size_t* start, OUT size_t* end)
+{
+    return ClipboardGetHtmlRange((const BYTE*)data, strlen(data), start, end);
+}
+
+static void HtmlTests(void)
+{
+    // as written by browsers: the document range is optional, the fragment is required
+    const char* fragmentOnly =
+        "Version:1.0\r\nStartHTML:-1\r\nEndHTML:-1\r\nStartFragment:000000087\r\nEndFragment:000000098\r\n"
+        "<b>bold</b>";
+    const char* outOfRange =
+        "Version:0.9\r\nStartHTML:0000000097\r\nEndHTML:0000001000\r\n<html></html>";
+    const char* reversed =
+        "Version:0.9\r\nStartHTML:0000000060\r\nEndHTML:0000000050\r\n<html></html>";
+    size_t start, end;
+
+    ExpectHtmlRoundTrip(0);
+    ExpectHtmlRoundTrip(1);
+    ExpectHtmlRoundTrip(4096);
+    ExpectHtmlRoundTrip(3 * 1000 * 1000);
+
+    TEST_CHECK(HtmlRange(fragmentOnly, &start, &end) && start == 87 && end == 98);
+    TEST_CHECK(!HtmlRange("<html></html>", &start, &end));
+    TEST_CHECK(!HtmlRange("Version:0.9\r\nStartHTML:0000000040\r\n", &start, &end));
+    TEST_CHECK(!HtmlRange(outOfRange, &start, &end));
+    TEST_CHECK(!HtmlRange(reversed, &start, &end));
+    TEST_CHECK(!ClipboardGetHtmlRange((const BYTE*)"", 0, &start, &end));
+}
+
+// CF_DIB data with room for a palette and pixels after the header.
+typedef union _TEST_DIB
+{
+    BITMAPINFOHEADER Info;
+    BITMAPV5HEADER V5;
+    BYTE Bytes[sizeof(BITMAPV5HEADER) + 256 * sizeof(RGBQUAD) + 64];
+} TEST_DIB;
+
+static void MakeDib(OUT TEST_DIB* dib, IN DWORD headerSize, IN WORD bitCount, IN DWORD compression, IN DWORD colorsUsed)
+{
+    ZeroMemory(dib, sizeof(*dib));
+    dib->Info.biSize = headerSize;
+    dib->Info.biWidth = 4;
+    dib->Info.biHeight = 4;
+    dib->Info.biPlanes = 1;
+    dib->Info.biBitCount = bitCount;
+    dib->Info.biCompression = compression;
+    dib->Info.biClrUsed = colorsUsed;
+}
+
+// The file header must point past the header, palette and masks to the pixels.
+static BOOL ExpectPixelOffset(IN const TEST_DIB* dib, IN size_t size, IN size_t pixelOffset)
+{
+    BITMAPFILEHEADER fileHeader;
+
+    return ClipboardGetBitmapFileHeader(dib->Bytes, size, &fileHeader) &&
+        fileHeader.bfType == 0x4d42 &&
+        fileHeader.bfSize == sizeof(BITMAPFILEHEADER) + size &&
+        fileHeader.bfOffBits == sizeof(BITMAPFILEHEADER) + pixelOffset;
+}
+
+static void BitmapTests(void)
+{
+    TEST_DIB dib;
+    BITMAPFILEHEADER fileHeader;
+
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 24, BI_RGB, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(BITMAPINFOHEADER) + 48, sizeof(BITMAPINFOHEADER)));
+
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 32, BI_RGB, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(BITMAPINFOHEADER) + 64, sizeof(BITMAPINFOHEADER)));
+
+    // a full palette unless biClrUsed says otherwise
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 8, BI_RGB, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(dib), sizeof(BITMAPINFOHEADER) + 256 * sizeof(RGBQUAD)));
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 8, BI_RGB, 16);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(dib), sizeof(BITMAPINFOHEADER) + 16 * sizeof(RGBQUAD)));
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 1, BI_RGB, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(dib), sizeof(BITMAPINFOHEADER) + 2 * sizeof(RGBQUAD)));
+
+    // color masks follow a BITMAPINFOHEADER, but are part of a BITMAPV5HEADER
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 32, BI_BITFIELDS, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(dib), sizeof(BITMAPINFOHEADER) + 3 * sizeof(DWORD)));
+    MakeDib(&dib, sizeof(BITMAPV5HEADER), 32, BI_BITFIELDS, 0);
+    TEST_CHECK(ExpectPixelOffset(&dib, sizeof(dib), sizeof(BITMAPV5HEADER)));
+
+    // truncated or inconsistent headers
+    MakeDib(&dib, sizeof(BITMAPINFOHEADER), 24, BI_RGB, 0);
+    TEST_CHECK(!ClipboardGetBitmapFileHeader(dib.Bytes, sizeof(BITMAPINFOHEADER) - 1, &fileHeader));
+    MakeDib(&dib, sizeof(BITMAPCOREHEADER), 24, BI_RGB, 0);
+    TEST_CHECK(!ClipboardGetBitmapFileHeader(dib.Bytes, sizeof(dib), &fileHeader));
+    MakeDib(&dib, sizeof(BITMAPV5HEADER), 24, BI_RGB, 0);
+    TEST_CHECK(!ClipboardGetBitmapFileHeader(dib.Bytes, sizeof(BITMAPV5HEADER) - 1, &fileHeader));
+}
+
+void ClipboardFormatTests(void)
+{
+    FormatNameTests();
+    FormatListTests();
+    HtmlTests();
+    BitmapTests();
+}
@@ -0,0 +1,422 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the chunked UTF-8 <-> UTF-16 conversion used by clipboard-copy and clipboard-paste.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clipboard.h"
+#include "test.h"
+
+#define REPLACEMENT_UTF16 L"\xfffd"
+#define REPLACEMENT_UTF8  "\xef\xbf\xbd"
+
+// every input is also converted in chunks of these sizes, 0 means all at once
+static const size_t g_ChunkSizes[] = { 0, 1, 2, 3, 4, 5, 7, 16, 17 };
+
+#define GUARD_WCHAR 0xcccc
+#define GUARD_BYTE  0xcc
+
+// Convert UTF-8 text in chunks of chunkSize bytes. Output needs room for UTF8_DECODE_BUFFER_LENGTH(inputSize) WCHARs.
+static size_t Decode(IN const char* input, IN size_t inputSize, IN size_t chunkSize, OUT WCHAR* output)
+{
+    UTF8_DECODER decoder = { 0 };
+    size_t offset = 0;
+    size_t total = 0;
+    size_t length;
+
+    if (chunkSize == 0 || chunkSize > CLIPBOARD_CHUNK_SIZE)
+        chunkSize = CLIPBOARD_CHUNK_SIZE;
+
+    do
+    {
+        size_t size = min(chunkSize, inputSize - offset);
+
+        Utf8DecodeChunk(&decoder, input + offset, size, output + total, &length, offset + size == inputSize);
+        offset += size;
+        total += length;
+    } while (offset < inputSize);
+
+    return total;
+}
+
+// Convert UTF-16 text in chunks of chunkLength WCHARs. Output needs room for UTF16_ENCODE_BUFFER_SIZE(inputLength) bytes.
+static size_t Encode(IN const WCHAR* input, IN size_t inputLength, IN size_t chunkLength, OUT char* output)
+{
+    UTF16_ENCODER encoder = { 0 };
+    size_t offset = 0;
+    size_t total = 0;
+    size_t size;
+
+    if (chunkLength == 0 || chunkLength > CLIPBOARD_CHUNK_SIZE)
+        chunkLength = CLIPBOARD_CHUNK_SIZE;
+
+    do
+    {
+        size_t length = min(chunkLength, inputLength - offset);
+
+        Utf16EncodeChunk(&encoder, input + offset, length, output + total, &size, offset + length == inputLength);
+        offset += length;
+        total += size;
+    } while (offset < inputLength);
+
+    return total;
+}
+
+static void ExpectDecode(IN const char* input, IN size_t inputSize, IN const WCHAR* expected, IN size_t expectedLength,
+    IN int line)
+{
+    size_t bufferLength = UTF8_DECODE_BUFFER_LENGTH(inputSize);
+    WCHAR* output = malloc((bufferLength + 1) * sizeof(WCHAR));
+
+    if (!TestCheck(output != NULL, "output != NULL", __FILE__, line))
+        return;
+
+    for (size_t i = 0; i < ARRAYSIZE(g_ChunkSizes); i++)
+    {
+        size_t length;
+
+        output[bufferLength] = GUARD_WCHAR;
+        length = Decode(input, inputSize, g_ChunkSizes[i], output);
+        TestCheck(length == expectedLength && memcmp(output, expected, length * sizeof(WCHAR)) == 0,
+            "decoded text matches", __FILE__, line);
+        TestCheck(output[bufferLength] == GUARD_WCHAR, "decoder stays within its buffer", __FILE__, line);
+    }
+
+    free(output);
+}
+
+static void ExpectEncode(IN const WCHAR* input, IN size_t inputLength, IN const char* expected, IN size_t expectedSize,
+    IN int line)
+{
+    size_t bufferSize = UTF16_ENCODE_BUFFER_SIZE(inputLength);
+    char* output = malloc(bufferSize + 1);
+
+    if (!TestCheck(output != NULL, "output != NULL", __FILE__, line))
+        return;
+
+    for (size_t i = 0; i < ARRAYSIZE(g_ChunkSizes); i++)
+    {
+        size_t size;
+
+        output[bufferSize] = (char)GUARD_BYTE;
+        size = Encode(input, inputLength, g_ChunkSizes[i], output);
+        TestCheck(size == expectedSize && memcmp(output, expected, size) == 0,
+            "encoded text matches", __FILE__, line);
+        TestCheck(output[bufferSize] == (char)GUARD_BYTE, "encoder stays within its buffer", __FILE__, line);
+    }
+
+    free(output);
+}
+
+// arguments are string literals
+#define EXPECT_DECODE(input, expected) \
+    ExpectDecode(input, sizeof(input) - 1, expected, ARRAYSIZE(expected) - 1, __LINE__)
+#define EXPECT_ENCODE(input, expected) \
+    ExpectEncode(input, ARRAYSIZE(input) - 1, expected, sizeof(expected) - 1, __LINE__)
+
+static void DecodeLineEndingTests(void)
+{
+    EXPECT_DECODE("", L"");
+    EXPECT_DECODE("a\nb", L"a\r\nb");
+    EXPECT_DECODE("a\r\nb", L"a\r\nb");
+    EXPECT_DECODE("\n\n", L"\r\n\r\n");
+    EXPECT_DECODE("\r\r\n\n\r", L"\r\r\n\r\n\r");
+    // vector blocks: LF inside a block, CR ending a block and LF starting the next one
+    EXPECT_DECODE("0123456789abcdef\n0123456789abcdef", L"0123456789abcdef\r\n0123456789abcdef");
+    EXPECT_DECODE("0123456\n89abcdef0123456789abcdef", L"0123456\r\n89abcdef0123456789abcdef");
+    EXPECT_DECODE("0123456789abcdef0123456789abcde\r\n", L"0123456789abcdef0123456789abcde\r\n");
+    EXPECT_DECODE("0123456789abcde\r\n123456789abcdef", L"0123456789abcde\r\n123456789abcdef");
+}
+
+static void DecodeValidTests(void)
+{
+    EXPECT_DECODE("\x7f", L"\x007f");
+    EXPECT_DECODE("\xc2\x80", L"\x0080");
+    EXPECT_DECODE("\xc3\xa9", L"\x00e9");
+    EXPECT_DECODE("\xdf\xbf", L"\x07ff");
+    EXPECT_DECODE("\xe0\xa0\x80", L"\x0800");
+    EXPECT_DECODE("\xe2\x82\xac", L"\x20ac");
+    EXPECT_DECODE("\xed\x9f\xbf", L"\xd7ff");
+    EXPECT_DECODE("\xee\x80\x80", L"\xe000");
+    EXPECT_DECODE("\xef\xbf\xbf", L"\xffff");
+    EXPECT_DECODE("\xf0\x90\x80\x80", L"\xd800\xdc00");
+    EXPECT_DECODE("\xf0\x9f\x98\x80", L"\xd83d\xde00");
+    EXPECT_DECODE("\xf4\x8f\xbf\xbf", L"\xdbff\xdfff");
+    EXPECT_DECODE("0123456789abcde\xc3\xa9" "0123456789abcdef", L"0123456789abcde\x00e9" L"0123456789abcdef");
+}
+
+// Invalid input is replaced by U+FFFD per maximal subpart (Unicode chapter 3, "U+FFFD Substitution of Maximal Subparts").
+static void DecodeInvalidTests(void)
+{
+    // stray continuation and never valid bytes
+    EXPECT_DECODE("\x80", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xbf\x80", REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xfe", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xff", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xf5\x80\x80\x80", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+
+    // overlong encodings
+    EXPECT_DECODE("\xc0\xaf", REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xc1\xbf", REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xe0\x80\xaf", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xe0\x9f\xbf", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xf0\x80\x80\xaf", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xf0\x8f\xbf\xbf", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+
+    // encoded surrogates and values above U+10FFFF
+    EXPECT_DECODE("\xed\xa0\x80", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xed\xbf\xbf", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xed\xa0\xbd\xed\xb8\x80", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16
+        REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xf4\x90\x80\x80", REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16 REPLACEMENT_UTF16);
+
+    // truncated sequences: one replacement for the valid prefix, the next byte is decoded on its own
+    EXPECT_DECODE("\xc3", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xe2\x82", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xf0\x9f\x98", REPLACEMENT_UTF16);
+    EXPECT_DECODE("\xe2\x82" "A", REPLACEMENT_UTF16 L"A");
+    EXPECT_DECODE("\xf0\x9f\x98" "\n", REPLACEMENT_UTF16 L"\r\n");
+    EXPECT_DECODE("\xc3\xc3\xa9", REPLACEMENT_UTF16 L"\x00e9");
+    EXPECT_DECODE("\xf0\x9f\xf0\x9f\x98\x80", REPLACEMENT_UTF16 L"\xd83d\xde00");
+    EXPECT_DECODE("\xe2\x82\x80\x80", L"\x2080" REPLACEMENT_UTF16);
+
+    // a replacement isn't a CR
+    EXPECT_DECODE("\r\x80\n", L"\r" REPLACEMENT_UTF16 L"\r\n");
+}
+
+static void EncodeTests(void)
+{
+    EXPECT_ENCODE(L"", "");
+    EXPECT_ENCODE(L"a\r\nb", "a\nb");
+    EXPECT_ENCODE(L"a\rb\n", "ab\n");
+    EXPECT_ENCODE(L"0123456\r89abcdef\r\n", "0123456" "89abcdef\n");
+    EXPECT_ENCODE(L"\x007f", "\x7f");
+    EXPECT_ENCODE(L"\x0080", "\xc2\x80");
+    EXPECT_ENCODE(L"\x07ff", "\xdf\xbf");
+    EXPECT_ENCODE(L"\x0800", "\xe0\xa0\x80");
+    EXPECT_ENCODE(L"\xd7ff", "\xed\x9f\xbf");
+    EXPECT_ENCODE(L"\xe000", "\xee\x80\x80");
+    EXPECT_ENCODE(L"\xffff", "\xef\xbf\xbf");
+    EXPECT_ENCODE(L"\xd800\xdc00", "\xf0\x90\x80\x80");
+    EXPECT_ENCODE(L"\xd83d\xde00", "\xf0\x9f\x98\x80");
+    EXPECT_ENCODE(L"\xdbff\xdfff", "\xf4\x8f\xbf\xbf");
+    EXPECT_ENCODE(L"0123456\x00e9" L"89abcdef", "0123456\xc3\xa9" "89abcdef");
+
+    // unpaired surrogates
+    EXPECT_ENCODE(L"\xd800", REPLACEMENT_UTF8);
+    EXPECT_ENCODE(L"\xdc00", REPLACEMENT_UTF8);
+    EXPECT_ENCODE(L"\xd800" L"A", REPLACEMENT_UTF8 "A");
+    EXPECT_ENCODE(L"\xd800\r\n", REPLACEMENT_UTF8 "\n");
+    EXPECT_ENCODE(L"\xdc00\xd800", REPLACEMENT_UTF8 REPLACEMENT_UTF8);
+    EXPECT_ENCODE(L"\xd800\xd800\xdc00", REPLACEMENT_UTF8 "\xf0\x90\x80\x80");
+    EXPECT_ENCODE(L"\xd83d\xde00\xde00", "\xf0\x9f\x98\x80" REPLACEMENT_UTF8);
+}
+
+static size_t PutReferenceUtf8(IN UINT32 codePoint, OUT BYTE* output)
+{
+    if (codePoint < 0x80)
+    {
+        output[0] = (BYTE)codePoint;
+        return 1;
+    }
+
+    if (codePoint < 0x800)
+    {
+        output[0] = (BYTE)(0xc0 | (codePoint >> 6));
+        output[1] = (BYTE)(0x80 | (codePoint & 0x3f));
+        return 2;
+    }
+
+    if (codePoint < 0x10000)
+    {
+        output[0] = (BYTE)(0xe0 | (codePoint >> 12));
+        output[1] = (BYTE)(0x80 | ((codePoint >> 6) & 0x3f));
+        output[2] = (BYTE)(0x80 | (codePoint & 0x3f));
+        return 3;
+    }
+
+    output[0] = (BYTE)(0xf0 | (codePoint >> 18));
+    output[1] = (BYTE)(0x80 | ((codePoint >> 12) & 0x3f));
+    output[2] = (BYTE)(0x80 | ((codePoint >> 6) & 0x3f));
+    output[3] = (BYTE)(0x80 | (codePoint & 0x3f));
+    return 4;
+}
+
+// Every Unicode scalar value in both directions, in CLIPBOARD_CHUNK_SIZE chunks like the services use.
+// Chunk boundaries split surrogate pairs and multi-byte sequences.
+static void AllCodePointsTest(void)
+{
+    const size_t codePoints = 0x110000;
+    WCHAR* utf16 = malloc(2 * codePoints * sizeof(WCHAR)); // CRLF for LF, LF for CRLF
+    BYTE* utf8 = malloc(4 * codePoints);
+    char* encoded = malloc(UTF16_ENCODE_BUFFER_SIZE(2 * codePoints));
+    WCHAR* decoded = malloc(UTF8_DECODE_BUFFER_LENGTH(4 * codePoints) * sizeof(WCHAR));
+    size_t utf16Length = 0;
+    size_t utf8Size = 0;
+    size_t size;
+    size_t length;
+
+    if (!TEST_CHECK(utf16 && utf8 && encoded && decoded))
+        goto cleanup;
+
+    for (UINT32 codePoint = 0; codePoint < codePoints; codePoint++)
+    {
+        // CR is dropped when encoding, surrogates aren't scalar values
+        if (codePoint == '\r' || (codePoint >= 0xd800 && codePoint <= 0xdfff))
+            continue;
+
+        if (codePoint == '\n')
+            utf16[utf16Length++] = L'\r';
+
+        if (codePoint < 0x10000)
+        {
+            utf16[utf16Length++] = (WCHAR)codePoint;
+        }
+        else
+        {
+            utf16[utf16Length++] = (WCHAR)(0xd800 | ((codePoint - 0x10000) >> 10));
+            utf16[utf16Length++] = (WCHAR)(0xdc00 | ((codePoint - 0x10000) & 0x3ff));
+        }
+
+        utf8Size += PutReferenceUtf8(codePoint, utf8 + utf8Size);
+    }
+
+    size = Encode(utf16, utf16Length, CLIPBOARD_CHUNK_SIZE, encoded);
+    TEST_CHECK(size == utf8Size && memcmp(encoded, utf8, size) == 0);
+
+    length = Decode((const char*)utf8, utf8Size, CLIPBOARD_CHUNK_SIZE, decoded);
+    TEST_CHECK(length == utf16Length && memcmp(decoded, utf16, length * sizeof(WCHAR)) == 0);
+
+cleanup:
+    free(decoded);
+    free(encoded);
+    free(utf8);
+    free(utf16);
+}
+
+#define CLIPBOARD_BENCHMARK_SIZE (100 * 1000 * 1000)
+
+// Typical multi-MB paste: a log with some non-ASCII text, LF line endings.
+static const char* g_BenchmarkLines[] =
+{
+    "2026-10-19 12:00:00.000 [info] service started, listening on port 8080\n",
+    "2026-10-19 12:00:00.125 [warn] za\xc5\xbc\xc3\xb3\xc5\x82\xc4\x87 g\xc4\x99\xc5\x9bl\xc4\x85 ja\xc5\xba\xc5\x84\n",
+    "2026-10-19 12:00:01.500 [info] \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\n",
+    "\tat frame 3 \xf0\x9f\x98\x80 \xf0\x9f\x93\x8b\n",
+};
+
+static ULONG64 ElapsedMs(IN const LARGE_INTEGER* start, IN const LARGE_INTEGER* frequency)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    return (ULONG64)(now.QuadPart - start->QuadPart) * 1000 / frequency->QuadPart;
+}
+
+// 100 MB of text through the conversion pipeline of both services, in the chunks they use:
+// clipboard-paste decodes into a growing buffer, clipboard-copy encodes it back.
+void ClipboardBenchmark(void)
+{
+    char* text = malloc(CLIPBOARD_BENCHMARK_SIZE);
+    char* roundTrip = malloc(CLIPBOARD_BENCHMARK_SIZE + UTF16_ENCODE_BUFFER_SIZE(CLIPBOARD_CHUNK_SIZE));
+    WCHAR* utf16 = NULL;
+    UTF8_DECODER decoder = { 0 };
+    UTF16_ENCODER encoder = { 0 };
+    size_t textSize = 0;
+    size_t length = 0;
+    size_t capacity = 0;
+    size_t size = 0;
+    LARGE_INTEGER frequency, start;
+    ULONG64 pasteMs, copyMs;
+
+    if (!TEST_CHECK(text && roundTrip))
+        goto cleanup;
+
+    for (ULONG line = 0; ; line++)
+    {
+        const char* lineText = g_BenchmarkLines[line % ARRAYSIZE(g_BenchmarkLines)];
+        size_t lineSize = strlen(lineText);
+
+        if (textSize + lineSize > CLIPBOARD_BENCHMARK_SIZE)
+            break;
+        memcpy(text + textSize, lineText, lineSize);
+        textSize += lineSize;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    QueryPerformanceCounter(&start);
+    for (size_t offset = 0; offset < textSize; offset += CLIPBOARD_CHUNK_SIZE)
+    {
+        size_t chunkSize = min(textSize - offset, CLIPBOARD_CHUNK_SIZE);
+        size_t needed = length + UTF8_DECODE_BUFFER_LENGTH(chunkSize);
+        size_t written;
+
+        if (needed > capacity)
+        {
+            WCHAR* grown;
+
+            capacity = max(capacity * 2, needed);
+            grown = realloc(utf16, capacity * sizeof(WCHAR));
+            if (!TEST_CHECK(grown != NULL))
+                goto cleanup;
+            utf16 = grown;
+        }
+
+        Utf8DecodeChunk(&decoder, text + offset, chunkSize, utf16 + length, &written, offset + chunkSize == textSize);
+        length += written;
+    }
+    pasteMs = ElapsedMs(&start, &frequency);
+
+    QueryPerformanceCounter(&start);
+    for (size_t offset = 0; offset < length && size <= textSize; offset += CLIPBOARD_CHUNK_SIZE)
+    {
+        size_t chunkLength = min(length - offset, CLIPBOARD_CHUNK_SIZE);
+        size_t written;
+
+        Utf16EncodeChunk(&encoder, utf16 + offset, chunkLength, roundTrip + size, &written, offset + chunkLength == length);
+        size += written;
+    }
+    copyMs = ElapsedMs(&start, &frequency);
+
+    // LF became CRLF on the clipboard and back, nothing else changes
+    TEST_CHECK(size == textSize && memcmp(roundTrip, text, size) == 0);
+
+    printf("clipboard round trip of %zu MB: paste %llu ms (%llu MB/s), copy %llu ms (%llu MB/s)\n",
+        textSize / 1000000, pasteMs, textSize / 1000 / max(pasteMs, 1), copyMs, textSize / 1000 / max(copyMs, 1));
+
+cleanup:
+    free(utf16);
+    free(roundTrip);
+    free(text);
+}
+
+void ClipboardTests(void)
+{
+    DecodeLineEndingTests();
+    DecodeValidTests();
+    DecodeInvalidTests();
+    EncodeTests();
+    AllCodePointsTest();
+}
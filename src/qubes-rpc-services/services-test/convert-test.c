@@ -0,0 +1,140 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Differential tests of the SSE2 BGRA -> RGBA conversion used by get-image-rgba
+// against a plain per-pixel swizzle.
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "test.h"
+
+#define CONVERT_MAX_COUNT  67 // covers every tail length after several full SSE2 blocks
+#define CONVERT_MAX_OFFSET 16 // start offsets in bytes, including ones that aren't pixel aligned
+#define CONVERT_GUARD      16 // bytes checked on both sides of the pixels
+#define CONVERT_LARGE_SIZE 256 // pixels per side of the large image
+
+static ULONG g_Random = 1;
+
+static ULONG Random(IN ULONG range)
+{
+    g_Random = g_Random * 1103515245 + 12345;
+    return (g_Random >> 16) % range;
+}
+
+static void ReferenceConvert(IN const BYTE* bgra, OUT BYTE* rgba, IN size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        rgba[i * 4 + 0] = bgra[i * 4 + 2];
+        rgba[i * 4 + 1] = bgra[i * 4 + 1];
+        rgba[i * 4 + 2] = bgra[i * 4 + 0];
+        rgba[i * 4 + 3] = bgra[i * 4 + 3];
+    }
+}
+
+// Convert count pixels at offset in a random buffer, compare with the reference and the original guard bytes.
+static BOOL ExpectConvert(IN size_t count, IN size_t offset, IN BYTE fill)
+{
+    size_t size = CONVERT_GUARD + offset + count * 4 + CONVERT_GUARD;
+    BYTE* buffer = malloc(size);
+    BYTE* original = malloc(size);
+    BYTE* expected = malloc(size);
+    BOOL ok = FALSE;
+
+    if (!TEST_CHECK(buffer && original && expected))
+        goto cleanup;
+
+    // fill 0 means random pixels, anything else is repeated in every byte
+    for (size_t i = 0; i < size; i++)
+        original[i] = fill ? fill : (BYTE)Random(256);
+
+    memcpy(buffer, original, size);
+    memcpy(expected, original, size);
+    ReferenceConvert(original + CONVERT_GUARD + offset, expected + CONVERT_GUARD + offset, count);
+
+    ConvertToRgba(buffer + CONVERT_GUARD + offset, count);
+    ok = memcmp(buffer, expected, size) == 0;
+
+    // the swap is its own inverse
+    ConvertToRgba(buffer + CONVERT_GUARD + offset, count);
+    ok = ok && memcmp(buffer, original, size) == 0;
+
+cleanup:
+    free(buffer);
+    free(original);
+    free(expected);
+    return ok;
+}
+
+static void CountOffsetTests(void)
+{
+    for (size_t count = 0; count <= CONVERT_MAX_COUNT; count++)
+    {
+        for (size_t offset = 0; offset < CONVERT_MAX_OFFSET; offset++)
+        {
+            BOOL ok = ExpectConvert(count, offset, 0);
+
+            // report only the first failure of each count, not every offset
+            if (!TEST_CHECK(ok))
+                break;
+        }
+    }
+}
+
+// values that would expose sign extension or carries between channels in the shifts
+static void BoundaryValueTests(void)
+{
+    static const BYTE fills[] = { 0x01, 0x7f, 0x80, 0xfe, 0xff };
+
+    for (size_t i = 0; i < ARRAYSIZE(fills); i++)
+    {
+        TEST_CHECK(ExpectConvert(CONVERT_MAX_COUNT, 0, fills[i]));
+        TEST_CHECK(ExpectConvert(CONVERT_MAX_COUNT, 3, fills[i]));
+    }
+}
+
+// pixels with exactly one channel set, one channel per pixel position within an SSE2 block
+static void SingleChannelTests(void)
+{
+    for (int channel = 0; channel < 4; channel++)
+    {
+        BYTE pixels[8 * 4] = { 0 };
+        BYTE expected[8 * 4] = { 0 };
+
+        for (int i = 0; i < 8; i++)
+            pixels[i * 4 + (channel + i) % 4] = (BYTE)(0x81 + i);
+
+        ReferenceConvert(pixels, expected, 8);
+        ConvertToRgba(pixels, 8);
+        TEST_CHECK(memcmp(pixels, expected, sizeof(pixels)) == 0);
+    }
+}
+
+void ConvertTests(void)
+{
+    CountOffsetTests();
+    BoundaryValueTests();
+    SingleChannelTests();
+    TEST_CHECK(ExpectConvert(CONVERT_LARGE_SIZE * CONVERT_LARGE_SIZE, 1, 0));
+}
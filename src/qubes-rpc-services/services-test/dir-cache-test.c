@@ -0,0 +1,475 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the directory cache used by file-receiver. Every entry is created both through the
+// cache and by full path with the plain Win32 calls, in two trees in %TEMP%: the results and
+// the trees must be the same, whatever Win32 does with the name.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir-cache.h"
+#include "test.h"
+
+#define EVICT_DIRS       (3 * DIR_CACHE_SIZE)
+#define EVICT_CACHED_DIRS 4 // created last, still cached when their times are set
+#define BENCHMARK_PARENT L"received\\documents\\project"
+#define BENCHMARK_DIRS   100
+#define BENCHMARK_FILES  100 // per directory
+
+typedef struct _DIR_CACHE_OP
+{
+    BOOL Directory;
+    const WCHAR* Name; // relative to the tree
+} DIR_CACHE_OP;
+
+// duplicate names and names Win32 changes or maps to devices
+static const DIR_CACHE_OP g_NameOps[] =
+{
+    { TRUE, L"d" },
+    { FALSE, L"d\\f" },
+    { FALSE, L"d\\f" },
+    { FALSE, L"d\\F" },
+    { TRUE, L"d\\f" },
+    { TRUE, L"D" },
+    { FALSE, L"d" },
+    { TRUE, L"d\\sub" },
+    { FALSE, L"d\\sub\\f" },
+    { FALSE, L"d\\SUB\\f" },
+    // trailing dots and spaces are stripped by Win32
+    { FALSE, L"d\\t." },
+    { FALSE, L"d\\t " },
+    { FALSE, L"d\\u. ." },
+    { FALSE, L"d\\v.txt." },
+    { TRUE, L"e." },
+    { FALSE, L"e.\\g" },
+    { TRUE, L"e " },
+    { FALSE, L"e \\h" },
+    { TRUE, L"e\\i " },
+    { FALSE, L"e\\i \\j" },
+    // DOS device names, with extensions, trailing spaces and in any case
+    { FALSE, L"CON" },
+    { FALSE, L"d\\CON" },
+    { FALSE, L"d\\con.txt" },
+    { FALSE, L"d\\PRN" },
+    { FALSE, L"d\\aux.c" },
+    { FALSE, L"d\\NUL" },
+    { FALSE, L"d\\nul.tar.gz" },
+    { FALSE, L"d\\NUL " },
+    { FALSE, L"d\\nul .txt" },
+    { FALSE, L"d\\COM0" },
+    { FALSE, L"d\\COM1" },
+    { FALSE, L"d\\com9.log" },
+    { FALSE, L"d\\LPT0" },
+    { FALSE, L"d\\lpt1.txt" },
+    { FALSE, L"d\\COM\x00b9" },
+    { FALSE, L"d\\LPT\x00b3.txt" },
+    { FALSE, L"d\\CONIN$" },
+    { FALSE, L"d\\CONOUT$" },
+    { FALSE, L"d\\conout$.txt" },
+    { TRUE, L"d\\AUX" },
+    { TRUE, L"d\\nul.dir" },
+    // not devices
+    { FALSE, L"d\\COM10" },
+    { FALSE, L"d\\LPT\x00b4" },
+    { FALSE, L"d\\CONX" },
+    { FALSE, L"d\\NULL" },
+    { FALSE, L"d\\xCON" },
+};
+
+// entries below directory symlinks, created in both trees by SymlinkTests
+static const DIR_CACHE_OP g_SymlinkOps[] =
+{
+    { TRUE, L"target" },
+    { FALSE, L"link\\f" },
+    { FALSE, L"target\\f" },
+    { TRUE, L"link\\sub" },
+    { FALSE, L"link\\sub\\g" },
+    { FALSE, L"target\\sub\\g" },
+    { FALSE, L"absolute\\h" },
+    { FALSE, L"link\\h" },
+    { TRUE, L"absolute\\sub2" },
+    { FALSE, L"link\\sub2\\i" },
+    { FALSE, L"link\\missing\\j" },
+};
+
+static WCHAR g_Root[MAX_PATH];
+static WCHAR g_CacheTree[MAX_PATH];
+static WCHAR g_Win32Tree[MAX_PATH];
+
+static ULONG64 ElapsedMs(IN const LARGE_INTEGER* start, IN const LARGE_INTEGER* frequency)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    return (ULONG64)(now.QuadPart - start->QuadPart) * 1000 / frequency->QuadPart;
+}
+
+static BOOL IsSubdirectory(IN const WIN32_FIND_DATA* data)
+{
+    return (data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(data->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+        wcscmp(data->cFileName, L".") != 0 && wcscmp(data->cFileName, L"..") != 0;
+}
+
+// Paths are \\?\ ones so that names Win32 would change or map to devices are removed as they are.
+static void DeleteTree(IN const WCHAR* path)
+{
+    WIN32_FIND_DATA data;
+    WCHAR child[MAX_PATH];
+    HANDLE find;
+
+    swprintf_s(child, ARRAYSIZE(child), L"%s\\*", path);
+    find = FindFirstFile(child, &data);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0)
+                continue;
+
+            swprintf_s(child, ARRAYSIZE(child), L"%s\\%s", path, data.cFileName);
+            if (IsSubdirectory(&data))
+                DeleteTree(child);
+            else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                RemoveDirectory(child); // the link, not its target
+            else
+                DeleteFile(child);
+        } while (FindNextFile(find, &data));
+        FindClose(find);
+    }
+
+    RemoveDirectory(path);
+}
+
+// Same names and types in the same order, directory links aren't followed.
+static BOOL CompareTrees(IN const WCHAR* path1, IN const WCHAR* path2)
+{
+    const DWORD typeMask = FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT;
+    WIN32_FIND_DATA data1, data2;
+    WCHAR child1[MAX_PATH];
+    WCHAR child2[MAX_PATH];
+    HANDLE find1, find2;
+    BOOL more1, more2;
+    BOOL same = TRUE;
+
+    swprintf_s(child1, ARRAYSIZE(child1), L"%s\\*", path1);
+    swprintf_s(child2, ARRAYSIZE(child2), L"%s\\*", path2);
+    find1 = FindFirstFile(child1, &data1);
+    find2 = FindFirstFile(child2, &data2);
+    more1 = find1 != INVALID_HANDLE_VALUE;
+    more2 = find2 != INVALID_HANDLE_VALUE;
+
+    while (same && more1 && more2)
+    {
+        same = wcscmp(data1.cFileName, data2.cFileName) == 0 &&
+            (data1.dwFileAttributes & typeMask) == (data2.dwFileAttributes & typeMask);
+        if (!same)
+            fprintf(stderr, "'%S' in %S, '%S' in %S\n", data1.cFileName, path1, data2.cFileName, path2);
+
+        if (same && IsSubdirectory(&data1))
+        {
+            swprintf_s(child1, ARRAYSIZE(child1), L"%s\\%s", path1, data1.cFileName);
+            swprintf_s(child2, ARRAYSIZE(child2), L"%s\\%s", path2, data2.cFileName);
+            same = CompareTrees(child1, child2);
+        }
+
+        more1 = FindNextFile(find1, &data1);
+        more2 = FindNextFile(find2, &data2);
+    }
+
+    if (find1 != INVALID_HANDLE_VALUE)
+        FindClose(find1);
+    if (find2 != INVALID_HANDLE_VALUE)
+        FindClose(find2);
+    return same && more1 == more2;
+}
+
+// Create the entries through the cache in the cache tree and with Win32 in the other one,
+// both must succeed or fail with the same error.
+static void RunOps(IN const DIR_CACHE_OP* ops, IN size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        WCHAR cachePath[MAX_PATH];
+        WCHAR win32Path[MAX_PATH];
+        BOOL cacheSuccess, win32Success;
+        DWORD cacheError, win32Error;
+
+        swprintf_s(cachePath, ARRAYSIZE(cachePath), L"%s\\%s", g_CacheTree, ops[i].Name);
+        swprintf_s(win32Path, ARRAYSIZE(win32Path), L"%s\\%s", g_Win32Tree, ops[i].Name);
+
+        if (ops[i].Directory)
+        {
+            cacheSuccess = DirCacheCreateDirectory(cachePath);
+            cacheError = GetLastError();
+            win32Success = CreateDirectory(win32Path, NULL);
+            win32Error = GetLastError();
+        }
+        else
+        {
+            HANDLE file = DirCacheCreateFile(cachePath);
+
+            cacheError = GetLastError();
+            cacheSuccess = file != INVALID_HANDLE_VALUE;
+            if (cacheSuccess)
+                CloseHandle(file);
+
+            file = CreateFile(win32Path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+            win32Error = GetLastError();
+            win32Success = file != INVALID_HANDLE_VALUE;
+            if (win32Success)
+                CloseHandle(file);
+        }
+
+        if (!TEST_CHECK(cacheSuccess == win32Success && (cacheSuccess || cacheError == win32Error)))
+        {
+            fprintf(stderr, "%s '%S': cache %d (error %lu), Win32 %d (error %lu)\n", ops[i].Directory ? "directory" : "file",
+                ops[i].Name, cacheSuccess, cacheError, win32Success, win32Error);
+        }
+    }
+}
+
+// Parents that are directory links, relative and absolute: the cached handle must lead
+// to the same directory as the full path.
+static void SymlinkTests(void)
+{
+    const WCHAR* trees[] = { g_CacheTree, g_Win32Tree };
+    WCHAR link[MAX_PATH];
+    WCHAR target[MAX_PATH];
+
+    // the target doesn't have to exist yet
+    for (size_t i = 0; i < ARRAYSIZE(trees); i++)
+    {
+        swprintf_s(link, ARRAYSIZE(link), L"%s\\link", trees[i]);
+        if (!CreateSymbolicLink(link, L"target", SYMBOLIC_LINK_FLAG_DIRECTORY | SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE))
+        {
+            DWORD error = GetLastError();
+
+            // needs developer mode or the privilege
+            TEST_CHECK(error == ERROR_PRIVILEGE_NOT_HELD);
+            printf("directory cache: can't create symbolic links (error %lu), skipping link tests\n", error);
+            return;
+        }
+
+        swprintf_s(link, ARRAYSIZE(link), L"%s\\absolute", trees[i]);
+        swprintf_s(target, ARRAYSIZE(target), L"%s\\target", trees[i]);
+        TEST_CHECK(CreateSymbolicLink(link, target, SYMBOLIC_LINK_FLAG_DIRECTORY | SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE));
+    }
+
+    RunOps(g_SymlinkOps, ARRAYSIZE(g_SymlinkOps));
+}
+
+static BOOL GetDirectoryTime(IN const WCHAR* path, OUT FILETIME* modificationTime)
+{
+    HANDLE directory = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    BOOL success;
+
+    if (directory == INVALID_HANDLE_VALUE)
+        return FALSE;
+    success = GetFileTime(directory, NULL, NULL, modificationTime);
+    CloseHandle(directory);
+    return success;
+}
+
+// More directories than the cache holds: evicted handles are closed and their directories
+// opened by path again, and a directory removed after its handle was evicted isn't used.
+// Times are set through the handles of new directories that are still cached, by path otherwise.
+static void EvictionTests(void)
+{
+    WCHAR path[MAX_PATH];
+    DWORD baseline, handles;
+    HANDLE file;
+
+    DirCacheInit(g_CacheTree);
+    GetProcessHandleCount(GetCurrentProcess(), &baseline);
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\evict", g_CacheTree);
+    TEST_CHECK(DirCacheCreateDirectory(path));
+    for (int i = 0; i < EVICT_DIRS; i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\%02d", g_CacheTree, i);
+        TEST_CHECK(DirCacheCreateDirectory(path));
+    }
+
+    // in the order they were created, so every parent was evicted since
+    for (int i = 0; i < EVICT_DIRS; i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\%02d\\f", g_CacheTree, i);
+        file = DirCacheCreateFile(path);
+        if (TEST_CHECK(file != INVALID_HANDLE_VALUE))
+            CloseHandle(file);
+    }
+
+    TEST_CHECK(GetProcessHandleCount(GetCurrentProcess(), &handles) && handles <= baseline + DIR_CACHE_SIZE);
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\00\\f", g_CacheTree);
+    TEST_CHECK(DeleteFile(path));
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\00", g_CacheTree);
+    TEST_CHECK(RemoveDirectory(path));
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\00\\f", g_CacheTree);
+    file = DirCacheCreateFile(path);
+    TEST_CHECK(file == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PATH_NOT_FOUND);
+
+    for (int i = EVICT_DIRS; i < EVICT_DIRS + EVICT_CACHED_DIRS; i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\%02d", g_CacheTree, i);
+        TEST_CHECK(DirCacheCreateDirectory(path));
+    }
+
+    for (int i = 1; i < EVICT_DIRS + EVICT_CACHED_DIRS; i++)
+    {
+        FILETIME time = { (DWORD)(0x12345678 + i), 0x01d00000 };
+        FILETIME readTime;
+
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\evict\\%02d", g_CacheTree, i);
+        TEST_CHECK(DirCacheSetTimes(path, NULL, &time));
+        TEST_CHECK(GetDirectoryTime(path, &readTime) && CompareFileTime(&readTime, &time) == 0);
+    }
+
+    DirCacheClose();
+    TEST_CHECK(GetProcessHandleCount(GetCurrentProcess(), &handles) && handles == baseline);
+}
+
+void DirCacheTests(void)
+{
+    WCHAR tempPath[MAX_PATH];
+    WCHAR rawCache[MAX_PATH + 4];
+    WCHAR rawWin32[MAX_PATH + 4];
+    WCHAR rawRoot[MAX_PATH + 4];
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(tempPath), tempPath) != 0))
+        return;
+    swprintf_s(g_Root, ARRAYSIZE(g_Root), L"%sservices-test-dirs-%lu", tempPath, GetCurrentProcessId());
+    swprintf_s(g_CacheTree, ARRAYSIZE(g_CacheTree), L"%s\\cache", g_Root);
+    swprintf_s(g_Win32Tree, ARRAYSIZE(g_Win32Tree), L"%s\\win32", g_Root);
+    swprintf_s(rawRoot, ARRAYSIZE(rawRoot), L"\\\\?\\%s", g_Root);
+    swprintf_s(rawCache, ARRAYSIZE(rawCache), L"\\\\?\\%s", g_CacheTree);
+    swprintf_s(rawWin32, ARRAYSIZE(rawWin32), L"\\\\?\\%s", g_Win32Tree);
+    DeleteTree(rawRoot);
+
+    if (!TEST_CHECK(CreateDirectory(g_Root, NULL)) || !TEST_CHECK(CreateDirectory(g_CacheTree, NULL)) ||
+        !TEST_CHECK(CreateDirectory(g_Win32Tree, NULL)))
+        goto cleanup;
+
+    DirCacheInit(g_CacheTree);
+    RunOps(g_NameOps, ARRAYSIZE(g_NameOps));
+    SymlinkTests();
+    DirCacheClose();
+
+    TEST_CHECK(CompareTrees(rawCache, rawWin32));
+
+    EvictionTests();
+
+cleanup:
+    DeleteTree(rawRoot);
+    TEST_CHECK(GetFileAttributes(g_Root) == INVALID_FILE_ATTRIBUTES);
+}
+
+// Create BENCHMARK_DIRS directories with BENCHMARK_FILES empty files each, deep in the tree.
+static ULONG64 CreateBenchmarkTree(IN const WCHAR* tree, IN BOOL useCache)
+{
+    const WCHAR* parents[] = { L"received", L"received\\documents", BENCHMARK_PARENT };
+    LARGE_INTEGER frequency, start;
+    WCHAR path[MAX_PATH];
+
+    if (!TEST_CHECK(CreateDirectory(tree, NULL)))
+        return 0;
+
+    for (size_t i = 0; i < ARRAYSIZE(parents); i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\%s", tree, parents[i]);
+        if (!TEST_CHECK(CreateDirectory(path, NULL)))
+            return 0;
+    }
+
+    if (useCache)
+        DirCacheInit(tree);
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    for (int d = 0; d < BENCHMARK_DIRS; d++)
+    {
+        BOOL success;
+
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\" BENCHMARK_PARENT L"\\directory %03d", tree, d);
+        success = useCache ? DirCacheCreateDirectory(path) : CreateDirectory(path, NULL);
+        if (!TEST_CHECK(success))
+            break;
+
+        for (int f = 0; f < BENCHMARK_FILES; f++)
+        {
+            HANDLE file;
+
+            swprintf_s(path, ARRAYSIZE(path), L"%s\\" BENCHMARK_PARENT L"\\directory %03d\\file %03d.txt", tree, d, f);
+            if (useCache)
+                file = DirCacheCreateFile(path);
+            else
+                file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                success = FALSE;
+                break;
+            }
+            CloseHandle(file);
+        }
+
+        if (!TEST_CHECK(success))
+            break;
+    }
+
+    if (useCache)
+        DirCacheClose();
+    return ElapsedMs(&start, &frequency);
+}
+
+// file-receiver's creates for a received tree of many small files, by full path and through the cache
+void DirCacheBenchmark(void)
+{
+    WCHAR tempPath[MAX_PATH];
+    WCHAR rawCache[MAX_PATH + 4];
+    WCHAR rawWin32[MAX_PATH + 4];
+    ULONG64 win32Ms, cacheMs;
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(tempPath), tempPath) != 0))
+        return;
+    swprintf_s(g_Root, ARRAYSIZE(g_Root), L"%sservices-test-dirs-%lu", tempPath, GetCurrentProcessId());
+    swprintf_s(g_CacheTree, ARRAYSIZE(g_CacheTree), L"%s\\cache", g_Root);
+    swprintf_s(g_Win32Tree, ARRAYSIZE(g_Win32Tree), L"%s\\win32", g_Root);
+    if (!TEST_CHECK(CreateDirectory(g_Root, NULL)))
+        return;
+
+    win32Ms = CreateBenchmarkTree(g_Win32Tree, FALSE);
+    cacheMs = CreateBenchmarkTree(g_CacheTree, TRUE);
+
+    swprintf_s(rawCache, ARRAYSIZE(rawCache), L"\\\\?\\%s", g_CacheTree);
+    swprintf_s(rawWin32, ARRAYSIZE(rawWin32), L"\\\\?\\%s", g_Win32Tree);
+    TEST_CHECK(CompareTrees(rawCache, rawWin32));
+
+    printf("file-receiver: %d files in %d directories created by full path in %llu ms, through the directory cache in %llu ms\n",
+        BENCHMARK_DIRS * BENCHMARK_FILES, BENCHMARK_DIRS, win32Ms, cacheMs);
+
+    swprintf_s(rawCache, ARRAYSIZE(rawCache), L"\\\\?\\%s", g_Root);
+    DeleteTree(rawCache);
+}
@@ -0,0 +1,245 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Round trip of file and directory times from file-sender to file-receiver: the times the sender
+// reads are converted to file_header fields and back, then set on received files by the writer
+// threads and on received directories through the directory cache. Uses a directory in %TEMP%.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filecopy.h"
+#include "dir-cache.h"
+#include "writer.h"
+#include "test.h"
+
+#define UNIX_EPOCH_FILETIME 0x019db1ded53e8000ULL // 1970-01-01
+
+// as FILETIME values, all with the exact precision the header keeps
+static const ULONG64 g_Times[] =
+{
+    UNIX_EPOCH_FILETIME,
+    0x019db1ded5d71681ULL, // 1970-01-01 00:00:01.0000001
+    0x01bf53eb25801687ULL, // 2000-01-01 00:00:00.1234567
+    0x01da6b0bb406ae7fULL, // 2024-02-29 12:34:56.9999999
+    0x0236485ed53e7fffULL, // 2106-02-07 06:28:15.9999999, the last one the header can hold
+};
+
+static WCHAR g_Dir[MAX_PATH];
+
+static FILETIME ToFileTime(IN ULONG64 value)
+{
+    FILETIME time = { (DWORD)value, (DWORD)(value >> 32) };
+
+    return time;
+}
+
+static BOOL SameTime(IN const FILETIME* time, IN ULONG64 expected)
+{
+    FILETIME expectedTime = ToFileTime(expected);
+
+    return CompareFileTime(time, &expectedTime) == 0;
+}
+
+static void ConversionTests(void)
+{
+    FILETIME time;
+    UINT32 seconds, nsec;
+
+    FcUnixTimeToWindows(0, 0, &time);
+    TEST_CHECK(SameTime(&time, UNIX_EPOCH_FILETIME));
+    FcUnixTimeToWindows(1, 100, &time);
+    TEST_CHECK(SameTime(&time, g_Times[1]));
+    // invalid nanoseconds from the sender are ignored
+    FcUnixTimeToWindows(1, 1000000000, &time);
+    TEST_CHECK(SameTime(&time, UNIX_EPOCH_FILETIME + 10000000));
+    FcUnixTimeToWindows(MAXDWORD, MAXDWORD, &time);
+    TEST_CHECK(SameTime(&time, g_Times[4] - 9999999));
+
+    time = ToFileTime(g_Times[2]);
+    FcWindowsTimeToUnix(&time, &seconds, &nsec);
+    TEST_CHECK(seconds == 946684800 && nsec == 123456700);
+    time = ToFileTime(g_Times[4]);
+    FcWindowsTimeToUnix(&time, &seconds, &nsec);
+    TEST_CHECK(seconds == MAXDWORD && nsec == 999999900);
+}
+
+// Set the times on a source entry and read them back like file-sender does.
+static BOOL SendTimes(IN const WCHAR* path, IN ULONG64 accessTime, IN ULONG64 modificationTime, OUT struct file_header* header)
+{
+    FILETIME access = ToFileTime(accessTime);
+    FILETIME modification = ToFileTime(modificationTime);
+    HANDLE handle = CreateFile(path, FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    BOOL success;
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    success = SetFileTime(handle, NULL, &access, &modification) && GetFileTime(handle, NULL, &access, &modification);
+    CloseHandle(handle);
+    if (success)
+    {
+        FcWindowsTimeToUnix(&access, &header->atime, &header->atime_nsec);
+        FcWindowsTimeToUnix(&modification, &header->mtime, &header->mtime_nsec);
+    }
+
+    return success;
+}
+
+static BOOL CheckTimes(IN const WCHAR* path, IN ULONG64 accessTime, IN ULONG64 modificationTime)
+{
+    FILETIME access, modification;
+    HANDLE handle = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    BOOL success;
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    success = GetFileTime(handle, NULL, &access, &modification) && SameTime(&access, accessTime) &&
+        SameTime(&modification, modificationTime);
+    CloseHandle(handle);
+    return success;
+}
+
+static void FileTest(IN ULONG index)
+{
+    struct file_header header = { 0 };
+    ULONG64 accessTime = g_Times[index];
+    ULONG64 modificationTime = g_Times[(index + 1) % ARRAYSIZE(g_Times)];
+    FILETIME access, modification;
+    WCHAR path[MAX_PATH];
+    WRITER_FILE* file;
+    HANDLE handle;
+    BYTE* buffer;
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\source%lu", g_Dir, index);
+    handle = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, 0, NULL);
+    if (!TEST_CHECK(handle != INVALID_HANDLE_VALUE))
+        return;
+    CloseHandle(handle);
+    if (!TEST_CHECK(SendTimes(path, accessTime, modificationTime, &header)))
+        return;
+
+    // received with some data, the times are set after it's written
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\received%lu", g_Dir, index);
+    handle = DirCacheCreateFile(path);
+    if (!TEST_CHECK(handle != INVALID_HANDLE_VALUE))
+        return;
+    file = WriterOpen(handle, "received");
+    if (!TEST_CHECK(file != NULL))
+        return;
+
+    buffer = WriterGetBuffer();
+    memset(buffer, 'x', 1000);
+    WriterWrite(file, buffer, 1000, 0);
+    FcUnixTimeToWindows(header.atime, header.atime_nsec, &access);
+    FcUnixTimeToWindows(header.mtime, header.mtime_nsec, &modification);
+    WriterClose(file, &access, &modification);
+}
+
+static void DirectoryTest(IN ULONG index)
+{
+    struct file_header header = { 0 };
+    ULONG64 accessTime = g_Times[index];
+    ULONG64 modificationTime = g_Times[(index + 1) % ARRAYSIZE(g_Times)];
+    FILETIME access, modification;
+    WCHAR path[MAX_PATH];
+    HANDLE handle;
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\source-dir%lu", g_Dir, index);
+    if (!TEST_CHECK(CreateDirectory(path, NULL)) || !TEST_CHECK(SendTimes(path, accessTime, modificationTime, &header)))
+        return;
+
+    // the receiver creates the directory, then its contents, then sets its times from the repeated header
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\received-dir%lu", g_Dir, index);
+    if (!TEST_CHECK(DirCacheCreateDirectory(path)))
+        return;
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\received-dir%lu\\file", g_Dir, index);
+    handle = DirCacheCreateFile(path);
+    if (TEST_CHECK(handle != INVALID_HANDLE_VALUE))
+        CloseHandle(handle);
+
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\received-dir%lu", g_Dir, index);
+    FcUnixTimeToWindows(header.atime, header.atime_nsec, &access);
+    FcUnixTimeToWindows(header.mtime, header.mtime_nsec, &modification);
+    TEST_CHECK(DirCacheSetTimes(path, &access, &modification));
+    TEST_CHECK(CheckTimes(path, accessTime, modificationTime));
+}
+
+static void RemoveTestDir(void)
+{
+    WCHAR path[MAX_PATH];
+
+    for (ULONG i = 0; i < ARRAYSIZE(g_Times); i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\source%lu", g_Dir, i);
+        DeleteFile(path);
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\received%lu", g_Dir, i);
+        DeleteFile(path);
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\source-dir%lu", g_Dir, i);
+        RemoveDirectory(path);
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\received-dir%lu\\file", g_Dir, i);
+        DeleteFile(path);
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\received-dir%lu", g_Dir, i);
+        RemoveDirectory(path);
+    }
+    RemoveDirectory(g_Dir);
+}
+
+void FileTimesTests(void)
+{
+    WCHAR tempPath[MAX_PATH];
+    WCHAR path[MAX_PATH];
+    const char* failedName;
+
+    ConversionTests();
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(tempPath), tempPath) != 0))
+        return;
+    swprintf_s(g_Dir, ARRAYSIZE(g_Dir), L"%sservices-test-times-%lu", tempPath, GetCurrentProcessId());
+    RemoveTestDir();
+
+    if (!TEST_CHECK(CreateDirectory(g_Dir, NULL)) || !TEST_CHECK(WriterInit() == ERROR_SUCCESS))
+        goto cleanup;
+
+    DirCacheInit(g_Dir);
+    for (ULONG i = 0; i < ARRAYSIZE(g_Times); i++)
+    {
+        FileTest(i);
+        DirectoryTest(i);
+    }
+    DirCacheClose();
+
+    TEST_CHECK(WriterFlush(&failedName));
+    for (ULONG i = 0; i < ARRAYSIZE(g_Times); i++)
+    {
+        swprintf_s(path, ARRAYSIZE(path), L"%s\\received%lu", g_Dir, i);
+        TEST_CHECK(CheckTimes(path, g_Times[i], g_Times[(i + 1) % ARRAYSIZE(g_Times)]));
+    }
+
+cleanup:
+    RemoveTestDir();
+    TEST_CHECK(GetFileAttributes(g_Dir) == INVALID_FILE_ATTRIBUTES);
+}
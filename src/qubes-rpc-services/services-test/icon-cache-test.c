@@ -0,0 +1,280 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the icon cache used by get-image-rgba: entries that are corrupt, truncated or stale
+// must be misses, never garbage sent to dom0. Uses a directory in %TEMP%.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icon-cache.h"
+#include "test.h"
+
+#define ICON_NAME  L"0123456789abcdef0123456789abcdef01234567"
+#define ICON_SIZE  32 // requested size of the second entry
+#define ICON_WIDTH 5
+#define ICON_HEIGHT 3
+#define ICON_DATA_SIZE (ICON_WIDTH * ICON_HEIGHT * ICON_BYTES_PER_PIXEL)
+
+static WCHAR g_Dir[MAX_PATH];
+
+static void EntryPath(IN ULONG size, OUT WCHAR* path)
+{
+    if (size != 0)
+        swprintf_s(path, MAX_PATH, L"%s\\%s.%lu.rgba", g_Dir, ICON_NAME, size);
+    else
+        swprintf_s(path, MAX_PATH, L"%s\\%s.rgba", g_Dir, ICON_NAME);
+}
+
+static BOOL WriteEntry(IN const WCHAR* path, IN const void* data, IN DWORD size)
+{
+    HANDLE file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD written;
+    BOOL ok;
+
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+    ok = WriteFile(file, data, size, &written, NULL) && written == size;
+    CloseHandle(file);
+    return ok;
+}
+
+// Entry as IconCacheStore writes it, followed by one spare byte for the too long case.
+typedef struct _RAW_ENTRY
+{
+    ICON_CACHE_HEADER Header;
+    BYTE Pixels[ICON_DATA_SIZE + 1];
+} RAW_ENTRY;
+
+static void MakeEntry(IN const FILETIME* linkLastWrite, OUT RAW_ENTRY* entry)
+{
+    entry->Header.Magic = ICON_CACHE_MAGIC;
+    entry->Header.Version = ICON_CACHE_VERSION;
+    entry->Header.LinkLastWrite = *linkLastWrite;
+    entry->Header.Width = ICON_WIDTH;
+    entry->Header.Height = ICON_HEIGHT;
+    for (int i = 0; i < ICON_DATA_SIZE + 1; i++)
+        entry->Pixels[i] = (BYTE)(i * 7);
+}
+
+static BOOL LoadEntry(IN const FILETIME* linkLastWrite)
+{
+    ICON_IMAGE image = { 0 };
+    BOOL hit = IconCacheLoad(ICON_NAME, 0, linkLastWrite, &image);
+
+    free(image.Pixels);
+    return hit;
+}
+
+// store and load the same pixels, the file layout is what RAW_ENTRY describes
+static void RoundTripTests(IN const FILETIME* linkLastWrite)
+{
+    RAW_ENTRY entry;
+    ICON_IMAGE stored = { ICON_WIDTH, ICON_HEIGHT, NULL };
+    ICON_IMAGE loaded = { 0 };
+    WCHAR path[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    MakeEntry(linkLastWrite, &entry);
+    stored.Pixels = entry.Pixels;
+
+    for (ULONG size = 0; size <= ICON_SIZE; size += ICON_SIZE)
+    {
+        EntryPath(size, path);
+        TEST_CHECK(IconCacheStore(ICON_NAME, size, linkLastWrite, &stored) == ERROR_SUCCESS);
+        TEST_CHECK(GetFileAttributesEx(path, GetFileExInfoStandard, &attributes) &&
+            attributes.nFileSizeLow == sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE);
+        if (TEST_CHECK(IconCacheLoad(ICON_NAME, size, linkLastWrite, &loaded)))
+        {
+            TEST_CHECK(loaded.Width == ICON_WIDTH && loaded.Height == ICON_HEIGHT);
+            TEST_CHECK(memcmp(loaded.Pixels, entry.Pixels, ICON_DATA_SIZE) == 0);
+            free(loaded.Pixels);
+            loaded.Pixels = NULL;
+        }
+    }
+
+    // sizes are separate entries
+    TEST_CHECK(!IconCacheLoad(ICON_NAME, ICON_SIZE * 2, linkLastWrite, &loaded));
+}
+
+static void CorruptEntryTests(IN const FILETIME* linkLastWrite)
+{
+    RAW_ENTRY entry;
+    WCHAR path[MAX_PATH];
+
+    EntryPath(0, path);
+
+    MakeEntry(linkLastWrite, &entry);
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE) && LoadEntry(linkLastWrite));
+
+    entry.Header.Magic++;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE) && !LoadEntry(linkLastWrite));
+
+    MakeEntry(linkLastWrite, &entry);
+    entry.Header.Version++;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE) && !LoadEntry(linkLastWrite));
+
+    MakeEntry(linkLastWrite, &entry);
+    entry.Header.Width = 0;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER)) && !LoadEntry(linkLastWrite));
+
+    // dimensions that would overflow the data size computation
+    MakeEntry(linkLastWrite, &entry);
+    entry.Header.Width = 0x10000;
+    entry.Header.Height = 0x10000;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER)) && !LoadEntry(linkLastWrite));
+
+    MakeEntry(linkLastWrite, &entry);
+    entry.Header.Height = ICON_MAX_DIMENSION + 1;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE) && !LoadEntry(linkLastWrite));
+
+    // dimensions that don't match the file size
+    MakeEntry(linkLastWrite, &entry);
+    entry.Header.Width++;
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE) && !LoadEntry(linkLastWrite));
+
+    MakeEntry(linkLastWrite, &entry);
+    TEST_CHECK(WriteEntry(path, &entry, sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE + 1) && !LoadEntry(linkLastWrite));
+}
+
+static void TruncatedEntryTests(IN const FILETIME* linkLastWrite)
+{
+    RAW_ENTRY entry;
+    WCHAR path[MAX_PATH];
+
+    EntryPath(0, path);
+    MakeEntry(linkLastWrite, &entry);
+
+    // every length short of a full entry, including an empty file and a partial header
+    for (DWORD size = 0; size < sizeof(ICON_CACHE_HEADER) + ICON_DATA_SIZE; size++)
+        TEST_CHECK(WriteEntry(path, &entry, size) && !LoadEntry(linkLastWrite));
+}
+
+static void StaleEntryTests(IN const FILETIME* linkLastWrite)
+{
+    RAW_ENTRY entry;
+    ICON_IMAGE stored = { ICON_WIDTH, ICON_HEIGHT, NULL };
+    ICON_IMAGE loaded = { 0 };
+    FILETIME modified = *linkLastWrite;
+
+    MakeEntry(linkLastWrite, &entry);
+    stored.Pixels = entry.Pixels;
+    TEST_CHECK(IconCacheStore(ICON_NAME, 0, linkLastWrite, &stored) == ERROR_SUCCESS);
+
+    // the shortcut was modified after the icon was cached, in either direction
+    modified.dwLowDateTime++;
+    TEST_CHECK(!LoadEntry(&modified));
+    modified.dwLowDateTime -= 2;
+    TEST_CHECK(!LoadEntry(&modified));
+    modified = *linkLastWrite;
+    modified.dwHighDateTime++;
+    TEST_CHECK(!LoadEntry(&modified));
+
+    // the next miss replaces the stale entry
+    entry.Pixels[0] ^= 0xff;
+    TEST_CHECK(IconCacheStore(ICON_NAME, 0, &modified, &stored) == ERROR_SUCCESS);
+    TEST_CHECK(!LoadEntry(linkLastWrite));
+    if (TEST_CHECK(IconCacheLoad(ICON_NAME, 0, &modified, &loaded)))
+    {
+        TEST_CHECK(memcmp(loaded.Pixels, entry.Pixels, ICON_DATA_SIZE) == 0);
+        free(loaded.Pixels);
+    }
+}
+
+// names that aren't AppMap hashes never touch the filesystem
+static void NameTests(IN const FILETIME* linkLastWrite)
+{
+    static const WCHAR* names[] =
+    {
+        L"",
+        L"0123456789ABCDEF0123456789ABCDEF01234567",
+        L"0123456789abcdef0123456789abcdef0123456",
+        L"0123456789abcdef0123456789abcdef012345678",
+        L"..\\..\\456789abcdef0123456789abcdef01234567",
+        L"0123456789abcdef0123456789abcdef0123456g",
+    };
+    RAW_ENTRY entry;
+    ICON_IMAGE stored = { ICON_WIDTH, ICON_HEIGHT, NULL };
+    ICON_IMAGE loaded = { 0 };
+    WIN32_FIND_DATA findData;
+    HANDLE find;
+    WCHAR pattern[MAX_PATH];
+    int files = 0;
+
+    MakeEntry(linkLastWrite, &entry);
+    stored.Pixels = entry.Pixels;
+
+    for (size_t i = 0; i < ARRAYSIZE(names); i++)
+    {
+        TEST_CHECK(IconCacheStore(names[i], 0, linkLastWrite, &stored) == ERROR_SUCCESS);
+        TEST_CHECK(!IconCacheLoad(names[i], 0, linkLastWrite, &loaded));
+    }
+
+    // only the entries stored by the tests above, no temporary files left behind
+    swprintf_s(pattern, ARRAYSIZE(pattern), L"%s\\*", g_Dir);
+    find = FindFirstFile(pattern, &findData);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                files++;
+        } while (FindNextFile(find, &findData));
+        FindClose(find);
+    }
+    TEST_CHECK(files == 2);
+}
+
+static void RemoveCacheDir(void)
+{
+    WCHAR path[MAX_PATH];
+
+    EntryPath(0, path);
+    DeleteFile(path);
+    EntryPath(ICON_SIZE, path);
+    DeleteFile(path);
+    RemoveDirectory(g_Dir);
+}
+
+void IconCacheTests(void)
+{
+    FILETIME linkLastWrite = { 0x89abcdef, 0x01d00000 };
+    WCHAR tempPath[MAX_PATH];
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(tempPath), tempPath) != 0))
+        return;
+    swprintf_s(g_Dir, ARRAYSIZE(g_Dir), L"%sservices-test-icons-%lu", tempPath, GetCurrentProcessId());
+    RemoveCacheDir();
+
+    if (!TEST_CHECK(IconCacheInit(g_Dir) == ERROR_SUCCESS))
+        return;
+
+    RoundTripTests(&linkLastWrite);
+    CorruptEntryTests(&linkLastWrite);
+    TruncatedEntryTests(&linkLastWrite);
+    StaleEntryTests(&linkLastWrite);
+    NameTests(&linkLastWrite);
+
+    RemoveCacheDir();
+    TEST_CHECK(GetFileAttributes(g_Dir) == INVALID_FILE_ATTRIBUTES);
+}
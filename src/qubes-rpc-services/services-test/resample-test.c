@@ -0,0 +1,315 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the icon downscaler used by get-image-rgba against a straightforward
+// double precision area average, and a benchmark of the sizes dom0 asks for.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+#include "test.h"
+
+#define RESAMPLE_BENCHMARK_SIZE 256 // jumbo system icon
+#define RESAMPLE_BENCHMARK_RUNS 200
+
+static ULONG g_Random = 1;
+
+static ULONG Random(IN ULONG range)
+{
+    g_Random = g_Random * 1103515245 + 12345;
+    return (g_Random >> 16) % range;
+}
+
+// Box filter over the exact source area of each target pixel, colors weighted by alpha.
+// Rounding matches ResampleRgba. alphaSums receives the unrounded alpha of every target pixel.
+static void ReferenceResample(IN const BYTE* source, IN ULONG sourceWidth, IN ULONG sourceHeight,
+    OUT BYTE* target, IN ULONG targetWidth, IN ULONG targetHeight, OUT double* alphaSums)
+{
+    double scaleX = (double)sourceWidth / targetWidth;
+    double scaleY = (double)sourceHeight / targetHeight;
+
+    for (ULONG ty = 0; ty < targetHeight; ty++)
+    {
+        double top = ty * scaleY;
+        double bottom = top + scaleY;
+
+        for (ULONG tx = 0; tx < targetWidth; tx++)
+        {
+            double left = tx * scaleX;
+            double right = left + scaleX;
+            double sum[4] = { 0 };
+            BYTE* pixel = target + ((size_t)ty * targetWidth + tx) * 4;
+
+            for (ULONG y = (ULONG)top; y < sourceHeight && y < bottom; y++)
+            {
+                double coverageY = min(bottom, y + 1.0) - max(top, (double)y);
+
+                for (ULONG x = (ULONG)left; x < sourceWidth && x < right; x++)
+                {
+                    const BYTE* sourcePixel = source + ((size_t)y * sourceWidth + x) * 4;
+                    double weight = coverageY * (min(right, x + 1.0) - max(left, (double)x)) / (scaleX * scaleY);
+                    double alpha = sourcePixel[3] / 255.0;
+
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += weight * sourcePixel[c] * alpha;
+                    sum[3] += weight * sourcePixel[3];
+                }
+            }
+
+            alphaSums[(size_t)ty * targetWidth + tx] = sum[3];
+            if (sum[3] < 0.5)
+            {
+                memset(pixel, 0, 4);
+                continue;
+            }
+
+            for (int c = 0; c < 3; c++)
+                pixel[c] = (BYTE)min(sum[c] * 255.0 / sum[3] + 0.5, 255.0);
+            pixel[3] = (BYTE)min(sum[3] + 0.5, 255.0);
+        }
+    }
+}
+
+// kinds of test images
+enum
+{
+    IMAGE_OPAQUE, // random colors, alpha 255
+    IMAGE_RANDOM, // random colors and alpha
+    IMAGE_EDGES, // opaque disc on a transparent background, like most icons
+};
+
+static void FillImage(OUT BYTE* pixels, IN ULONG width, IN ULONG height, IN int kind)
+{
+    for (ULONG y = 0; y < height; y++)
+    {
+        for (ULONG x = 0; x < width; x++)
+        {
+            BYTE* pixel = pixels + ((size_t)y * width + x) * 4;
+            LONG dx = 2 * (LONG)x - (LONG)width;
+            LONG dy = 2 * (LONG)y - (LONG)height;
+
+            for (int c = 0; c < 3; c++)
+                pixel[c] = (BYTE)Random(256);
+
+            if (kind == IMAGE_OPAQUE)
+                pixel[3] = 0xff;
+            else if (kind == IMAGE_RANDOM)
+                pixel[3] = (BYTE)Random(256);
+            else if (dx * dx + dy * dy < (LONG)(width * height) / 2)
+                pixel[3] = 0xff;
+            else
+                *(ULONG*)pixel = 0;
+        }
+    }
+}
+
+// Compare with the reference. Channels may differ by one because ResampleRgba sums in single
+// precision; pixels whose alpha is right at the transparency threshold are not compared.
+static BOOL ExpectResample(IN ULONG sourceWidth, IN ULONG sourceHeight, IN ULONG targetWidth, IN ULONG targetHeight,
+    IN int kind)
+{
+    size_t targetCount = (size_t)targetWidth * targetHeight;
+    BYTE* source = malloc((size_t)sourceWidth * sourceHeight * 4);
+    BYTE* target = malloc(targetCount * 4 + 4);
+    BYTE* expected = malloc(targetCount * 4);
+    double* alphaSums = malloc(targetCount * sizeof(double));
+    BOOL ok = FALSE;
+
+    if (!TEST_CHECK(source && target && expected && alphaSums))
+        goto cleanup;
+
+    FillImage(source, sourceWidth, sourceHeight, kind);
+    ReferenceResample(source, sourceWidth, sourceHeight, expected, targetWidth, targetHeight, alphaSums);
+    memset(target + targetCount * 4, 0xcc, 4);
+
+    if (ResampleRgba(source, sourceWidth, sourceHeight, target, targetWidth, targetHeight) != ERROR_SUCCESS)
+        goto cleanup;
+
+    ok = *(ULONG*)(target + targetCount * 4) == 0xcccccccc;
+    for (size_t i = 0; ok && i < targetCount; i++)
+    {
+        if (alphaSums[i] > 0.49 && alphaSums[i] < 0.51)
+            continue;
+
+        for (int c = 0; c < 4; c++)
+        {
+            if (abs(target[i * 4 + c] - expected[i * 4 + c]) > 1)
+            {
+                fprintf(stderr, "%lux%lu -> %lux%lu: pixel %zu channel %d is %d, expected %d\n",
+                    sourceWidth, sourceHeight, targetWidth, targetHeight, i, c, target[i * 4 + c], expected[i * 4 + c]);
+                ok = FALSE;
+                break;
+            }
+        }
+    }
+
+cleanup:
+    free(source);
+    free(target);
+    free(expected);
+    free(alphaSums);
+    return ok;
+}
+
+static void InvalidSizeTests(void)
+{
+    BYTE source[4 * 4 * 4] = { 0 };
+    BYTE target[4 * 4 * 4];
+
+    TEST_CHECK(ResampleRgba(source, 4, 4, target, 0, 4) == ERROR_INVALID_PARAMETER);
+    TEST_CHECK(ResampleRgba(source, 4, 4, target, 4, 0) == ERROR_INVALID_PARAMETER);
+    TEST_CHECK(ResampleRgba(source, 4, 4, target, 5, 4) == ERROR_INVALID_PARAMETER);
+    TEST_CHECK(ResampleRgba(source, 4, 4, target, 4, 5) == ERROR_INVALID_PARAMETER);
+}
+
+// Fully transparent pixels must not bleed their (undefined) color into the edges.
+static void AlphaWeightingTests(void)
+{
+    const BYTE source[2 * 4] = { 200, 100, 50, 0xff, 0, 0, 0, 0 };
+    const BYTE blackEdge[2 * 4] = { 200, 100, 50, 0xff, 0, 0, 0, 1 };
+    BYTE transparent[3 * 4] = { 0 };
+    BYTE target[4];
+
+    if (TEST_CHECK(ResampleRgba(source, 2, 1, target, 1, 1) == ERROR_SUCCESS))
+        TEST_CHECK(target[0] == 200 && target[1] == 100 && target[2] == 50 && target[3] == 128);
+
+    // a barely visible black pixel barely darkens
+    if (TEST_CHECK(ResampleRgba(blackEdge, 2, 1, target, 1, 1) == ERROR_SUCCESS))
+        TEST_CHECK(target[0] == 199 && target[1] == 100 && target[2] == 50 && target[3] == 128);
+
+    // transparent stays transparent black, whatever the colors were
+    transparent[0] = transparent[5] = transparent[10] = 0xff;
+    if (TEST_CHECK(ResampleRgba(transparent, 3, 1, target, 1, 1) == ERROR_SUCCESS))
+        TEST_CHECK(*(ULONG*)target == 0);
+}
+
+// Same size is a copy, a solid color stays solid at any ratio.
+static void ExactTests(void)
+{
+    static const ULONG sizes[][2] = { { 7, 7 }, { 16, 16 }, { 48, 32 }, { 48, 17 }, { 256, 48 }, { 256, 1 } };
+    const BYTE color[4] = { 12, 34, 56, 0xff };
+    BYTE* source = malloc(256 * 256 * 4);
+    BYTE* target = malloc(256 * 256 * 4);
+
+    if (!TEST_CHECK(source && target))
+        goto cleanup;
+
+    FillImage(source, 16, 16, IMAGE_RANDOM);
+    // alpha 0 pixels come out as transparent black
+    for (ULONG i = 0; i < 16 * 16; i++)
+    {
+        if (source[i * 4 + 3] == 0)
+            *(ULONG*)(source + i * 4) = 0;
+    }
+
+    if (TEST_CHECK(ResampleRgba(source, 16, 16, target, 16, 16) == ERROR_SUCCESS))
+        TEST_CHECK(memcmp(source, target, 16 * 16 * 4) == 0);
+
+    for (size_t s = 0; s < ARRAYSIZE(sizes); s++)
+    {
+        ULONG from = sizes[s][0];
+        ULONG to = sizes[s][1];
+        BOOL solid = TRUE;
+
+        for (ULONG i = 0; i < from * from; i++)
+            memcpy(source + i * 4, color, 4);
+
+        if (!TEST_CHECK(ResampleRgba(source, from, from, target, to, to) == ERROR_SUCCESS))
+            continue;
+
+        for (ULONG i = 0; i < to * to; i++)
+            solid = solid && memcmp(target + i * 4, color, 4) == 0;
+        TEST_CHECK(solid);
+    }
+
+cleanup:
+    free(source);
+    free(target);
+}
+
+// Random images at integer and fractional ratios, and non-square ones.
+static void ReferenceTests(void)
+{
+    static const ULONG sizes[][4] =
+    {
+        { 2, 2, 1, 1 },
+        { 32, 32, 16, 16 },
+        { 48, 48, 32, 32 },
+        { 48, 48, 17, 17 },
+        { 256, 256, 48, 48 },
+        { 256, 256, 32, 32 },
+        { 256, 256, 16, 16 },
+        { 100, 30, 33, 29 },
+        { 31, 257, 7, 64 },
+        { 256, 256, 1, 1 },
+    };
+
+    for (size_t i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        for (int kind = IMAGE_OPAQUE; kind <= IMAGE_EDGES; kind++)
+            TEST_CHECK(ExpectResample(sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3], kind));
+    }
+}
+
+void ResampleTests(void)
+{
+    InvalidSizeTests();
+    AlphaWeightingTests();
+    ExactTests();
+    ReferenceTests();
+}
+
+void ResampleBenchmark(void)
+{
+    static const ULONG sizes[] = { 48, 32, 16 };
+    BYTE* source = malloc(RESAMPLE_BENCHMARK_SIZE * RESAMPLE_BENCHMARK_SIZE * 4);
+    BYTE* target = malloc(RESAMPLE_BENCHMARK_SIZE * RESAMPLE_BENCHMARK_SIZE * 4);
+    LARGE_INTEGER frequency, start, end;
+
+    if (!TEST_CHECK(source && target))
+        goto cleanup;
+
+    FillImage(source, RESAMPLE_BENCHMARK_SIZE, RESAMPLE_BENCHMARK_SIZE, IMAGE_EDGES);
+    QueryPerformanceFrequency(&frequency);
+
+    for (size_t i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        DWORD status = ERROR_SUCCESS;
+
+        QueryPerformanceCounter(&start);
+        for (int run = 0; run < RESAMPLE_BENCHMARK_RUNS && status == ERROR_SUCCESS; run++)
+            status = ResampleRgba(source, RESAMPLE_BENCHMARK_SIZE, RESAMPLE_BENCHMARK_SIZE, target, sizes[i], sizes[i]);
+        QueryPerformanceCounter(&end);
+
+        if (!TEST_CHECK(status == ERROR_SUCCESS))
+            break;
+
+        printf("resample %dx%d -> %lux%lu: %lld us\n", RESAMPLE_BENCHMARK_SIZE, RESAMPLE_BENCHMARK_SIZE, sizes[i], sizes[i],
+            (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart / RESAMPLE_BENCHMARK_RUNS);
+    }
+
+cleanup:
+    free(source);
+    free(target);
+}
@@ -0,0 +1,537 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of the conversion of received names and link targets to paths within the incoming dir.
+
+#include <windows.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <utf8-conv.h>
+
+#include "sanitize.h"
+#include "sanitize-internal.h"
+#include "test.h"
+
+#define INCOMING_DIR L"C:\\Users\\user\\Documents\\QubesIncoming\\work"
+#define INCOMING_DIR_LENGTH (ARRAYSIZE(INCOMING_DIR) - 1)
+
+#define FUZZ_ITERATIONS 100000
+#define FUZZ_MAX_COMPONENTS 12
+
+#define DECODE_ITERATIONS 200000
+#define DECODE_MAX_INPUT  80 // bytes, several SSE2 blocks
+#define DECODE_GUARD      0xcccc
+
+static WCHAR g_Path[MAX_PATH_LONG];
+
+static void ExpectPath(IN const WCHAR* incomingDir, IN const char* untrustedPath, IN const WCHAR* linkPath OPTIONAL,
+    IN int expectedStatus, IN const WCHAR* expectedPath OPTIONAL, IN int line)
+{
+    int status = ResolveUntrustedPath(incomingDir, untrustedPath, linkPath, g_Path);
+
+    TestCheck(status == expectedStatus, "status matches", __FILE__, line);
+    if (status == 0 && expectedPath)
+        TestCheck(wcscmp(g_Path, expectedPath) == 0, "path matches", __FILE__, line);
+}
+
+#define EXPECT_PATH(untrusted, expected) ExpectPath(INCOMING_DIR, untrusted, NULL, 0, expected, __LINE__)
+#define EXPECT_REJECTED(untrusted) ExpectPath(INCOMING_DIR, untrusted, NULL, EINVAL, NULL, __LINE__)
+#define EXPECT_LINK(link, target, status, expected) ExpectPath(INCOMING_DIR, target, link, status, expected, __LINE__)
+
+static void ResolveTests(void)
+{
+    EXPECT_PATH("a", INCOMING_DIR L"\\a");
+    EXPECT_PATH("a/b/c", INCOMING_DIR L"\\a\\b\\c");
+    EXPECT_PATH("a//b/", INCOMING_DIR L"\\a\\b");
+    EXPECT_PATH("a/./b", INCOMING_DIR L"\\a\\b");
+    EXPECT_PATH(".", INCOMING_DIR);
+    EXPECT_PATH("a/..", INCOMING_DIR);
+    EXPECT_PATH("a/../b", INCOMING_DIR L"\\b");
+    EXPECT_PATH("a/b/../../c", INCOMING_DIR L"\\c");
+    // backslash is a separator too
+    EXPECT_PATH("a\\b", INCOMING_DIR L"\\a\\b");
+    // no drive letters or alternate data streams
+    EXPECT_PATH("C:/x", INCOMING_DIR L"\\C_\\x");
+    EXPECT_PATH("a:stream", INCOMING_DIR L"\\a_stream");
+    EXPECT_PATH("\xc3\xa9", INCOMING_DIR L"\\\x00e9");
+    ExpectPath(INCOMING_DIR L"\\", "a", NULL, 0, INCOMING_DIR L"\\a", __LINE__);
+
+    // outside of the incoming dir
+    EXPECT_REJECTED("");
+    EXPECT_REJECTED("..");
+    EXPECT_REJECTED("../x");
+    EXPECT_REJECTED("./..");
+    EXPECT_REJECTED("a/../..");
+    EXPECT_REJECTED("a/b/../../../x");
+    EXPECT_REJECTED("a/../../work/x");
+    EXPECT_REJECTED("a\\..\\..\\x");
+    EXPECT_REJECTED("/x");
+    EXPECT_REJECTED("\\x");
+    EXPECT_REJECTED("//server/share");
+}
+
+static void LinkTests(void)
+{
+    const WCHAR* link = INCOMING_DIR L"\\a\\link";
+    const WCHAR* topLink = INCOMING_DIR L"\\link";
+
+    EXPECT_LINK(link, "b", 0, INCOMING_DIR L"\\a\\b");
+    EXPECT_LINK(link, "../b", 0, INCOMING_DIR L"\\b");
+    EXPECT_LINK(link, "..", 0, INCOMING_DIR);
+    EXPECT_LINK(topLink, ".", 0, INCOMING_DIR);
+    EXPECT_LINK(link, "../..", EINVAL, NULL);
+    EXPECT_LINK(link, "../../work/b", EINVAL, NULL);
+    EXPECT_LINK(topLink, "..", EINVAL, NULL);
+    EXPECT_LINK(link, "", EINVAL, NULL);
+    // absolute targets are refused differently than absolute names
+    EXPECT_LINK(link, "/etc/passwd", EPERM, NULL);
+    // the link itself must be within the incoming dir
+    EXPECT_LINK(INCOMING_DIR, "a", EINVAL, NULL);
+    EXPECT_LINK(L"C:\\x", "a", EINVAL, NULL);
+    EXPECT_LINK(INCOMING_DIR L"2\\link", "a", EINVAL, NULL);
+}
+
+static char* RepeatString(IN const char* part, IN size_t count)
+{
+    size_t partSize = strlen(part);
+    char* result = malloc(partSize * count + 1);
+
+    if (!result)
+        return NULL;
+
+    for (size_t i = 0; i < count; i++)
+        memcpy(result + i * partSize, part, partSize);
+    result[partSize * count] = '\0';
+    return result;
+}
+
+static void LongPathTests(void)
+{
+    // longest name that fits: the root, a separator, the name and the terminator
+    size_t longest = MAX_PATH_LONG - INCOMING_DIR_LENGTH - 2;
+    char* path;
+
+    path = RepeatString("a", longest);
+    if (TEST_CHECK(path != NULL))
+    {
+        TEST_CHECK(ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path) == 0);
+        TEST_CHECK(wcslen(g_Path) == MAX_PATH_LONG - 1);
+        free(path);
+    }
+
+    path = RepeatString("a", longest + 1);
+    if (TEST_CHECK(path != NULL))
+    {
+        TEST_CHECK(ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path) == EINVAL);
+        free(path);
+    }
+
+    // doesn't fit the conversion buffer
+    path = RepeatString("a", MAX_PATH_LONG);
+    if (TEST_CHECK(path != NULL))
+    {
+        TEST_CHECK(ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path) == EINVAL);
+        free(path);
+    }
+
+    // too long only before resolving, the limit applies to the result
+    path = RepeatString("a/../", 6000);
+    if (TEST_CHECK(path != NULL))
+    {
+        TEST_CHECK(ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path) == 0);
+        TEST_CHECK(wcscmp(g_Path, INCOMING_DIR) == 0);
+        free(path);
+    }
+
+    // fits the conversion buffer, the result doesn't
+    path = RepeatString("a/", (MAX_PATH_LONG - 2) / 2);
+    if (TEST_CHECK(path != NULL))
+    {
+        TEST_CHECK(ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path) == EINVAL);
+        free(path);
+    }
+}
+
+// Name components for the fuzz test, with their resolved form.
+static const struct
+{
+    const char* Name;
+    const WCHAR* Resolved; // NULL for "." and "..", empty for nothing
+} g_Components[] =
+{
+    { "a", L"a" },
+    { "bc", L"bc" },
+    { "x:y", L"x_y" },
+    { "\xc3\xa9", L"\x00e9" },
+    { "", L"" },
+    { ".", NULL },
+    { "..", NULL },
+    { "..", NULL },
+};
+
+static ULONG g_Random = 1;
+
+static ULONG Random(IN ULONG range)
+{
+    g_Random = g_Random * 1103515245 + 12345;
+    return (g_Random >> 16) % range;
+}
+
+// Build a random relative path and resolve it with a simple component stack.
+// Returns FALSE if the path goes above the start (the stack holds 'depth' components already).
+static BOOL RandomPath(OUT char* path, IN size_t pathSize, IN OUT ULONG* stack, IN OUT ULONG* depth)
+{
+    ULONG components = 1 + Random(FUZZ_MAX_COMPONENTS);
+    BOOL valid = TRUE;
+
+    path[0] = '\0';
+    for (ULONG i = 0; i < components; i++)
+    {
+        ULONG component;
+
+        // an empty first component would make the path absolute
+        do
+        {
+            component = Random(ARRAYSIZE(g_Components));
+        } while (i == 0 && g_Components[component].Name[0] == '\0');
+
+        if (i > 0)
+            strcat_s(path, pathSize, Random(2) ? "/" : "\\");
+        strcat_s(path, pathSize, g_Components[component].Name);
+
+        if (strcmp(g_Components[component].Name, "..") == 0)
+        {
+            if (*depth == 0)
+                valid = FALSE;
+            else
+                (*depth)--;
+        }
+        else if (g_Components[component].Resolved && g_Components[component].Resolved[0])
+        {
+            stack[(*depth)++] = component;
+        }
+    }
+
+    return valid;
+}
+
+// path needs space for MAX_PATH WCHARs
+static void BuildPath(IN const ULONG* stack, IN ULONG depth, OUT WCHAR* path)
+{
+    wcscpy_s(path, MAX_PATH, INCOMING_DIR);
+    for (ULONG i = 0; i < depth; i++)
+    {
+        wcscat_s(path, MAX_PATH, L"\\");
+        wcscat_s(path, MAX_PATH, g_Components[stack[i]].Resolved);
+    }
+}
+
+// Random names and link targets compared with a straightforward model. Nothing may resolve
+// outside of the incoming dir.
+static void FuzzTest(void)
+{
+    char path[FUZZ_MAX_COMPONENTS * 4 + 1];
+    WCHAR link[MAX_PATH];
+    WCHAR expected[MAX_PATH];
+    ULONG stack[FUZZ_MAX_COMPONENTS * 2];
+    ULONG depth;
+    ULONG linkDepth;
+    int status;
+
+    for (ULONG i = 0; i < FUZZ_ITERATIONS; i++)
+    {
+        BOOL valid;
+
+        depth = 0;
+        valid = RandomPath(path, sizeof(path), stack, &depth);
+        status = ResolveUntrustedPath(INCOMING_DIR, path, NULL, g_Path);
+        if (!valid)
+        {
+            TEST_CHECK(status == EINVAL);
+            continue;
+        }
+
+        BuildPath(stack, depth, expected);
+        if (!TEST_CHECK(status == 0 && wcscmp(g_Path, expected) == 0))
+            continue;
+
+        // a link with this name, the target is relative to the directory containing it
+        if (depth == 0)
+            continue;
+
+        wcscpy_s(link, ARRAYSIZE(link), g_Path);
+        linkDepth = depth - 1;
+        valid = RandomPath(path, sizeof(path), stack, &linkDepth);
+        status = ResolveUntrustedPath(INCOMING_DIR, path, link, g_Path);
+        if (!valid)
+        {
+            TEST_CHECK(status == EINVAL);
+            continue;
+        }
+
+        BuildPath(stack, linkDepth, expected);
+        TEST_CHECK(status == 0 && wcscmp(g_Path, expected) == 0);
+    }
+}
+
+// The decoder before the SSE2 ASCII fast path was added, the reference for xutftowcsn.
+static int ScalarUtfToWcsn(wchar_t *wcs, const char *utfs, size_t wcslen, int utflen)
+{
+    int upos = 0, wpos = 0;
+    const unsigned char *utf = (const unsigned char*) utfs;
+    if (!utf || !wcs || wcslen < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* reserve space for \0 */
+    wcslen--;
+    if (utflen < 0)
+        utflen = INT_MAX;
+
+    while (upos < utflen) {
+        int c = utf[upos++] & 0xff;
+        if (utflen == INT_MAX && c == 0)
+            break;
+
+        if (wpos >= (int)wcslen) {
+            wcs[wpos] = 0;
+            errno = ERANGE;
+            return -1;
+        }
+
+        if (c < 0x80) {
+            /* ASCII */
+            if (c == ':') {
+                c = '_';
+            } else if (c == '/') {
+                // CanonicalizePath... APIs don't change slashes to backslashes
+                // this is needed to properly compare normalized path prefixes
+                c = '\\';
+            }
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xc2 && c < 0xe0 && upos < utflen &&
+                   (utf[upos] & 0xc0) == 0x80) {
+            /* 2-byte utf-8 */
+            c = ((c & 0x1f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xe0 && c < 0xf0 && upos + 1 < utflen &&
+                   !(c == 0xe0 && utf[upos] < 0xa0) && /* over-long encoding */
+                   (utf[upos] & 0xc0) == 0x80 &&
+                   (utf[upos + 1] & 0xc0) == 0x80) {
+            /* 3-byte utf-8 */
+            c = ((c & 0x0f) << 12);
+            c |= ((utf[upos++] & 0x3f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else if (c >= 0xf0 && c < 0xf5 && upos + 2 < utflen &&
+                   wpos + 1 < wcslen &&
+                   !(c == 0xf0 && utf[upos] < 0x90) && /* over-long encoding */
+                   !(c == 0xf4 && utf[upos] >= 0x90) && /* > \u10ffff */
+                   (utf[upos] & 0xc0) == 0x80 &&
+                   (utf[upos + 1] & 0xc0) == 0x80 &&
+                   (utf[upos + 2] & 0xc0) == 0x80) {
+            /* 4-byte utf-8: convert to \ud8xx \udcxx surrogate pair */
+            c = ((c & 0x07) << 18);
+            c |= ((utf[upos++] & 0x3f) << 12);
+            c |= ((utf[upos++] & 0x3f) << 6);
+            c |= (utf[upos++] & 0x3f);
+            c -= 0x10000;
+            assert((0xd800 | (c >> 10)) <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)(0xd800 | (c >> 10));
+            assert((0xdc00 | (c & 0x3ff)) <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)(0xdc00 | (c & 0x3ff));
+        } else if (c >= 0xa0) {
+            /* invalid utf-8 byte, printable unicode char: convert 1:1 */
+            assert(c <= WCHAR_MAX);
+            wcs[wpos++] = (wchar_t)c;
+        } else {
+            /* invalid utf-8 byte, non-printable unicode: convert to hex */
+            static const char *hex = "0123456789abcdef";
+            wcs[wpos++] = hex[c >> 4];
+            if (wpos < wcslen)
+                wcs[wpos++] = hex[c & 0x0f];
+        }
+    }
+    wcs[wpos] = 0;
+    return wpos;
+}
+
+// Run both decoders on the same input and output size, compare results, errno and the whole output buffer.
+static BOOL CompareDecoders(IN const char* input, IN int inputSize, IN size_t outputLength)
+{
+    WCHAR expected[2 * DECODE_MAX_INPUT + 8];
+    WCHAR actual[2 * DECODE_MAX_INPUT + 8];
+    int expectedResult, actualResult;
+    int expectedErrno, actualErrno;
+
+    for (size_t i = 0; i < ARRAYSIZE(expected); i++)
+        expected[i] = actual[i] = DECODE_GUARD;
+
+    errno = 0;
+    expectedResult = ScalarUtfToWcsn(expected, input, outputLength, inputSize);
+    expectedErrno = errno;
+    errno = 0;
+    actualResult = xutftowcsn(actual, input, outputLength, inputSize);
+    actualErrno = errno;
+
+    return actualResult == expectedResult && (actualResult >= 0 || actualErrno == expectedErrno) &&
+        memcmp(actual, expected, sizeof(actual)) == 0;
+}
+
+// Bytes that exercise every branch: mapped and plain ASCII, continuation bytes, valid and invalid
+// lead bytes, and the second bytes that make 3 and 4 byte sequences overlong or too big.
+static char RandomByte(void)
+{
+    static const BYTE special[] = { ':', '/', '\\', '.', 0, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf,
+        0xc0, 0xc1, 0xc2, 0xdf, 0xe0, 0xed, 0xef, 0xf0, 0xf4, 0xf5, 0xff };
+
+    switch (Random(4))
+    {
+    case 0:
+        return (char)special[Random(ARRAYSIZE(special))];
+    case 1:
+        return (char)(0x80 | Random(0x40)); // continuation
+    case 2:
+        return (char)Random(256);
+    default:
+        return (char)('a' + Random(26));
+    }
+}
+
+static void DecodeRandomTest(void)
+{
+    char input[DECODE_MAX_INPUT + 1];
+
+    for (ULONG i = 0; i < DECODE_ITERATIONS; i++)
+    {
+        ULONG size = Random(DECODE_MAX_INPUT + 1);
+        // mostly ASCII runs so that the fast path is taken, with a few other bytes mixed in
+        ULONG mix = Random(4);
+        size_t outputLength;
+
+        for (ULONG b = 0; b < size; b++)
+            input[b] = Random(8) < mix ? RandomByte() : (char)(' ' + Random(0x5f));
+        input[size] = '\0';
+
+        // too small, exactly enough for ASCII, and enough for anything
+        switch (Random(3))
+        {
+        case 0:
+            outputLength = Random(size + 2);
+            break;
+        case 1:
+            outputLength = size + 1;
+            break;
+        default:
+            outputLength = 2 * (size_t)size + 1;
+            break;
+        }
+
+        // explicit size (embedded NULs are converted) or terminated
+        if (!TEST_CHECK(CompareDecoders(input, Random(2) ? (int)size : -1, outputLength)))
+            break;
+    }
+}
+
+// Fast path boundaries: input and output sizes around multiples of 16, a single special byte at every position.
+static void DecodeBoundaryTest(void)
+{
+    static const char special[] = { ':', '/', '\0', (char)0x80, (char)0xc3, (char)0xe2, (char)0xf0, (char)0xff };
+    char input[DECODE_MAX_INPUT + 1];
+
+    for (int size = 0; size <= 48; size++)
+    {
+        for (int position = -1; position < size; position++)
+        {
+            for (size_t s = 0; s < ARRAYSIZE(special); s++)
+            {
+                for (int i = 0; i < size; i++)
+                    input[i] = (char)('A' + i % 26);
+                if (position >= 0)
+                    input[position] = special[s];
+                input[size] = '\0';
+
+                for (size_t outputLength = max(size, 2) - 1; outputLength <= (size_t)size + 2; outputLength++)
+                {
+                    TEST_CHECK(CompareDecoders(input, size, outputLength));
+                    TEST_CHECK(CompareDecoders(input, -1, outputLength));
+                }
+
+                // same result for every special byte
+                if (position < 0)
+                    break;
+            }
+        }
+    }
+
+    TEST_CHECK(CompareDecoders(input, 0, 0));
+    TEST_CHECK(CompareDecoders(NULL, 0, 4));
+}
+
+// A terminated name that ends right before an inaccessible page: the fast path must not read past the terminator.
+static void DecodePageEndTest(void)
+{
+    SYSTEM_INFO info;
+    BYTE* pages;
+    DWORD oldProtect;
+    WCHAR output[DECODE_MAX_INPUT + 1];
+
+    GetSystemInfo(&info);
+    pages = VirtualAlloc(NULL, 2 * (size_t)info.dwPageSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!TEST_CHECK(pages != NULL))
+        return;
+
+    if (TEST_CHECK(VirtualProtect(pages + info.dwPageSize, info.dwPageSize, PAGE_NOACCESS, &oldProtect)))
+    {
+        for (int size = 0; size < 40; size++)
+        {
+            char* input = (char*)pages + info.dwPageSize - size - 1;
+
+            memset(input, 'x', size);
+            input[size] = '\0';
+            TEST_CHECK(xutftowcsn(output, input, ARRAYSIZE(output), -1) == size);
+            // an explicit size that ends at the page end
+            TEST_CHECK(xutftowcsn(output, input + 1, ARRAYSIZE(output), size) == size);
+        }
+    }
+
+    VirtualFree(pages, 0, MEM_RELEASE);
+}
+
+void SanitizeTests(void)
+{
+    ResolveTests();
+    LinkTests();
+    LongPathTests();
+    FuzzTest();
+    DecodeRandomTest();
+    DecodeBoundaryTest();
+    DecodePageEndTest();
+}
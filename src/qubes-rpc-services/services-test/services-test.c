@@ -0,0 +1,215 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Self-contained tests of the parts of the RPC services that process untrusted input.
+// Doesn't touch the clipboard, files are only created in %TEMP%, can run anywhere.
+// With -b it also benchmarks the service executables built next to it.
+
+#include <windows.h>
+#include <strsafe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+static ULONG g_Checks = 0;
+static ULONG g_Failures = 0;
+
+BOOL TestCheck(IN BOOL result, IN const char* expression, IN const char* file, IN int line)
+{
+    g_Checks++;
+    if (!result)
+    {
+        g_Failures++;
+        fprintf(stderr, "%s(%d): check failed: %s\n", file, line, expression);
+    }
+
+    return result;
+}
+
+typedef struct _STDIN_WRITER
+{
+    HANDLE Pipe;
+    const BYTE* Data;
+    size_t Size;
+} STDIN_WRITER;
+
+// Feeds the service's stdin so that a service which writes before it reads everything can't deadlock.
+static DWORD WINAPI StdinWriterThread(IN void* param)
+{
+    STDIN_WRITER* writer = param;
+    size_t offset = 0;
+
+    while (offset < writer->Size)
+    {
+        DWORD written;
+
+        if (!WriteFile(writer->Pipe, writer->Data + offset, (DWORD)min(writer->Size - offset, 1024 * 1024), &written, NULL))
+            break;
+        offset += written;
+    }
+
+    CloseHandle(writer->Pipe);
+    return 0;
+}
+
+DWORD TestRunService(IN const WCHAR* exeName, IN const WCHAR* arguments OPTIONAL, IN const void* input OPTIONAL,
+    IN size_t inputSize, OUT char** output, OUT size_t* outputSize, OUT ULONG64* ms)
+{
+    SECURITY_ATTRIBUTES inherit = { sizeof(inherit), NULL, TRUE };
+    STARTUPINFO si = { sizeof(si) };
+    PROCESS_INFORMATION pi = { 0 };
+    STDIN_WRITER writer = { NULL, input, inputSize };
+    HANDLE stdinRead = NULL, stdoutRead = NULL, stdoutWrite = NULL;
+    HANDLE writerThread = NULL;
+    WCHAR exePath[MAX_PATH];
+    WCHAR* commandLine = NULL;
+    size_t commandLineLength;
+    size_t capacity = 65536;
+    DWORD exitCode = (DWORD)-1;
+    ULONG64 start;
+    WCHAR* slash;
+
+    *output = NULL;
+    *outputSize = 0;
+    *ms = 0;
+
+    // the service is next to this executable
+    if (GetModuleFileName(NULL, exePath, ARRAYSIZE(exePath)) == ARRAYSIZE(exePath))
+        return exitCode;
+    slash = wcsrchr(exePath, L'\\');
+    if (!slash)
+        return exitCode;
+    slash[1] = L'\0';
+    if (FAILED(StringCchCat(exePath, ARRAYSIZE(exePath), exeName)))
+        return exitCode;
+
+    commandLineLength = wcslen(exePath) + (arguments ? wcslen(arguments) : 0) + 4;
+    commandLine = malloc(commandLineLength * sizeof(WCHAR));
+    *output = malloc(capacity);
+    if (!commandLine || !*output)
+        goto cleanup;
+    StringCchPrintf(commandLine, commandLineLength, L"\"%s\" %s", exePath, arguments ? arguments : L"");
+
+    // only the child's ends are inheritable
+    if (!CreatePipe(&stdinRead, &writer.Pipe, &inherit, 0) || !CreatePipe(&stdoutRead, &stdoutWrite, &inherit, 0))
+        goto cleanup;
+    SetHandleInformation(writer.Pipe, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(stdoutRead, HANDLE_FLAG_INHERIT, 0);
+
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = stdinRead;
+    si.hStdOutput = stdoutWrite;
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+    start = GetTickCount64();
+    if (!CreateProcess(exePath, commandLine, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+    {
+        fprintf(stderr, "failed to run %S: %lu\n", exePath, GetLastError());
+        goto cleanup;
+    }
+
+    // close our copies of the child's ends so that the pipes break when it exits
+    CloseHandle(stdinRead);
+    stdinRead = NULL;
+    CloseHandle(stdoutWrite);
+    stdoutWrite = NULL;
+
+    writerThread = CreateThread(NULL, 0, StdinWriterThread, &writer, 0, NULL);
+    if (!writerThread)
+        CloseHandle(writer.Pipe);
+    writer.Pipe = NULL; // owned by the thread
+
+    while (TRUE)
+    {
+        DWORD read;
+
+        if (*outputSize == capacity)
+        {
+            char* grown = realloc(*output, capacity * 2);
+
+            if (!grown)
+                break;
+            *output = grown;
+            capacity *= 2;
+        }
+
+        if (!ReadFile(stdoutRead, *output + *outputSize, (DWORD)min(capacity - *outputSize, MAXDWORD), &read, NULL) ||
+            read == 0)
+            break;
+        *outputSize += read;
+    }
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    *ms = GetTickCount64() - start;
+    if (writerThread)
+        WaitForSingleObject(writerThread, INFINITE);
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+
+cleanup:
+    if (pi.hProcess)
+        CloseHandle(pi.hProcess);
+    if (pi.hThread)
+        CloseHandle(pi.hThread);
+    if (writerThread)
+        CloseHandle(writerThread);
+    if (writer.Pipe)
+        CloseHandle(writer.Pipe);
+    if (stdinRead)
+        CloseHandle(stdinRead);
+    if (stdoutRead)
+        CloseHandle(stdoutRead);
+    if (stdoutWrite)
+        CloseHandle(stdoutWrite);
+    free(commandLine);
+    return exitCode;
+}
+
+int main(int argc, char* argv[])
+{
+    ClipboardTests();
+    ClipboardFormatTests();
+    SanitizeTests();
+    IconCacheTests();
+    ConvertTests();
+    ResampleTests();
+    DirCacheTests();
+    FileTimesTests();
+    WriterTests();
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        AppMenusBenchmark();
+        ResampleBenchmark();
+        ClipboardBenchmark();
+        DirCacheBenchmark();
+    }
+
+    if (g_Failures > 0)
+    {
+        fprintf(stderr, "%lu of %lu checks failed\n", g_Failures, g_Checks);
+        return 1;
+    }
+
+    printf("all %lu checks passed\n", g_Checks);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Minimal checking helpers for services-test. A failed check is reported with its location
+// and the test run continues, the process exit code tells if anything failed.
+
+#pragma once
+#include <windows.h>
+
+#define TEST_CHECK(condition) TestCheck(!!(condition), #condition, __FILE__, __LINE__)
+
+/**
+ * @brief Record the result of a check, report it if it failed.
+ * @return The result.
+ */
+BOOL TestCheck(IN BOOL result, IN const char* expression, IN const char* file, IN int line);
+
+/**
+ * @brief Run a service executable from the directory of services-test.exe.
+ * @param arguments Command line arguments, without the executable name.
+ * @param input Written to the service's stdin, which is then closed.
+ * @param output Everything the service wrote to stdout, free() it.
+ * @param ms Time from process start to exit.
+ * @return Exit code of the service, or (DWORD)-1 if it couldn't be run.
+ */
+DWORD TestRunService(IN const WCHAR* exeName, IN const WCHAR* arguments OPTIONAL, IN const void* input OPTIONAL,
+    IN size_t inputSize, OUT char** output, OUT size_t* outputSize, OUT ULONG64* ms);
+
+void ClipboardTests(void);
+void ClipboardFormatTests(void);
+void SanitizeTests(void);
+void IconCacheTests(void);
+void ConvertTests(void);
+void ResampleTests(void);
+void DirCacheTests(void);
+void FileTimesTests(void);
+void WriterTests(void); // leaves a write failure behind, so it runs last
+
+// Benchmarks, only run with -b. Some of them run the service executables, see TestRunService.
+void AppMenusBenchmark(void);
+void ClipboardBenchmark(void);
+void ResampleBenchmark(void);
+void DirCacheBenchmark(void);
@@ -0,0 +1,292 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests of file-receiver's writer threads: data written in buffers of many files at once ends
+// up at the right offsets and times are set after the last write, and the first file a write
+// fails for is the one reported while writes queued after it are still completed.
+// Uses a directory in %TEMP%.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "writer.h"
+#include "test.h"
+
+#define WRITER_TEST_FILES     40
+#define WRITER_TEST_BIG_SIZE  (2ULL * WRITER_BUFFERS * WRITER_BUFFER_SIZE + 1234) // cycles through the pool
+#define WRITER_TEST_FAIL_WAIT 10000 // ms
+
+static WCHAR g_Dir[MAX_PATH];
+
+// The byte at every offset is different from its neighbours and from other files at the same offset.
+static BYTE PatternByte(IN UINT64 offset, IN ULONG seed)
+{
+    return (BYTE)(offset * 31 + (offset >> 12) + seed * 7);
+}
+
+static UINT64 TestFileSize(IN ULONG index)
+{
+    static const UINT64 sizes[] = { 0, 1, WRITER_BUFFER_SIZE - 1, WRITER_BUFFER_SIZE, WRITER_BUFFER_SIZE + 1,
+        3 * WRITER_BUFFER_SIZE + 7 };
+
+    return sizes[index % ARRAYSIZE(sizes)] + index / ARRAYSIZE(sizes) * 4099;
+}
+
+static void TestFilePath(IN ULONG index, OUT WCHAR* path)
+{
+    swprintf_s(path, MAX_PATH, L"%s\\file%02lu", g_Dir, index);
+}
+
+static WRITER_FILE* OpenTestFile(IN ULONG index, IN BOOL writable)
+{
+    WCHAR path[MAX_PATH];
+    char name[32];
+    HANDLE handle;
+
+    TestFilePath(index, path);
+    sprintf_s(name, sizeof(name), "file%02lu", index);
+    // a handle without write access makes every write fail
+    handle = CreateFile(path, writable ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_NEW, 0, NULL);
+    if (!TEST_CHECK(handle != INVALID_HANDLE_VALUE))
+        return NULL;
+
+    return WriterOpen(handle, name);
+}
+
+// Queue the next buffer of a file, returns the new offset.
+static UINT64 WriteNext(IN WRITER_FILE* file, IN ULONG seed, IN UINT64 offset, IN UINT64 size)
+{
+    BYTE* buffer = WriterGetBuffer();
+    DWORD chunk = (DWORD)min(size - offset, WRITER_BUFFER_SIZE);
+
+    for (DWORD i = 0; i < chunk; i++)
+        buffer[i] = PatternByte(offset + i, seed);
+
+    WriterWrite(file, buffer, chunk, offset);
+    return offset + chunk;
+}
+
+static FILETIME TestFileTime(IN ULONG index, IN BOOL access)
+{
+    FILETIME time = { (DWORD)(0x10000000 + index * 1000 + access), 0x01d00000 + index };
+
+    return time;
+}
+
+// Check the contents, times and that the writer closed the handle (the file can be opened exclusively).
+static BOOL CheckFile(IN ULONG index, IN UINT64 size, IN BOOL checkTimes)
+{
+    static BYTE buffer[WRITER_BUFFER_SIZE];
+    WCHAR path[MAX_PATH];
+    FILETIME accessTime, modificationTime;
+    FILETIME expectedAccess = TestFileTime(index, TRUE);
+    FILETIME expectedModification = TestFileTime(index, FALSE);
+    LARGE_INTEGER fileSize;
+    HANDLE handle;
+    BOOL same = TRUE;
+
+    TestFilePath(index, path);
+    handle = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    // before reading, that can update the access time
+    if (checkTimes)
+    {
+        same = GetFileTime(handle, NULL, &accessTime, &modificationTime) &&
+            CompareFileTime(&accessTime, &expectedAccess) == 0 && CompareFileTime(&modificationTime, &expectedModification) == 0;
+    }
+
+    if (!GetFileSizeEx(handle, &fileSize) || (UINT64)fileSize.QuadPart != size)
+        same = FALSE;
+
+    for (UINT64 offset = 0; same && offset < size; )
+    {
+        DWORD read;
+
+        if (!ReadFile(handle, buffer, sizeof(buffer), &read, NULL) || read == 0)
+        {
+            same = FALSE;
+            break;
+        }
+
+        for (DWORD i = 0; i < read && same; i++)
+            same = buffer[i] == PatternByte(offset + i, index);
+        offset += read;
+    }
+
+    CloseHandle(handle);
+    return same;
+}
+
+// One file bigger than the whole buffer pool, written in order.
+static void BigFileTest(void)
+{
+    WRITER_FILE* file = OpenTestFile(0, TRUE);
+    FILETIME accessTime = TestFileTime(0, TRUE);
+    FILETIME modificationTime = TestFileTime(0, FALSE);
+    const char* failedName;
+
+    if (!file)
+        return;
+
+    for (UINT64 offset = 0; offset < WRITER_TEST_BIG_SIZE; )
+        offset = WriteNext(file, 0, offset, WRITER_TEST_BIG_SIZE);
+    WriterClose(file, &accessTime, &modificationTime);
+
+    TEST_CHECK(WriterFlush(&failedName) && failedName == NULL);
+    TEST_CHECK(CheckFile(0, WRITER_TEST_BIG_SIZE, TRUE));
+}
+
+// Buffers of many files queued round-robin, so the threads write and close them in any order.
+// Every other file is closed without times.
+static void InterleavedTest(void)
+{
+    WRITER_FILE* files[WRITER_TEST_FILES];
+    UINT64 offsets[WRITER_TEST_FILES] = { 0 };
+    BOOL writing[WRITER_TEST_FILES];
+    ULONG openCount = 0;
+    const char* failedName;
+
+    for (ULONG i = 1; i < WRITER_TEST_FILES; i++)
+    {
+        files[i] = OpenTestFile(i, TRUE);
+        writing[i] = files[i] != NULL;
+        if (writing[i])
+            openCount++;
+    }
+
+    while (openCount > 0)
+    {
+        for (ULONG i = 1; i < WRITER_TEST_FILES; i++)
+        {
+            if (!writing[i])
+                continue;
+
+            if (offsets[i] < TestFileSize(i))
+            {
+                offsets[i] = WriteNext(files[i], i, offsets[i], TestFileSize(i));
+                continue;
+            }
+
+            if (i % 2 == 0)
+            {
+                FILETIME accessTime = TestFileTime(i, TRUE);
+                FILETIME modificationTime = TestFileTime(i, FALSE);
+
+                WriterClose(files[i], &accessTime, &modificationTime);
+            }
+            else
+            {
+                WriterClose(files[i], NULL, NULL);
+            }
+
+            writing[i] = FALSE;
+            openCount--;
+        }
+    }
+
+    TEST_CHECK(WriterFlush(&failedName) && failedName == NULL);
+    for (ULONG i = 1; i < WRITER_TEST_FILES; i++)
+        TEST_CHECK(CheckFile(i, TestFileSize(i), i % 2 == 0));
+}
+
+// Write a whole file and close it.
+static void WriteTestFile(IN ULONG index, IN BOOL writable)
+{
+    WRITER_FILE* file = OpenTestFile(index, writable);
+
+    if (!file)
+        return;
+
+    for (UINT64 offset = 0; offset < TestFileSize(index); )
+        offset = WriteNext(file, index, offset, TestFileSize(index));
+    WriterClose(file, NULL, NULL);
+}
+
+// A file whose writes fail, then files written normally and another one that fails:
+// the first one is reported and everything queued after it is still written and closed.
+// The failure stays for the rest of the process, so this runs last.
+static void FailureTest(void)
+{
+    const ULONG first = WRITER_TEST_FILES;
+    const ULONG second = WRITER_TEST_FILES + 2;
+    const char* failedName;
+    char firstName[32];
+    ULONG64 start;
+
+    sprintf_s(firstName, sizeof(firstName), "file%02lu", first);
+    TEST_CHECK(!WriterFailed(&failedName) && failedName == NULL);
+
+    WriteTestFile(first, FALSE);
+    // the reader checks after every file, it doesn't wait for the writes
+    start = GetTickCount64();
+    while (!WriterFailed(&failedName) && GetTickCount64() - start < WRITER_TEST_FAIL_WAIT)
+        Sleep(1);
+    if (!TEST_CHECK(failedName != NULL && strcmp(failedName, firstName) == 0))
+        return;
+
+    WriteTestFile(first + 1, TRUE);
+    WriteTestFile(second, FALSE);
+    WriteTestFile(second + 1, TRUE);
+
+    TEST_CHECK(!WriterFlush(&failedName) && failedName != NULL && strcmp(failedName, firstName) == 0);
+    TEST_CHECK(CheckFile(first + 1, TestFileSize(first + 1), FALSE));
+    TEST_CHECK(CheckFile(second + 1, TestFileSize(second + 1), FALSE));
+    // the failed ones are closed too, and nothing was written to them
+    TEST_CHECK(CheckFile(first, 0, FALSE));
+    TEST_CHECK(CheckFile(second, 0, FALSE));
+}
+
+static void RemoveTestDir(void)
+{
+    WCHAR path[MAX_PATH];
+
+    for (ULONG i = 0; i < WRITER_TEST_FILES + 4; i++)
+    {
+        TestFilePath(i, path);
+        DeleteFile(path);
+    }
+    RemoveDirectory(g_Dir);
+}
+
+void WriterTests(void)
+{
+    WCHAR tempPath[MAX_PATH];
+
+    if (!TEST_CHECK(GetTempPath(ARRAYSIZE(tempPath), tempPath) != 0))
+        return;
+    swprintf_s(g_Dir, ARRAYSIZE(g_Dir), L"%sservices-test-writer-%lu", tempPath, GetCurrentProcessId());
+    RemoveTestDir();
+
+    if (!TEST_CHECK(CreateDirectory(g_Dir, NULL)) || !TEST_CHECK(WriterInit() == ERROR_SUCCESS))
+        goto cleanup;
+
+    BigFileTest();
+    InterleavedTest();
+    FailureTest();
+
+cleanup:
+    RemoveTestDir();
+    TEST_CHECK(GetFileAttributes(g_Dir) == INVALID_FILE_ATTRIBUTES);
+}
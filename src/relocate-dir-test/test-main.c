@@ -0,0 +1,1094 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Tests that an interrupted relocation resumes correctly. Each relocation runs in a child
+// process that fault injection terminates after a random number of files, like a power loss
+// during the boot-time relocation would. Other tests check what is copied besides file data.
+// Needs an elevated prompt, works in %TEMP%.
+//
+// Usage: relocate-dir-test [seed]
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test-nt.h"
+
+#define TEST_DIRS           16
+#define TEST_FILES          3200 // several journal checkpoints
+#define TEST_LARGE_EVERY    800 // every Nth file is large
+#define TEST_LARGE_SIZE     (5 * 1024 * 1024) // over COPY_LARGE_FILE_SIZE
+#define TEST_MAX_SMALL_SIZE 8192
+#define TEST_BIG_DIR_FILES  2000 // enough long names to grow the enumeration buffer
+#define TEST_DEPTH          40 // more than the initial number of per-depth buffers
+#define TEST_DEPTH_FILES    4
+#define TEST_SPARSE_SIZE    (64 * 1024 * 1024)
+#define TEST_SPARSE_RANGES  3 // allocated ranges of a sparse stream, one per quarter
+#define TEST_SPARSE_RANGE   (64 * 1024)
+#define TEST_MAX_RANGES     64
+#define TEST_READONLY_EVERY 10
+#define TEST_BLOCKED_FILE   (8 * TEST_DIRS) // early in d00, locked while the source is deleted
+#define TEST_DELETE_SLACK   64 // deletes that may still complete after the first failure, well below COPY_QUEUE_SIZE
+#define TEST_SECURITY_EVERY 97 // every Nth file gets its own descriptor
+#define TEST_SECURITY_DIR   3 // directory that denies adding files
+#define TEST_FILE_SDDL      L"O:BAD:P(A;;FA;;;BA)(A;;FR;;;WD)"
+#define TEST_DISTINCT_SDS   600 // more distinct descriptors than the cache interns
+#define TEST_DIR_SDDL       L"D:P(D;;0x6;;;WD)(A;OICI;FA;;;WD)" // 0x6: FILE_ADD_FILE | FILE_ADD_SUBDIRECTORY
+
+#define JOURNAL_PHASE_COPY_DONE 1 // see journal.h
+
+// Exit status of a child terminated by fault injection (COPY_FAULT_STATUS).
+#define FAULT_STATUS        STATUS_REQUEST_ABORTED
+
+#define CHECK(condition) Check(!!(condition), #condition, __LINE__)
+
+static ULONG g_Checks = 0;
+static ULONG g_Failures = 0;
+
+static WCHAR g_Root[MAX_PATH];
+static WCHAR g_Source[MAX_PATH];
+static WCHAR g_Target[MAX_PATH];
+static BYTE *g_Expected = NULL; // TEST_LARGE_SIZE
+static BYTE *g_Actual = NULL; // TEST_LARGE_SIZE
+static TEST_STATS g_Stats; // of the last RunRelocation
+
+static BOOL Check(IN BOOL result, IN const char *expression, IN int line)
+{
+    g_Checks++;
+    if (!result)
+    {
+        g_Failures++;
+        fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, line, expression);
+    }
+
+    return result;
+}
+
+void TestPrint(const wchar_t *message)
+{
+    fputws(message, stdout);
+}
+
+static DWORD FileSize(IN ULONG index)
+{
+    if (index % TEST_LARGE_EVERY == 0)
+        return TEST_LARGE_SIZE;
+    return (index * 7919) % TEST_MAX_SMALL_SIZE;
+}
+
+static void FileContent(IN ULONG index, OUT BYTE *buffer, IN DWORD size)
+{
+    for (DWORD i = 0; i < size; i++)
+        buffer[i] = (BYTE)(index * 31 + i * 7 + (i >> 8));
+}
+
+static void FilePath(IN const WCHAR *root, IN ULONG index, OUT WCHAR *path)
+{
+    swprintf_s(path, MAX_PATH, L"%s\\d%02lu\\f%05lu.dat", root, index % TEST_DIRS, index);
+}
+
+static BOOL WriteTestFile(IN const WCHAR *path, IN ULONG index)
+{
+    HANDLE file;
+    DWORD size, written;
+    BOOL ok;
+
+    file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    size = FileSize(index);
+    FileContent(index, g_Expected, size);
+    ok = WriteFile(file, g_Expected, size, &written, NULL) && written == size;
+    CloseHandle(file);
+    return ok;
+}
+
+static BOOL TestFileMatches(IN const WCHAR *path, IN ULONG index)
+{
+    HANDLE file;
+    DWORD size, read;
+    BOOL match;
+
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    size = FileSize(index);
+    FileContent(index, g_Expected, size);
+    // One byte more than expected to detect files that are too long.
+    match = ReadFile(file, g_Actual, size + 1, &read, NULL) && read == size &&
+        memcmp(g_Expected, g_Actual, size) == 0;
+
+    CloseHandle(file);
+    return match;
+}
+
+static BOOL CreateSourceTree(void)
+{
+    WCHAR path[MAX_PATH];
+
+    if (!CreateDirectoryW(g_Source, NULL))
+        return FALSE;
+
+    for (ULONG i = 0; i < TEST_DIRS; i++)
+    {
+        swprintf_s(path, MAX_PATH, L"%s\\d%02lu", g_Source, i);
+        if (!CreateDirectoryW(path, NULL))
+            return FALSE;
+    }
+
+    for (ULONG i = 0; i < TEST_FILES; i++)
+    {
+        FilePath(g_Source, i, path);
+        if (!WriteTestFile(path, i))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Doesn't follow reparse points, the source becomes a symlink to the target.
+static void DeleteTree(IN const WCHAR *path)
+{
+    WCHAR pattern[MAX_PATH];
+    WCHAR child[MAX_PATH];
+    WIN32_FIND_DATAW fd;
+    HANDLE find;
+    DWORD attrs = GetFileAttributesW(path);
+
+    if (attrs == INVALID_FILE_ATTRIBUTES)
+        return;
+
+    if ((attrs & FILE_ATTRIBUTE_DIRECTORY) && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT))
+    {
+        swprintf_s(pattern, MAX_PATH, L"%s\\*", path);
+        find = FindFirstFileW(pattern, &fd);
+        if (find != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+                    continue;
+                swprintf_s(child, MAX_PATH, L"%s\\%s", path, fd.cFileName);
+                DeleteTree(child);
+            } while (FindNextFileW(find, &fd));
+            FindClose(find);
+        }
+    }
+
+    if (attrs & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        RemoveDirectoryW(path);
+    }
+    else
+    {
+        if (attrs & FILE_ATTRIBUTE_READONLY)
+            SetFileAttributesW(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+        DeleteFileW(path);
+    }
+}
+
+static void Cleanup(void)
+{
+    WCHAR journal[MAX_PATH];
+
+    DeleteTree(g_Source);
+    DeleteTree(g_Target);
+    swprintf_s(journal, MAX_PATH, L"%s.journal", g_Target);
+    DeleteFileW(journal);
+}
+
+static BOOL Setup(void)
+{
+    Cleanup();
+    if (!CreateSourceTree())
+    {
+        fprintf(stderr, "creating the source tree failed: %lu\n", GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Run a relocation in a child process, see TestRelocate. Other statistics are in g_Stats.
+static NTSTATUS RunRelocationEx(IN ULONG failAfterFiles, IN ULONG flags, OUT ULONG64 *copiedFiles, OUT ULONG *ms)
+{
+    WCHAR exePath[MAX_PATH];
+    WCHAR resultPath[MAX_PATH];
+    WCHAR commandLine[4 * MAX_PATH];
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    DWORD exitCode = (DWORD)STATUS_UNSUCCESSFUL;
+    ULONGLONG start;
+    FILE *result;
+
+    ZeroMemory(&g_Stats, sizeof(g_Stats));
+    *copiedFiles = 0;
+    *ms = 0;
+    swprintf_s(resultPath, MAX_PATH, L"%s\\result.txt", g_Root);
+    DeleteFileW(resultPath);
+
+    if (!GetModuleFileNameW(NULL, exePath, MAX_PATH))
+        return STATUS_UNSUCCESSFUL;
+
+    swprintf_s(commandLine, ARRAYSIZE(commandLine), L"\"%s\" child \"%s\" \"%s\" %lu %lu \"%s\"",
+        exePath, g_Source, g_Target, failAfterFiles, flags, resultPath);
+
+    start = GetTickCount64();
+    if (!CreateProcessW(exePath, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+    {
+        fprintf(stderr, "CreateProcess failed: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    *ms = (ULONG)(GetTickCount64() - start);
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+
+    if (_wfopen_s(&result, resultPath, L"r") == 0)
+    {
+        if (fscanf_s(result, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", &g_Stats.CopiedFiles, &g_Stats.BufferGrowths,
+            &g_Stats.ClonedFiles, &g_Stats.LargeFiles, &g_Stats.Streams, &g_Stats.HoleBytes, &g_Stats.SecurityQueries,
+            &g_Stats.SecurityHits, &g_Stats.SecurityUnique, &g_Stats.SetsSkipped, &g_Stats.DeletedFiles) != 11)
+            ZeroMemory(&g_Stats, sizeof(g_Stats));
+        fclose(result);
+    }
+
+    *copiedFiles = g_Stats.CopiedFiles;
+    return (NTSTATUS)exitCode;
+}
+
+static NTSTATUS RunRelocation(IN ULONG failAfterFiles, OUT ULONG64 *copiedFiles, OUT ULONG *ms)
+{
+    return RunRelocationEx(failAfterFiles, 0, copiedFiles, ms);
+}
+
+static int ChildMain(IN WCHAR *argv[])
+{
+    TEST_STATS stats;
+    NTSTATUS status;
+    FILE *result;
+
+    // Also written for a failed relocation, only fault injection terminates the child before.
+    status = TestRelocate(argv[2], argv[3], wcstoul(argv[4], NULL, 10), wcstoul(argv[5], NULL, 10), &stats);
+    if (_wfopen_s(&result, argv[6], L"w") == 0)
+    {
+        fprintf(result, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n", stats.CopiedFiles, stats.BufferGrowths,
+            stats.ClonedFiles, stats.LargeFiles, stats.Streams, stats.HoleBytes, stats.SecurityQueries,
+            stats.SecurityHits, stats.SecurityUnique, stats.SetsSkipped, stats.DeletedFiles);
+        fclose(result);
+    }
+
+    return status;
+}
+
+static BOOL VerifyTarget(void)
+{
+    WCHAR path[MAX_PATH];
+    DWORD attrs;
+    TEST_JOURNAL journal;
+    ULONG mismatches = 0;
+
+    attrs = GetFileAttributesW(g_Source);
+    CHECK(attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_REPARSE_POINT));
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    for (ULONG i = 0; i < TEST_FILES; i++)
+    {
+        FilePath(g_Target, i, path);
+        if (!TestFileMatches(path, i))
+            mismatches++;
+    }
+
+    return CHECK(mismatches == 0);
+}
+
+static ULONG Random(IN ULONG min, IN ULONG max)
+{
+    return min + (ULONG)(((ULONG64)rand() * RAND_MAX + rand()) % (max - min + 1));
+}
+
+// Interrupted during the copy, after at least one checkpoint.
+static void ResumeCopyTest(void)
+{
+    ULONG failAfter = Random(TEST_FILES / 2, TEST_FILES - 1);
+    ULONG64 copiedFiles;
+    ULONG fullMs, resumeMs;
+    TEST_JOURNAL journal;
+
+    printf("ResumeCopyTest: fault after %lu files\n", failAfter);
+    if (!CHECK(Setup()))
+        return;
+
+    CHECK(RunRelocation(failAfter, &copiedFiles, &fullMs) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_SUCCESS);
+    CHECK(journal.Phase == 0);
+    CHECK(journal.FileRecords > 0 && journal.FileRecords <= failAfter);
+
+    CHECK(RunRelocation(0, &copiedFiles, &resumeMs) == STATUS_SUCCESS);
+    // Files in the journal are skipped, everything else is copied again.
+    CHECK(copiedFiles == TEST_FILES - journal.FileRecords);
+    printf("ResumeCopyTest: %lu files journaled, resume copied %llu files in %lu ms\n",
+        journal.FileRecords, copiedFiles, resumeMs);
+    VerifyTarget();
+}
+
+// Several interruptions in a row, including during the delete.
+static void RepeatedFaultTest(void)
+{
+    ULONG64 copiedFiles;
+    ULONG ms;
+    NTSTATUS status = FAULT_STATUS;
+
+    printf("RepeatedFaultTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    for (int run = 0; run < 4 && status == FAULT_STATUS; run++)
+    {
+        // Copy and delete both count, so a run may also finish.
+        status = RunRelocation(Random(1, 2 * TEST_FILES), &copiedFiles, &ms);
+        CHECK(status == FAULT_STATUS || status == STATUS_SUCCESS);
+    }
+
+    if (status == FAULT_STATUS)
+        CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    VerifyTarget();
+}
+
+// A record cut short by the power loss must be dropped when resuming.
+static void TornTailTest(void)
+{
+    ULONG failAfter = Random(TEST_FILES / 2, TEST_FILES - 1);
+    ULONG64 copiedFiles;
+    ULONG ms;
+    TEST_JOURNAL before, torn, resumed;
+
+    printf("TornTailTest: fault after %lu files\n", failAfter);
+    if (!CHECK(Setup()))
+        return;
+
+    CHECK(RunRelocation(failAfter, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &before) == STATUS_SUCCESS);
+
+    CHECK(TestTearJournal(g_Target) == STATUS_SUCCESS);
+    CHECK(TestReadJournal(g_Target, &torn) == STATUS_SUCCESS);
+    CHECK(torn.FileSize > before.FileSize);
+    CHECK(torn.ValidSize == before.ValidSize);
+    CHECK(torn.FileRecords == before.FileRecords);
+
+    // Stop right after loading the journal, before the next checkpoint.
+    CHECK(RunRelocation(1, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &resumed) == STATUS_SUCCESS);
+    CHECK(resumed.FileSize == before.ValidSize);
+    CHECK(resumed.FileRecords == before.FileRecords);
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES - before.FileRecords);
+    VerifyTarget();
+}
+
+// Records that fail their checksum or validation are dropped on resume, with everything after them.
+static void CorruptRecordTest(void)
+{
+    static const char *kindNames[TEST_CORRUPT_KINDS] = { "checksum", "outside path", "unterminated path", "phase" };
+    ULONG failAfter = Random(TEST_FILES / 2, TEST_FILES - 1);
+    ULONG64 copiedFiles;
+    ULONG ms;
+    TEST_JOURNAL before, corrupt, resumed;
+
+    printf("CorruptRecordTest: fault after %lu files\n", failAfter);
+    if (!CHECK(Setup()))
+        return;
+
+    CHECK(RunRelocation(failAfter, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &before) == STATUS_SUCCESS);
+
+    for (int kind = 0; kind < TEST_CORRUPT_KINDS; kind++)
+    {
+        printf("CorruptRecordTest: %s\n", kindNames[kind]);
+        CHECK(TestCorruptJournal(g_Target, kind) == STATUS_SUCCESS);
+        CHECK(TestReadJournal(g_Target, &corrupt) == STATUS_SUCCESS);
+        CHECK(corrupt.FileSize > before.FileSize);
+        CHECK(corrupt.ValidSize == before.ValidSize);
+        CHECK(corrupt.FileRecords == before.FileRecords);
+        CHECK(corrupt.Phase == before.Phase);
+
+        // Stop right after loading the journal, before the next checkpoint.
+        CHECK(RunRelocation(1, &copiedFiles, &ms) == FAULT_STATUS);
+        CHECK(TestReadJournal(g_Target, &resumed) == STATUS_SUCCESS);
+        CHECK(resumed.FileSize == before.ValidSize);
+        CHECK(resumed.FileRecords == before.FileRecords);
+    }
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES - before.FileRecords);
+    VerifyTarget();
+}
+
+// Raw reparse data of a link, without following it.
+static DWORD ReadReparseData(IN const WCHAR *path, OUT BYTE *buffer, IN DWORD size)
+{
+    HANDLE file;
+    DWORD read = 0;
+
+    file = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    if (!DeviceIoControl(file, FSCTL_GET_REPARSE_POINT, NULL, 0, buffer, size, &read, NULL))
+        read = 0;
+
+    CloseHandle(file);
+    return read;
+}
+
+// Interrupted after creating the directory for a reparse point but before setting its data.
+// The link sorts before the file directories, so it's the first file copied.
+static void ReparseResumeTest(void)
+{
+    WCHAR link[MAX_PATH];
+    BYTE expected[MAXIMUM_REPARSE_DATA_BUFFER_SIZE];
+    BYTE actual[MAXIMUM_REPARSE_DATA_BUFFER_SIZE];
+    DWORD expectedSize, actualSize;
+    ULONG64 copiedFiles;
+    ULONG ms;
+    DWORD attrs;
+    TEST_JOURNAL journal;
+
+    printf("ReparseResumeTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    swprintf_s(link, MAX_PATH, L"%s\\a-link", g_Source);
+    if (!CHECK(CreateSymbolicLinkW(link, g_Root, SYMBOLIC_LINK_FLAG_DIRECTORY)))
+        return;
+    expectedSize = ReadReparseData(link, expected, sizeof(expected));
+    CHECK(expectedSize > 0);
+
+    CHECK(RunRelocation(1, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_SUCCESS);
+    CHECK(journal.FileRecords == 0);
+    swprintf_s(link, MAX_PATH, L"%s\\a-link", g_Target);
+    attrs = GetFileAttributesW(link);
+    CHECK(attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY) && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT));
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES);
+    attrs = GetFileAttributesW(link);
+    CHECK(attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_REPARSE_POINT));
+    actualSize = ReadReparseData(link, actual, sizeof(actual));
+    CHECK(actualSize == expectedSize && memcmp(actual, expected, expectedSize) == 0);
+    VerifyTarget();
+}
+
+// Interrupted while deleting the source, nothing is copied again.
+static void ResumeDeleteTest(void)
+{
+    ULONG failAfter = TEST_FILES + Random(1, TEST_FILES - 1);
+    ULONG64 copiedFiles;
+    ULONG ms;
+    DWORD attrs;
+    TEST_JOURNAL journal;
+
+    printf("ResumeDeleteTest: fault after %lu files\n", failAfter);
+    if (!CHECK(Setup()))
+        return;
+
+    CHECK(RunRelocation(failAfter, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_SUCCESS);
+    CHECK(journal.Phase == JOURNAL_PHASE_COPY_DONE);
+    attrs = GetFileAttributesW(g_Source);
+    CHECK(attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT));
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == 0);
+    VerifyTarget();
+}
+
+static void BigDirPath(IN const WCHAR *root, IN ULONG index, OUT WCHAR *path)
+{
+    swprintf_s(path, MAX_PATH, L"%s\\d00\\big\\%0120lu.dat", root, index);
+}
+
+// Directory at depth (0 = d01\a), its subdirectory "a" sorts before its files.
+static void DeepDirPath(IN const WCHAR *root, IN ULONG depth, OUT WCHAR *path)
+{
+    swprintf_s(path, MAX_PATH, L"%s\\d01", root);
+    for (ULONG i = 0; i <= depth; i++)
+        wcscat_s(path, MAX_PATH, L"\\a");
+}
+
+static BOOL CreateDirectoryTree(void)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR filePath[MAX_PATH];
+
+    swprintf_s(path, MAX_PATH, L"%s\\d00\\big", g_Source);
+    if (!CreateDirectoryW(path, NULL))
+        return FALSE;
+
+    for (ULONG i = 0; i < TEST_BIG_DIR_FILES; i++)
+    {
+        BigDirPath(g_Source, i, path);
+        if (!WriteTestFile(path, i))
+            return FALSE;
+    }
+
+    for (ULONG depth = 0; depth < TEST_DEPTH; depth++)
+    {
+        DeepDirPath(g_Source, depth, path);
+        if (!CreateDirectoryW(path, NULL))
+            return FALSE;
+
+        for (ULONG i = 0; i < TEST_DEPTH_FILES; i++)
+        {
+            swprintf_s(filePath, MAX_PATH, L"%s\\f%lu.dat", path, i);
+            if (!WriteTestFile(filePath, depth * TEST_DEPTH_FILES + i))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOL VerifyDirectoryTree(void)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR filePath[MAX_PATH];
+    ULONG mismatches = 0;
+
+    for (ULONG i = 0; i < TEST_BIG_DIR_FILES; i++)
+    {
+        BigDirPath(g_Target, i, path);
+        if (!TestFileMatches(path, i))
+            mismatches++;
+    }
+
+    for (ULONG depth = 0; depth < TEST_DEPTH; depth++)
+    {
+        DeepDirPath(g_Target, depth, path);
+        for (ULONG i = 0; i < TEST_DEPTH_FILES; i++)
+        {
+            swprintf_s(filePath, MAX_PATH, L"%s\\f%lu.dat", path, i);
+            if (!TestFileMatches(filePath, depth * TEST_DEPTH_FILES + i))
+                mismatches++;
+        }
+    }
+
+    return CHECK(mismatches == 0);
+}
+
+// A directory big enough to grow its enumeration buffer and one nested deeper than the initial
+// per-depth buffers. Entries of a parent must stay valid while its subdirectories are enumerated.
+// Interrupted in the big directory, which is copied first.
+static void DirectoryTreeTest(void)
+{
+    const ULONG64 totalFiles = TEST_FILES + TEST_BIG_DIR_FILES + TEST_DEPTH * TEST_DEPTH_FILES;
+    ULONG failAfter = Random(1, TEST_BIG_DIR_FILES - 1);
+    ULONG64 copiedFiles;
+    ULONG ms;
+    TEST_JOURNAL journal;
+
+    printf("DirectoryTreeTest: fault after %lu files\n", failAfter);
+    if (!CHECK(Setup()) || !CHECK(CreateDirectoryTree()))
+        return;
+
+    CHECK(RunRelocation(failAfter, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_SUCCESS);
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == totalFiles - journal.FileRecords);
+    CHECK(g_Stats.BufferGrowths > 0);
+    printf("DirectoryTreeTest: %lu files journaled, resume copied %llu files in %lu ms, %llu buffer growths\n",
+        journal.FileRecords, copiedFiles, ms, g_Stats.BufferGrowths);
+    VerifyTarget();
+    VerifyDirectoryTree();
+}
+
+// Data at the start of each quarter but the last, everything else is a hole.
+static LONGLONG SparseRangeOffset(IN ULONG range)
+{
+    return (LONGLONG)range * (TEST_SPARSE_SIZE / 4);
+}
+
+static BOOL WriteSparseStream(IN const WCHAR *path, IN ULONG index)
+{
+    HANDLE file;
+    LARGE_INTEGER offset;
+    DWORD written;
+    BOOL ok;
+
+    file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    ok = DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &written, NULL);
+    for (ULONG i = 0; ok && i < TEST_SPARSE_RANGES; i++)
+    {
+        FileContent(index + i, g_Expected, TEST_SPARSE_RANGE);
+        offset.QuadPart = SparseRangeOffset(i);
+        ok = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) &&
+            WriteFile(file, g_Expected, TEST_SPARSE_RANGE, &written, NULL) && written == TEST_SPARSE_RANGE;
+    }
+
+    offset.QuadPart = TEST_SPARSE_SIZE;
+    ok = ok && SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    return ok;
+}
+
+static BOOL SparseStreamMatches(IN const WCHAR *path, IN ULONG index)
+{
+    HANDLE file;
+    LARGE_INTEGER offset, size;
+    DWORD read;
+    BOOL match;
+
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    match = GetFileSizeEx(file, &size) && size.QuadPart == TEST_SPARSE_SIZE;
+    for (ULONG i = 0; match && i < TEST_SPARSE_RANGES; i++)
+    {
+        FileContent(index + i, g_Expected, TEST_SPARSE_RANGE);
+        offset.QuadPart = SparseRangeOffset(i);
+        // The byte after the range is in a hole.
+        g_Expected[TEST_SPARSE_RANGE] = 0;
+        match = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) &&
+            ReadFile(file, g_Actual, TEST_SPARSE_RANGE + 1, &read, NULL) && read == TEST_SPARSE_RANGE + 1 &&
+            memcmp(g_Expected, g_Actual, TEST_SPARSE_RANGE + 1) == 0;
+    }
+
+    CloseHandle(file);
+    return match;
+}
+
+// Allocated ranges of a stream, a stream that isn't sparse is one range. Returns the number of ranges, -1 on failure.
+static int QueryRanges(IN const WCHAR *path, OUT FILE_ALLOCATED_RANGE_BUFFER *ranges)
+{
+    HANDLE file;
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    LARGE_INTEGER size;
+    DWORD returned;
+    int count = -1;
+
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+
+    query.FileOffset.QuadPart = 0;
+    if (GetFileSizeEx(file, &size))
+    {
+        query.Length = size;
+        if (DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+            ranges, TEST_MAX_RANGES * sizeof(*ranges), &returned, NULL))
+            count = (int)(returned / sizeof(*ranges));
+    }
+
+    CloseHandle(file);
+    return count;
+}
+
+// Bytes of a stream that are not in an allocated range.
+static LONGLONG HoleSize(IN const FILE_ALLOCATED_RANGE_BUFFER *ranges, IN int count, IN LONGLONG size)
+{
+    for (int i = 0; i < count; i++)
+        size -= ranges[i].Length.QuadPart;
+    return size;
+}
+
+// A sparse file with a plain alternate stream and a plain file with a sparse alternate stream.
+// Each stream keeps its own data and allocated ranges, holes are not copied.
+static void StreamTest(void)
+{
+    static const WCHAR *names[] = { L"d02\\sparse.dat", L"d02\\sparse.dat:plain", L"d02\\plain.dat", L"d02\\plain.dat:sparse" };
+    static const BOOL sparse[] = { TRUE, FALSE, FALSE, TRUE };
+    FILE_ALLOCATED_RANGE_BUFFER expected[ARRAYSIZE(names)][TEST_MAX_RANGES];
+    FILE_ALLOCATED_RANGE_BUFFER actual[TEST_MAX_RANGES];
+    int expectedCount[ARRAYSIZE(names)];
+    int actualCount;
+    WCHAR path[MAX_PATH];
+    LONGLONG holes = 0;
+    ULONG64 copiedFiles;
+    ULONG ms;
+
+    printf("StreamTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    for (ULONG i = 0; i < ARRAYSIZE(names); i++)
+    {
+        swprintf_s(path, MAX_PATH, L"%s\\%s", g_Source, names[i]);
+        if (sparse[i])
+            CHECK(WriteSparseStream(path, i));
+        else
+            CHECK(WriteTestFile(path, i));
+
+        expectedCount[i] = QueryRanges(path, expected[i]);
+        CHECK(expectedCount[i] >= 0);
+        if (sparse[i])
+            holes += HoleSize(expected[i], expectedCount[i], TEST_SPARSE_SIZE);
+    }
+
+    CHECK(holes > 0);
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES + 2);
+    CHECK(g_Stats.Streams == 2);
+    // A cloned main stream has no holes to skip.
+    if (g_Stats.ClonedFiles == 0)
+        CHECK(g_Stats.HoleBytes == (ULONG64)holes);
+    VerifyTarget();
+
+    for (ULONG i = 0; i < ARRAYSIZE(names); i++)
+    {
+        swprintf_s(path, MAX_PATH, L"%s\\%s", g_Target, names[i]);
+        if (sparse[i])
+            CHECK(SparseStreamMatches(path, i));
+        else
+            CHECK(TestFileMatches(path, i));
+
+        actualCount = QueryRanges(path, actual);
+        CHECK(actualCount >= 0 && actualCount == expectedCount[i] &&
+            memcmp(actual, expected[i], actualCount * sizeof(actual[0])) == 0);
+    }
+}
+
+static BOOL SetSecurityString(IN const WCHAR *path, IN const WCHAR *sddl, IN SECURITY_INFORMATION info)
+{
+    PSECURITY_DESCRIPTOR sd;
+    BOOL ok;
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &sd, NULL))
+        return FALSE;
+
+    ok = SetFileSecurityW(path, info, sd);
+    LocalFree(sd);
+    return ok;
+}
+
+// Owner, group and DACL of a file as SDDL, free with LocalFree. NULL on failure.
+static WCHAR *GetSecurityString(IN const WCHAR *path)
+{
+    const SECURITY_INFORMATION info = OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION;
+    BYTE buffer[4096];
+    DWORD size;
+    WCHAR *sddl = NULL;
+
+    if (!GetFileSecurityW(path, info, (PSECURITY_DESCRIPTOR)buffer, sizeof(buffer), &size))
+        return NULL;
+
+    if (!ConvertSecurityDescriptorToStringSecurityDescriptorW((PSECURITY_DESCRIPTOR)buffer, SDDL_REVISION_1, info, &sddl, NULL))
+        return NULL;
+
+    return sddl;
+}
+
+static BOOL SecurityMatches(IN const WCHAR *path, IN const WCHAR *expected)
+{
+    WCHAR *actual = GetSecurityString(path);
+    BOOL match = expected && actual && wcscmp(expected, actual) == 0;
+
+    if (actual)
+        LocalFree(actual);
+    return match;
+}
+
+// Descriptors of files and directories are preserved. One directory denies adding files: with its
+// descriptor applied only after the workers are done, all files still end up in it.
+static void SecurityTest(void)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR *expected[TEST_FILES / TEST_SECURITY_EVERY + 1] = { 0 };
+    WCHAR *expectedDir;
+    ULONG64 copiedFiles;
+    ULONG ms, count = 0, mismatches = 0;
+
+    printf("SecurityTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    for (ULONG i = 0; i < TEST_FILES; i += TEST_SECURITY_EVERY)
+    {
+        FilePath(g_Source, i, path);
+        CHECK(SetSecurityString(path, TEST_FILE_SDDL, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION));
+        expected[count++] = GetSecurityString(path);
+    }
+
+    swprintf_s(path, MAX_PATH, L"%s\\d%02lu", g_Source, TEST_SECURITY_DIR);
+    CHECK(SetSecurityString(path, TEST_DIR_SDDL, DACL_SECURITY_INFORMATION));
+    expectedDir = GetSecurityString(path);
+    CHECK(expectedDir != NULL);
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES);
+    VerifyTarget();
+
+    swprintf_s(path, MAX_PATH, L"%s\\d%02lu", g_Target, TEST_SECURITY_DIR);
+    CHECK(SecurityMatches(path, expectedDir));
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        FilePath(g_Target, i * TEST_SECURITY_EVERY, path);
+        if (!SecurityMatches(path, expected[i]))
+            mismatches++;
+        if (expected[i])
+            LocalFree(expected[i]);
+    }
+
+    CHECK(mismatches == 0);
+    if (expectedDir)
+        LocalFree(expectedDir);
+}
+
+// Data is block cloned where the volume supports it, otherwise copied with the tier for its size.
+// Then clones are forced: where they fail, the data must be copied instead.
+static void CopyTierTest(void)
+{
+    const ULONG64 largeFiles = TEST_FILES / TEST_LARGE_EVERY;
+    WCHAR volume[MAX_PATH];
+    DWORD fsFlags = 0;
+    BOOL cloneSupported;
+    ULONG64 copiedFiles;
+    ULONG ms;
+
+    if (!GetVolumePathNameW(g_Root, volume, MAX_PATH) ||
+        !GetVolumeInformationW(volume, NULL, 0, NULL, NULL, &fsFlags, NULL, 0))
+        fsFlags = 0;
+    cloneSupported = (fsFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) != 0;
+    printf("CopyTierTest: block cloning %s\n", cloneSupported ? "supported" : "not supported");
+
+    for (ULONG flags = 0; flags <= TEST_FORCE_CLONE; flags += TEST_FORCE_CLONE)
+    {
+        if (!CHECK(Setup()))
+            return;
+
+        CHECK(RunRelocationEx(0, flags, &copiedFiles, &ms) == STATUS_SUCCESS);
+        CHECK(copiedFiles == TEST_FILES);
+        if (cloneSupported)
+        {
+            CHECK(g_Stats.ClonedFiles == TEST_FILES);
+        }
+        else
+        {
+            CHECK(g_Stats.ClonedFiles == 0);
+            CHECK(g_Stats.LargeFiles == largeFiles);
+        }
+
+        printf("CopyTierTest: flags %lu: %llu cloned, %llu large, %llu buffered files in %lu ms\n", flags,
+            g_Stats.ClonedFiles, g_Stats.LargeFiles, copiedFiles - g_Stats.ClonedFiles - g_Stats.LargeFiles, ms);
+        VerifyTarget();
+    }
+}
+
+// Files sharing a descriptor use one interned copy, the descriptor is applied when the target is created.
+// More distinct descriptors than the cache holds: the rest are used as private copies and still applied.
+static void SecurityInternTest(void)
+{
+    WCHAR path[MAX_PATH];
+    WCHAR sddl[128];
+    WCHAR **expected;
+    ULONG64 copiedFiles;
+    ULONG ms, mismatches = 0;
+
+    printf("SecurityInternTest\n");
+    expected = calloc(TEST_DISTINCT_SDS, sizeof(*expected));
+    if (!CHECK(expected != NULL) || !CHECK(Setup()))
+    {
+        free(expected);
+        return;
+    }
+
+    for (ULONG i = 0; i < TEST_DISTINCT_SDS; i++)
+    {
+        FilePath(g_Source, i, path);
+        swprintf_s(sddl, ARRAYSIZE(sddl), L"O:BAD:P(A;;FA;;;BA)(A;;0x%lx;;;WD)", i + 1);
+        CHECK(SetSecurityString(path, sddl, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION));
+        expected[i] = GetSecurityString(path);
+    }
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES);
+    CHECK(g_Stats.SecurityQueries >= TEST_FILES);
+    CHECK(g_Stats.SecurityUnique > 0 && g_Stats.SecurityUnique < TEST_DISTINCT_SDS);
+    // Files past the distinct descriptors share the inherited one.
+    CHECK(g_Stats.SecurityHits >= TEST_FILES - TEST_DISTINCT_SDS - 1);
+    // Some descriptors didn't fit.
+    CHECK(g_Stats.SecurityHits + g_Stats.SecurityUnique < g_Stats.SecurityQueries);
+    CHECK(g_Stats.SetsSkipped == TEST_FILES);
+    printf("SecurityInternTest: %llu queries, %llu hits, %llu interned\n",
+        g_Stats.SecurityQueries, g_Stats.SecurityHits, g_Stats.SecurityUnique);
+    VerifyTarget();
+
+    for (ULONG i = 0; i < TEST_DISTINCT_SDS; i++)
+    {
+        FilePath(g_Target, i, path);
+        if (!SecurityMatches(path, expected[i]))
+            mismatches++;
+        if (expected[i])
+            LocalFree(expected[i]);
+    }
+
+    CHECK(mismatches == 0);
+    free(expected);
+}
+
+static BOOL VerifySource(void)
+{
+    WCHAR path[MAX_PATH];
+    ULONG mismatches = 0;
+
+    for (ULONG i = 0; i < TEST_FILES; i++)
+    {
+        FilePath(g_Source, i, path);
+        if (!TestFileMatches(path, i))
+            mismatches++;
+    }
+
+    return CHECK(mismatches == 0);
+}
+
+// Read-only files are deleted with POSIX semantics. A source file that can't be deleted stops the delete:
+// files queued after it are skipped, the source is restored from the target and the journal is removed.
+static void DeleteErrorTest(void)
+{
+    WCHAR path[MAX_PATH];
+    HANDLE blocker;
+    ULONG64 copiedFiles;
+    ULONG ms;
+    DWORD attrs;
+    NTSTATUS status;
+    TEST_JOURNAL journal;
+
+    printf("DeleteErrorTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    for (ULONG i = 0; i < TEST_FILES; i += TEST_READONLY_EVERY)
+    {
+        FilePath(g_Source, i, path);
+        CHECK(SetFileAttributesW(path, FILE_ATTRIBUTE_READONLY));
+    }
+
+    // Copy everything, stop at the first delete.
+    CHECK(RunRelocation(TEST_FILES + 1, &copiedFiles, &ms) == FAULT_STATUS);
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_SUCCESS);
+    CHECK(journal.Phase == JOURNAL_PHASE_COPY_DONE);
+
+    // No delete sharing, so the file can't be deleted.
+    FilePath(g_Source, TEST_BLOCKED_FILE, path);
+    blocker = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (!CHECK(blocker != INVALID_HANDLE_VALUE))
+        return;
+
+    status = RunRelocation(0, &copiedFiles, &ms);
+    CloseHandle(blocker);
+    CHECK(status == STATUS_SHARING_VIOLATION);
+    CHECK(g_Stats.DeletedFiles < TEST_DELETE_SLACK);
+    printf("DeleteErrorTest: delete failed with %lx after %llu files\n", status, g_Stats.DeletedFiles);
+
+    attrs = GetFileAttributesW(g_Source);
+    CHECK(attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT));
+    CHECK(TestReadJournal(g_Target, &journal) == STATUS_OBJECT_NAME_NOT_FOUND);
+    VerifySource();
+
+    // The restored source relocates, read-only files included.
+    DeleteTree(g_Target);
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES);
+    VerifyTarget();
+}
+
+// Reference time of an uninterrupted relocation.
+static void FullRelocationTest(void)
+{
+    ULONG64 copiedFiles;
+    ULONG ms;
+
+    printf("FullRelocationTest\n");
+    if (!CHECK(Setup()))
+        return;
+
+    CHECK(RunRelocation(0, &copiedFiles, &ms) == STATUS_SUCCESS);
+    CHECK(copiedFiles == TEST_FILES);
+    printf("FullRelocationTest: copied %llu files in %lu ms\n", copiedFiles, ms);
+    VerifyTarget();
+}
+
+int wmain(int argc, WCHAR *argv[])
+{
+    WCHAR tempPath[MAX_PATH];
+    unsigned int seed;
+
+    if (argc == 7 && wcscmp(argv[1], L"child") == 0)
+        return ChildMain(argv);
+
+    seed = (argc > 1) ? wcstoul(argv[1], NULL, 10) : GetTickCount();
+    srand(seed);
+    printf("seed %u\n", seed);
+
+    if (!GetTempPathW(MAX_PATH, tempPath))
+        return 1;
+
+    swprintf_s(g_Root, MAX_PATH, L"%srelocate-dir-test-%lu", tempPath, GetCurrentProcessId());
+    swprintf_s(g_Source, MAX_PATH, L"%s\\source", g_Root);
+    swprintf_s(g_Target, MAX_PATH, L"%s\\target", g_Root);
+
+    g_Expected = malloc(TEST_LARGE_SIZE + 1);
+    g_Actual = malloc(TEST_LARGE_SIZE + 1);
+    if (!g_Expected || !g_Actual || !CreateDirectoryW(g_Root, NULL))
+        return 1;
+
+    FullRelocationTest();
+    ResumeCopyTest();
+    TornTailTest();
+    CorruptRecordTest();
+    ReparseResumeTest();
+    ResumeDeleteTest();
+    RepeatedFaultTest();
+    DirectoryTreeTest();
+    CopyTierTest();
+    StreamTest();
+    SecurityTest();
+    SecurityInternTest();
+    DeleteErrorTest();
+
+    Cleanup();
+    RemoveDirectoryW(g_Root);
+
+    if (g_Failures > 0)
+    {
+        fprintf(stderr, "%lu of %lu checks failed\n", g_Failures, g_Checks);
+        return 1;
+    }
+
+    printf("all %lu checks passed\n", g_Checks);
+    return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Native API side of relocate-dir-test, stands in for relocate-dir's main.c.
+
+#include <stdio.h>
+
+#include "copy.h"
+#include "io.h"
+#include "journal.h"
+#include "relocate.h"
+#include "security.h"
+#include "test-nt.h"
+
+HANDLE g_Heap;
+
+void NtLog(IN BOOLEAN print, IN const PWCHAR format, ...)
+{
+    va_list args;
+    WCHAR buffer[1024];
+
+    if (!print)
+        return;
+
+    va_start(args, format);
+    _vsnwprintf_s(buffer, RTL_NUMBER_OF(buffer), _TRUNCATE, format, args);
+    va_end(args);
+
+    TestPrint(buffer);
+}
+
+static BOOLEAN InitHeap(void)
+{
+    RTL_HEAP_PARAMETERS heapParams;
+
+    if (g_Heap)
+        return TRUE;
+
+    RtlZeroMemory(&heapParams, sizeof(heapParams));
+    heapParams.Length = sizeof(heapParams);
+    g_Heap = RtlCreateHeap(HEAP_GROWABLE, NULL, 0x100000, 0x1000, NULL, &heapParams);
+    return g_Heap != NULL;
+}
+
+long TestRelocate(const wchar_t *sourcePath, const wchar_t *targetPath, unsigned long failAfterFiles, unsigned long flags,
+    TEST_STATS *stats)
+{
+    NTSTATUS status;
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    if (!InitHeap())
+        return STATUS_NO_MEMORY;
+
+    status = EnablePrivileges();
+    if (status != STATUS_SUCCESS) // STATUS_NOT_ALL_ASSIGNED is a success code
+    {
+        NtLog(TRUE, L"[!] EnablePrivileges failed: %x\n", status);
+        return status;
+    }
+
+    g_FailAfterFiles = failAfterFiles;
+    g_ForceClone = (flags & TEST_FORCE_CLONE) != 0;
+    status = Relocate((PWCHAR) sourcePath, (PWCHAR) targetPath);
+
+    for (int i = 0; i < COPY_TIER_COUNT; i++)
+        stats->CopiedFiles += (ULONG64)g_CopyStats.Files[i];
+    stats->BufferGrowths = g_DirQueryStats.BufferGrowths;
+    stats->ClonedFiles = (ULONG64)g_CopyStats.Files[COPY_TIER_CLONE];
+    stats->LargeFiles = (ULONG64)g_CopyStats.Files[COPY_TIER_LARGE];
+    stats->Streams = (ULONG64)g_CopyStats.Streams;
+    stats->HoleBytes = (ULONG64)g_CopyStats.HoleBytes;
+    stats->SecurityQueries = (ULONG64)g_SecurityStats.Queries;
+    stats->SecurityHits = (ULONG64)g_SecurityStats.Hits;
+    stats->SecurityUnique = (ULONG64)g_SecurityStats.Unique;
+    stats->SetsSkipped = (ULONG64)g_SecurityStats.SetsSkipped;
+    stats->DeletedFiles = (ULONG64)g_CopyStats.Deleted;
+
+    return status;
+}
+
+static NTSTATUS OpenJournal(IN const wchar_t *targetPath, IN BOOLEAN write, OUT HANDLE *file)
+{
+    PWCHAR journalPath;
+    NTSTATUS status;
+
+    if (!InitHeap())
+        return STATUS_NO_MEMORY;
+
+    journalPath = RtlAllocateHeap(g_Heap, 0, MAX_PATH_LONG * sizeof(WCHAR));
+    if (!journalPath)
+        return STATUS_NO_MEMORY;
+
+    if (wcscpy_s(journalPath, MAX_PATH_LONG, targetPath) == 0 &&
+        wcscat_s(journalPath, MAX_PATH_LONG, JOURNAL_SUFFIX) == 0)
+        status = FileOpen(file, journalPath, write, FALSE, FALSE);
+    else
+        status = STATUS_NAME_TOO_LONG;
+
+    RtlFreeHeap(g_Heap, 0, journalPath);
+    return status;
+}
+
+// Same parsing as JournalLoad, but the file is not truncated.
+long TestReadJournal(const wchar_t *targetPath, TEST_JOURNAL *journal)
+{
+    HANDLE file = NULL;
+    INT64 fileSize;
+    BYTE *data = NULL;
+    ULONG offset, readSize;
+    JOURNAL_HEADER *header;
+    JOURNAL_RECORD *record;
+    NTSTATUS status;
+
+    RtlZeroMemory(journal, sizeof(*journal));
+
+    status = OpenJournal(targetPath, FALSE, &file);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileGetSize(file, &fileSize);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
+
+    if (fileSize < (INT64)sizeof(JOURNAL_HEADER) || fileSize > MAXLONG)
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto cleanup;
+    }
+
+    journal->FileSize = (ULONG)fileSize;
+    data = RtlAllocateHeap(g_Heap, 0, journal->FileSize);
+    if (!data)
+    {
+        status = STATUS_NO_MEMORY;
+        goto cleanup;
+    }
+
+    for (offset = 0; offset < journal->FileSize; offset += readSize)
+    {
+        status = FileRead(file, data + offset, journal->FileSize - offset, &readSize);
+        if (!NT_SUCCESS(status))
+            goto cleanup;
+        if (readSize == 0)
+        {
+            status = STATUS_END_OF_FILE;
+            goto cleanup;
+        }
+    }
+
+    header = (JOURNAL_HEADER *) data;
+    if (header->Magic != JOURNAL_MAGIC || header->Version != JOURNAL_VERSION)
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto cleanup;
+    }
+
+    offset = sizeof(JOURNAL_HEADER);
+    while (offset < journal->FileSize)
+    {
+        record = (JOURNAL_RECORD *) (data + offset);
+        if (!JournalRecordIsValid(record, journal->FileSize - offset))
+            break;
+
+        if (record->Type == JOURNAL_RECORD_FILE)
+            journal->FileRecords++;
+        else
+            journal->Phase = *(ULONG *) (record + 1);
+
+        offset += (ULONG)sizeof(JOURNAL_RECORD) + record->Size;
+    }
+
+    journal->ValidSize = offset;
+    status = STATUS_SUCCESS;
+
+cleanup:
+    if (data)
+        RtlFreeHeap(g_Heap, 0, data);
+    if (file)
+        NtClose(file);
+    return status;
+}
+
+long TestTearJournal(const wchar_t *targetPath)
+{
+    HANDLE file = NULL;
+    INT64 fileSize;
+    struct
+    {
+        JOURNAL_RECORD Record;
+        WCHAR Path[4]; // Record.Size claims more
+    } torn = { { JOURNAL_RECORD_FILE, 64 * sizeof(WCHAR), 0 }, L"tor" };
+    NTSTATUS status;
+
+    status = OpenJournal(targetPath, TRUE, &file);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileGetSize(file, &fileSize);
+    if (NT_SUCCESS(status))
+        status = FileSetPosition(file, fileSize);
+    if (NT_SUCCESS(status))
+        status = FileWrite(file, &torn, sizeof(torn), NULL);
+
+    NtClose(file);
+    return status;
+}
+
+long TestCorruptJournal(const wchar_t *targetPath, int kind)
+{
+    HANDLE file = NULL;
+    INT64 fileSize;
+    struct
+    {
+        JOURNAL_RECORD Record;
+        WCHAR Data[16];
+    } bad, good = { { JOURNAL_RECORD_FILE, sizeof(L"d00\\new.dat"), 0 }, L"d00\\new.dat" };
+    NTSTATUS status;
+
+    RtlZeroMemory(&bad, sizeof(bad));
+    switch (kind)
+    {
+    case TEST_CORRUPT_CRC:
+        bad.Record.Type = JOURNAL_RECORD_FILE;
+        bad.Record.Size = sizeof(L"d00\\bad.dat");
+        wcscpy_s(bad.Data, RTL_NUMBER_OF(bad.Data), L"d00\\bad.dat");
+        break;
+    case TEST_CORRUPT_OUTSIDE:
+        bad.Record.Type = JOURNAL_RECORD_FILE;
+        bad.Record.Size = sizeof(L"..\\escape.dat");
+        wcscpy_s(bad.Data, RTL_NUMBER_OF(bad.Data), L"..\\escape.dat");
+        break;
+    case TEST_CORRUPT_UNTERMINATED:
+        bad.Record.Type = JOURNAL_RECORD_FILE;
+        bad.Record.Size = sizeof(L"d00\\bad.dat") - sizeof(WCHAR);
+        wcscpy_s(bad.Data, RTL_NUMBER_OF(bad.Data), L"d00\\bad.dat");
+        break;
+    case TEST_CORRUPT_PHASE:
+        bad.Record.Type = JOURNAL_RECORD_PHASE;
+        bad.Record.Size = sizeof(ULONG);
+        bad.Data[0] = JOURNAL_PHASE_DELETE_DONE + 1;
+        break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    bad.Record.Crc = JournalRecordCrc(&bad.Record, bad.Data);
+    if (kind == TEST_CORRUPT_CRC)
+        bad.Record.Crc ^= 1;
+    good.Record.Crc = JournalRecordCrc(&good.Record, good.Data);
+
+    status = OpenJournal(targetPath, TRUE, &file);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileGetSize(file, &fileSize);
+    if (NT_SUCCESS(status))
+        status = FileSetPosition(file, fileSize);
+    if (NT_SUCCESS(status))
+        status = FileWrite(file, &bad, (ULONG)sizeof(bad.Record) + bad.Record.Size, NULL);
+    if (NT_SUCCESS(status))
+        status = FileWrite(file, &good, (ULONG)sizeof(good.Record) + good.Record.Size, NULL);
+
+    NtClose(file);
+    return status;
+}
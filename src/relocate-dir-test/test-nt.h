@@ -0,0 +1,75 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Interface between the test driver (Win32) and the relocate-dir code (native API).
+// windows.h and ntifs.h can't be included together, so only C types are used here.
+
+#pragma once
+
+typedef struct _TEST_JOURNAL
+{
+    unsigned long FileRecords;  // complete file records
+    unsigned long Phase;        // last phase record, 0 if none
+    unsigned long ValidSize;    // bytes up to the end of the last complete record
+    unsigned long FileSize;
+} TEST_JOURNAL;
+
+typedef struct _TEST_STATS
+{
+    unsigned long long CopiedFiles;     // copied by this run, files skipped thanks to the journal are not counted
+    unsigned long long BufferGrowths;   // directory enumeration buffers grown
+    unsigned long long ClonedFiles;
+    unsigned long long LargeFiles;      // preallocated and copied in large chunks
+    unsigned long long Streams;         // alternate data streams
+    unsigned long long HoleBytes;       // sparse ranges not copied
+    unsigned long long SecurityQueries;
+    unsigned long long SecurityHits;    // descriptor was already interned
+    unsigned long long SecurityUnique;  // descriptors interned
+    unsigned long long SetsSkipped;     // descriptor applied at file creation
+    unsigned long long DeletedFiles;
+} TEST_STATS;
+
+#define TEST_FORCE_CLONE 1 // try block cloning even if the volume doesn't support it
+
+// Relocate a directory in this process like relocate-dir does at boot. Returns NTSTATUS.
+// The process is terminated after failAfterFiles copied or deleted files (0 = never).
+// flags are TEST_* flags.
+long TestRelocate(const wchar_t *sourcePath, const wchar_t *targetPath, unsigned long failAfterFiles, unsigned long flags,
+    TEST_STATS *stats);
+
+// Parse the journal of a relocation to targetPath without changing it. Returns NTSTATUS.
+long TestReadJournal(const wchar_t *targetPath, TEST_JOURNAL *journal);
+
+// Append a record that is cut short, like a write interrupted by a power loss. Returns NTSTATUS.
+long TestTearJournal(const wchar_t *targetPath);
+
+#define TEST_CORRUPT_CRC            0 // checksum doesn't match
+#define TEST_CORRUPT_OUTSIDE        1 // path escapes the source directory
+#define TEST_CORRUPT_UNTERMINATED   2 // path without its NUL
+#define TEST_CORRUPT_PHASE          3 // unknown phase value
+#define TEST_CORRUPT_KINDS          4
+
+// Append a record that JournalLoad must reject, followed by a valid file record that must be
+// dropped with it. Returns NTSTATUS.
+long TestCorruptJournal(const wchar_t *targetPath, int kind);
+
+// Implemented by the driver, prints log messages of relocate-dir.
+void TestPrint(const wchar_t *message);
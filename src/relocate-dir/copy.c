@@ -0,0 +1,401 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "io.h"
+#include "copy.h"
+#include "journal.h"
+#include "progress.h"
+
+typedef enum _COPY_OPERATION
+{
+    COPY_OP_COPY = 0,
+    COPY_OP_DELETE,
+} COPY_OPERATION;
+
+typedef struct _COPY_JOB
+{
+    COPY_OPERATION Operation;
+    PWCHAR SourcePath; // file to delete for COPY_OP_DELETE
+    PWCHAR TargetPath;
+    INT64 Size;
+    ULONG Attributes;
+} COPY_JOB;
+
+static HANDLE g_Workers[COPY_MAX_WORKERS];
+static ULONG g_WorkerCount = 0;
+
+// Ring buffer of pending jobs, protected by g_QueueLock.
+static COPY_JOB g_Queue[COPY_QUEUE_SIZE];
+static ULONG g_QueueHead = 0;
+static ULONG g_QueueCount = 0;
+
+// All events are auto-reset. There is no user mode critical section in a native app without
+// pulling in more undocumented APIs, an event is cheap enough compared to a file copy.
+static HANDLE g_QueueLock = NULL;   // signaled = unlocked
+static HANDLE g_WorkEvent = NULL;   // jobs available (or stopping)
+static HANDLE g_SpaceEvent = NULL;  // a job was taken from the queue
+static HANDLE g_IdleEvent = NULL;   // last outstanding job completed
+
+static volatile LONG g_Outstanding = 0; // queued or being copied
+static volatile LONG g_Stopping = FALSE;
+static volatile LONG g_FirstError = STATUS_SUCCESS; // of a delete job
+static volatile LONG g_FilesDone = 0; // for g_FailAfterFiles
+
+// Data copy buffer of the thread walking the tree, for files it copies itself.
+static BYTE *g_CallerBuffer = NULL;
+
+ULONG g_FailAfterFiles = 0;
+
+static void QueueLock(void)
+{
+    ZwWaitForSingleObject(g_QueueLock, FALSE, NULL);
+}
+
+static void QueueUnlock(void)
+{
+    ZwSetEvent(g_QueueLock, NULL);
+}
+
+static PWCHAR CopyString(IN const PWCHAR string)
+{
+    SIZE_T size = (wcslen(string) + 1) * sizeof(WCHAR);
+    PWCHAR copy = RtlAllocateHeap(g_Heap, 0, size);
+
+    if (copy)
+        RtlCopyMemory(copy, string, size);
+    return copy;
+}
+
+static void FreeJob(IN OUT COPY_JOB *job)
+{
+    if (job->SourcePath)
+        RtlFreeHeap(g_Heap, 0, job->SourcePath);
+    if (job->TargetPath)
+        RtlFreeHeap(g_Heap, 0, job->TargetPath);
+    job->SourcePath = job->TargetPath = NULL;
+}
+
+void CopyEngineFileDone(void)
+{
+    if (g_FailAfterFiles == 0 || (ULONG)InterlockedIncrement(&g_FilesDone) < g_FailAfterFiles)
+        return;
+
+    NtLog(TRUE, L"[!] Fault injection: terminating after %lu files\n", g_FailAfterFiles);
+    NtTerminateProcess(NtCurrentProcess(), COPY_FAULT_STATUS);
+}
+
+void CopyEngineFaultPoint(void)
+{
+    if (g_FailAfterFiles == 0 || (ULONG)g_FilesDone + 1 < g_FailAfterFiles)
+        return;
+
+    NtLog(TRUE, L"[!] Fault injection: terminating during file %lu\n", g_FailAfterFiles);
+    NtTerminateProcess(NtCurrentProcess(), COPY_FAULT_STATUS);
+}
+
+// Copy a file and record it in the journal. buffer is passed to FileCopy.
+static NTSTATUS CopyOneFile(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN INT64 size, IN BYTE *buffer)
+{
+    NTSTATUS status = FileCopy(sourcePath, targetPath, buffer);
+
+    if (NT_SUCCESS(status))
+    {
+        JournalFileCopied(sourcePath);
+        CopyEngineFileDone();
+    }
+    ProgressAdd(1, size);
+    return status;
+}
+
+static NTSTATUS DeleteOneFile(IN const PWCHAR path, IN ULONG attributes)
+{
+    NTSTATUS status;
+
+    // The serial delete stopped at the first failure. Deletes queued after it are dropped,
+    // only the ones already running on other workers complete.
+    if (g_FirstError != STATUS_SUCCESS)
+        return STATUS_CANCELLED;
+
+    status = FileDeletePath(path, attributes);
+    if (NT_SUCCESS(status))
+    {
+        InterlockedIncrement64(&g_CopyStats.Deleted);
+        CopyEngineFileDone();
+        ProgressAdd(1, 0);
+    }
+    else
+        InterlockedCompareExchange(&g_FirstError, status, STATUS_SUCCESS);
+    return status;
+}
+
+static BOOLEAN PopJob(OUT COPY_JOB *job)
+{
+    BOOLEAN wasFull;
+
+    QueueLock();
+    if (g_QueueCount == 0)
+    {
+        QueueUnlock();
+        return FALSE;
+    }
+
+    wasFull = (g_QueueCount == COPY_QUEUE_SIZE);
+    *job = g_Queue[g_QueueHead];
+    g_QueueHead = (g_QueueHead + 1) % COPY_QUEUE_SIZE;
+    g_QueueCount--;
+
+    // Auto-reset event wakes only one worker, pass the wakeup on if there is more work.
+    if (g_QueueCount > 0)
+        ZwSetEvent(g_WorkEvent, NULL);
+    QueueUnlock();
+
+    if (wasFull)
+        ZwSetEvent(g_SpaceEvent, NULL);
+
+    return TRUE;
+}
+
+static NTSTATUS NTAPI CopyWorker(IN PVOID context)
+{
+    COPY_JOB job;
+    BYTE *buffer;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(context);
+
+    // One data buffer for all files of this worker. If it can't be allocated, FileCopy allocates one per file.
+    buffer = RtlAllocateHeap(g_Heap, 0, COPY_LARGE_BUFFER_SIZE);
+
+    while (TRUE)
+    {
+        ZwWaitForSingleObject(g_WorkEvent, FALSE, NULL);
+
+        while (PopJob(&job))
+        {
+            if (job.Operation == COPY_OP_DELETE)
+            {
+                // Failure stops the whole delete, so it's shown like it was before.
+                status = DeleteOneFile(job.SourcePath, job.Attributes);
+                if (!NT_SUCCESS(status) && status != STATUS_CANCELLED)
+                    NtLog(TRUE, L"[!] FileDeletePath(%s) failed: %x\n", job.SourcePath, status);
+            }
+            else
+            {
+                status = CopyOneFile(job.SourcePath, job.TargetPath, job.Size, buffer);
+                if (!NT_SUCCESS(status))
+                    NtLog(FALSE, L"[!] FileCopy(%s, %s) failed: %x\n", job.SourcePath, job.TargetPath, status);
+            }
+
+            FreeJob(&job);
+
+            if (InterlockedDecrement(&g_Outstanding) == 0)
+                ZwSetEvent(g_IdleEvent, NULL);
+        }
+
+        if (g_Stopping)
+        {
+            // wake the next worker so it can exit too
+            ZwSetEvent(g_WorkEvent, NULL);
+            break;
+        }
+    }
+
+    if (buffer)
+        RtlFreeHeap(g_Heap, 0, buffer);
+    RtlExitUserThread(STATUS_SUCCESS);
+}
+
+static NTSTATUS CopyCreateEvent(OUT HANDLE *event, IN BOOLEAN signaled)
+{
+    OBJECT_ATTRIBUTES oa;
+
+    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
+    return ZwCreateEvent(event, EVENT_ALL_ACCESS, &oa, SynchronizationEvent, signaled);
+}
+
+static void CloseEvents(void)
+{
+    HANDLE *events[] = { &g_QueueLock, &g_WorkEvent, &g_SpaceEvent, &g_IdleEvent };
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(events); i++)
+    {
+        if (*events[i])
+            NtClose(*events[i]);
+        *events[i] = NULL;
+    }
+}
+
+NTSTATUS CopyEngineStart(IN ULONG workerCount)
+{
+    NTSTATUS status;
+
+    if (workerCount > COPY_MAX_WORKERS)
+        workerCount = COPY_MAX_WORKERS;
+
+    g_QueueHead = g_QueueCount = 0;
+    g_Outstanding = 0;
+    g_Stopping = FALSE;
+    g_FirstError = STATUS_SUCCESS;
+
+    status = CopyCreateEvent(&g_QueueLock, TRUE);
+    if (NT_SUCCESS(status))
+        status = CopyCreateEvent(&g_WorkEvent, FALSE);
+    if (NT_SUCCESS(status))
+        status = CopyCreateEvent(&g_SpaceEvent, FALSE);
+    if (NT_SUCCESS(status))
+        status = CopyCreateEvent(&g_IdleEvent, FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] CopyEngineStart: NtCreateEvent failed: %x\n", status);
+        CloseEvents();
+        return status;
+    }
+
+    for (g_WorkerCount = 0; g_WorkerCount < workerCount; g_WorkerCount++)
+    {
+        status = RtlCreateUserThread(NtCurrentProcess(), NULL, FALSE, 0, 0, 0, CopyWorker, NULL,
+            &g_Workers[g_WorkerCount], NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] CopyEngineStart: RtlCreateUserThread failed: %x\n", status);
+            break;
+        }
+    }
+
+    // Fewer workers than requested is fine, none means synchronous copy.
+    if (g_WorkerCount == 0)
+    {
+        CloseEvents();
+        return status;
+    }
+
+    NtLog(FALSE, L"[*] Copy engine: %lu workers\n", g_WorkerCount);
+    return STATUS_SUCCESS;
+}
+
+static void QueueJob(IN const COPY_JOB *job)
+{
+    InterlockedIncrement(&g_Outstanding);
+
+    QueueLock();
+    while (g_QueueCount == COPY_QUEUE_SIZE)
+    {
+        QueueUnlock();
+        ZwWaitForSingleObject(g_SpaceEvent, FALSE, NULL);
+        QueueLock();
+    }
+
+    g_Queue[(g_QueueHead + g_QueueCount) % COPY_QUEUE_SIZE] = *job;
+    g_QueueCount++;
+    QueueUnlock();
+
+    ZwSetEvent(g_WorkEvent, NULL);
+}
+
+static NTSTATUS CopyFileOnCaller(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN INT64 size)
+{
+    if (!g_CallerBuffer)
+        g_CallerBuffer = RtlAllocateHeap(g_Heap, 0, COPY_LARGE_BUFFER_SIZE);
+
+    return CopyOneFile(sourcePath, targetPath, size, g_CallerBuffer);
+}
+
+NTSTATUS CopyEngineQueueFile(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN INT64 size)
+{
+    COPY_JOB job = { 0 };
+
+    if (g_WorkerCount == 0)
+        return CopyFileOnCaller(sourcePath, targetPath, size);
+
+    job.Operation = COPY_OP_COPY;
+    job.SourcePath = CopyString(sourcePath);
+    job.TargetPath = CopyString(targetPath);
+    job.Size = size;
+    if (!job.SourcePath || !job.TargetPath)
+    {
+        FreeJob(&job);
+        return CopyFileOnCaller(sourcePath, targetPath, size);
+    }
+
+    QueueJob(&job);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CopyEngineQueueDelete(IN const PWCHAR path, IN ULONG attributes)
+{
+    COPY_JOB job = { 0 };
+
+    if (g_WorkerCount == 0)
+        return DeleteOneFile(path, attributes);
+
+    job.Operation = COPY_OP_DELETE;
+    job.SourcePath = CopyString(path);
+    job.Attributes = attributes;
+    if (!job.SourcePath)
+        return DeleteOneFile(path, attributes);
+
+    QueueJob(&job);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CopyEngineGetError(void)
+{
+    return g_FirstError;
+}
+
+void CopyEngineWait(void)
+{
+    if (g_WorkerCount == 0)
+        return;
+
+    // The idle event may be left signaled from an earlier drain, recheck the counter.
+    while (g_Outstanding != 0)
+        ZwWaitForSingleObject(g_IdleEvent, FALSE, NULL);
+}
+
+void CopyEngineStop(void)
+{
+    if (g_CallerBuffer)
+    {
+        RtlFreeHeap(g_Heap, 0, g_CallerBuffer);
+        g_CallerBuffer = NULL;
+    }
+
+    if (g_WorkerCount == 0)
+        return;
+
+    CopyEngineWait();
+
+    InterlockedExchange(&g_Stopping, TRUE);
+    ZwSetEvent(g_WorkEvent, NULL);
+
+    for (ULONG i = 0; i < g_WorkerCount; i++)
+    {
+        ZwWaitForSingleObject(g_Workers[i], FALSE, NULL);
+        NtClose(g_Workers[i]);
+        g_Workers[i] = NULL;
+    }
+
+    g_WorkerCount = 0;
+    CloseEvents();
+}
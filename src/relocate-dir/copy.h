@@ -0,0 +1,67 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Parallel copy engine for regular files, also used to delete them.
+// The directory walk stays on the calling thread (so target directories always
+// exist before their children are copied), files are handed to a pool of workers.
+
+#pragma once
+
+#include "nt.h"
+
+#define COPY_WORKERS        4
+#define COPY_MAX_WORKERS    16
+#define COPY_QUEUE_SIZE     256
+
+// Exit status of a process terminated by g_FailAfterFiles.
+#define COPY_FAULT_STATUS   STATUS_REQUEST_ABORTED
+
+// Terminate the process (like a power loss would) after this many files were copied or deleted, 0 = never.
+// Only for testing the journal.
+extern ULONG g_FailAfterFiles;
+
+// Start worker threads. If this fails, files are copied synchronously by CopyEngineQueueFile.
+NTSTATUS CopyEngineStart(IN ULONG workerCount);
+
+// Copy a file on a worker thread (paths are copied). Blocks while the queue is full.
+// size is only used for progress display.
+NTSTATUS CopyEngineQueueFile(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN INT64 size);
+
+// Delete a file or reparse point on a worker thread (path is copied). Blocks while the queue is full.
+// attributes are from the directory entry. Failures are reported by CopyEngineGetError,
+// after the first one queued deletes are skipped.
+NTSTATUS CopyEngineQueueDelete(IN const PWCHAR path, IN ULONG attributes);
+
+// First failure of a queued delete since CopyEngineStart, STATUS_SUCCESS if none.
+NTSTATUS CopyEngineGetError(void);
+
+// Wait until all queued files are copied.
+void CopyEngineWait(void);
+
+// Wait for queued files and stop worker threads.
+void CopyEngineStop(void);
+
+// Count a copied or deleted file for g_FailAfterFiles.
+void CopyEngineFileDone(void);
+
+// Terminate in the middle of the file that would reach g_FailAfterFiles.
+// Called between the steps of operations that can't be done atomically.
+void CopyEngineFaultPoint(void);
@@ -20,6 +20,10 @@
  */
 
 #include "io.h"
+#include "copy.h"
+#include "journal.h"
+#include "progress.h"
+#include "security.h"
 
 __declspec(dllimport)
 int swprintf_s(
@@ -29,7 +33,9 @@ int swprintf_s(
     ...
     );
 
-NTSTATUS FileOpen(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write, IN BOOLEAN overwrite, IN BOOLEAN isReparse)
+// If the file is created, sd (if not NULL) is applied to it and *created is set.
+static NTSTATUS FileOpenWithSecurity(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write, IN BOOLEAN overwrite,
+    IN BOOLEAN isReparse, IN PSECURITY_DESCRIPTOR sd, OUT BOOLEAN *created)
 {
     UNICODE_STRING fileNameU = { 0 };
     IO_STATUS_BLOCK iosb;
@@ -49,7 +55,7 @@ NTSTATUS FileOpen(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write,
         &fileNameU,
         OBJ_CASE_INSENSITIVE,
         NULL,
-        NULL);
+        sd);
 
     desiredAccess = SYNCHRONIZE | FILE_READ_ATTRIBUTES | FILE_READ_EA | FILE_TRAVERSE | READ_CONTROL | ACCESS_SYSTEM_SECURITY;
 
@@ -89,6 +95,9 @@ NTSTATUS FileOpen(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write,
         NULL,
         0);
 
+    if (created)
+        *created = NT_SUCCESS(status) && iosb.Information == FILE_CREATED;
+
 cleanup:
 
     if (fileNameU.Buffer)
@@ -96,6 +105,11 @@ cleanup:
     return status;
 }
 
+NTSTATUS FileOpen(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write, IN BOOLEAN overwrite, IN BOOLEAN isReparse)
+{
+    return FileOpenWithSecurity(file, fileName, write, overwrite, isReparse, NULL, NULL);
+}
+
 NTSTATUS FileGetAttributes(IN const PWCHAR fileName, OUT ULONG *attrs)
 {
     NTSTATUS status;
@@ -336,35 +350,17 @@ cleanup:
 NTSTATUS FileCopySecurity(IN HANDLE source, IN HANDLE target)
 {
     PSECURITY_DESCRIPTOR sd = NULL;
-    ULONG requiredSize = 0;
+    BOOLEAN interned = FALSE;
     NTSTATUS status;
 
-    sd = RtlAllocateHeap(g_Heap, 0, 65536); // don't allocate on stack, deep recursion can be fatal
-    // maximum security descriptor size for NTFS (http://msdn.microsoft.com/en-us/library/windows/hardware/ff567066(v=vs.85).aspx)
-    if (!sd)
-    {
-        NtLog(TRUE, L"[!] FileCopySecurity: RtlAllocateHeap failed\n");
-        status = STATUS_NO_MEMORY;
-        goto cleanup;
-    }
-
-    status = NtQuerySecurityObject(
-        source,
-        OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION,
-        sd,
-        65536,
-        &requiredSize);
-
+    status = SecurityQuery(source, &sd, &interned);
     if (!NT_SUCCESS(status))
     {
         NtLog(TRUE, L"[!] FileCopySecurity: NtQuerySecurityObject failed: %x\n", status);
         goto cleanup;
     }
 
-    status = NtSetSecurityObject(
-        target,
-        OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION,
-        sd);
+    status = NtSetSecurityObject(target, SECURITY_COPY_INFORMATION, sd);
 
     if (!NT_SUCCESS(status))
     {
@@ -373,8 +369,7 @@ NTSTATUS FileCopySecurity(IN HANDLE source, IN HANDLE target)
 
 cleanup:
 
-    if (sd)
-        RtlFreeHeap(g_Heap, 0, sd);
+    SecurityRelease(sd, interned);
     return status;
 }
 
@@ -395,75 +390,501 @@ cleanup:
     return status;
 }
 
-NTSTATUS FileCopy(IN const PWCHAR sourceName, IN const PWCHAR targetName)
+COPY_STATS g_CopyStats = { 0 };
+
+// Set by FileCopyDirectory for the tree being copied, read-only while files are copied.
+static BOOLEAN g_CloneSupported = FALSE;
+static ULONG g_CloneClusterSize = 0;
+
+BOOLEAN g_ForceClone = FALSE;
+
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+#endif
+
+#ifndef FILE_SUPPORTS_BLOCK_REFCOUNTING
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+#endif
+
+// DUPLICATE_EXTENTS_DATA, not present in all WDK versions.
+typedef struct _CLONE_EXTENTS_DATA
+{
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} CLONE_EXTENTS_DATA;
+
+// ReFS limits a single clone to less than 4 GiB.
+#define CLONE_CHUNK_SIZE (1024LL * 1024 * 1024)
+
+// Check whether data can be block-cloned between two directories (same volume with block refcounting, e.g. ReFS).
+static BOOLEAN FileCanClone(IN HANDLE source, IN HANDLE target, OUT ULONG *clusterSize)
+{
+    IO_STATUS_BLOCK iosb;
+    FILE_FS_SIZE_INFORMATION sizeInfo;
+    BYTE buffer[sizeof(FILE_FS_VOLUME_INFORMATION) + 64 * sizeof(WCHAR)]; // label is variable size
+    FILE_FS_VOLUME_INFORMATION *volumeInfo = (FILE_FS_VOLUME_INFORMATION *) buffer;
+    FILE_FS_ATTRIBUTE_INFORMATION *attributeInfo = (FILE_FS_ATTRIBUTE_INFORMATION *) buffer;
+    ULONG sourceSerial;
+    NTSTATUS status;
+
+    status = NtQueryVolumeInformationFile(source, &iosb, buffer, sizeof(buffer), FileFsVolumeInformation);
+    if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW)
+        return FALSE;
+    sourceSerial = volumeInfo->VolumeSerialNumber;
+
+    status = NtQueryVolumeInformationFile(target, &iosb, buffer, sizeof(buffer), FileFsVolumeInformation);
+    if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW)
+        return FALSE;
+    if (volumeInfo->VolumeSerialNumber != sourceSerial)
+        return FALSE;
+
+    status = NtQueryVolumeInformationFile(target, &iosb, buffer, sizeof(buffer), FileFsAttributeInformation);
+    if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW)
+        return FALSE;
+    if (!(attributeInfo->FileSystemAttributes & FILE_SUPPORTS_BLOCK_REFCOUNTING))
+        return FALSE;
+
+    status = NtQueryVolumeInformationFile(target, &iosb, &sizeInfo, sizeof(sizeInfo), FileFsSizeInformation);
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    *clusterSize = sizeInfo.BytesPerSector * sizeInfo.SectorsPerAllocationUnit;
+    return *clusterSize != 0;
+}
+
+// Share the source's data blocks with the target instead of copying them.
+static NTSTATUS FileCloneData(IN HANDLE source, IN HANDLE target, IN INT64 fileSize)
+{
+    FILE_END_OF_FILE_INFORMATION eof;
+    CLONE_EXTENTS_DATA clone;
+    IO_STATUS_BLOCK iosb;
+    INT64 clonedSize;
+    INT64 offset;
+    NTSTATUS status;
+
+    // Target must be big enough for the cloned range, the range must be cluster-aligned.
+    eof.EndOfFile.QuadPart = fileSize;
+    status = NtSetInformationFile(target, &iosb, &eof, sizeof(eof), FileEndOfFileInformation);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    clonedSize = (fileSize + g_CloneClusterSize - 1) & ~((INT64) g_CloneClusterSize - 1);
+
+    for (offset = 0; offset < clonedSize; offset += CLONE_CHUNK_SIZE)
+    {
+        clone.FileHandle = source;
+        clone.SourceFileOffset.QuadPart = offset;
+        clone.TargetFileOffset.QuadPart = offset;
+        clone.ByteCount.QuadPart = min(CLONE_CHUNK_SIZE, clonedSize - offset);
+
+        status = NtFsControlFile(
+            target,
+            NULL,
+            NULL, NULL,
+            &iosb,
+            FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+            &clone, sizeof(clone),
+            NULL, 0);
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Copy a range of data with read/write calls of bufferSize bytes.
+static NTSTATUS FileCopyData(IN HANDLE source, IN HANDLE target, IN INT64 offset, IN INT64 length, IN BYTE *buffer, IN ULONG bufferSize)
 {
-    HANDLE fileSource = NULL;
-    HANDLE fileTarget = NULL;
-    BYTE *buffer = NULL;
-    INT64 fileSize = 0;
     INT64 writtenTotal = 0;
     ULONG readSize = 0;
     ULONG writtenSize = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    status = FileSetPosition(source, offset);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileSetPosition(target, offset);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    while (writtenTotal < length)
+    {
+        readSize = 0;
+
+        status = FileRead(source, buffer, (ULONG) min(bufferSize, length - writtenTotal), &readSize);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        status = FileWrite(target, buffer, readSize, &writtenSize);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        if (readSize != writtenSize)
+            return STATUS_UNSUCCESSFUL;
+
+        writtenTotal += writtenSize;
+    }
+
+    if (writtenTotal != length)
+        return STATUS_UNSUCCESSFUL;
+
+    return STATUS_SUCCESS;
+}
+
+// Copy only allocated ranges of a sparse stream, holes stay unallocated in the target.
+static NTSTATUS FileCopySparseData(IN HANDLE source, IN HANDLE target, IN INT64 fileSize, IN BYTE *buffer, IN ULONG bufferSize)
+{
+    FILE_END_OF_FILE_INFORMATION eof;
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    IO_STATUS_BLOCK iosb;
+    INT64 copied = 0;
+    ULONG count;
+    NTSTATUS queryStatus, status;
+
+    // Set the size first so that a trailing hole isn't lost.
+    eof.EndOfFile.QuadPart = fileSize;
+    status = NtSetInformationFile(target, &iosb, &eof, sizeof(eof), FileEndOfFileInformation);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = fileSize;
+
+    while (query.Length.QuadPart > 0)
+    {
+        queryStatus = NtFsControlFile(
+            source,
+            NULL,
+            NULL, NULL,
+            &iosb,
+            FSCTL_QUERY_ALLOCATED_RANGES,
+            &query, sizeof(query),
+            ranges, sizeof(ranges));
+
+        if (!NT_SUCCESS(queryStatus) && queryStatus != STATUS_BUFFER_OVERFLOW)
+            return queryStatus;
+
+        count = (ULONG) (iosb.Information / sizeof(ranges[0]));
+        if (count == 0)
+            break;
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            INT64 length = min(ranges[i].Length.QuadPart, fileSize - ranges[i].FileOffset.QuadPart);
+
+            status = FileCopyData(source, target, ranges[i].FileOffset.QuadPart, length, buffer, bufferSize);
+            if (!NT_SUCCESS(status))
+                return status;
+            copied += length;
+        }
+
+        // More ranges follow if the output buffer was too small.
+        if (queryStatus != STATUS_BUFFER_OVERFLOW)
+            break;
+
+        query.FileOffset.QuadPart = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+        query.Length.QuadPart = fileSize - query.FileOffset.QuadPart;
+    }
+
+    InterlockedAdd64(&g_CopyStats.HoleBytes, fileSize - copied);
+    return STATUS_SUCCESS;
+}
+
+// Copy data of a stream without block cloning. buffer is COPY_LARGE_BUFFER_SIZE bytes.
+static NTSTATUS FileCopyStreamData(IN HANDLE source, IN HANDLE target, IN INT64 size, IN BOOLEAN sparse, IN BYTE *buffer,
+    OUT COPY_TIER *tier)
+{
+    FILE_ALLOCATION_INFORMATION fai;
+    IO_STATUS_BLOCK iosb;
+    ULONG bufferSize = COPY_BUFFER_SIZE;
+
+    *tier = COPY_TIER_BUFFERED;
+    if (size >= COPY_LARGE_FILE_SIZE)
+    {
+        *tier = COPY_TIER_LARGE;
+        bufferSize = COPY_LARGE_BUFFER_SIZE;
+    }
+
+    if (sparse)
+        return FileCopySparseData(source, target, size, buffer, bufferSize);
+
+    if (*tier == COPY_TIER_LARGE)
+    {
+        // Preallocate so the target isn't extended (and fragmented) chunk by chunk.
+        fai.AllocationSize.QuadPart = size;
+        NtSetInformationFile(target, &iosb, &fai, sizeof(fai), FileAllocationInformation);
+    }
+
+    return FileCopyData(source, target, 0, size, buffer, bufferSize);
+}
+
+// Sparse and compression attributes can't be set with FileBasicInformation.
+// Needs to be done before any data is written.
+static NTSTATUS FileCopyStorageAttributes(IN HANDLE source, IN HANDLE target, OUT BOOLEAN *sparse)
+{
+    FILE_BASIC_INFORMATION fbi;
+    IO_STATUS_BLOCK iosb;
+    USHORT compression;
     NTSTATUS status;
 
-    status = FileOpen(&fileSource, sourceName, FALSE, FALSE, FALSE);
+    *sparse = FALSE;
+
+    status = NtQueryInformationFile(source, &iosb, &fbi, sizeof(fbi), FileBasicInformation);
     if (!NT_SUCCESS(status))
+        return status;
+
+    if (fbi.FileAttributes & FILE_ATTRIBUTE_COMPRESSED)
+    {
+        status = NtFsControlFile(source, NULL, NULL, NULL, &iosb, FSCTL_GET_COMPRESSION,
+            NULL, 0, &compression, sizeof(compression));
+        if (NT_SUCCESS(status))
+            status = NtFsControlFile(target, NULL, NULL, NULL, &iosb, FSCTL_SET_COMPRESSION,
+                &compression, sizeof(compression), NULL, 0);
+
+        // Not fatal, the target volume may not support compression.
+        if (!NT_SUCCESS(status))
+            NtLog(FALSE, L"[!] FileCopyStorageAttributes: copying compression state failed: %x\n", status);
+    }
+
+    if (fbi.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+    {
+        status = NtFsControlFile(target, NULL, NULL, NULL, &iosb, FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+        if (NT_SUCCESS(status))
+            *sparse = TRUE;
+        else
+            NtLog(FALSE, L"[!] FileCopyStorageAttributes: FSCTL_SET_SPARSE failed: %x, copying holes\n", status);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Copy alternate data streams. The main stream is copied by the caller.
+static NTSTATUS FileCopyStreams(IN HANDLE source, IN const PWCHAR sourceName, IN const PWCHAR targetName, IN BYTE *buffer,
+    OUT ULONG *streamCount)
+{
+    FILE_STREAM_INFORMATION *streamInfo = NULL, *entry;
+    ULONG bufferSize = COPY_BUFFER_SIZE;
+    IO_STATUS_BLOCK iosb;
+    HANDLE sourceStream, targetStream;
+    WCHAR *sourceStreamName = NULL;
+    WCHAR *targetStreamName = NULL;
+    BOOLEAN sparse;
+    COPY_TIER tier;
+    NTSTATUS status;
+
+    *streamCount = 0;
+
+    // Grow until all streams fit, a partial list would silently lose streams.
+    while (TRUE)
+    {
+        streamInfo = RtlAllocateHeap(g_Heap, 0, bufferSize);
+        if (!streamInfo)
+            return STATUS_NO_MEMORY;
+
+        status = NtQueryInformationFile(source, &iosb, streamInfo, bufferSize, FileStreamInformation);
+        if (status != STATUS_BUFFER_OVERFLOW && status != STATUS_BUFFER_TOO_SMALL)
+            break;
+
+        RtlFreeHeap(g_Heap, 0, streamInfo);
+        streamInfo = NULL;
+        if (bufferSize > MAXULONG / 2)
+        {
+            NtLog(FALSE, L"[!] FileCopyStreams: stream list of %s too big\n", sourceName);
+            return STATUS_BUFFER_OVERFLOW;
+        }
+
+        bufferSize *= 2;
+    }
+
+    // No streams at all (e.g. FAT) or nothing besides the main one.
+    if (!NT_SUCCESS(status) || iosb.Information == 0)
+    {
+        if (status == STATUS_INVALID_PARAMETER || status == STATUS_NOT_IMPLEMENTED)
+            status = STATUS_SUCCESS;
         goto cleanup;
+    }
+
+    entry = streamInfo;
+    while (TRUE)
+    {
+        if (entry->StreamNameLength / sizeof(WCHAR) != 7 || 0 != wcsncmp(entry->StreamName, L"::$DATA", 7))
+        {
+            if (!sourceStreamName)
+                sourceStreamName = RtlAllocateHeap(g_Heap, 0, MAX_PATH_LONG * sizeof(WCHAR));
+            if (!targetStreamName)
+                targetStreamName = RtlAllocateHeap(g_Heap, 0, MAX_PATH_LONG * sizeof(WCHAR));
+            if (!sourceStreamName || !targetStreamName)
+            {
+                status = STATUS_NO_MEMORY;
+                goto cleanup;
+            }
+
+            // Stream names look like ":name:$DATA"
+            wcscpy_s(sourceStreamName, MAX_PATH_LONG, sourceName);
+            wcsncat_s(sourceStreamName, MAX_PATH_LONG, entry->StreamName, entry->StreamNameLength / sizeof(WCHAR));
+            wcscpy_s(targetStreamName, MAX_PATH_LONG, targetName);
+            wcsncat_s(targetStreamName, MAX_PATH_LONG, entry->StreamName, entry->StreamNameLength / sizeof(WCHAR));
+
+            sourceStream = targetStream = NULL;
+            status = FileOpen(&sourceStream, sourceStreamName, FALSE, FALSE, FALSE);
+            if (NT_SUCCESS(status))
+                status = FileOpen(&targetStream, targetStreamName, TRUE, TRUE, FALSE);
+            // Every stream has its own sparse and compression state.
+            if (NT_SUCCESS(status))
+                status = FileCopyStorageAttributes(sourceStream, targetStream, &sparse);
+            if (NT_SUCCESS(status))
+                status = FileCopyStreamData(sourceStream, targetStream, entry->StreamSize.QuadPart, sparse, buffer, &tier);
+
+            if (sourceStream)
+                NtClose(sourceStream);
+            if (targetStream)
+                NtClose(targetStream);
+
+            if (!NT_SUCCESS(status))
+            {
+                NtLog(FALSE, L"[!] FileCopyStreams: copying %s failed: %x\n", sourceStreamName, status);
+                goto cleanup;
+            }
+
+            (*streamCount)++;
+        }
+
+        if (!entry->NextEntryOffset)
+            break;
+
+        entry = (FILE_STREAM_INFORMATION *) ((ULONG_PTR) entry + entry->NextEntryOffset);
+    }
+
+    status = STATUS_SUCCESS;
+
+cleanup:
+    RtlFreeHeap(g_Heap, 0, streamInfo);
+    if (sourceStreamName)
+        RtlFreeHeap(g_Heap, 0, sourceStreamName);
+    if (targetStreamName)
+        RtlFreeHeap(g_Heap, 0, targetStreamName);
+    return status;
+}
 
-    status = FileOpen(&fileTarget, targetName, TRUE, TRUE, FALSE);
+NTSTATUS FileCopy(IN const PWCHAR sourceName, IN const PWCHAR targetName, IN BYTE *buffer)
+{
+    BYTE *ownBuffer = NULL;
+    HANDLE fileSource = NULL;
+    HANDLE fileTarget = NULL;
+    PSECURITY_DESCRIPTOR sd = NULL;
+    BOOLEAN interned = FALSE;
+    BOOLEAN created = FALSE;
+    INT64 fileSize = 0;
+    LARGE_INTEGER startTime, endTime;
+    BOOLEAN sparse;
+    ULONG streamCount;
+    COPY_TIER tier;
+    NTSTATUS status;
+
+    NtQuerySystemTime(&startTime);
+
+    status = FileOpen(&fileSource, sourceName, FALSE, FALSE, FALSE);
     if (!NT_SUCCESS(status))
         goto cleanup;
 
-    status = FileCopyBasicInformation(fileSource, fileTarget);
+    status = SecurityQuery(fileSource, &sd, &interned);
     if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileCopy: NtQuerySecurityObject(%s) failed: %x\n", sourceName, status);
         goto cleanup;
+    }
 
-    status = FileCopySecurity(fileSource, fileTarget);
+    // A new file gets its descriptor at creation, an existing one (resumed copy) needs it set.
+    status = FileOpenWithSecurity(&fileTarget, targetName, TRUE, TRUE, FALSE, sd, &created);
+    if (status == STATUS_INVALID_OWNER || status == STATUS_INVALID_SECURITY_DESCR || status == STATUS_PRIVILEGE_NOT_HELD)
+        status = FileOpenWithSecurity(&fileTarget, targetName, TRUE, TRUE, FALSE, NULL, NULL);
     if (!NT_SUCCESS(status))
         goto cleanup;
 
-    status = FileGetSize(fileSource, &fileSize);
+    status = FileCopyBasicInformation(fileSource, fileTarget);
     if (!NT_SUCCESS(status))
         goto cleanup;
 
-    buffer = RtlAllocateHeap(g_Heap, 0, 65536); // don't allocate on stack, deep recursion can be fatal
-    if (!buffer)
+    if (created)
     {
-        status = STATUS_NO_MEMORY;
-        goto cleanup;
+        InterlockedIncrement64(&g_SecurityStats.SetsSkipped);
     }
-
-    // TODO: ADS, quota, ...?
-    // Copy data.
-    writtenTotal = 0;
-    while (writtenTotal < fileSize)
+    else
     {
-        readSize = 0;
-
-        status = FileRead(fileSource, buffer, 65536, &readSize);
+        status = NtSetSecurityObject(fileTarget, SECURITY_COPY_INFORMATION, sd);
         if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileCopySecurity: NtSetSecurityObject failed: %x\n", status);
             goto cleanup;
+        }
+    }
 
-        status = FileWrite(fileTarget, buffer, readSize, &writtenSize);
-        if (!NT_SUCCESS(status))
-            goto cleanup;
+    status = FileGetSize(fileSource, &fileSize);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
 
-        if (readSize != writtenSize)
+    status = FileCopyStorageAttributes(fileSource, fileTarget, &sparse);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
+
+    if (!buffer)
+    {
+        ownBuffer = buffer = RtlAllocateHeap(g_Heap, 0, COPY_LARGE_BUFFER_SIZE); // don't allocate on stack, deep recursion can be fatal
+        if (!buffer)
         {
-            status = STATUS_UNSUCCESSFUL;
+            status = STATUS_NO_MEMORY;
             goto cleanup;
         }
+    }
 
-        writtenTotal += writtenSize;
+    // TODO: quota, EAs?
+    // Copy data, cheapest method first.
+    if (g_CloneSupported && fileSize > 0)
+    {
+        status = FileCloneData(fileSource, fileTarget, fileSize);
+        if (NT_SUCCESS(status))
+        {
+            tier = COPY_TIER_CLONE;
+            goto streams;
+        }
+
+        NtLog(FALSE, L"[*] FileCopy: block clone of %s failed: %x, copying data\n", sourceName, status);
     }
 
-    if (writtenSize != fileSize)
-        status = STATUS_UNSUCCESSFUL;
+    status = FileCopyStreamData(fileSource, fileTarget, fileSize, sparse, buffer, &tier);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
+
+streams:
+    status = FileCopyStreams(fileSource, sourceName, targetName, buffer, &streamCount);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
+
+    if (streamCount > 0)
+    {
+        InterlockedAdd64(&g_CopyStats.Streams, streamCount);
+
+        // Writes through the stream handles updated the timestamps.
+        status = FileCopyBasicInformation(fileSource, fileTarget);
+        if (!NT_SUCCESS(status))
+            goto cleanup;
+    }
+
+    NtQuerySystemTime(&endTime);
+    InterlockedIncrement64(&g_CopyStats.Files[tier]);
+    InterlockedAdd64(&g_CopyStats.Bytes[tier], fileSize);
+    InterlockedAdd64(&g_CopyStats.Time[tier], endTime.QuadPart - startTime.QuadPart);
 
 cleanup:
 
-    if (buffer)
-        RtlFreeHeap(g_Heap, 0, buffer);
+    if (ownBuffer)
+        RtlFreeHeap(g_Heap, 0, ownBuffer);
+    SecurityRelease(sd, interned);
     if (fileSource)
         NtClose(fileSource);
     if (fileTarget)
@@ -546,17 +967,31 @@ cleanup:
     return status;
 }
 
-NTSTATUS FileCreateDirectory(const IN PWCHAR path)
+#ifndef FILE_DISPOSITION_DELETE
+#define FILE_DISPOSITION_DELETE                     0x00000001
+#define FILE_DISPOSITION_POSIX_SEMANTICS            0x00000002
+#define FILE_DISPOSITION_IGNORE_READONLY_ATTRIBUTE  0x00000010
+#endif
+
+// FileDispositionInformationEx, not present in all WDK versions.
+#define FILE_DISPOSITION_EX_CLASS ((FILE_INFORMATION_CLASS) 64)
+
+// Cleared when the file system doesn't support FileDispositionInformationEx (pre-1809 Windows, FAT).
+static volatile LONG g_PosixDeleteSupported = TRUE;
+
+// Unlink the name right away and ignore the read-only attribute, without opening the file for write.
+static NTSTATUS FileDeletePosix(IN const PWCHAR path)
 {
     UNICODE_STRING pathU = { 0 };
-    NTSTATUS status;
-    HANDLE file = NULL;
     OBJECT_ATTRIBUTES oa;
     IO_STATUS_BLOCK iosb;
+    HANDLE file = NULL;
+    ULONG flags;
+    NTSTATUS status;
 
     if (!RtlDosPathNameToNtPathName_U(path, &pathU, NULL, NULL))
     {
-        status = STATUS_UNSUCCESSFUL;
+        status = STATUS_INVALID_PARAMETER_1;
         goto cleanup;
     }
 
@@ -564,19 +999,24 @@ NTSTATUS FileCreateDirectory(const IN PWCHAR path)
 
     status = NtCreateFile(
         &file,
-        SYNCHRONIZE | FILE_OPEN_FOR_BACKUP_INTENT,
+        SYNCHRONIZE | DELETE | FILE_READ_ATTRIBUTES,
         &oa,
         &iosb,
         NULL,
-        FILE_ATTRIBUTE_NORMAL,
         0,
-        FILE_CREATE,
-        FILE_SYNCHRONOUS_IO_NONALERT | FILE_DIRECTORY_FILE,
+        0, // no sharing
+        FILE_OPEN,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT,
         NULL,
         0);
 
-cleanup:
+    if (!NT_SUCCESS(status))
+        goto cleanup;
 
+    flags = FILE_DISPOSITION_DELETE | FILE_DISPOSITION_POSIX_SEMANTICS | FILE_DISPOSITION_IGNORE_READONLY_ATTRIBUTE;
+    status = NtSetInformationFile(file, &iosb, &flags, sizeof(flags), FILE_DISPOSITION_EX_CLASS);
+
+cleanup:
     if (pathU.Buffer)
         RtlFreeUnicodeString(&pathU);
     if (file)
@@ -584,11 +1024,95 @@ cleanup:
     return status;
 }
 
-// sourcePath must be an existing and empty directory.
-NTSTATUS FileSetSymlink(IN const PWCHAR sourcePath, IN const PWCHAR targetPath)
+NTSTATUS FileDeletePath(IN const PWCHAR path, IN ULONG attrs)
 {
-    BYTE buffer[MAX_PATH_LONG]; // MSDN doesn't specify maximum structure's length, but it should be close to MAX_PATH_LONG
-    REPARSE_DATA_BUFFER *rdb = (REPARSE_DATA_BUFFER *) buffer;
+    HANDLE file;
+    NTSTATUS status;
+
+    // Reparse points need their data removed first, see FileDelete.
+    if (g_PosixDeleteSupported && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT))
+    {
+        status = FileDeletePosix(path);
+        if (status != STATUS_INVALID_INFO_CLASS && status != STATUS_INVALID_PARAMETER && status != STATUS_NOT_SUPPORTED)
+            return status;
+
+        if (InterlockedExchange(&g_PosixDeleteSupported, FALSE))
+            NtLog(FALSE, L"[*] POSIX delete not supported: %x\n", status);
+    }
+
+    // Clear read-only attribute.
+    if (attrs & FILE_ATTRIBUTE_READONLY)
+    {
+        status = FileSetAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileSetAttributes(%s) failed: %x\n", path, status);
+            return status;
+        }
+    }
+
+    status = FileOpen(&file, path, TRUE, FALSE, FALSE);
+
+    if ((!NT_SUCCESS(status)) && (attrs & FILE_ATTRIBUTE_REPARSE_POINT))
+        status = FileOpen(&file, path, TRUE, FALSE, TRUE);
+
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", path, status);
+        return status;
+    }
+
+    status = FileDelete(file);
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] FileDelete(%s) failed: %x\n", path, status);
+
+    NtClose(file);
+    return status;
+}
+
+NTSTATUS FileCreateDirectory(const IN PWCHAR path)
+{
+    UNICODE_STRING pathU = { 0 };
+    NTSTATUS status;
+    HANDLE file = NULL;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+
+    if (!RtlDosPathNameToNtPathName_U(path, &pathU, NULL, NULL))
+    {
+        status = STATUS_UNSUCCESSFUL;
+        goto cleanup;
+    }
+
+    InitializeObjectAttributes(&oa, &pathU, OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    status = NtCreateFile(
+        &file,
+        SYNCHRONIZE | FILE_OPEN_FOR_BACKUP_INTENT,
+        &oa,
+        &iosb,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        0,
+        FILE_CREATE,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_DIRECTORY_FILE,
+        NULL,
+        0);
+
+cleanup:
+
+    if (pathU.Buffer)
+        RtlFreeUnicodeString(&pathU);
+    if (file)
+        NtClose(file);
+    return status;
+}
+
+// sourcePath must be an existing and empty directory.
+NTSTATUS FileSetSymlink(IN const PWCHAR sourcePath, IN const PWCHAR targetPath)
+{
+    BYTE buffer[MAX_PATH_LONG]; // MSDN doesn't specify maximum structure's length, but it should be close to MAX_PATH_LONG
+    REPARSE_DATA_BUFFER *rdb = (REPARSE_DATA_BUFFER *) buffer;
     ULONG targetSize;
     NTSTATUS status;
     HANDLE file = NULL;
@@ -714,12 +1238,19 @@ NTSTATUS FileCopyReparsePoint(IN const PWCHAR sourcePath, IN const PWCHAR target
     }
 
     status = FileCreateDirectory(targetPath);
+    // An interrupted run may have created the directory, or even set the reparse point,
+    // without journaling it. FileOpen doesn't follow it, the reparse data is set again.
+    if (status == STATUS_OBJECT_NAME_COLLISION && JournalIsResuming())
+        status = STATUS_SUCCESS;
+
     if (!NT_SUCCESS(status))
     {
         NtLog(TRUE, L"[!] FileCopyReparsePoint: FileCreateDirectory(%s) failed: %x\n", targetPath, status);
         goto cleanup;
     }
 
+    CopyEngineFaultPoint();
+
     status = FileOpen(&target, targetPath, TRUE, FALSE, FALSE);
     if (!NT_SUCCESS(status))
     {
@@ -764,18 +1295,213 @@ cleanup:
     return status;
 }
 
-NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors)
+// Enumeration buffer for one recursion depth. Entries returned by DirQuery stay valid
+// until the next query at the same depth, deeper directories use their own buffers.
+typedef struct _DIR_BUFFER
+{
+    FILE_FULL_DIR_INFORMATION *Buffer;
+    ULONG Size;
+    ULONG LastUsed; // bytes returned by the last query
+} DIR_BUFFER;
+
+// Only used by the thread walking the tree.
+static DIR_BUFFER *g_DirBuffers = NULL;
+static ULONG g_DirBufferCount = 0;
+
+DIR_QUERY_STATS g_DirQueryStats = { 0 };
+
+static NTSTATUS DirGetBuffer(IN ULONG depth, OUT DIR_BUFFER **dirBuffer)
+{
+    DIR_BUFFER *buffer;
+    void *larger;
+
+    if (depth >= g_DirBufferCount)
+    {
+        ULONG count = g_DirBufferCount ? g_DirBufferCount * 2 : 16;
+        DIR_BUFFER *buffers;
+
+        while (count <= depth)
+            count *= 2;
+
+        buffers = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, count * sizeof(DIR_BUFFER));
+        if (!buffers)
+            return STATUS_NO_MEMORY;
+
+        if (g_DirBuffers)
+        {
+            RtlCopyMemory(buffers, g_DirBuffers, g_DirBufferCount * sizeof(DIR_BUFFER));
+            RtlFreeHeap(g_Heap, 0, g_DirBuffers);
+        }
+
+        g_DirBuffers = buffers;
+        g_DirBufferCount = count;
+    }
+
+    buffer = &g_DirBuffers[depth];
+
+    if (!buffer->Buffer)
+    {
+        buffer->Buffer = RtlAllocateHeap(g_Heap, 0, DIR_QUERY_BUFFER_MIN);
+        if (!buffer->Buffer)
+            return STATUS_NO_MEMORY;
+        buffer->Size = DIR_QUERY_BUFFER_MIN;
+        buffer->LastUsed = 0;
+    }
+    else if (buffer->LastUsed >= buffer->Size / 2 && buffer->Size < DIR_QUERY_BUFFER_MAX)
+    {
+        // Big directory: fewer, larger queries. Keep the old buffer if this fails.
+        larger = RtlAllocateHeap(g_Heap, 0, buffer->Size * 2);
+        if (larger)
+        {
+            RtlFreeHeap(g_Heap, 0, buffer->Buffer);
+            buffer->Buffer = larger;
+            buffer->Size *= 2;
+            g_DirQueryStats.BufferGrowths++;
+        }
+    }
+
+    *dirBuffer = buffer;
+    return STATUS_SUCCESS;
+}
+
+static void DirFreeBuffers(void)
+{
+    for (ULONG i = 0; i < g_DirBufferCount; i++)
+    {
+        if (g_DirBuffers[i].Buffer)
+            RtlFreeHeap(g_Heap, 0, g_DirBuffers[i].Buffer);
+    }
+
+    if (g_DirBuffers)
+        RtlFreeHeap(g_Heap, 0, g_DirBuffers);
+
+    g_DirBuffers = NULL;
+    g_DirBufferCount = 0;
+}
+
+static NTSTATUS DirQuery(IN HANDLE dir, IN HANDLE event, IN ULONG depth, IN BOOLEAN firstQuery,
+    OUT FILE_FULL_DIR_INFORMATION **dirInfo)
+{
+    DIR_BUFFER *buffer;
+    FILE_FULL_DIR_INFORMATION *entry;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+
+    status = DirGetBuffer(depth, &buffer);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = NtQueryDirectoryFile(
+        dir,
+        event,
+        NULL,
+        0,
+        &iosb,
+        buffer->Buffer,
+        buffer->Size,
+        FileFullDirectoryInformation,
+        FALSE,
+        NULL,
+        firstQuery);
+
+    if (status == STATUS_PENDING)
+    {
+        ZwWaitForSingleObject(event, FALSE, NULL);
+        status = iosb.Status;
+    }
+
+    g_DirQueryStats.Calls++;
+    if (!NT_SUCCESS(status))
+    {
+        buffer->LastUsed = 0;
+        return status;
+    }
+
+    buffer->LastUsed = (ULONG)iosb.Information;
+
+    for (entry = buffer->Buffer; ; entry = (FILE_FULL_DIR_INFORMATION *) ((ULONG_PTR) entry + entry->NextEntryOffset))
+    {
+        g_DirQueryStats.Entries++;
+        if (!entry->NextEntryOffset)
+            break;
+    }
+
+    *dirInfo = buffer->Buffer;
+    return status;
+}
+
+// Directory whose security is copied after all files are copied.
+typedef struct _DEFERRED_DIRECTORY
+{
+    LIST_ENTRY ListEntry;
+    PWCHAR SourcePath;
+    PWCHAR TargetPath;
+} DEFERRED_DIRECTORY;
+
+static NTSTATUS CopyDirectorySecurity(IN const PWCHAR sourcePath, IN const PWCHAR targetPath)
+{
+    HANDLE source = NULL, target = NULL;
+    NTSTATUS status;
+
+    status = FileOpen(&source, sourcePath, FALSE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", sourcePath, status);
+        goto cleanup;
+    }
+
+    status = FileOpen(&target, targetPath, TRUE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", targetPath, status);
+        goto cleanup;
+    }
+
+    status = FileCopySecurity(source, target);
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] FileCopySecurity(%s, %s) failed: %x\n", sourcePath, targetPath, status);
+
+cleanup:
+    if (source)
+        NtClose(source);
+    if (target)
+        NtClose(target);
+    return status;
+}
+
+// Remember a directory for CopyDirectorySecurity. Directories are added in post-order (children first).
+static NTSTATUS DeferDirectorySecurity(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN OUT LIST_ENTRY *deferred)
+{
+    SIZE_T sourceSize = (wcslen(sourcePath) + 1) * sizeof(WCHAR);
+    SIZE_T targetSize = (wcslen(targetPath) + 1) * sizeof(WCHAR);
+    DEFERRED_DIRECTORY *entry;
+
+    // one allocation for the entry and both paths
+    entry = RtlAllocateHeap(g_Heap, 0, sizeof(DEFERRED_DIRECTORY) + sourceSize + targetSize);
+    if (!entry)
+        return STATUS_NO_MEMORY;
+
+    entry->SourcePath = (PWCHAR)(entry + 1);
+    entry->TargetPath = (PWCHAR)((BYTE *)entry->SourcePath + sourceSize);
+    RtlCopyMemory(entry->SourcePath, sourcePath, sourceSize);
+    RtlCopyMemory(entry->TargetPath, targetPath, targetSize);
+    InsertTailList(deferred, &entry->ListEntry);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS CopyDirectoryTree(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors,
+    IN ULONG depth, IN OUT LIST_ENTRY *deferred)
 {
     UNICODE_STRING dirNameU = { 0 };
     OBJECT_ATTRIBUTES oa;
     HANDLE dir = NULL, target = NULL;
     NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
     BOOLEAN firstQuery = TRUE;
     FILE_FULL_DIR_INFORMATION *dirInfo = NULL, *entry;
     HANDLE event = NULL;
     WCHAR *fullPath = NULL;
     WCHAR *fullTargetPath = NULL;
+    BOOLEAN sparse;
 
     if (!RtlDosPathNameToNtPathName_U(sourcePath, &dirNameU, NULL, NULL))
     {
@@ -787,6 +1513,10 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
     NtLog(FALSE, L"[D] %s\n", sourcePath);
 
     status = FileCreateDirectory(targetPath);
+    // Directories created by an interrupted run are reused.
+    if (status == STATUS_OBJECT_NAME_COLLISION && JournalIsResuming())
+        status = STATUS_SUCCESS;
+
     if (!NT_SUCCESS(status))
     {
         NtLog(TRUE, L"[!] FileCreateDirectory(%s) failed: %x\n", targetPath, status);
@@ -808,6 +1538,17 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
         goto cleanup;
     }
 
+    if (depth == 0)
+    {
+        g_CloneSupported = FileCanClone(dir, target, &g_CloneClusterSize);
+        if (g_ForceClone && !g_CloneSupported)
+        {
+            g_CloneSupported = TRUE;
+            g_CloneClusterSize = 4096; // a valid cluster size, the clone fails anyway
+        }
+        NtLog(FALSE, L"[*] Block cloning %s\n", g_CloneSupported ? L"supported" : L"not supported");
+    }
+
     status = FileCopyBasicInformation(dir, target);
     if (!NT_SUCCESS(status))
     {
@@ -816,13 +1557,8 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
             goto cleanup;
     }
 
-    dirInfo = RtlAllocateHeap(g_Heap, 0, 16384);
-    if (!dirInfo)
-    {
-        NtLog(TRUE, L"[!] RtlAllocateHeap(dirInfo) failed\n");
-        status = STATUS_NO_MEMORY;
-        goto cleanup;
-    }
+    // Compression state is inherited by new files.
+    FileCopyStorageAttributes(dir, target, &sparse);
 
     InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
     status = ZwCreateEvent(
@@ -840,24 +1576,7 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
 
     while (TRUE)
     {
-        status = NtQueryDirectoryFile(
-            dir,
-            event,
-            NULL,
-            0,
-            &iosb,
-            dirInfo,
-            16384,
-            FileFullDirectoryInformation,
-            FALSE,
-            NULL,
-            firstQuery);
-
-        if (status == STATUS_PENDING)
-        {
-            ZwWaitForSingleObject(event, FALSE, NULL);
-            status = iosb.Status;
-        }
+        status = DirQuery(dir, event, depth, firstQuery, &dirInfo);
 
         if (status == STATUS_NO_MORE_FILES)
             break;
@@ -891,17 +1610,28 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
                 wcscat_s(fullTargetPath, MAX_PATH_LONG, L"\\");
                 wcsncat_s(fullTargetPath, MAX_PATH_LONG, entry->FileName, entry->FileNameLength / 2);
 
-                if (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                if ((!(entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) || (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) &&
+                    JournalIsFileCopied(fullPath))
+                {
+                    NtLog(FALSE, L"[*] Already copied: %s\n", fullPath);
+                    ProgressAdd(1, (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? 0 : entry->EndOfFile.QuadPart);
+                }
+                else if (entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
                 {
-                    FileCopyReparsePoint(fullPath, fullTargetPath);
+                    if (NT_SUCCESS(FileCopyReparsePoint(fullPath, fullTargetPath)))
+                    {
+                        JournalFileCopied(fullPath);
+                        CopyEngineFileDone();
+                    }
+                    ProgressAdd(1, 0);
                 }
                 else if (entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
                 {
-                    FileCopyDirectory(fullPath, fullTargetPath, ignoreErrors);
+                    CopyDirectoryTree(fullPath, fullTargetPath, ignoreErrors, depth + 1, deferred);
                 }
                 else
                 {
-                    FileCopy(fullPath, fullTargetPath);
+                    CopyEngineQueueFile(fullPath, fullTargetPath, entry->EndOfFile.QuadPart);
                 }
             }
 
@@ -915,13 +1645,20 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
         firstQuery = FALSE;
     }
 
-    // copy ACLs after dealing with children so we don't get tripped by restrictive access
-    status = FileCopySecurity(dir, target);
+    // Copy ACLs after dealing with children so we don't get tripped by restrictive access.
+    // Files may still be queued for copying, so this is done by FileCopyDirectory at the end.
+    status = DeferDirectorySecurity(sourcePath, targetPath, deferred);
     if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] FileCopySecurity(%s, %s) failed: %x\n", sourcePath, targetPath, status);
-        if (!ignoreErrors)
-            goto cleanup;
+        NtLog(TRUE, L"[!] DeferDirectorySecurity(%s) failed: %x\n", sourcePath, status);
+        CopyEngineWait();
+        status = FileCopySecurity(dir, target);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileCopySecurity(%s, %s) failed: %x\n", sourcePath, targetPath, status);
+            if (!ignoreErrors)
+                goto cleanup;
+        }
     }
 
     status = STATUS_SUCCESS;
@@ -929,8 +1666,6 @@ NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPat
 cleanup:
     if (dirNameU.Buffer)
         RtlFreeUnicodeString(&dirNameU);
-    if (dirInfo)
-        RtlFreeHeap(g_Heap, 0, dirInfo);
     if (fullPath)
         RtlFreeHeap(g_Heap, 0, fullPath);
     if (fullTargetPath)
@@ -944,40 +1679,231 @@ cleanup:
     return status;
 }
 
-NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
+// Count files (including reparse points) and their data size in a directory tree.
+static NTSTATUS ScanDirectoryTree(IN const PWCHAR path, IN ULONG depth, IN OUT ULONG64 *files, IN OUT ULONG64 *bytes)
 {
-    UNICODE_STRING dirNameU = { 0 };
     OBJECT_ATTRIBUTES oa;
-    HANDLE dir = NULL, file;
+    HANDLE dir = NULL;
     NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
     BOOLEAN firstQuery = TRUE;
     FILE_FULL_DIR_INFORMATION *dirInfo = NULL, *entry;
     HANDLE event = NULL;
     WCHAR *fullPath = NULL;
+
+    status = FileOpen(&dir, path, FALSE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", path, status);
+        goto cleanup;
+    }
+
+    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
+    status = ZwCreateEvent(
+        &event,
+        EVENT_ALL_ACCESS,
+        &oa,
+        SynchronizationEvent,
+        FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] NtCreateEvent failed: %x\n", status);
+        goto cleanup;
+    }
+
+    while (TRUE)
+    {
+        status = DirQuery(dir, event, depth, firstQuery, &dirInfo);
+
+        if (status == STATUS_NO_MORE_FILES)
+            break;
+
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] NtQueryDirectoryFile(%s) failed: %x\n", path, status);
+            goto cleanup;
+        }
+
+        entry = dirInfo;
+
+        while (entry)
+        {
+            if (0 != wcsncmp(L".", entry->FileName, entry->FileNameLength / 2) &&
+                0 != wcsncmp(L"..", entry->FileName, entry->FileNameLength / 2))
+            {
+                if ((entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                {
+                    if (!fullPath)
+                        fullPath = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, MAX_PATH_LONG*sizeof(WCHAR));
+
+                    wcscpy_s(fullPath, MAX_PATH_LONG - 1, path); // 1 for backslash
+                    wcscat_s(fullPath, MAX_PATH_LONG, L"\\");
+                    wcsncat_s(fullPath, MAX_PATH_LONG, entry->FileName, entry->FileNameLength / 2);
+
+                    status = ScanDirectoryTree(fullPath, depth + 1, files, bytes);
+                    if (!NT_SUCCESS(status))
+                        goto cleanup;
+                }
+                else
+                {
+                    (*files)++;
+                    if (!(entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                        *bytes += entry->EndOfFile.QuadPart;
+                }
+            }
+
+            if (!entry->NextEntryOffset)
+                break;
+
+            // Move to next entry.
+            entry = (FILE_FULL_DIR_INFORMATION *) ((ULONG_PTR) entry + entry->NextEntryOffset);
+        }
+
+        firstQuery = FALSE;
+    }
+
+    status = STATUS_SUCCESS;
+
+cleanup:
+    if (fullPath)
+        RtlFreeHeap(g_Heap, 0, fullPath);
+    if (event)
+        NtClose(event);
+    if (dir)
+        NtClose(dir);
+    return status;
+}
+
+NTSTATUS FileScanDirectory(IN const PWCHAR path, OUT ULONG64 *files, OUT ULONG64 *bytes)
+{
+    NTSTATUS status;
+
+    *files = *bytes = 0;
+    status = ScanDirectoryTree(path, 0, files, bytes);
+    DirFreeBuffers();
+    return status;
+}
+
+NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors)
+{
+    LIST_ENTRY deferred;
+    DEFERRED_DIRECTORY *entry;
+    NTSTATUS status, securityStatus;
+
+    InitializeListHead(&deferred);
+
+    status = SecurityCacheInit();
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] SecurityCacheInit failed: %x\n", status);
+
+    status = CopyEngineStart(COPY_WORKERS);
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] CopyEngineStart failed: %x, copying on one thread\n", status);
+
+    status = CopyDirectoryTree(sourcePath, targetPath, ignoreErrors, 0, &deferred);
+    DirFreeBuffers();
+
+    // all files must be in place before directory ACLs are applied
+    CopyEngineStop();
+
+    while (!IsListEmpty(&deferred))
+    {
+        entry = CONTAINING_RECORD(RemoveHeadList(&deferred), DEFERRED_DIRECTORY, ListEntry);
+        securityStatus = CopyDirectorySecurity(entry->SourcePath, entry->TargetPath);
+
+        // Only the top directory (added last) fails the whole copy, as errors in subdirectories always were ignored.
+        if (IsListEmpty(&deferred) && NT_SUCCESS(status) && !ignoreErrors)
+            status = securityStatus;
+
+        RtlFreeHeap(g_Heap, 0, entry);
+    }
+
+    SecurityCacheFree();
+    return status;
+}
+
+typedef struct _DEFERRED_DELETE
+{
+    LIST_ENTRY ListEntry;
+    PWCHAR Path;
+} DEFERRED_DELETE;
+
+// Remember a directory to delete once its files are gone. Directories are added in post-order (children first).
+static NTSTATUS DeferDirectoryDelete(IN const PWCHAR path, IN OUT LIST_ENTRY *deferred)
+{
+    SIZE_T size = (wcslen(path) + 1) * sizeof(WCHAR);
+    DEFERRED_DELETE *entry;
+
+    entry = RtlAllocateHeap(g_Heap, 0, sizeof(DEFERRED_DELETE) + size);
+    if (!entry)
+        return STATUS_NO_MEMORY;
+
+    entry->Path = (PWCHAR)(entry + 1);
+    RtlCopyMemory(entry->Path, path, size);
+    InsertTailList(deferred, &entry->ListEntry);
+    return STATUS_SUCCESS;
+}
+
+// Delete an empty directory.
+static NTSTATUS DeleteDirectory(IN const PWCHAR path)
+{
+    HANDLE dir = NULL;
     ULONG attrs;
+    NTSTATUS status;
 
-    if (!RtlDosPathNameToNtPathName_U(path, &dirNameU, NULL, NULL))
+    // Clear read-only attribute.
+    status = FileGetAttributes(path, &attrs);
+    if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] RtlDosPathNameToNtPathName_U(%s) failed\n", path);
-        status = STATUS_UNSUCCESSFUL;
+        NtLog(TRUE, L"[!] FileGetAttributes(%s) failed: %x\n", path, status);
         goto cleanup;
     }
 
-    NtLog(FALSE, L"[~] %s\n", path);
+    if (attrs & FILE_ATTRIBUTE_READONLY)
+    {
+        status = FileSetAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileSetAttributes(%s) failed: %x\n", path, status);
+            goto cleanup;
+        }
+    }
 
-    status = FileOpen(&dir, path, FALSE, FALSE, FALSE);
+    // Open for write.
+    status = FileOpen(&dir, path, TRUE, FALSE, FALSE);
     if (!NT_SUCCESS(status))
     {
         NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", path, status);
         goto cleanup;
     }
 
-    dirInfo = RtlAllocateHeap(g_Heap, 0, 16384);
-    if (!dirInfo)
+    status = FileDelete(dir);
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] FileDelete(%s) failed: %x\n", path, status);
+
+cleanup:
+    if (dir)
+        NtClose(dir);
+    return status;
+}
+
+// Files are deleted by the copy engine workers, directories are only collected in deferred.
+static NTSTATUS DeleteDirectoryTree(IN const PWCHAR path, IN BOOLEAN deleteSelf, IN ULONG depth, IN OUT LIST_ENTRY *deferred)
+{
+    OBJECT_ATTRIBUTES oa;
+    HANDLE dir = NULL;
+    NTSTATUS status;
+    BOOLEAN firstQuery = TRUE;
+    FILE_FULL_DIR_INFORMATION *dirInfo = NULL, *entry;
+    HANDLE event = NULL;
+    WCHAR *fullPath = NULL;
+
+    NtLog(FALSE, L"[~] %s\n", path);
+
+    status = FileOpen(&dir, path, FALSE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
     {
-        NtLog(TRUE, L"[!] RtlAllocateHeap(dirInfo) failed\n");
-        status = STATUS_NO_MEMORY;
+        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", path, status);
         goto cleanup;
     }
 
@@ -997,24 +1923,7 @@ NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
 
     while (TRUE)
     {
-        status = NtQueryDirectoryFile(
-            dir,
-            event,
-            NULL,
-            0,
-            &iosb,
-            dirInfo,
-            16384,
-            FileFullDirectoryInformation,
-            FALSE,
-            NULL,
-            firstQuery);
-
-        if (status == STATUS_PENDING)
-        {
-            ZwWaitForSingleObject(event, FALSE, NULL);
-            status = iosb.Status;
-        }
+        status = DirQuery(dir, event, depth, firstQuery, &dirInfo);
 
         if (status == STATUS_NO_MORE_FILES)
             break;
@@ -1043,21 +1952,10 @@ NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
                 wcscat_s(fullPath, MAX_PATH_LONG, L"\\");
                 wcsncat_s(fullPath, MAX_PATH_LONG, entry->FileName, entry->FileNameLength / 2);
 
-                // Clear read-only attribute.
-                if (entry->FileAttributes & FILE_ATTRIBUTE_READONLY)
-                {
-                    status = FileSetAttributes(fullPath, entry->FileAttributes & ~FILE_ATTRIBUTE_READONLY);
-                    if (!NT_SUCCESS(status))
-                    {
-                        NtLog(TRUE, L"[!] FileSetAttributes(%s) failed: %x\n", fullPath, status);
-                        goto cleanup;
-                    }
-                }
-
                 if ((entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
                 {
                     // directory that is not a reparse point: recursively delete
-                    status = FileDeleteDirectory(fullPath, TRUE);
+                    status = DeleteDirectoryTree(fullPath, TRUE, depth + 1, deferred);
                     if (!NT_SUCCESS(status))
                     {
                         NtLog(TRUE, L"[!] FileDeleteDirectory(%s) failed: %x\n", fullPath, status);
@@ -1067,26 +1965,18 @@ NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
                 else
                 {
                     // just delete
-                    status = FileOpen(&file, fullPath, TRUE, FALSE, FALSE);
-                    
-                    if ((!NT_SUCCESS(status)) && (entry->FileAttributes  & FILE_ATTRIBUTE_REPARSE_POINT))
-		        status = FileOpen(&file, fullPath, TRUE, FALSE, TRUE);
-
-                    if (!NT_SUCCESS(status))
-                    {
-                        NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", fullPath, status);
-                        goto cleanup;
-                    }
-
-                    status = FileDelete(file);
+                    status = CopyEngineQueueDelete(fullPath, entry->FileAttributes);
                     if (!NT_SUCCESS(status))
                     {
-                        NtLog(TRUE, L"[!] FileDelete(%s) failed: %x\n", fullPath, status);
-                        NtClose(file);
+                        NtLog(TRUE, L"[!] FileDeletePath(%s) failed: %x\n", fullPath, status);
                         goto cleanup;
                     }
-                    NtClose(file);
                 }
+
+                // Stop walking after the first failure, like the serial delete did.
+                status = CopyEngineGetError();
+                if (!NT_SUCCESS(status))
+                    goto cleanup;
             }
 
             if (!entry->NextEntryOffset)
@@ -1101,49 +1991,14 @@ NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
 
     if (deleteSelf)
     {
-        NtClose(dir);
-
-        // Clear read-only attribute.
-        status = FileGetAttributes(path, &attrs);
-        if (!NT_SUCCESS(status))
-        {
-            NtLog(TRUE, L"[!] FileGetAttributes(%s) failed: %x\n", path, status);
-            goto cleanup;
-        }
-
-        if (attrs & FILE_ATTRIBUTE_READONLY)
-        {
-            status = FileSetAttributes(path, attrs & ~FILE_ATTRIBUTE_READONLY);
-            if (!NT_SUCCESS(status))
-            {
-                NtLog(TRUE, L"[!] FileSetAttributes(%s) failed: %x\n", path, status);
-                goto cleanup;
-            }
-        }
-        // Reopen for write.
-        status = FileOpen(&dir, path, TRUE, FALSE, FALSE);
-        if (!NT_SUCCESS(status))
-        {
-            NtLog(TRUE, L"[!] FileOpen(%s) failed: %x\n", path, status);
-            goto cleanup;
-        }
-
-        // Delete the parent itself.
-        status = FileDelete(dir);
+        status = DeferDirectoryDelete(path, deferred);
         if (!NT_SUCCESS(status))
-        {
-            NtLog(TRUE, L"[!] FileDelete(%s) failed: %x\n", path, status);
             goto cleanup;
-        }
     }
 
     status = STATUS_SUCCESS;
 
 cleanup:
-    if (dirNameU.Buffer)
-        RtlFreeUnicodeString(&dirNameU);
-    if (dirInfo)
-        RtlFreeHeap(g_Heap, 0, dirInfo);
     if (fullPath)
         RtlFreeHeap(g_Heap, 0, fullPath);
     if (event)
@@ -1152,3 +2007,37 @@ cleanup:
         NtClose(dir);
     return status;
 }
+
+NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf)
+{
+    LIST_ENTRY deferred;
+    DEFERRED_DELETE *entry;
+    NTSTATUS status, engineStatus;
+
+    InitializeListHead(&deferred);
+
+    status = CopyEngineStart(COPY_WORKERS);
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] CopyEngineStart failed: %x, deleting on one thread\n", status);
+
+    status = DeleteDirectoryTree(path, deleteSelf, 0, &deferred);
+    DirFreeBuffers();
+
+    // all files must be gone before their directories are deleted
+    CopyEngineWait();
+    engineStatus = CopyEngineGetError();
+    CopyEngineStop();
+
+    if (NT_SUCCESS(status))
+        status = engineStatus;
+
+    while (!IsListEmpty(&deferred))
+    {
+        entry = CONTAINING_RECORD(RemoveHeadList(&deferred), DEFERRED_DELETE, ListEntry);
+        if (NT_SUCCESS(status))
+            status = DeleteDirectory(entry->Path);
+        RtlFreeHeap(g_Heap, 0, entry);
+    }
+
+    return status;
+}
@@ -32,6 +32,48 @@ extern HANDLE g_Heap;
 // Maximum path length for NTFS.
 #define MAX_PATH_LONG 32768
 
+// Directory enumeration buffers start small and grow for big directories.
+#define DIR_QUERY_BUFFER_MIN (64 * 1024)
+#define DIR_QUERY_BUFFER_MAX (1024 * 1024)
+
+typedef struct _DIR_QUERY_STATS
+{
+    ULONG64 Calls; // NtQueryDirectoryFile calls
+    ULONG64 Entries; // directory entries returned
+    ULONG64 BufferGrowths;
+} DIR_QUERY_STATS;
+
+extern DIR_QUERY_STATS g_DirQueryStats;
+
+// Data copy buffers. Files at least COPY_LARGE_FILE_SIZE big are preallocated and copied in bigger chunks.
+#define COPY_BUFFER_SIZE        (64 * 1024)
+#define COPY_LARGE_BUFFER_SIZE  (1024 * 1024)
+#define COPY_LARGE_FILE_SIZE    (4 * 1024 * 1024)
+
+// How FileCopy copied the data.
+typedef enum _COPY_TIER
+{
+    COPY_TIER_CLONE = 0, // block clone (same volume, ReFS)
+    COPY_TIER_LARGE,     // preallocated target, large IO
+    COPY_TIER_BUFFERED,  // small read/write loop
+    COPY_TIER_COUNT
+} COPY_TIER;
+
+typedef struct _COPY_STATS
+{
+    volatile LONG64 Files[COPY_TIER_COUNT];
+    volatile LONG64 Bytes[COPY_TIER_COUNT];
+    volatile LONG64 Time[COPY_TIER_COUNT]; // 100ns units, summed over worker threads
+    volatile LONG64 Streams; // alternate data streams copied
+    volatile LONG64 HoleBytes; // sparse ranges not copied
+    volatile LONG64 Deleted; // files and reparse points deleted by the copy engine
+} COPY_STATS;
+
+extern COPY_STATS g_CopyStats;
+
+// Try block cloning on any volume, a failed clone falls back to copying the data. Only for testing the fallback.
+extern BOOLEAN g_ForceClone;
+
 void NtLog(IN BOOLEAN print, IN const PWCHAR format, ...);
 NTSTATUS FileOpen(OUT HANDLE *file, IN const PWCHAR fileName, IN BOOLEAN write, IN BOOLEAN overwrite, IN BOOLEAN isReparse);
 NTSTATUS FileGetAttributes(IN const PWCHAR fileName, OUT ULONG *attrs);
@@ -42,12 +84,16 @@ NTSTATUS FileSetPosition(IN HANDLE file, IN INT64 position);
 NTSTATUS FileRead(IN HANDLE file, OUT void *buffer, IN ULONG bufferSize, OUT ULONG *readSize);
 NTSTATUS FileWrite(IN HANDLE file, IN const PVOID buffer, IN ULONG bufferSize, OUT ULONG *writtenSize);
 NTSTATUS FileRename(IN const PWCHAR existingFileName, IN const PWCHAR newFileName, IN BOOLEAN replaceIfExists);
-NTSTATUS FileCopy(IN const PWCHAR sourceName, IN const PWCHAR targetName);
+// buffer of COPY_LARGE_BUFFER_SIZE bytes is for the data copy, so that a thread can reuse one for all its files.
+// NULL: allocated for this file.
+NTSTATUS FileCopy(IN const PWCHAR sourceName, IN const PWCHAR targetName, IN BYTE *buffer);
 NTSTATUS FileCopySecurity(IN HANDLE source, IN HANDLE target);
 NTSTATUS FileDelete(IN HANDLE file);
+NTSTATUS FileDeletePath(IN const PWCHAR path, IN ULONG attrs);
 NTSTATUS FileCreateDirectory(const IN PWCHAR path);
 NTSTATUS FileCopyReparsePoint(IN const PWCHAR sourcePath, IN const PWCHAR targetPath);
 NTSTATUS FileSetSymlink(IN const PWCHAR sourcePath, IN const PWCHAR targetPath);
+NTSTATUS FileScanDirectory(IN const PWCHAR path, OUT ULONG64 *files, OUT ULONG64 *bytes);
 NTSTATUS FileCopyDirectory(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN ignoreErrors);
 NTSTATUS FileDeleteDirectory(IN const PWCHAR path, IN BOOLEAN deleteSelf);
 
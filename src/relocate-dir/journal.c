@@ -0,0 +1,598 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "io.h"
+#include "journal.h"
+
+static HANDLE g_Journal = NULL;
+static HANDLE g_Volume = NULL; // target volume, flushed before records are written
+static WCHAR g_JournalPath[MAX_PATH_LONG];
+static SIZE_T g_SourceLength = 0; // characters in the source directory path
+static BOOLEAN g_Resuming = FALSE;
+
+// Completed files not yet in the journal, protected by g_JournalLock.
+static HANDLE g_JournalLock = NULL; // auto-reset event, signaled = unlocked
+static BYTE *g_Pending = NULL;
+static ULONG g_PendingSize = 0;
+static ULONG g_PendingCount = 0;
+
+// Files copied by an interrupted run (relative paths), open addressing.
+static PWCHAR *g_CopiedSet = NULL;
+static ULONG g_CopiedSetSize = 0; // power of 2
+static ULONG g_CopiedCount = 0;
+
+static ULONG HashPath(IN const WCHAR *path, IN SIZE_T length)
+{
+    ULONG hash = 2166136261; // FNV-1a
+
+    for (SIZE_T i = 0; i < length; i++)
+    {
+        hash ^= path[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static NTSTATUS CopiedSetInsert(IN const WCHAR *path, IN SIZE_T length);
+
+static NTSTATUS CopiedSetGrow(void)
+{
+    PWCHAR *oldSet = g_CopiedSet;
+    ULONG oldSize = g_CopiedSetSize;
+    ULONG size = oldSize ? oldSize * 2 : 4096;
+
+    g_CopiedSet = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, size * sizeof(PWCHAR));
+    if (!g_CopiedSet)
+    {
+        g_CopiedSet = oldSet;
+        return STATUS_NO_MEMORY;
+    }
+
+    g_CopiedSetSize = size;
+    g_CopiedCount = 0;
+
+    for (ULONG i = 0; i < oldSize; i++)
+    {
+        if (oldSet[i])
+        {
+            CopiedSetInsert(oldSet[i], wcslen(oldSet[i]));
+            RtlFreeHeap(g_Heap, 0, oldSet[i]);
+        }
+    }
+
+    if (oldSet)
+        RtlFreeHeap(g_Heap, 0, oldSet);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS CopiedSetInsert(IN const WCHAR *path, IN SIZE_T length)
+{
+    ULONG i;
+    PWCHAR copy;
+
+    if ((g_CopiedCount + 1) * 2 > g_CopiedSetSize)
+    {
+        NTSTATUS status = CopiedSetGrow();
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    for (i = HashPath(path, length) & (g_CopiedSetSize - 1); g_CopiedSet[i]; i = (i + 1) & (g_CopiedSetSize - 1))
+    {
+        if (wcslen(g_CopiedSet[i]) == length && wcsncmp(g_CopiedSet[i], path, length) == 0)
+            return STATUS_SUCCESS;
+    }
+
+    copy = RtlAllocateHeap(g_Heap, 0, (length + 1) * sizeof(WCHAR));
+    if (!copy)
+        return STATUS_NO_MEMORY;
+
+    RtlCopyMemory(copy, path, length * sizeof(WCHAR));
+    copy[length] = L'\0';
+    g_CopiedSet[i] = copy;
+    g_CopiedCount++;
+    return STATUS_SUCCESS;
+}
+
+static void CopiedSetFree(void)
+{
+    for (ULONG i = 0; i < g_CopiedSetSize; i++)
+    {
+        if (g_CopiedSet[i])
+            RtlFreeHeap(g_Heap, 0, g_CopiedSet[i]);
+    }
+
+    if (g_CopiedSet)
+        RtlFreeHeap(g_Heap, 0, g_CopiedSet);
+
+    g_CopiedSet = NULL;
+    g_CopiedSetSize = g_CopiedCount = 0;
+}
+
+static ULONG Crc32(IN ULONG crc, IN const BYTE *data, IN SIZE_T size)
+{
+    // Bitwise, records are short and written once per copied file.
+    crc = ~crc;
+    for (SIZE_T i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+ULONG JournalRecordCrc(IN const JOURNAL_RECORD *record, IN const void *data)
+{
+    ULONG crc = Crc32(0, (const BYTE *) &record->Type, sizeof(record->Type));
+
+    crc = Crc32(crc, (const BYTE *) &record->Size, sizeof(record->Size));
+    return Crc32(crc, data, record->Size);
+}
+
+// A relative path from JournalFileCopied: no drive, stream or root, no empty, "." or ".." components.
+static BOOLEAN PathIsInsideSource(IN const WCHAR *path, IN SIZE_T length)
+{
+    SIZE_T start = 0;
+
+    for (SIZE_T i = 0; i <= length; i++)
+    {
+        if (i < length && path[i] != L'\\')
+        {
+            if (path[i] == L':' || path[i] == L'/')
+                return FALSE;
+            continue;
+        }
+
+        // component [start, i)
+        if (i == start ||
+            (i - start == 1 && path[start] == L'.') ||
+            (i - start == 2 && path[start] == L'.' && path[start + 1] == L'.'))
+            return FALSE;
+        start = i + 1;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN JournalRecordIsValid(IN const JOURNAL_RECORD *record, IN SIZE_T available)
+{
+    const void *data = record + 1;
+    const WCHAR *path = data;
+    SIZE_T length;
+    ULONG phase;
+
+    if (available < sizeof(JOURNAL_RECORD) || available - sizeof(JOURNAL_RECORD) < record->Size)
+        return FALSE; // torn write
+
+    if (record->Crc != JournalRecordCrc(record, data))
+        return FALSE;
+
+    switch (record->Type)
+    {
+    case JOURNAL_RECORD_FILE:
+        if (record->Size < 2 * sizeof(WCHAR) || record->Size % sizeof(WCHAR) != 0)
+            return FALSE;
+        length = record->Size / sizeof(WCHAR) - 1;
+        if (path[length] != L'\0' || wcsnlen(path, length) != length)
+            return FALSE;
+        return PathIsInsideSource(path, length);
+
+    case JOURNAL_RECORD_PHASE:
+        if (record->Size != sizeof(ULONG))
+            return FALSE;
+        RtlCopyMemory(&phase, data, sizeof(phase));
+        return phase == JOURNAL_PHASE_COPY_DONE || phase == JOURNAL_PHASE_DELETE_DONE;
+
+    default:
+        return FALSE;
+    }
+}
+
+// Path relative to the source directory, NULL if the path is outside of it.
+static const WCHAR *RelativePath(IN const PWCHAR sourcePath)
+{
+    if (wcslen(sourcePath) <= g_SourceLength || sourcePath[g_SourceLength] != L'\\')
+        return NULL;
+
+    return sourcePath + g_SourceLength + 1;
+}
+
+static void JournalLock(void)
+{
+    ZwWaitForSingleObject(g_JournalLock, FALSE, NULL);
+}
+
+static void JournalUnlock(void)
+{
+    ZwSetEvent(g_JournalLock, NULL);
+}
+
+// Open the volume containing the target directory for flushing.
+static NTSTATUS OpenTargetVolume(IN const PWCHAR targetPath)
+{
+    UNICODE_STRING pathU = { 0 };
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+
+    if (!RtlDosPathNameToNtPathName_U(targetPath, &pathU, NULL, NULL))
+        return STATUS_INVALID_PARAMETER;
+
+    // "\??\X:" is the volume, only drive letter paths are supported.
+    if (pathU.Length < 6 * sizeof(WCHAR) || pathU.Buffer[5] != L':')
+    {
+        status = STATUS_NOT_SUPPORTED;
+        goto cleanup;
+    }
+
+    pathU.Length = 6 * sizeof(WCHAR);
+    InitializeObjectAttributes(&oa, &pathU, OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    status = NtCreateFile(
+        &g_Volume,
+        SYNCHRONIZE | FILE_WRITE_DATA,
+        &oa,
+        &iosb,
+        NULL,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_SYNCHRONOUS_IO_NONALERT,
+        NULL,
+        0);
+
+cleanup:
+    if (pathU.Buffer)
+        RtlFreeUnicodeString(&pathU);
+    return status;
+}
+
+// Parse an existing journal, truncate it at the first record that is torn or fails validation.
+static NTSTATUS JournalLoad(OUT JOURNAL_PHASE *phase)
+{
+    BYTE *data = NULL;
+    INT64 fileSize;
+    ULONG size;
+    ULONG readSize;
+    ULONG offset;
+    JOURNAL_HEADER *header;
+    JOURNAL_RECORD *record;
+    FILE_END_OF_FILE_INFORMATION eof;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+
+    *phase = JOURNAL_PHASE_NONE;
+
+    status = FileGetSize(g_Journal, &fileSize);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    if (fileSize < (INT64)sizeof(JOURNAL_HEADER) || fileSize > MAXLONG)
+        return STATUS_FILE_CORRUPT_ERROR;
+
+    size = (ULONG)fileSize;
+    data = RtlAllocateHeap(g_Heap, 0, size);
+    if (!data)
+        return STATUS_NO_MEMORY;
+
+    for (offset = 0; offset < size; offset += readSize)
+    {
+        status = FileRead(g_Journal, data + offset, size - offset, &readSize);
+        if (!NT_SUCCESS(status))
+            goto cleanup;
+        if (readSize == 0)
+        {
+            status = STATUS_END_OF_FILE;
+            goto cleanup;
+        }
+    }
+
+    header = (JOURNAL_HEADER *) data;
+    if (header->Magic != JOURNAL_MAGIC || header->Version != JOURNAL_VERSION)
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto cleanup;
+    }
+
+    offset = sizeof(JOURNAL_HEADER);
+    while (offset < size)
+    {
+        record = (JOURNAL_RECORD *) (data + offset);
+        if (!JournalRecordIsValid(record, size - offset))
+        {
+            // Records after a bad one can't be trusted either, checkpoints are written in order.
+            NtLog(TRUE, L"[!] Journal: dropping %lu bytes from offset %lu\n", size - offset, offset);
+            break;
+        }
+
+        if (record->Type == JOURNAL_RECORD_FILE)
+        {
+            status = CopiedSetInsert((WCHAR *) (record + 1), record->Size / sizeof(WCHAR) - 1);
+            if (!NT_SUCCESS(status))
+                goto cleanup;
+        }
+        else
+        {
+            *phase = *(ULONG *) (record + 1);
+        }
+
+        offset += (ULONG)sizeof(JOURNAL_RECORD) + record->Size;
+    }
+
+    // Append after the last complete record.
+    eof.EndOfFile.QuadPart = offset;
+    status = NtSetInformationFile(g_Journal, &iosb, &eof, sizeof(eof), FileEndOfFileInformation);
+    if (NT_SUCCESS(status))
+        status = FileSetPosition(g_Journal, offset);
+
+    NtLog(TRUE, L"[*] Resuming interrupted relocation: phase %d, %lu files already copied\n", *phase, g_CopiedCount);
+
+cleanup:
+    RtlFreeHeap(g_Heap, 0, data);
+    return status;
+}
+
+static NTSTATUS JournalDelete(void)
+{
+    HANDLE file = NULL;
+    ULONG attrs;
+    NTSTATUS status;
+
+    status = FileGetAttributes(g_JournalPath, &attrs);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileOpen(&file, g_JournalPath, TRUE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileDelete(file);
+    NtClose(file);
+    return status;
+}
+
+NTSTATUS JournalOpen(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN targetExists, OUT JOURNAL_PHASE *phase)
+{
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    JOURNAL_HEADER header;
+    ULONG attrs;
+    NTSTATUS status;
+
+    *phase = JOURNAL_PHASE_NONE;
+    g_SourceLength = wcslen(sourcePath);
+
+    wcscpy_s(g_JournalPath, RTL_NUMBER_OF(g_JournalPath) - wcslen(JOURNAL_SUFFIX), targetPath);
+    wcscat_s(g_JournalPath, RTL_NUMBER_OF(g_JournalPath), JOURNAL_SUFFIX);
+
+    if (targetExists)
+    {
+        // Target without a journal isn't ours.
+        status = FileGetAttributes(g_JournalPath, &attrs);
+        if (!NT_SUCCESS(status))
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    else
+    {
+        // Leftover from a run that never got to copying.
+        JournalDelete();
+    }
+
+    status = OpenTargetVolume(targetPath);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] JournalOpen: opening volume of %s failed: %x\n", targetPath, status);
+        goto fail;
+    }
+
+    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
+    status = ZwCreateEvent(&g_JournalLock, EVENT_ALL_ACCESS, &oa, SynchronizationEvent, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail;
+
+    g_Pending = RtlAllocateHeap(g_Heap, 0, JOURNAL_BUFFER_SIZE);
+    if (!g_Pending)
+    {
+        status = STATUS_NO_MEMORY;
+        goto fail;
+    }
+    g_PendingSize = g_PendingCount = 0;
+
+    status = FileOpen(&g_Journal, g_JournalPath, TRUE, FALSE, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] JournalOpen: FileOpen(%s) failed: %x\n", g_JournalPath, status);
+        goto fail;
+    }
+
+    if (targetExists)
+    {
+        status = JournalLoad(phase);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] JournalOpen: loading %s failed: %x\n", g_JournalPath, status);
+            goto fail;
+        }
+        g_Resuming = TRUE;
+    }
+    else
+    {
+        header.Magic = JOURNAL_MAGIC;
+        header.Version = JOURNAL_VERSION;
+        status = FileWrite(g_Journal, &header, sizeof(header), NULL);
+        if (NT_SUCCESS(status))
+            status = NtFlushBuffersFile(g_Journal, &iosb);
+        if (!NT_SUCCESS(status))
+            goto fail;
+    }
+
+    return STATUS_SUCCESS;
+
+fail:
+    JournalClose(FALSE);
+    return status;
+}
+
+BOOLEAN JournalIsResuming(void)
+{
+    return g_Resuming;
+}
+
+BOOLEAN JournalIsFileCopied(IN const PWCHAR sourcePath)
+{
+    const WCHAR *relativePath;
+    SIZE_T length;
+
+    if (!g_Journal || g_CopiedCount == 0)
+        return FALSE;
+
+    relativePath = RelativePath(sourcePath);
+    if (!relativePath)
+        return FALSE;
+
+    length = wcslen(relativePath);
+    for (ULONG i = HashPath(relativePath, length) & (g_CopiedSetSize - 1); g_CopiedSet[i]; i = (i + 1) & (g_CopiedSetSize - 1))
+    {
+        if (wcscmp(g_CopiedSet[i], relativePath) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Make everything copied so far durable, then record it. Caller holds the lock.
+static NTSTATUS JournalCheckpoint(void)
+{
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+
+    if (g_PendingSize == 0)
+        return STATUS_SUCCESS;
+
+    status = NtFlushBuffersFile(g_Volume, &iosb);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = FileWrite(g_Journal, g_Pending, g_PendingSize, NULL);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    g_PendingSize = g_PendingCount = 0;
+    return NtFlushBuffersFile(g_Journal, &iosb);
+}
+
+static NTSTATUS JournalAppend(IN USHORT type, IN const void *data, IN USHORT size)
+{
+    JOURNAL_RECORD record;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (g_PendingSize + sizeof(record) + size > JOURNAL_BUFFER_SIZE)
+    {
+        status = JournalCheckpoint();
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    record.Type = type;
+    record.Size = size;
+    record.Crc = JournalRecordCrc(&record, data);
+    RtlCopyMemory(g_Pending + g_PendingSize, &record, sizeof(record));
+    RtlCopyMemory(g_Pending + g_PendingSize + sizeof(record), data, size);
+    g_PendingSize += (ULONG)sizeof(record) + size;
+    g_PendingCount++;
+    return status;
+}
+
+void JournalFileCopied(IN const PWCHAR sourcePath)
+{
+    const WCHAR *relativePath;
+    NTSTATUS status;
+
+    if (!g_Journal)
+        return;
+
+    relativePath = RelativePath(sourcePath);
+    if (!relativePath)
+        return;
+
+    JournalLock();
+    status = JournalAppend(JOURNAL_RECORD_FILE, relativePath, (USHORT)((wcslen(relativePath) + 1) * sizeof(WCHAR)));
+    if (NT_SUCCESS(status) && g_PendingCount >= JOURNAL_CHECKPOINT_FILES)
+        status = JournalCheckpoint();
+    JournalUnlock();
+
+    // Not fatal: the file will just be copied again if we're interrupted.
+    if (!NT_SUCCESS(status))
+        NtLog(FALSE, L"[!] JournalFileCopied(%s) failed: %x\n", sourcePath, status);
+}
+
+NTSTATUS JournalSetPhase(IN JOURNAL_PHASE phase)
+{
+    ULONG value = phase;
+    NTSTATUS status;
+
+    if (!g_Journal)
+        return STATUS_SUCCESS;
+
+    JournalLock();
+    status = JournalAppend(JOURNAL_RECORD_PHASE, &value, sizeof(value));
+    if (NT_SUCCESS(status))
+        status = JournalCheckpoint();
+    JournalUnlock();
+
+    if (!NT_SUCCESS(status))
+        NtLog(TRUE, L"[!] JournalSetPhase(%d) failed: %x\n", phase, status);
+    return status;
+}
+
+void JournalClose(IN BOOLEAN remove)
+{
+    if (g_Journal)
+    {
+        NtClose(g_Journal);
+        g_Journal = NULL;
+    }
+
+    if (g_Volume)
+    {
+        NtClose(g_Volume);
+        g_Volume = NULL;
+    }
+
+    if (g_JournalLock)
+    {
+        NtClose(g_JournalLock);
+        g_JournalLock = NULL;
+    }
+
+    if (g_Pending)
+    {
+        RtlFreeHeap(g_Heap, 0, g_Pending);
+        g_Pending = NULL;
+    }
+
+    CopiedSetFree();
+    g_Resuming = FALSE;
+
+    if (remove && g_JournalPath[0])
+        JournalDelete();
+}
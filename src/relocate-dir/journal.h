@@ -0,0 +1,91 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Crash-safe journal of a relocation, so that an interrupted run can resume on the next boot.
+// Lives next to the target directory (<target>.journal). Records are only written after
+// the data they describe has been flushed to the target volume.
+
+#pragma once
+
+#include "nt.h"
+
+#define JOURNAL_SUFFIX          L".journal"
+#define JOURNAL_MAGIC           0x4a444c52 // 'RLDJ'
+#define JOURNAL_VERSION         1
+
+// Completed files are written to the journal in batches.
+#define JOURNAL_CHECKPOINT_FILES    1024
+#define JOURNAL_BUFFER_SIZE         (256 * 1024)
+
+typedef enum _JOURNAL_PHASE
+{
+    JOURNAL_PHASE_NONE = 0,     // copy not finished
+    JOURNAL_PHASE_COPY_DONE,    // target complete, source not deleted
+    JOURNAL_PHASE_DELETE_DONE,  // source contents deleted, symlink may be missing
+} JOURNAL_PHASE;
+
+typedef enum _JOURNAL_RECORD_TYPE
+{
+    JOURNAL_RECORD_FILE = 1,    // data: path relative to the source directory
+    JOURNAL_RECORD_PHASE,       // data: JOURNAL_PHASE (ULONG)
+} JOURNAL_RECORD_TYPE;
+
+typedef struct _JOURNAL_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+} JOURNAL_HEADER;
+
+// File paths are stored with their terminating NUL.
+typedef struct _JOURNAL_RECORD
+{
+    USHORT Type;
+    USHORT Size; // bytes of data following the record header
+    ULONG Crc;   // CRC-32 of Type, Size and the data
+} JOURNAL_RECORD;
+
+// CRC-32 of a record with its data, for JOURNAL_RECORD.Crc.
+ULONG JournalRecordCrc(IN const JOURNAL_RECORD *record, IN const void *data);
+
+// TRUE if a record with its data fits in available bytes, matches its checksum and could have
+// been written by this code: a known type, a phase that exists, a relative path that stays
+// inside the source directory. Loading stops at the first record that fails this.
+BOOLEAN JournalRecordIsValid(IN const JOURNAL_RECORD *record, IN SIZE_T available);
+
+// Open or create the journal for a relocation.
+// If targetExists is FALSE a stale journal is discarded and a new one is created.
+// If targetExists is TRUE the journal must exist, otherwise STATUS_OBJECT_NAME_NOT_FOUND is returned.
+NTSTATUS JournalOpen(IN const PWCHAR sourcePath, IN const PWCHAR targetPath, IN BOOLEAN targetExists, OUT JOURNAL_PHASE *phase);
+
+// TRUE if the journal was loaded from an interrupted run.
+BOOLEAN JournalIsResuming(void);
+
+// TRUE if a file (or reparse point) under the source directory was already copied by an interrupted run.
+BOOLEAN JournalIsFileCopied(IN const PWCHAR sourcePath);
+
+// Record a copied file. Thread safe, written at the next checkpoint.
+void JournalFileCopied(IN const PWCHAR sourcePath);
+
+// Flush the target volume and record completion of a phase.
+NTSTATUS JournalSetPhase(IN JOURNAL_PHASE phase);
+
+// Close the journal, delete its file if requested (also works after a previous close).
+void JournalClose(IN BOOLEAN remove);
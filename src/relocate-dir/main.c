@@ -19,7 +19,9 @@
  *
  */
 
+#include "copy.h"
 #include "io.h"
+#include "relocate.h"
 
 HANDLE g_Heap;
 
@@ -128,43 +130,6 @@ BOOLEAN FreeHeap(HANDLE heap)
     return NULL == RtlDestroyHeap(heap);
 }
 
-NTSTATUS EnablePrivileges(void)
-{
-    HANDLE processToken = NULL;
-    TOKEN_PRIVILEGES *tp = NULL;
-    ULONG size;
-    NTSTATUS status;
-    const int privilegeCount = 3;
-
-    // This is a variable-size struct, but definition contains 1 element by default.
-    size = sizeof(TOKEN_PRIVILEGES) + (privilegeCount - 1) * sizeof(LUID_AND_ATTRIBUTES);
-    tp = RtlAllocateHeap(g_Heap, 0, size);
-
-    status = NtOpenProcessToken(NtCurrentProcess(), TOKEN_ALL_ACCESS, &processToken);
-    if (!NT_SUCCESS(status))
-        goto cleanup;
-
-    tp->PrivilegeCount = privilegeCount;
-    tp->Privileges[0].Luid.HighPart = 0;
-    tp->Privileges[0].Luid.LowPart = SE_SECURITY_PRIVILEGE; // needed for file security manipulation
-    tp->Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-    tp->Privileges[1].Luid.HighPart = 0;
-    tp->Privileges[1].Luid.LowPart = SE_BACKUP_PRIVILEGE; // needed for reading files with ACLs that don't grant access to SYSTEM
-    tp->Privileges[1].Attributes = SE_PRIVILEGE_ENABLED;
-    tp->Privileges[2].Luid.HighPart = 0;
-    tp->Privileges[2].Luid.LowPart = SE_RESTORE_PRIVILEGE; // needed for setting file ownership
-    tp->Privileges[2].Attributes = SE_PRIVILEGE_ENABLED;
-
-    status = NtAdjustPrivilegesToken(processToken, FALSE, tp, size, NULL, NULL);
-
-cleanup:
-    if (processToken)
-        NtClose(processToken);
-    if (tp)
-        RtlFreeHeap(g_Heap, 0, tp);
-    return status;
-}
-
 // TODO: preserve non-default values if present.
 NTSTATUS RemoveBootExecuteEntry(void)
 {
@@ -213,10 +178,56 @@ cleanup:
     return status;
 }
 
+#ifdef _DEBUG
+// Debug builds can simulate a power loss in the middle of a relocation to test resuming it.
+static void ReadFaultInjection(void)
+{
+    WCHAR keyName[] = L"\\Registry\\Machine\\Software\\Invisible Things Lab\\Qubes Tools\\relocate-dir";
+    WCHAR valueName[] = L"FailAfterFiles";
+    UNICODE_STRING keyNameU, valueNameU;
+    OBJECT_ATTRIBUTES oa;
+    HANDLE key = NULL;
+    struct
+    {
+        KEY_VALUE_PARTIAL_INFORMATION Info;
+        ULONG Data; // Info.Data is only 1 byte
+    } value;
+    ULONG size;
+    NTSTATUS status;
+
+    keyNameU.Buffer = keyName;
+    keyNameU.Length = (USHORT)wcslen(keyName) * sizeof(WCHAR);
+    keyNameU.MaximumLength = keyNameU.Length + sizeof(WCHAR);
+
+    InitializeObjectAttributes(
+        &oa,
+        &keyNameU,
+        OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL);
+
+    status = NtOpenKey(&key, KEY_READ, &oa);
+    if (!NT_SUCCESS(status))
+        return;
+
+    valueNameU.Buffer = valueName;
+    valueNameU.Length = (USHORT)wcslen(valueName) * sizeof(WCHAR);
+    valueNameU.MaximumLength = valueNameU.Length + sizeof(WCHAR);
+
+    status = NtQueryValueKey(key, &valueNameU, KeyValuePartialInformation, &value, sizeof(value), &size);
+    if (NT_SUCCESS(status) && value.Info.Type == REG_DWORD && value.Info.DataLength == sizeof(ULONG))
+    {
+        RtlCopyMemory(&g_FailAfterFiles, value.Info.Data, sizeof(ULONG));
+        NtLog(TRUE, L"[*] Fault injection enabled, terminating after %lu files\n", g_FailAfterFiles);
+    }
+
+    NtClose(key);
+}
+#endif
+
 NTSTATUS wmain(INT argc, WCHAR *argv[], WCHAR *envp[], ULONG DebugFlag OPTIONAL)
 {
     NTSTATUS status;
-    ULONG attrs;
     TIME_FIELDS tf;
     LARGE_INTEGER systemTime, localTime;
 
@@ -246,58 +257,11 @@ NTSTATUS wmain(INT argc, WCHAR *argv[], WCHAR *envp[], ULONG DebugFlag OPTIONAL)
         goto cleanup;
     }
 
-    // Check if source directory is already a symlink.
-    status = FileGetAttributes(argv[1], &attrs);
-    if (!NT_SUCCESS(status))
-    {
-        NtLog(TRUE, L"[!] FileGetAttributes(%s) failed: %x\n", argv[1], status);
-        goto cleanup;
-    }
-
-    if (attrs & FILE_ATTRIBUTE_REPARSE_POINT)
-    {
-        NtLog(TRUE, L"[*] Source directory (%s) is already a reparse point, aborting\n", argv[1]);
-        goto cleanup;
-    }
-
-    // Check if destination directory exists.
-    status = FileGetAttributes(argv[2], &attrs);
-    if (NT_SUCCESS(status))
-    {
-        NtLog(TRUE, L"[?] Destination directory (%s) already exists, aborting\n", argv[2]);
-        goto cleanup;
-    }
-
-    // TODO: parsing quotes so directories can have embedded spaces
-    // Might happen in some non-english languages?
-    NtLog(TRUE, L"[*] Copying: '%s' -> '%s', stand by...\n", argv[1], argv[2]);
-    status = FileCopyDirectory(argv[1], argv[2], FALSE);
-    if (!NT_SUCCESS(status))
-    {
-        NtLog(TRUE, L"[!] FileCopyDirectory(%s, %s) failed: %x\n", argv[1], argv[2], status);
-        goto cleanup;
-    }
-
-    NtLog(TRUE, L"[*] Deleting: '%s'\n", argv[1]);
-    status = FileDeleteDirectory(argv[1], FALSE);
-    if (!NT_SUCCESS(status))
-    {
-        NtLog(TRUE, L"[!] FileDeleteDirectory failed: %x\n", status);
-
-        // Attempt to restore previous state.
-        FileCopyDirectory(argv[2], argv[1], TRUE);
-        goto cleanup;
-    }
-
-    NtLog(TRUE, L"[*] Creating symlink: '%s' -> '%s'\n", argv[1], argv[2]);
-    status = FileSetSymlink(argv[1], argv[2]);
-    if (!NT_SUCCESS(status))
-    {
-        NtLog(TRUE, L"[!] FileSetReparsePoint failed: %x\n", status);
-        goto cleanup;
-    }
+#ifdef _DEBUG
+    ReadFaultInjection();
+#endif
 
-    status = STATUS_SUCCESS;
+    status = Relocate(argv[1], argv[2]);
 
 cleanup:
     NtQuerySystemTime(&systemTime);
@@ -312,7 +276,6 @@ cleanup:
 
     return status;
 }
-
 void EnvironmentStringToUnicodeString(IN WCHAR *wsIn, OUT UNICODE_STRING *usOut)
 {
     if (wsIn)
@@ -103,6 +103,17 @@ NtSetValueKey(
     IN  ULONG DataSize
     );
 
+NTSTATUS
+NTAPI
+NtQueryValueKey(
+    IN  HANDLE KeyHandle,
+    IN  PUNICODE_STRING ValueName,
+    IN  KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+    OUT PVOID KeyValueInformation,
+    IN  ULONG Length,
+    OUT ULONG *ResultLength
+    );
+
 NTSTATUS
 NTAPI
 NtTerminateProcess(
@@ -116,6 +127,32 @@ NtQuerySystemTime(
     OUT LARGE_INTEGER *CurrentTime
     );
 
+typedef NTSTATUS (NTAPI *PUSER_THREAD_START_ROUTINE)(
+    IN  PVOID ThreadParameter
+    );
+
+NTSTATUS
+NTAPI
+RtlCreateUserThread(
+    IN  HANDLE Process,
+    IN  PSECURITY_DESCRIPTOR ThreadSecurityDescriptor OPTIONAL,
+    IN  BOOLEAN CreateSuspended,
+    IN  ULONG ZeroBits OPTIONAL,
+    IN  SIZE_T MaximumStackSize OPTIONAL,
+    IN  SIZE_T CommittedStackSize OPTIONAL,
+    IN  PUSER_THREAD_START_ROUTINE StartAddress,
+    IN  PVOID Parameter OPTIONAL,
+    OUT HANDLE *ThreadHandle OPTIONAL,
+    OUT PCLIENT_ID ClientId OPTIONAL
+    );
+
+DECLSPEC_NORETURN
+VOID
+NTAPI
+RtlExitUserThread(
+    IN  NTSTATUS ExitStatus
+    );
+
 // process startup parameters
 
 typedef struct _PEB_LDR_DATA
@@ -0,0 +1,109 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "io.h"
+#include "progress.h"
+
+static PWCHAR g_Phase = NULL;
+static ULONG64 g_TotalFiles = 0;
+static ULONG64 g_TotalBytes = 0;
+static volatile LONG64 g_DoneFiles = 0;
+static volatile LONG64 g_DoneBytes = 0;
+static LONG64 g_StartTime = 0;
+static volatile LONG64 g_LastDisplay = 0; // only the thread that updates this prints
+
+static void ProgressDisplay(IN LONG64 now)
+{
+    ULONG64 doneFiles = g_DoneFiles;
+    ULONG64 doneBytes = g_DoneBytes;
+    LONG64 elapsedMs = (now - g_StartTime) / NANOTICKS;
+    ULONG64 percent = 100;
+    ULONG64 rate = 0; // KB/s
+    ULONG64 eta = 0; // seconds
+
+    if (g_TotalBytes > 0)
+    {
+        if (doneBytes < g_TotalBytes)
+            percent = doneBytes * 100 / g_TotalBytes;
+    }
+    else if (g_TotalFiles > 0 && doneFiles < g_TotalFiles)
+    {
+        percent = doneFiles * 100 / g_TotalFiles;
+    }
+
+    if (elapsedMs > 0)
+        rate = doneBytes * 1000 / 1024 / elapsedMs;
+
+    if (g_TotalBytes > 0 && rate > 0 && doneBytes < g_TotalBytes)
+        eta = (g_TotalBytes - doneBytes) / 1024 / rate;
+    else if (g_TotalBytes == 0 && doneFiles > 0 && doneFiles < g_TotalFiles)
+        eta = (g_TotalFiles - doneFiles) * elapsedMs / doneFiles / 1000;
+
+    NtLog(TRUE, L"[*] %s: %I64u%% (%I64u/%I64u files, %I64u/%I64u MB), %I64u.%I64u MB/s, ETA %I64u:%02I64u\n",
+        g_Phase, percent, doneFiles, g_TotalFiles, doneBytes / (1024 * 1024), g_TotalBytes / (1024 * 1024),
+        rate / 1024, rate % 1024 * 10 / 1024, eta / 60, eta % 60);
+}
+
+void ProgressStart(IN const PWCHAR phase, IN ULONG64 totalFiles, IN ULONG64 totalBytes)
+{
+    LARGE_INTEGER now;
+
+    NtQuerySystemTime(&now);
+    g_Phase = phase;
+    g_TotalFiles = totalFiles;
+    g_TotalBytes = totalBytes;
+    g_DoneFiles = 0;
+    g_DoneBytes = 0;
+    g_StartTime = now.QuadPart;
+    g_LastDisplay = now.QuadPart;
+}
+
+void ProgressAdd(IN ULONG64 files, IN ULONG64 bytes)
+{
+    LARGE_INTEGER now;
+    LONG64 last;
+
+    if (!g_Phase)
+        return;
+
+    InterlockedAdd64(&g_DoneFiles, files);
+    InterlockedAdd64(&g_DoneBytes, bytes);
+
+    NtQuerySystemTime(&now);
+    last = g_LastDisplay;
+    if (now.QuadPart - last < PROGRESS_INTERVAL_MS * NANOTICKS)
+        return;
+
+    if (InterlockedCompareExchange64(&g_LastDisplay, now.QuadPart, last) == last)
+        ProgressDisplay(now.QuadPart);
+}
+
+void ProgressEnd(void)
+{
+    LARGE_INTEGER now;
+
+    if (!g_Phase)
+        return;
+
+    NtQuerySystemTime(&now);
+    ProgressDisplay(now.QuadPart);
+    g_Phase = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Progress of the copy and delete phases, shown on the boot screen.
+// Totals come from a pre-scan of the source tree, so the display is only an estimate
+// if the tree changes (it shouldn't, nothing else is running at boot).
+
+#pragma once
+
+#include "nt.h"
+
+// Minimum time between progress lines. Display goes through NtDisplayString and the log,
+// don't let it slow down copying.
+#define PROGRESS_INTERVAL_MS    2000
+
+// Begin tracking a phase. If totalBytes is 0 progress is computed from file counts.
+void ProgressStart(IN const PWCHAR phase, IN ULONG64 totalFiles, IN ULONG64 totalBytes);
+
+// Account for processed files. Thread safe, prints a line at most every PROGRESS_INTERVAL_MS.
+void ProgressAdd(IN ULONG64 files, IN ULONG64 bytes);
+
+// Print the final line for the phase and stop tracking.
+void ProgressEnd(void);
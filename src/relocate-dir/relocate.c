@@ -0,0 +1,258 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "io.h"
+#include "journal.h"
+#include "progress.h"
+#include "relocate.h"
+#include "security.h"
+
+NTSTATUS EnablePrivileges(void)
+{
+    HANDLE processToken = NULL;
+    TOKEN_PRIVILEGES *tp = NULL;
+    ULONG size;
+    NTSTATUS status;
+    const int privilegeCount = 3;
+
+    // This is a variable-size struct, but definition contains 1 element by default.
+    size = sizeof(TOKEN_PRIVILEGES) + (privilegeCount - 1) * sizeof(LUID_AND_ATTRIBUTES);
+    tp = RtlAllocateHeap(g_Heap, 0, size);
+
+    status = NtOpenProcessToken(NtCurrentProcess(), TOKEN_ALL_ACCESS, &processToken);
+    if (!NT_SUCCESS(status))
+        goto cleanup;
+
+    tp->PrivilegeCount = privilegeCount;
+    tp->Privileges[0].Luid.HighPart = 0;
+    tp->Privileges[0].Luid.LowPart = SE_SECURITY_PRIVILEGE; // needed for file security manipulation
+    tp->Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    tp->Privileges[1].Luid.HighPart = 0;
+    tp->Privileges[1].Luid.LowPart = SE_BACKUP_PRIVILEGE; // needed for reading files with ACLs that don't grant access to SYSTEM
+    tp->Privileges[1].Attributes = SE_PRIVILEGE_ENABLED;
+    tp->Privileges[2].Luid.HighPart = 0;
+    tp->Privileges[2].Luid.LowPart = SE_RESTORE_PRIVILEGE; // needed for setting file ownership
+    tp->Privileges[2].Attributes = SE_PRIVILEGE_ENABLED;
+
+    status = NtAdjustPrivilegesToken(processToken, FALSE, tp, size, NULL, NULL);
+
+cleanup:
+    if (processToken)
+        NtClose(processToken);
+    if (tp)
+        RtlFreeHeap(g_Heap, 0, tp);
+    return status;
+}
+
+static void LogDirQueryStats(IN const PWCHAR phase)
+{
+    NtLog(FALSE, L"[*] %s: %I64u directory queries, %I64u entries, %I64u buffer growths\n",
+        phase, g_DirQueryStats.Calls, g_DirQueryStats.Entries, g_DirQueryStats.BufferGrowths);
+    RtlZeroMemory(&g_DirQueryStats, sizeof(g_DirQueryStats));
+}
+
+static void LogCopyStats(void)
+{
+    static const PWCHAR tierNames[COPY_TIER_COUNT] = { L"clone", L"large", L"buffered" };
+
+    for (int i = 0; i < COPY_TIER_COUNT; i++)
+    {
+        LONG64 ms = g_CopyStats.Time[i] / NANOTICKS;
+
+        if (g_CopyStats.Files[i] == 0)
+            continue;
+
+        NtLog(FALSE, L"[*] %s copy: %I64d files, %I64d bytes, %I64d ms, %I64d KB/s\n",
+            tierNames[i], g_CopyStats.Files[i], g_CopyStats.Bytes[i], ms,
+            ms ? g_CopyStats.Bytes[i] / ms * 1000 / 1024 : 0);
+    }
+
+    NtLog(FALSE, L"[*] %I64d alternate data streams, %I64d bytes in sparse holes skipped\n",
+        g_CopyStats.Streams, g_CopyStats.HoleBytes);
+
+    NtLog(FALSE, L"[*] Security descriptors: %I64d queried, %I64d distinct, %I64d cache hits, %I64d applied at creation\n",
+        g_SecurityStats.Queries, g_SecurityStats.Unique, g_SecurityStats.Hits, g_SecurityStats.SetsSkipped);
+}
+
+typedef enum _RELOCATE_PHASE
+{
+    PHASE_SCAN = 0,
+    PHASE_COPY,
+    PHASE_DELETE,
+    PHASE_SYMLINK,
+    PHASE_COUNT
+} RELOCATE_PHASE;
+
+static LONG64 g_PhaseTime[PHASE_COUNT] = { 0 }; // 100ns units
+
+static void PhaseBegin(OUT LARGE_INTEGER *start)
+{
+    NtQuerySystemTime(start);
+}
+
+static void PhaseEnd(IN RELOCATE_PHASE phase, IN const LARGE_INTEGER *start)
+{
+    LARGE_INTEGER now;
+
+    NtQuerySystemTime(&now);
+    g_PhaseTime[phase] += now.QuadPart - start->QuadPart;
+}
+
+static void LogPhaseTimes(void)
+{
+    NtLog(TRUE, L"[*] Timings: scan %I64d ms, copy %I64d ms, delete %I64d ms, symlink %I64d ms\n",
+        g_PhaseTime[PHASE_SCAN] / NANOTICKS, g_PhaseTime[PHASE_COPY] / NANOTICKS,
+        g_PhaseTime[PHASE_DELETE] / NANOTICKS, g_PhaseTime[PHASE_SYMLINK] / NANOTICKS);
+}
+
+NTSTATUS Relocate(IN const PWCHAR sourcePath, IN const PWCHAR targetPath)
+{
+    NTSTATUS status;
+    ULONG attrs;
+    BOOLEAN targetExists;
+    JOURNAL_PHASE phase = JOURNAL_PHASE_NONE;
+    ULONG64 totalFiles = 0, totalBytes = 0;
+    LARGE_INTEGER phaseStart;
+
+    // Check if source directory is already a symlink.
+    status = FileGetAttributes(sourcePath, &attrs);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileGetAttributes(%s) failed: %x\n", sourcePath, status);
+        goto cleanup;
+    }
+
+    if (attrs & FILE_ATTRIBUTE_REPARSE_POINT)
+    {
+        NtLog(TRUE, L"[*] Source directory (%s) is already a reparse point, aborting\n", sourcePath);
+        goto cleanup;
+    }
+
+    // Destination directory may only exist if we're resuming an interrupted relocation.
+    targetExists = NT_SUCCESS(FileGetAttributes(targetPath, &attrs));
+
+    status = JournalOpen(sourcePath, targetPath, targetExists, &phase);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        NtLog(TRUE, L"[?] Destination directory (%s) already exists, aborting\n", targetPath);
+        goto cleanup;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        if (targetExists)
+        {
+            NtLog(TRUE, L"[!] Can't resume relocation to %s: %x, aborting\n", targetPath, status);
+            goto cleanup;
+        }
+
+        NtLog(TRUE, L"[!] JournalOpen failed: %x, relocation won't be resumable\n", status);
+    }
+
+    if (phase < JOURNAL_PHASE_DELETE_DONE)
+    {
+        // Totals for progress display, not fatal.
+        NtLog(TRUE, L"[*] Scanning: '%s'\n", sourcePath);
+        PhaseBegin(&phaseStart);
+        status = FileScanDirectory(sourcePath, &totalFiles, &totalBytes);
+        PhaseEnd(PHASE_SCAN, &phaseStart);
+        if (NT_SUCCESS(status))
+            NtLog(TRUE, L"[*] %I64u files, %I64u MB\n", totalFiles, totalBytes / (1024 * 1024));
+        else
+            NtLog(TRUE, L"[!] FileScanDirectory(%s) failed: %x, progress will not be shown\n", sourcePath, status);
+
+        LogDirQueryStats(L"scan");
+    }
+
+    if (phase < JOURNAL_PHASE_COPY_DONE)
+    {
+        // TODO: parsing quotes so directories can have embedded spaces
+        // Might happen in some non-english languages?
+        NtLog(TRUE, L"[*] Copying: '%s' -> '%s', stand by...\n", sourcePath, targetPath);
+        if (totalFiles > 0)
+            ProgressStart(L"Copying", totalFiles, totalBytes);
+
+        PhaseBegin(&phaseStart);
+        status = FileCopyDirectory(sourcePath, targetPath, FALSE);
+        PhaseEnd(PHASE_COPY, &phaseStart);
+        ProgressEnd();
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileCopyDirectory(%s, %s) failed: %x\n", sourcePath, targetPath, status);
+            goto cleanup;
+        }
+
+        LogDirQueryStats(L"copy");
+        LogCopyStats();
+
+        status = JournalSetPhase(JOURNAL_PHASE_COPY_DONE);
+        if (!NT_SUCCESS(status))
+            goto cleanup;
+    }
+
+    if (phase < JOURNAL_PHASE_DELETE_DONE)
+    {
+        NtLog(TRUE, L"[*] Deleting: '%s'\n", sourcePath);
+        if (totalFiles > 0)
+            ProgressStart(L"Deleting", totalFiles, 0);
+
+        PhaseBegin(&phaseStart);
+        status = FileDeleteDirectory(sourcePath, FALSE);
+        PhaseEnd(PHASE_DELETE, &phaseStart);
+        ProgressEnd();
+        NtLog(FALSE, L"[*] %I64d files deleted\n", g_CopyStats.Deleted);
+        if (!NT_SUCCESS(status))
+        {
+            NtLog(TRUE, L"[!] FileDeleteDirectory failed: %x\n", status);
+            LogDirQueryStats(L"delete");
+
+            // Attempt to restore previous state. The journal doesn't describe it anymore.
+            JournalClose(FALSE);
+            FileCopyDirectory(targetPath, sourcePath, TRUE);
+            JournalClose(TRUE);
+            goto cleanup;
+        }
+
+        LogDirQueryStats(L"delete");
+
+        status = JournalSetPhase(JOURNAL_PHASE_DELETE_DONE);
+        if (!NT_SUCCESS(status))
+            goto cleanup;
+    }
+
+    NtLog(TRUE, L"[*] Creating symlink: '%s' -> '%s'\n", sourcePath, targetPath);
+    PhaseBegin(&phaseStart);
+    status = FileSetSymlink(sourcePath, targetPath);
+    PhaseEnd(PHASE_SYMLINK, &phaseStart);
+    if (!NT_SUCCESS(status))
+    {
+        NtLog(TRUE, L"[!] FileSetReparsePoint failed: %x\n", status);
+        goto cleanup;
+    }
+
+    JournalClose(TRUE);
+    status = STATUS_SUCCESS;
+
+cleanup:
+    JournalClose(FALSE);
+    LogPhaseTimes();
+    return status;
+}
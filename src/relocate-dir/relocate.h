@@ -0,0 +1,33 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Relocation of a directory: copy, delete the source and replace it with a symlink to the target.
+// Separate from main.c so it can be run outside of BootExecute by tests.
+
+#pragma once
+
+#include "nt.h"
+
+// Enable privileges needed for copying files with their security.
+NTSTATUS EnablePrivileges(void);
+
+// Move sourcePath to targetPath and link it there, resuming an interrupted relocation if its journal exists.
+NTSTATUS Relocate(IN const PWCHAR sourcePath, IN const PWCHAR targetPath);
@@ -0,0 +1,182 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "io.h"
+#include "security.h"
+
+typedef struct _SECURITY_ENTRY
+{
+    ULONG Hash;
+    ULONG Size;
+    PSECURITY_DESCRIPTOR Sd; // NULL for a free slot
+} SECURITY_ENTRY;
+
+SECURITY_STATS g_SecurityStats = { 0 };
+
+static SECURITY_ENTRY *g_SecurityCache = NULL; // open addressing, SECURITY_CACHE_SIZE entries
+static ULONG g_SecurityCount = 0;
+static HANDLE g_SecurityLock = NULL; // auto-reset event, signaled = unlocked
+
+static ULONG HashDescriptor(IN const BYTE *data, IN ULONG size)
+{
+    ULONG hash = 2166136261; // FNV-1a
+
+    for (ULONG i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+NTSTATUS SecurityCacheInit(void)
+{
+    OBJECT_ATTRIBUTES oa;
+    NTSTATUS status;
+
+    InitializeObjectAttributes(&oa, NULL, 0, NULL, NULL);
+    status = ZwCreateEvent(&g_SecurityLock, EVENT_ALL_ACCESS, &oa, SynchronizationEvent, TRUE);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    g_SecurityCache = RtlAllocateHeap(g_Heap, HEAP_ZERO_MEMORY, SECURITY_CACHE_SIZE * sizeof(SECURITY_ENTRY));
+    if (!g_SecurityCache)
+    {
+        NtClose(g_SecurityLock);
+        g_SecurityLock = NULL;
+        return STATUS_NO_MEMORY;
+    }
+
+    g_SecurityCount = 0;
+    return STATUS_SUCCESS;
+}
+
+void SecurityCacheFree(void)
+{
+    if (g_SecurityCache)
+    {
+        for (ULONG i = 0; i < SECURITY_CACHE_SIZE; i++)
+        {
+            if (g_SecurityCache[i].Sd)
+                RtlFreeHeap(g_Heap, 0, g_SecurityCache[i].Sd);
+        }
+
+        RtlFreeHeap(g_Heap, 0, g_SecurityCache);
+        g_SecurityCache = NULL;
+    }
+
+    if (g_SecurityLock)
+    {
+        NtClose(g_SecurityLock);
+        g_SecurityLock = NULL;
+    }
+
+    g_SecurityCount = 0;
+}
+
+// Return the cached copy of sd if there is one, otherwise take ownership of sd if there's space.
+static PSECURITY_DESCRIPTOR SecurityIntern(IN PSECURITY_DESCRIPTOR sd, IN ULONG size, OUT BOOLEAN *interned)
+{
+    ULONG hash = HashDescriptor(sd, size);
+    PSECURITY_DESCRIPTOR result = sd;
+    ULONG i;
+
+    *interned = FALSE;
+
+    ZwWaitForSingleObject(g_SecurityLock, FALSE, NULL);
+
+    for (i = hash & (SECURITY_CACHE_SIZE - 1); g_SecurityCache[i].Sd; i = (i + 1) & (SECURITY_CACHE_SIZE - 1))
+    {
+        if (g_SecurityCache[i].Hash == hash && g_SecurityCache[i].Size == size &&
+            RtlEqualMemory(g_SecurityCache[i].Sd, sd, size))
+        {
+            result = g_SecurityCache[i].Sd;
+            *interned = TRUE;
+            InterlockedIncrement64(&g_SecurityStats.Hits);
+            goto unlock;
+        }
+    }
+
+    // Keep the table at most half full so probes stay short.
+    if (g_SecurityCount < SECURITY_CACHE_SIZE / 2)
+    {
+        g_SecurityCache[i].Hash = hash;
+        g_SecurityCache[i].Size = size;
+        g_SecurityCache[i].Sd = sd;
+        g_SecurityCount++;
+        *interned = TRUE;
+        InterlockedIncrement64(&g_SecurityStats.Unique);
+    }
+
+unlock:
+    ZwSetEvent(g_SecurityLock, NULL);
+    return result;
+}
+
+NTSTATUS SecurityQuery(IN HANDLE file, OUT PSECURITY_DESCRIPTOR *sd, OUT BOOLEAN *interned)
+{
+    PSECURITY_DESCRIPTOR buffer;
+    ULONG size = SECURITY_QUERY_SIZE;
+    ULONG requiredSize = 0;
+    PSECURITY_DESCRIPTOR cached;
+    NTSTATUS status;
+
+    *sd = NULL;
+    *interned = FALSE;
+    InterlockedIncrement64(&g_SecurityStats.Queries);
+
+    while (TRUE)
+    {
+        buffer = RtlAllocateHeap(g_Heap, 0, size); // don't allocate on stack, deep recursion can be fatal
+        if (!buffer)
+            return STATUS_NO_MEMORY;
+
+        status = NtQuerySecurityObject(file, SECURITY_COPY_INFORMATION, buffer, size, &requiredSize);
+        if (NT_SUCCESS(status))
+            break;
+
+        RtlFreeHeap(g_Heap, 0, buffer);
+        if (status != STATUS_BUFFER_TOO_SMALL || requiredSize <= size)
+            return status;
+
+        size = requiredSize;
+    }
+
+    if (!g_SecurityCache)
+    {
+        *sd = buffer;
+        return STATUS_SUCCESS;
+    }
+
+    size = RtlLengthSecurityDescriptor(buffer);
+    cached = SecurityIntern(buffer, size, interned);
+    if (cached != buffer)
+        RtlFreeHeap(g_Heap, 0, buffer);
+
+    *sd = cached;
+    return STATUS_SUCCESS;
+}
+
+void SecurityRelease(IN PSECURITY_DESCRIPTOR sd, IN BOOLEAN interned)
+{
+    if (sd && !interned)
+        RtlFreeHeap(g_Heap, 0, sd);
+}
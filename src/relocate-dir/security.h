@@ -0,0 +1,54 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Cache of file security descriptors seen while copying a tree.
+// A profile only has a handful of distinct descriptors (most files share an inherited one),
+// so descriptors are interned by content: each distinct one is stored once and can be
+// passed to NtCreateFile for new files instead of being set with a separate call.
+
+#pragma once
+
+#include "nt.h"
+
+#define SECURITY_CACHE_SIZE 1024 // hash table slots, power of 2. Only half are used, see SecurityIntern.
+#define SECURITY_QUERY_SIZE 1024 // first guess for the descriptor size, most are much smaller
+
+// Parts of the descriptor that are copied.
+#define SECURITY_COPY_INFORMATION (OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION)
+
+typedef struct _SECURITY_STATS
+{
+    volatile LONG64 Queries;
+    volatile LONG64 Hits; // descriptor was already cached
+    volatile LONG64 Unique; // descriptors added to the cache
+    volatile LONG64 SetsSkipped; // applied at creation instead of NtSetSecurityObject
+} SECURITY_STATS;
+
+extern SECURITY_STATS g_SecurityStats;
+
+// Without an initialized cache SecurityQuery returns private copies.
+NTSTATUS SecurityCacheInit(void);
+void SecurityCacheFree(void);
+
+// Get a file's descriptor (SECURITY_COPY_INFORMATION). Thread safe.
+// Must be released with SecurityRelease, an interned descriptor stays valid until SecurityCacheFree.
+NTSTATUS SecurityQuery(IN HANDLE file, OUT PSECURITY_DESCRIPTOR *sd, OUT BOOLEAN *interned);
+void SecurityRelease(IN PSECURITY_DESCRIPTOR sd, IN BOOLEAN interned);